@@ -2,128 +2,494 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include "../lib/blockfile.h"
+#include "../lib/bench.h"
 
+#ifndef B
 #define B 10  // Size of each block
+#endif
 
 typedef struct {
-    int id;           
-    char name[50];    
+    int id;
+    char name[50];
     float value;
 } T_rec;
 
 typedef struct {
-    int nb;         
-    T_rec data[B];      
-    int next;            
+    int nb;
+    T_rec data[B];
+    int next;
 } TBlock;
 
 typedef struct {
-    int head;       
-    int tail;      
-    int free;            
-    int nBlocks;         
+    int head;
+    int tail;
+    int free;
+    int nBlocks;
 } FileHeader;
 
+// How hard Enqueue/Dequeue work to make each operation survive a crash
+typedef enum {
+    DURABILITY_NONE,    // Header written at close only; the OS flushes blocks when it likes
+    DURABILITY_PER_OP,  // One fdatasync per operation
+    DURABILITY_GROUP    // Operations wait for a shared fdatasync every groupOps ops or groupMs ms
+} DurabilityMode;
+
+typedef struct {
+    DurabilityMode mode;
+    int groupOps;
+    int groupMs;
+} DurabilityConfig;
+
+// Two-lock queue: producers only take tailLock and consumers only take
+// headLock, so they never contend unless the queue fits in a single block.
+// Lock order is always headLock -> tailLock -> freeLock.
 typedef struct {
-    FILE *file;
+    BlockFile *file;
     FileHeader header;
+    pthread_mutex_t headLock;   // Guards header.head and headBuf
+    pthread_mutex_t tailLock;   // Guards header.tail and tailBuf
+    pthread_mutex_t freeLock;   // Guards header.free and header.nBlocks
+    TBlock headBuf;             // Cached copy of the head block
+    int headBufIndex;           // Block held in headBuf (-1 if none)
+    TBlock tailBuf;             // Cached copy of the tail block (always valid)
+
+    // Group commit state, guarded by syncLock
+    DurabilityConfig durability;
+    pthread_mutex_t syncLock;
+    pthread_cond_t syncCond;
+    long long opsIssued;        // Operations whose blocks have been written
+    long long opsSynced;        // Operations covered by a completed fdatasync
+    int opsActive;              // Operations started but not yet waiting for a sync
+    struct timespec groupStart; // When the oldest unsynced operation was issued
+    bool syncing;
+    long long nSyncs;
 } File;
 
-void CreateQueue(File *F) {
-    F->header.head = -1;  
-    F->header.tail = -1;  
-    F->header.free = -1;  
-    F->header.nBlocks = 0;
+// The queue header lives in the block-file header so the queue can be
+// reopened. Block I/O is pread/pwrite, so threads never share a file position.
+void ReadBlock(File *F, TBlock *Buf, int blockIndex) {
+    BlockFileRead(F->file, blockIndex, Buf);
 }
 
-bool IsQueueEmpty(File *F) {
-    return F->header.head == -1;
+void WriteBlock(File *F, const TBlock *Buf, int blockIndex) {
+    BlockFileWrite(F->file, blockIndex, Buf);
 }
 
-void ReadBlock(File *F, TBlock Buf, int blockIndex) {
-    fseek(F->file, blockIndex * sizeof(TBlock), SEEK_SET);
-    fread(&Buf, sizeof(TBlock), 1, F->file);
+// Head and tail are published atomically, so a snapshot never sees a torn
+// pointer; free and nBlocks are read, and the header written, under freeLock.
+static void WriteHeader(File *F) {
+    FileHeader h;
+    h.head = __atomic_load_n(&F->header.head, __ATOMIC_ACQUIRE);
+    h.tail = __atomic_load_n(&F->header.tail, __ATOMIC_ACQUIRE);
+    pthread_mutex_lock(&F->freeLock);
+    h.free = F->header.free;
+    h.nBlocks = F->header.nBlocks;
+    memcpy(F->file->header.user, &h, sizeof(FileHeader));
+    BlockFileWriteHeader(F->file);
+    pthread_mutex_unlock(&F->freeLock);
 }
 
-void WriteBlock(File *F, TBlock Buf, int blockIndex) {
-    fseek(F->file, blockIndex * sizeof(TBlock), SEEK_SET);
-    fwrite(&Buf, sizeof(TBlock), 1, F->file);
+static void InitLocks(File *F, DurabilityConfig durability) {
+    pthread_mutex_init(&F->headLock, NULL);
+    pthread_mutex_init(&F->tailLock, NULL);
+    pthread_mutex_init(&F->freeLock, NULL);
+    pthread_mutex_init(&F->syncLock, NULL);
+    // Group deadlines are measured on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&F->syncCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    F->durability = durability;
+    F->opsIssued = F->opsSynced = 0;
+    F->opsActive = 0;
+    F->syncing = false;
+    F->nSyncs = 0;
+    F->headBufIndex = -1;
 }
 
-void Enqueue(File *F, T_rec e) {
-    TBlock Buf1;
+// The queue always owns at least one block: an empty queue is an empty
+// block with head == tail, which keeps producers off the head pointer.
+void CreateQueue(File *F, DurabilityConfig durability) {
+    F->header.head = 0;
+    F->header.tail = 0;
+    F->header.free = -1;
+    F->header.nBlocks = 1;
+    InitLocks(F, durability);
+
+    F->tailBuf.nb = 0;
+    F->tailBuf.next = -1;
+    WriteBlock(F, &F->tailBuf, 0);
+    WriteHeader(F);
+}
+
+// Reopen an existing queue file, or create a new one. After a clean close
+// the queue is as it was left. After a crash the synced operations' blocks
+// are on disk, but the header is the last one synced, and blocks it points
+// at may have been rewritten since: dequeues shift the head block in place
+// and enqueues reuse the blocks dequeues freed. Nothing is logged, so such a
+// queue can lose or repeat records.
+bool OpenQueue(File *F, const char *path, DurabilityConfig durability) {
+    F->file = BlockFileOpen(path);
+    if (F->file && F->file->blockBytes == sizeof(TBlock)) {
+        memcpy(&F->header, F->file->header.user, sizeof(FileHeader));
+        InitLocks(F, durability);
+        ReadBlock(F, &F->tailBuf, F->header.tail);
+        return true;
+    }
+    if (F->file) BlockFileClose(F->file);
+
+    F->file = BlockFileCreate(path, sizeof(TBlock), FIXED_LAYOUT(TBlock, nb, data));
+    if (!F->file) return false;
+    CreateQueue(F, durability);
+    return true;
+}
+
+void CloseQueue(File *F) {
+    WriteHeader(F);
+    if (F->durability.mode != DURABILITY_NONE) BlockFileSync(F->file);
+    pthread_mutex_destroy(&F->headLock);
+    pthread_mutex_destroy(&F->tailLock);
+    pthread_mutex_destroy(&F->freeLock);
+    pthread_mutex_destroy(&F->syncLock);
+    pthread_cond_destroy(&F->syncCond);
+    BlockFileClose(F->file);
+}
+
+static double MsSince(const struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+static void BeginOp(File *F) {
+    __atomic_add_fetch(&F->opsActive, 1, __ATOMIC_RELAXED);
+}
+
+// An operation that changed nothing has nothing to sync
+static void AbortOp(File *F) {
+    __atomic_sub_fetch(&F->opsActive, 1, __ATOMIC_RELAXED);
+}
+
+// Called once an operation's blocks are written and its locks released.
+// In group mode the first waiter that finds the group full, too old, or
+// with no other operation still running becomes the leader and syncs on
+// behalf of every operation issued so far.
+static void CommitOp(File *F) {
+    __atomic_sub_fetch(&F->opsActive, 1, __ATOMIC_RELAXED);
+    if (F->durability.mode == DURABILITY_NONE) return;
+    if (F->durability.mode == DURABILITY_PER_OP) {
+        WriteHeader(F);
+        BlockFileSync(F->file);
+        __atomic_add_fetch(&F->nSyncs, 1, __ATOMIC_RELAXED);
+        return;
+    }
 
+    pthread_mutex_lock(&F->syncLock);
+    long long ticket = ++F->opsIssued;
+    if (ticket - F->opsSynced == 1) clock_gettime(CLOCK_MONOTONIC, &F->groupStart);
+
+    while (F->opsSynced < ticket) {
+        bool full = F->opsIssued - F->opsSynced >= F->durability.groupOps;
+        bool stale = MsSince(&F->groupStart) >= F->durability.groupMs;
+        bool idle = __atomic_load_n(&F->opsActive, __ATOMIC_RELAXED) == 0;
+        if (!F->syncing && (full || stale || idle)) {
+            long long upTo = F->opsIssued;
+            F->syncing = true;
+            pthread_mutex_unlock(&F->syncLock);
+
+            WriteHeader(F);
+            BlockFileSync(F->file);
+
+            pthread_mutex_lock(&F->syncLock);
+            F->syncing = false;
+            F->opsSynced = upTo;
+            F->nSyncs++;
+            if (F->opsIssued > F->opsSynced) clock_gettime(CLOCK_MONOTONIC, &F->groupStart);
+            pthread_cond_broadcast(&F->syncCond);
+        } else {
+            // Sleep until the group times out or someone else syncs
+            struct timespec deadline = F->groupStart;
+            long long ns = deadline.tv_nsec + (long long)F->durability.groupMs * 1000000;
+            deadline.tv_sec += ns / 1000000000;
+            deadline.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&F->syncCond, &F->syncLock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&F->syncLock);
+}
+
+static int LoadTail(File *F) {
+    return __atomic_load_n(&F->header.tail, __ATOMIC_ACQUIRE);
+}
+
+static int AllocQueueBlock(File *F) {
+    pthread_mutex_lock(&F->freeLock);
     int newBlock = F->header.free;
     if (newBlock != -1) {
-        ReadBlock(F, Buf1, newBlock);
-        F->header.free = Buf1.next;
+        TBlock Buf;
+        ReadBlock(F, &Buf, newBlock);
+        F->header.free = Buf.next;
     } else {
         newBlock = F->header.nBlocks++;
     }
+    pthread_mutex_unlock(&F->freeLock);
+    return newBlock;
+}
 
-    if (F->header.head == -1) {
-        F->header.head = newBlock;
-        F->header.tail = newBlock;
-        Buf1.nb = 0;
-        Buf1.next = -1;
-    } else {
-        TBlock BufTail;
-        ReadBlock(F, BufTail, F->header.tail);
-        if (BufTail.nb < B) {
-            BufTail.data[BufTail.nb++] = e;
-            WriteBlock(F, BufTail, F->header.tail);
-            return;
-        }
-        BufTail.next = newBlock;
+static void FreeQueueBlock(File *F, TBlock *Buf, int blockIndex) {
+    pthread_mutex_lock(&F->freeLock);
+    Buf->nb = 0;
+    Buf->next = F->header.free;
+    F->header.free = blockIndex;
+    WriteBlock(F, Buf, blockIndex);
+    pthread_mutex_unlock(&F->freeLock);
+}
+
+bool IsQueueEmpty(File *F) {
+    pthread_mutex_lock(&F->headLock);
+    pthread_mutex_lock(&F->tailLock);
+    bool empty = F->header.head == F->header.tail && F->tailBuf.nb == 0;
+    pthread_mutex_unlock(&F->tailLock);
+    pthread_mutex_unlock(&F->headLock);
+    return empty;
+}
+
+void Enqueue(File *F, T_rec e) {
+    IoOp op = BlockFileOpBegin(F->file, "enqueue");
+    BeginOp(F);
+    pthread_mutex_lock(&F->tailLock);
+
+    TBlock *BufTail = &F->tailBuf;
+    if (BufTail->nb < B) {
+        BufTail->data[BufTail->nb++] = e;
         WriteBlock(F, BufTail, F->header.tail);
-        F->header.tail = newBlock;
-        Buf1.nb = 0;
-        Buf1.next = -1;
+        pthread_mutex_unlock(&F->tailLock);
+        BlockFileOpEnd(&op);
+        CommitOp(F);
+        return;
     }
 
+    // Tail is full: the new block must be on disk before it is linked in
+    int newBlock = AllocQueueBlock(F);
+    TBlock Buf1;
+    Buf1.nb = 0;
+    Buf1.next = -1;
     Buf1.data[Buf1.nb++] = e;
-    WriteBlock(F, Buf1, newBlock);
+    WriteBlock(F, &Buf1, newBlock);
+
+    BufTail->next = newBlock;
+    WriteBlock(F, BufTail, F->header.tail);
+
+    *BufTail = Buf1;
+    __atomic_store_n(&F->header.tail, newBlock, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&F->tailLock);
+    BlockFileOpEnd(&op);
+    CommitOp(F);
 }
 
-void Dequeue(File *F, T_rec *e) {
-    if (IsQueueEmpty(F)) {
-        printf("Queue is empty\n");
-        return;
+bool Dequeue(File *F, T_rec *e) {
+    IoOp op = BlockFileOpBegin(F->file, "dequeue");
+    BeginOp(F);
+    pthread_mutex_lock(&F->headLock);
+
+    // Once head != tail the head block is sealed: the tail can only move to
+    // fresh blocks, so it cannot come back while we hold headLock.
+    int head = F->header.head;
+    bool shared = LoadTail(F) == head;
+    if (shared) {
+        pthread_mutex_lock(&F->tailLock);
+        shared = F->header.tail == head;
+        if (!shared) pthread_mutex_unlock(&F->tailLock);
     }
 
-    TBlock BufHead;
-    ReadBlock(F, BufHead, F->header.head);
+    TBlock *BufHead;
+    if (shared) {
+        BufHead = &F->tailBuf;
+        F->headBufIndex = -1;
+    } else {
+        BufHead = &F->headBuf;
+        if (F->headBufIndex != head) {
+            ReadBlock(F, BufHead, head);
+            F->headBufIndex = head;
+        }
+    }
 
-    *e = BufHead.data[0];
+    if (BufHead->nb == 0) {
+        if (shared) pthread_mutex_unlock(&F->tailLock);
+        pthread_mutex_unlock(&F->headLock);
+        AbortOp(F);
+        return false;
+    }
+
+    *e = BufHead->data[0];
 
-    for (int i = 1; i < BufHead.nb; i++) {
-        BufHead.data[i - 1] = BufHead.data[i];
+    for (int i = 1; i < BufHead->nb; i++) {
+        BufHead->data[i - 1] = BufHead->data[i];
     }
-    BufHead.nb--;
+    BufHead->nb--;
 
-    if (BufHead.nb == 0) {
-        int oldHead = F->header.head;
-        F->header.head = BufHead.next;
-        BufHead.next = F->header.free;
-        F->header.free = oldHead;
-        WriteBlock(F, BufHead, oldHead);
+    if (BufHead->nb == 0 && !shared) {
+        __atomic_store_n(&F->header.head, BufHead->next, __ATOMIC_RELEASE);
+        F->headBufIndex = -1;
+        FreeQueueBlock(F, BufHead, head);
     } else {
-        WriteBlock(F, BufHead, F->header.head);
+        WriteBlock(F, BufHead, head);
+    }
+
+    if (shared) pthread_mutex_unlock(&F->tailLock);
+    pthread_mutex_unlock(&F->headLock);
+    BlockFileOpEnd(&op);
+    CommitOp(F);
+    return true;
+}
+
+// Contention benchmark: producers tag each record with (producer, sequence)
+// and every consumer checks it sees each producer's records in order.
+// Producers also time each Enqueue, sync wait included.
+#define SEQ_SPAN 1000000
+
+typedef struct {
+    File *F;
+    int producer;
+    int count;
+    int total;
+    int *consumed;
+    int *fifoErrors;
+    double *latencies;  // Per-enqueue latency in seconds (producers only)
+} BenchArgs;
+
+static void *ProducerThread(void *arg) {
+    BenchArgs *a = arg;
+    T_rec e = {0, "bench", 0};
+    for (int i = 0; i < a->count; i++) {
+        e.id = a->producer * SEQ_SPAN + i;
+        double t0 = BenchNow();
+        Enqueue(a->F, e);
+        a->latencies[i] = BenchNow() - t0;
+    }
+    return NULL;
+}
+
+static void *ConsumerThread(void *arg) {
+    BenchArgs *a = arg;
+    int lastSeq[64];
+    for (int p = 0; p < 64; p++) lastSeq[p] = -1;
+
+    T_rec e;
+    while (__atomic_load_n(a->consumed, __ATOMIC_RELAXED) < a->total) {
+        if (!Dequeue(a->F, &e)) {
+            sched_yield();
+            continue;
+        }
+        __atomic_add_fetch(a->consumed, 1, __ATOMIC_RELAXED);
+        int p = e.id / SEQ_SPAN, seq = e.id % SEQ_SPAN;
+        if (seq <= lastSeq[p]) __atomic_add_fetch(a->fifoErrors, 1, __ATOMIC_RELAXED);
+        lastSeq[p] = seq;
+    }
+    return NULL;
+}
+
+void BenchContention(const char *path, int producers, int consumers, int perProducer, DurabilityConfig durability) {
+    File F;
+    F.file = BlockFileCreate(path, sizeof(TBlock), FIXED_LAYOUT(TBlock, nb, data));
+    if (!F.file) {
+        printf("Error opening file.\n");
+        return;
     }
+    CreateQueue(&F, durability);
 
-    if (F->header.head == -1) {
-        F->header.tail = -1;
+    int consumed = 0, fifoErrors = 0;
+    int total = producers * perProducer;
+    double *latencies = malloc(total * sizeof(double));
+    pthread_t threads[128];
+    BenchArgs args[128];
+    int nThreads = 0;
+
+    double start = BenchNow();
+    for (int p = 0; p < producers; p++, nThreads++) {
+        args[nThreads] = (BenchArgs){&F, p, perProducer, total, &consumed, &fifoErrors, latencies + p * perProducer};
+        pthread_create(&threads[nThreads], NULL, ProducerThread, &args[nThreads]);
+    }
+    for (int c = 0; c < consumers; c++, nThreads++) {
+        args[nThreads] = (BenchArgs){&F, -1, 0, total, &consumed, &fifoErrors, NULL};
+        pthread_create(&threads[nThreads], NULL, ConsumerThread, &args[nThreads]);
     }
+    for (int t = 0; t < nThreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    double elapsed = BenchNow() - start;
+
+    printf("%d producers / %d consumers: %d records in %.3f s (%.0f ops/s), %lld syncs, FIFO violations: %d\n",
+           producers, consumers, total, elapsed, 2.0 * total / elapsed, F.nSyncs, fifoErrors);
+    // The producers keep their own slices; the samples are gathered once
+    // they are done. Consumers share the block I/O, so only latency is shown.
+    BenchOp op;
+    BenchBegin(&op, "enqueue (contended)", total);
+    for (int i = 0; i < total; i++) BenchSample(&op, latencies[i]);
+    BenchReport(&op, false);
+
+    free(latencies);
+    CloseQueue(&F);
 }
 
-int main() {
+// Single-threaded enqueue then dequeue of cfg.records records. An enqueue
+// writes its tail block (plus the new block every B records); a dequeue
+// reads a block and recycles it every B records.
+int RunBench(const BenchConfig *cfg) {
+    DurabilityConfig none = {DURABILITY_NONE, 0, 0};
+    File F;
+    F.file = BlockFileCreate("bench_queue.dat", sizeof(TBlock), FIXED_LAYOUT(TBlock, nb, data));
+    if (!F.file) {
+        perror("bench_queue.dat");
+        return 1;
+    }
+    CreateQueue(&F, none);
+    printf("ex11 disk queue: %ld records, %s ids, %d records per block\n", cfg->records, KeyDistName(cfg->dist), B);
+
+    KeyGen keys;
+    BenchOp op;
+    T_rec e = {0, "bench", 0};
+    InitKeyGen(&keys, cfg->dist, cfg->records, cfg->seed);
+    BenchBegin(&op, "enqueue", cfg->records);
+    for (long i = 0; i < cfg->records; i++) {
+        e.id = (int)NextKey(&keys);
+        double t0 = BenchNow();
+        Enqueue(&F, e);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+
+    BenchBegin(&op, "dequeue", cfg->records);
+    for (long i = 0; i < cfg->records; i++) {
+        double t0 = BenchNow();
+        Dequeue(&F, &e);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+    CloseQueue(&F);
+
+    BenchContention("bench_queue.dat", 4, 2, (int)(cfg->records / 4), none);
+    remove("bench_queue.dat");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    if (ParseBenchArgs(argc, argv, 200000, &cfg)) return RunBench(&cfg);
+
     // Example of how to use the Queue
     File F;
-    CreateQueue(&F);
+    DurabilityConfig group = {DURABILITY_GROUP, 32, 2};
 
     // Open the file
-    F.file = fopen("queue.dat", "wb+");
-    if (!F.file) {
+    if (!OpenQueue(&F, "queue.dat", group)) {
         printf("Error opening file.\n");
         return 1;
     }
@@ -137,9 +503,26 @@ int main() {
 
     // Dequeue some data
     T_rec dequeued;
-    Dequeue(&F, &dequeued);
-    printf("Dequeued: %d, %s, %.2f\n", dequeued.id, dequeued.name, dequeued.value);
+    if (Dequeue(&F, &dequeued)) {
+        printf("Dequeued: %d, %s, %.2f\n", dequeued.id, dequeued.name, dequeued.value);
+    } else {
+        printf("Queue is empty\n");
+    }
+
+    CloseQueue(&F);
+
+    // Scale the number of producers against two consumers
+    DurabilityConfig none = {DURABILITY_NONE, 0, 0};
+    for (int producers = 1; producers <= 8; producers *= 2) {
+        BenchContention("queue_bench.dat", producers, 2, 20000, none);
+    }
 
-    fclose(F.file);
+    // Compare durability modes under the same load
+    DurabilityConfig perOp = {DURABILITY_PER_OP, 0, 0};
+    printf("\nper-op sync:\n");
+    BenchContention("queue_bench.dat", 4, 2, 500, perOp);
+    printf("group commit (32 ops / 2 ms):\n");
+    BenchContention("queue_bench.dat", 4, 2, 500, group);
+    remove("queue_bench.dat");
     return 0;
 }
@@ -1,8 +1,18 @@
+#define _GNU_SOURCE  // mremap
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../lib/bench.h"
 
+#ifndef B
 #define B 3  // Size of each block (for simplicity)
+#endif
 
 typedef struct {
     int id;           // ID of the record
@@ -11,66 +21,281 @@ typedef struct {
 } T_rec;
 
 typedef struct {
+    int start;        // Index of the first element in data (dequeues never shift)
     int nb;           // Number of elements currently in the block
     T_rec data[B];    // Array of elements (max B per block)
 } TBlock;
 
+#define RING_MAGIC 0x474E4952u  // "RING"
+
 typedef struct {
+    uint32_t magic;       // RING_MAGIC
+    uint32_t blockBytes;  // sizeof(TBlock) when written: B is fixed at build time
     int head;         // Index of the block containing the first element
     int tail;         // Index of the block containing the last element
     int nElements;    // Total number of elements in the queue
     int nBlocks;      // Total number of blocks
 } FileHeader;
 
+// The queue itself: lives either in malloc'd memory or in a mapped ring file
 typedef struct {
     FileHeader header;
     TBlock blocks[];  // Flexible array for blocks
+} QueueData;
+
+typedef struct {
+    QueueData *q;
+    int fd;           // Ring file descriptor, or -1 for the in-memory backend
+    size_t mapSize;   // Bytes mapped (or allocated)
+    bool growable;    // Double the ring instead of overflowing
 } File;
 
+static size_t QueueBytes(int nBlocks) {
+    return sizeof(QueueData) + (size_t)nBlocks * sizeof(TBlock);
+}
+
 void CreateQueue(File *F, int N) {
-    F->header.head = 0;       // First block starts at 0
-    F->header.tail = 0;       // Tail starts at the same position as head
-    F->header.nElements = 0;  // Initially, the queue is empty
-    F->header.nBlocks = N;    // Set the total number of blocks
+    F->q->header.magic = RING_MAGIC;
+    F->q->header.blockBytes = sizeof(TBlock);
+    F->q->header.head = 0;       // First block starts at 0
+    F->q->header.tail = 0;       // Tail starts at the same position as head
+    F->q->header.nElements = 0;  // Initially, the queue is empty
+    F->q->header.nBlocks = N;    // Set the total number of blocks
 
     for (int i = 0; i < N; i++) {
-        F->blocks[i].nb = 0;  // All blocks are initially empty
+        F->q->blocks[i].start = 0;
+        F->q->blocks[i].nb = 0;  // All blocks are initially empty
+    }
+}
+
+// In-memory queue of N blocks
+File *NewQueue(int N, bool growable) {
+    File *F = malloc(sizeof(File));
+    F->q = malloc(QueueBytes(N));
+    F->fd = -1;
+    F->mapSize = QueueBytes(N);
+    F->growable = growable;
+    CreateQueue(F, N);
+    return F;
+}
+
+// Why a mapped file of size bytes can't be used as a ring, or NULL if it can
+static const char *CheckRing(const QueueData *q, size_t size) {
+    const FileHeader *h = &q->header;
+    if (h->magic != RING_MAGIC) return "is not a ring file";
+    if (h->blockBytes != sizeof(TBlock)) return "was written with another block size";
+    if (h->nBlocks < 1 || h->head < 0 || h->head >= h->nBlocks || h->tail < 0 || h->tail >= h->nBlocks ||
+        h->nElements < 0 || h->nElements > (long)h->nBlocks * B) {
+        return "has a corrupt header";
     }
+    if (QueueBytes(h->nBlocks) > size) return "is truncated";
+    return NULL;
+}
+
+// Queue backed by a memory-mapped ring file. An existing file is mapped as
+// is, so a queue survives restarts without being copied back in; one that
+// is too short, foreign or built with another B is refused.
+File *OpenQueueFile(const char *path, int N, bool growable) {
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("Failed to open ring file");
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Failed to stat ring file");
+        close(fd);
+        return NULL;
+    }
+    bool fresh = st.st_size == 0;
+    if (!fresh && (size_t)st.st_size < sizeof(QueueData)) {
+        fprintf(stderr, "Ring file %s is too short for a header.\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = fresh ? QueueBytes(N) : (size_t)st.st_size;
+    if (fresh && ftruncate(fd, size) != 0) {
+        perror("Failed to size ring file");
+        close(fd);
+        return NULL;
+    }
+
+    QueueData *q = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (q == MAP_FAILED) {
+        perror("Failed to map ring file");
+        close(fd);
+        return NULL;
+    }
+
+    File *F = malloc(sizeof(File));
+    F->q = q;
+    F->fd = fd;
+    F->mapSize = size;
+    F->growable = growable;
+
+    const char *problem = fresh ? NULL : CheckRing(q, size);
+    if (fresh) {
+        CreateQueue(F, N);
+    } else if (problem) {
+        fprintf(stderr, "Ring file %s %s.\n", path, problem);
+        munmap(q, size);
+        close(fd);
+        free(F);
+        return NULL;
+    }
+    return F;
+}
+
+void CloseQueue(File *F) {
+    if (F->fd >= 0) {
+        msync(F->q, F->mapSize, MS_SYNC);
+        munmap(F->q, F->mapSize);
+        close(F->fd);
+    } else {
+        free(F->q);
+    }
+    free(F);
 }
 
 int NbElement(File *F) {
-    return F->header.nElements;
+    return F->q->header.nElements;
+}
+
+// Number of records that can still be enqueued without growing: the space
+// after the tail block's last element plus every block outside head..tail
+int FreeSlots(File *F) {
+    FileHeader *h = &F->q->header;
+    TBlock *tailBlock = &F->q->blocks[h->tail];
+    int usedBlocks = (h->tail - h->head + h->nBlocks) % h->nBlocks + 1;
+    return (B - tailBlock->start - tailBlock->nb) + (h->nBlocks - usedBlocks) * B;
+}
+
+// Double the ring. If the live blocks wrap (tail < head), the wrapped
+// prefix 0..tail is moved to the start of the new space so the ring stays
+// in order: head..oldN-1, oldN..oldN+tail, then free blocks. Old slots are
+// only cleared once the header points at the new layout, so a crash leaves
+// either the old or the new queue on disk.
+bool GrowQueue(File *F) {
+    int oldN = F->q->header.nBlocks;
+    int newN = 2 * oldN;
+    size_t newSize = QueueBytes(newN);
+
+    if (F->fd >= 0) {
+        if (ftruncate(F->fd, newSize) != 0) return false;
+        void *p = mremap(F->q, F->mapSize, newSize, MREMAP_MAYMOVE);
+        if (p == MAP_FAILED) return false;
+        F->q = p;
+    } else {
+        void *p = realloc(F->q, newSize);
+        if (!p) return false;
+        F->q = p;
+    }
+    F->mapSize = newSize;
+
+    QueueData *q = F->q;
+    for (int i = oldN; i < newN; i++) {
+        q->blocks[i].start = 0;
+        q->blocks[i].nb = 0;
+    }
+
+    int tail = q->header.tail;
+    bool wrapped = tail < q->header.head;
+    if (wrapped) {
+        memcpy(&q->blocks[oldN], &q->blocks[0], (tail + 1) * sizeof(TBlock));
+        if (F->fd >= 0) msync(q, newSize, MS_SYNC);
+    }
+
+    q->header.nBlocks = newN;
+    if (wrapped) q->header.tail = oldN + tail;
+    if (F->fd >= 0) msync(q, sizeof(QueueData), MS_SYNC);
+
+    if (wrapped) {
+        for (int i = 0; i <= tail; i++) {
+            q->blocks[i].start = 0;
+            q->blocks[i].nb = 0;
+        }
+    }
+    return true;
 }
 
 void EnqueueGroup(File *F, int n, T_rec T[]) {
     int index = 0; // Start at the first element of T
 
     while (n > 0) {
-        TBlock *tailBlock = &F->blocks[F->header.tail];
-        int space = B - tailBlock->nb; // Available space in the current tail block
+        TBlock *tailBlock = &F->q->blocks[F->q->header.tail];
+        int end = tailBlock->start + tailBlock->nb;
+        int space = B - end; // Free slots after the last element of the tail block
 
-        // Fill the current block or add as many as possible
-        int toAdd = (n < space) ? n : space;
-        for (int i = 0; i < toAdd; i++) {
-            tailBlock->data[tailBlock->nb++] = T[index++];
+        // Move to the next block once the current one is full
+        if (space == 0) {
+            int next = (F->q->header.tail + 1) % F->q->header.nBlocks;
+            if (next == F->q->header.head) {
+                if (F->growable && GrowQueue(F)) continue;
+                printf("Queue overflow: No space left!\n");
+                return;
+            }
+            F->q->header.tail = next;
+            continue;
         }
 
+        // Copy as many records as fit in one contiguous span
+        int toAdd = (n < space) ? n : space;
+        memcpy(&tailBlock->data[end], &T[index], toAdd * sizeof(T_rec));
+        tailBlock->nb += toAdd;
+        index += toAdd;
+
         n -= toAdd;
-        F->header.nElements += toAdd;
+        F->q->header.nElements += toAdd;
+    }
+}
 
-        // Move to the next block if the current one is full
-        if (tailBlock->nb == B) {
-            F->header.tail = (F->header.tail + 1) % F->header.nBlocks;
-            if (F->header.tail == F->header.head) {
-                printf("Queue overflow: No space left!\n");
-                return;
+// All-or-nothing variant: grows first if it may, otherwise enqueues nothing
+// and returns false when the whole group does not fit.
+bool EnqueueGroupAll(File *F, int n, T_rec T[]) {
+    while (FreeSlots(F) < n) {
+        if (!F->growable || !GrowQueue(F)) {
+            printf("Queue overflow: group of %d rejected, %d slots free\n", n, FreeSlots(F));
+            return false;
+        }
+    }
+    EnqueueGroup(F, n, T);
+    return true;
+}
+
+// Give direct access to the records at the front of the queue without copying.
+// Returns how many contiguous records (at most max) *span points to; they stay
+// valid until the next ConsumeGroup or EnqueueGroup.
+int PeekGroup(File *F, int max, const T_rec **span) {
+    TBlock *headBlock = &F->q->blocks[F->q->header.head];
+    int count = (max < headBlock->nb) ? max : headBlock->nb;
+    *span = &headBlock->data[headBlock->start];
+    return count;
+}
+
+// Drop n records from the front of the queue by moving block start offsets
+void ConsumeGroup(File *F, int n) {
+    while (n > 0 && F->q->header.nElements > 0) {
+        TBlock *headBlock = &F->q->blocks[F->q->header.head];
+        int toRemove = (n < headBlock->nb) ? n : headBlock->nb;
+
+        headBlock->start += toRemove;
+        headBlock->nb -= toRemove;
+        n -= toRemove;
+        F->q->header.nElements -= toRemove;
+
+        // An emptied block is reset; move on unless it is also the tail
+        if (headBlock->nb == 0) {
+            headBlock->start = 0;
+            if (F->q->header.head != F->q->header.tail) {
+                F->q->header.head = (F->q->header.head + 1) % F->q->header.nBlocks;
             }
         }
     }
 }
 
 void DequeueGroup(File *F, int n, T_rec T[]) {
-    if (F->header.nElements < n) {
+    if (F->q->header.nElements < n) {
         printf("Queue underflow: Not enough elements to dequeue!\n");
         return;
     }
@@ -78,26 +303,14 @@ void DequeueGroup(File *F, int n, T_rec T[]) {
     int index = 0; // Start filling T from the first position
 
     while (n > 0) {
-        TBlock *headBlock = &F->blocks[F->header.head];
-        int toRemove = (n < headBlock->nb) ? n : headBlock->nb;
+        const T_rec *span;
+        int count = PeekGroup(F, n, &span);
 
-        // Remove elements from the current block
-        for (int i = 0; i < toRemove; i++) {
-            T[index++] = headBlock->data[i];
-        }
-
-        // Shift remaining elements in the block
-        for (int i = toRemove; i < headBlock->nb; i++) {
-            headBlock->data[i - toRemove] = headBlock->data[i];
-        }
-        headBlock->nb -= toRemove;
-        n -= toRemove;
-        F->header.nElements -= toRemove;
-
-        // Move to the next block if the current one is empty
-        if (headBlock->nb == 0) {
-            F->header.head = (F->header.head + 1) % F->header.nBlocks;
-        }
+        // One memcpy per block, no shifting of what is left behind
+        memcpy(&T[index], span, count * sizeof(T_rec));
+        ConsumeGroup(F, count);
+        index += count;
+        n -= count;
     }
 }
 
@@ -108,10 +321,51 @@ void PrintRecords(T_rec *T, int n) {
     }
 }
 
-int main() {
+// Group enqueue/dequeue on a growable ring file, group sizes 1..32 drawn
+// from cfg.dist. The ring is mapped, so there is no block I/O to count.
+int RunBench(const BenchConfig *cfg) {
+    remove("bench_queue.ring");
+    File *F = OpenQueueFile("bench_queue.ring", 16, true);
+    if (!F) return 1;
+    printf("ex12 mapped ring queue: %ld records, %s group sizes, %d records per block\n", cfg->records,
+           KeyDistName(cfg->dist), B);
+
+    KeyGen sizes;
+    InitKeyGen(&sizes, cfg->dist, 32, cfg->seed);
+    T_rec group[32];
+    BenchOp enq, deq;
+    BenchBegin(&enq, "enqueue group", cfg->records / 16);
+    BenchBegin(&deq, "dequeue group", cfg->records / 16);
+    long moved = 0;
+    while (moved < cfg->records) {
+        int n = 1 + (int)NextKey(&sizes);
+        for (int i = 0; i < n; i++) group[i] = (T_rec){(int)(moved + i), "Bench", 0};
+        double t0 = BenchNow();
+        EnqueueGroup(F, n, group);
+        BenchSample(&enq, BenchNow() - t0);
+
+        // Keep some backlog so the ring wraps and grows
+        if (NbElement(F) > 256) {
+            t0 = BenchNow();
+            DequeueGroup(F, n, group);
+            BenchSample(&deq, BenchNow() - t0);
+        }
+        moved += n;
+    }
+    BenchReport(&enq, false);
+    BenchReport(&deq, false);
+    printf("  ring: %d blocks\n", F->q->header.nBlocks);
+    CloseQueue(F);
+    remove("bench_queue.ring");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    if (ParseBenchArgs(argc, argv, 1000000, &cfg)) return RunBench(&cfg);
+
     // Create a file with a total of 3 blocks
-    File *F = malloc(sizeof(File) + 3 * sizeof(TBlock)); // Allocate memory for 3 blocks
-    CreateQueue(F, 3);
+    File *F = NewQueue(3, false);
 
     // Enqueue group of records
     T_rec group1[] = {
@@ -143,8 +397,55 @@ int main() {
     printf("\nQueue after dequeuing:\n");
     printf("Total elements in queue: %d\n", NbElement(F));
 
+    // A fixed-size queue rejects a group that does not fit as a whole
+    T_rec big[8];
+    for (int i = 0; i < 8; i++) big[i] = (T_rec){100 + i, "Batch", 0};
+    EnqueueGroupAll(F, 8, big);
+    printf("Total elements in queue: %d\n", NbElement(F));
+
+    // Read the remaining records in place, block by block
+    printf("\nPeeking remaining records:\n");
+    while (NbElement(F) > 0) {
+        const T_rec *span;
+        int count = PeekGroup(F, NbElement(F), &span);
+        PrintRecords((T_rec *)span, count);
+        ConsumeGroup(F, count);
+    }
+
     // Clean up
-    free(F);
+    CloseQueue(F);
+
+    // File-backed ring that grows while its live blocks wrap around
+    F = OpenQueueFile("queue.ring", 2, true);
+    if (!F) return 1;
+    printf("\nRing file reopened with %d elements\n", NbElement(F));
+
+    int nextId = 1;
+    while (NbElement(F) > 0) {  // Drain whatever a previous run left behind
+        const T_rec *span;
+        ConsumeGroup(F, PeekGroup(F, NbElement(F), &span));
+    }
+    for (int round = 0; round < 4; round++) {
+        T_rec batch[5];
+        for (int i = 0; i < 5; i++) batch[i] = (T_rec){nextId++, "Ring", (float)round};
+        EnqueueGroupAll(F, 5, batch);
+        DequeueGroup(F, 2, dequeued);
+    }
+    printf("After 4 rounds: %d elements in %d blocks, head %d, tail %d\n",
+           NbElement(F), F->q->header.nBlocks, F->q->header.head, F->q->header.tail);
+
+    // Everything still comes out in FIFO order; leave two records for the next run
+    int n = NbElement(F) - 2;
+    T_rec *rest = malloc(n * sizeof(T_rec));
+    DequeueGroup(F, n, rest);
+    bool ordered = true;
+    for (int i = 1; i < n; i++) {
+        if (rest[i].id != rest[i - 1].id + 1) ordered = false;
+    }
+    printf("Dequeued IDs %d..%d %s, %d left in the ring\n",
+           rest[0].id, rest[n - 1].id, ordered ? "in order" : "OUT OF ORDER", NbElement(F));
+    free(rest);
+    CloseQueue(F);
 
     return 0;
 }
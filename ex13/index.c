@@ -1,34 +1,61 @@
+#define _GNU_SOURCE  // Writer-preferring rwlocks
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "../lib/blockfile.h"
+#include "../lib/bench.h"
+#include "../lib/aio.h"
+#include "../lib/wal.h"
 
+#ifndef B
 #define B 10  // Block size (in bytes)
+#endif
+#define CHUNK_BLOCKS 256  // Blocks moved per ReadBlocks/WriteBlocks call
+
+// Record layout: a 1-byte deletion flag ('0' live, '1' deleted), a binary
+// uint32 payload length, then the payload. Records are laid out back to back
+// as one byte stream over blocks 1..lastBlock and may span block boundaries.
+#define REC_HEADER 5
 
 typedef struct {
     char data[B];  // Array holding raw block data (max B bytes)
-    int nb;        // Number of valid records in the block
+    int nb;        // Number of records starting in the block
 } Block;
 
 typedef struct {
-    int lastBlock;
-    int firstFreePos;
+    int lastBlock;     // Last data block (0 when the file is empty)
+    int firstFreePos;  // First free byte in the last block
     int nbRecords;
     int nbDeleted;
 } Header;
 
+// Block 0 is the header, kept in the user area of the block-file header;
+// data block k is block k - 1 of the block file
 typedef struct {
+    BlockFile *bf;
+    pthread_rwlock_t lock;  // Readers share it; inserts, deletes and compaction windows take it alone
     Header header;
-    Block blocks[];  // Flexible array of blocks
 } File;
 
-// Mock functions to simulate reading and writing blocks to the file
+typedef struct {
+    long bytesBefore;
+    long bytesAfter;
+    long bytesReclaimed;
+    int recordsRemoved;
+    double seconds;
+} CompactStats;
+
 void ReadBlock(File *F, void *buf, int blockIndex) {
     if (blockIndex == 0) {
         // Read header block
         memcpy(buf, &F->header, sizeof(Header));
     } else {
         // Read block data
-        memcpy(buf, &F->blocks[blockIndex - 1], sizeof(Block));
+        BlockFileRead(F->bf, blockIndex - 1, buf);
     }
 }
 
@@ -36,54 +63,804 @@ void WriteBlock(File *F, void *buf, int blockIndex) {
     if (blockIndex == 0) {
         // Write to header block
         memcpy(&F->header, buf, sizeof(Header));
+        memcpy(F->bf->header.user, buf, sizeof(Header));
+        F->bf->header.nRecords = F->header.nbRecords;
+        F->bf->header.nDeleted = F->header.nbDeleted;
+        BlockFileWriteHeader(F->bf);
     } else {
         // Write to block data
-        memcpy(&F->blocks[blockIndex - 1], buf, sizeof(Block));
+        BlockFileWrite(F->bf, blockIndex - 1, buf);
+    }
+}
+
+// Read or write count consecutive data blocks starting at firstBlock (>= 1).
+// Blocks past the end of the file read as empty.
+void ReadBlocks(File *F, Block *buf, int firstBlock, int count) {
+    int64_t n = BlockFileReadRange(F->bf, firstBlock - 1, count, buf);
+    memset(buf + n, 0, (count - n) * sizeof(Block));
+}
+
+void WriteBlocks(File *F, const Block *buf, int firstBlock, int count) {
+    BlockFileWriteRange(F->bf, firstBlock - 1, count, buf);
+}
+
+// Create an empty file at path (replacing any previous one)
+File *NewFile(const char *path) {
+    BlockFile *bf = BlockFileCreate(path, sizeof(Block), VARIABLE_LAYOUT(Block, nb, data));
+    if (!bf) {
+        perror(path);
+        return NULL;
+    }
+    File *F = calloc(1, sizeof(File));
+    F->bf = bf;
+
+    // Prefer writers so a stream of readers cannot starve the compactor
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&F->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    return F;
+}
+
+void FreeFile(File *F) {
+    WriteBlock(F, &F->header, 0);
+    BlockFileClose(F->bf);
+    pthread_rwlock_destroy(&F->lock);
+    free(F);
+}
+
+// Byte offset one past the last record in the stream
+long StreamEnd(const Header *h) {
+    return h->lastBlock == 0 ? 0 : (long)(h->lastBlock - 1) * B + h->firstFreePos;
+}
+
+static void SetStreamEnd(Header *h, long end) {
+    h->lastBlock = (int)((end + B - 1) / B);
+    h->firstFreePos = h->lastBlock == 0 ? 0 : (int)(end - (long)(h->lastBlock - 1) * B);
+}
+
+// Sequential reader over the record stream. Blocks are loaded CHUNK_BLOCKS
+// at a time, and only when a byte inside them is actually needed, so
+// skipping a large deleted record does not read the blocks it covers.
+typedef struct {
+    File *F;
+    Block chunk[CHUNK_BLOCKS];
+    int firstBlock;  // Block number held in chunk[0]
+    int nLoaded;     // Blocks currently held in chunk
+    long pos;        // Stream offset of the next byte to read
+    long end;        // Stream offset one past the last record
+    int lastBlock;
+    ReadAhead *ra;   // Full passes stream every chunk instead (NULL: load on demand)
+} ChunkReader;
+
+static void ReaderInit(ChunkReader *r, File *F, const Header *h) {
+    r->F = F;
+    r->firstBlock = 1;
+    r->nLoaded = 0;
+    r->pos = 0;
+    r->end = StreamEnd(h);
+    r->lastBlock = h->lastBlock;
+    r->ra = NULL;
+}
+
+// For passes that touch every block: keep chunks in flight ahead of pos
+static void ReaderStream(ChunkReader *r) {
+    r->ra = ReadAheadOpen(r->F->bf, 0, r->lastBlock, 0, CHUNK_BLOCKS);
+}
+
+// Contiguous bytes available at pos (never crosses a block boundary)
+static int ReaderSpan(ChunkReader *r, const char **ptr) {
+    int block = (int)(r->pos / B) + 1;
+    while (r->ra && block >= r->firstBlock + r->nLoaded) {
+        int64_t first;
+        int n = ReadAheadNext(r->ra, r->chunk, &first);
+        if (n <= 0) {
+            ReadAheadClose(r->ra);  // Fall back to reading on demand
+            r->ra = NULL;
+            break;
+        }
+        r->firstBlock = (int)first + 1;
+        r->nLoaded = n;
+    }
+    if (block < r->firstBlock || block >= r->firstBlock + r->nLoaded) {
+        int count = r->lastBlock - block + 1;
+        if (count > CHUNK_BLOCKS) count = CHUNK_BLOCKS;
+        ReadBlocks(r->F, r->chunk, block, count);
+        r->firstBlock = block;
+        r->nLoaded = count;
+    }
+    int offset = (int)(r->pos % B);
+    *ptr = &r->chunk[block - r->firstBlock].data[offset];
+    return B - offset;
+}
+
+// Copy n bytes to dst (or just skip them when dst is NULL)
+static void ReaderRead(ChunkReader *r, void *dst, long n) {
+    if (!dst) {
+        r->pos += n;
+        return;
     }
+    char *out = dst;
+    while (n > 0) {
+        const char *src;
+        int span = ReaderSpan(r, &src);
+        if (span > n) span = (int)n;
+        memcpy(out, src, span);
+        out += span;
+        r->pos += span;
+        n -= span;
+    }
+}
+
+// Buffered writer that packs records back into blocks from block 1 on.
+// In-place compaction is safe because the write offset never passes the
+// read offset: every block it flushes has already been read (or skipped).
+typedef struct {
+    File *F;
+    Block chunk[CHUNK_BLOCKS];
+    int firstBlock;  // Block number that chunk[0] will be written to
+    int used;        // Bytes buffered in chunk
+    WriteBehind *wb; // Queue full chunks instead of writing them (NULL: write through)
+} ChunkWriter;
+
+static void WriterInit(ChunkWriter *w, File *F) {
+    w->F = F;
+    w->firstBlock = 1;
+    w->used = 0;
+    w->wb = NULL;
+    for (int i = 0; i < CHUNK_BLOCKS; i++) w->chunk[i].nb = 0;
+}
+
+// Start writing at stream offset pos, keeping what its block already holds
+static void WriterInitAt(ChunkWriter *w, File *F, long pos) {
+    WriterInit(w, F);
+    w->firstBlock = (int)(pos / B) + 1;
+    w->used = (int)(pos % B);
+    if (w->used > 0) ReadBlock(F, &w->chunk[0], w->firstBlock);
+}
+
+static void WriterFlush(ChunkWriter *w) {
+    int count = (w->used + B - 1) / B;
+    if (count > 0 && w->wb) WriteBehindPut(w->wb, w->firstBlock - 1, count, w->chunk);
+    else if (count > 0) WriteBlocks(w->F, w->chunk, w->firstBlock, count);
+}
+
+static void WriterNextChunk(ChunkWriter *w) {
+    WriterFlush(w);
+    w->firstBlock += CHUNK_BLOCKS;
+    w->used = 0;
+    for (int i = 0; i < CHUNK_BLOCKS; i++) w->chunk[i].nb = 0;
 }
 
-void CompactFile(File *F) {
+static void WriterPut(ChunkWriter *w, const char *src, long n) {
+    while (n > 0) {
+        if (w->used == CHUNK_BLOCKS * B) WriterNextChunk(w);
+        int offset = w->used % B;
+        int span = B - offset;
+        if (span > n) span = (int)n;
+        memcpy(&w->chunk[w->used / B].data[offset], src, span);
+        w->used += span;
+        src += span;
+        n -= span;
+    }
+}
+
+// Count a record as starting at the current write position
+static void WriterMarkRecord(ChunkWriter *w) {
+    if (w->used == CHUNK_BLOCKS * B) WriterNextChunk(w);
+    w->chunk[w->used / B].nb++;
+}
+
+// Stream n bytes from the reader to the writer without an intermediate copy
+static void CopyBytes(ChunkReader *r, ChunkWriter *w, long n) {
+    while (n > 0) {
+        const char *src;
+        int span = ReaderSpan(r, &src);
+        if (span > n) span = (int)n;
+        WriterPut(w, src, span);
+        r->pos += span;
+        n -= span;
+    }
+}
+
+// Append a record at the end of the stream; returns its offset.
+// The caller holds F->lock exclusively.
+long AppendRecord(File *F, const char *data, uint32_t len) {
+    Header *h = &F->header;
+    long offset = StreamEnd(h);
+
+    char hdr[REC_HEADER];
+    hdr[0] = '0';
+    memcpy(&hdr[1], &len, sizeof(uint32_t));
+
+    // Every block after the first is fresh, so the writer starts them empty
+    ChunkWriter writer;
+    WriterInitAt(&writer, F, offset);
+    WriterMarkRecord(&writer);
+    WriterPut(&writer, hdr, REC_HEADER);
+    WriterPut(&writer, data, len);
+    WriterFlush(&writer);
+
+    SetStreamEnd(h, offset + REC_HEADER + len);
+    h->nbRecords++;
+    return offset;
+}
+
+long InsertRecord(File *F, const char *data, uint32_t len) {
+    IoOp op = BlockFileOpBegin(F->bf, "insert");
+    pthread_rwlock_wrlock(&F->lock);
+    long offset = AppendRecord(F, data, len);
+    pthread_rwlock_unlock(&F->lock);
+    BlockFileOpEnd(&op);
+    return offset;
+}
+
+// Byte-level access to the record stream. The blocks covering the bytes are
+// read (and written back) STREAM_BLOCKS at a time.
+#define STREAM_BLOCKS 32
+
+static void StreamRead(File *F, long pos, void *dst, long n) {
+    Block blocks[STREAM_BLOCKS];
+    char *out = dst;
+    while (n > 0) {
+        int first = (int)(pos / B) + 1;
+        int count = (int)((pos % B + n + B - 1) / B);
+        if (count > STREAM_BLOCKS) count = STREAM_BLOCKS;
+        ReadBlocks(F, blocks, first, count);
+        for (int i = 0; i < count && n > 0; i++) {
+            int span = B - (int)(pos % B);
+            if (span > n) span = (int)n;
+            memcpy(out, &blocks[i].data[pos % B], span);
+            out += span;
+            pos += span;
+            n -= span;
+        }
+    }
+}
+
+static void StreamWrite(File *F, long pos, const void *src, long n) {
+    Block blocks[STREAM_BLOCKS];
+    const char *in = src;
+    while (n > 0) {
+        int first = (int)(pos / B) + 1;
+        int count = (int)((pos % B + n + B - 1) / B);
+        if (count > STREAM_BLOCKS) count = STREAM_BLOCKS;
+        ReadBlocks(F, blocks, first, count);
+        for (int i = 0; i < count && n > 0; i++) {
+            int span = B - (int)(pos % B);
+            if (span > n) span = (int)n;
+            memcpy(&blocks[i].data[pos % B], in, span);
+            in += span;
+            pos += span;
+            n -= span;
+        }
+        WriteBlocks(F, blocks, first, count);
+    }
+}
+
+// Adjust the count of records starting in the block holding pos
+static void AddStarts(File *F, long pos, int delta) {
+    int nb;
+    BlockFileReadBytes(F->bf, pos / B, offsetof(Block, nb), &nb, sizeof(int));
+    nb += delta;
+    BlockFileWriteBytes(F->bf, pos / B, offsetof(Block, nb), &nb, sizeof(int));
+}
+
+void DeleteRecord(File *F, long offset) {
+    IoOp op = BlockFileOpBegin(F->bf, "delete");
+    pthread_rwlock_wrlock(&F->lock);
+    char flag;
+    StreamRead(F, offset, &flag, 1);
+    if (flag == '0') {
+        StreamWrite(F, offset, "1", 1);
+        F->header.nbDeleted++;
+    }
+    pthread_rwlock_unlock(&F->lock);
+    BlockFileOpEnd(&op);
+}
+
+// Move n bytes towards the front of the stream (to <= from). Copying forward
+// is safe even when the ranges overlap: each span is read before any byte at
+// or after it is written.
+static void StreamMove(File *F, long to, long from, long n) {
+    char buf[STREAM_BLOCKS * B];
+    while (n > 0) {
+        long span = n < (long)sizeof(buf) ? n : (long)sizeof(buf);
+        StreamRead(F, from, buf, span);
+        StreamWrite(F, to, buf, span);
+        to += span;
+        from += span;
+        n -= span;
+    }
+}
+
+// Read the live record at offset; returns its length, or -1 if it is deleted.
+// The caller holds F->lock.
+long ReadRecord(File *F, long offset, char *buf, uint32_t max) {
+    char hdr[REC_HEADER];
+    uint32_t recLen;
+    StreamRead(F, offset, hdr, REC_HEADER);
+    memcpy(&recLen, &hdr[1], sizeof(uint32_t));
+
+    long result = -1;
+    if (hdr[0] == '0') {
+        StreamRead(F, offset + REC_HEADER, buf, recLen < max ? recLen : max);
+        result = recLen;
+    }
+    return result;
+}
+
+long ReadRecordAt(File *F, long offset, char *buf, uint32_t max) {
+    IoOp op = BlockFileOpBegin(F->bf, "read");
+    pthread_rwlock_rdlock(&F->lock);
+    long result = ReadRecord(F, offset, buf, max);
+    pthread_rwlock_unlock(&F->lock);
+    BlockFileOpEnd(&op);
+    return result;
+}
+
+// Single sequential pass that rewrites the live records in place
+CompactStats CompactFile(File *F) {
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    IoOp op = BlockFileOpBegin(F->bf, "compact");
+    pthread_rwlock_wrlock(&F->lock);
+    BlockFileBypassCache(F->bf, true);
+
     Header header;
     ReadBlock(F, &header, 0);  // Read the header block
 
-    Block Buf1, Buf2;
-    int writeIndex = 1;        // Start writing from block 1
-    int buf2Pos = 0;           // Position in Buf2
-
-    for (int i = 1; i <= header.lastBlock; i++) {
-        ReadBlock(F, &Buf1, i);  // Read block i into Buf1
-        int pos = 0;
-
-        while (pos < B) {
-            // Extract the deletion flag and record length
-            char delFlag = Buf1.data[pos];
-            if (pos + 5 >= B) break;  // Prevent overflow
-            int recLen = atoi(&Buf1.data[pos + 1]);  // Parse length
-
-            if (delFlag == '0') {  // If not deleted
-                // Check if the record fits into Buf2
-                if (buf2Pos + recLen + 6 > B) {
-                    // Write Buf2 to the file
-                    WriteBlock(F, &Buf2, writeIndex++);
-                    buf2Pos = 0;  // Reset Buf2 position
-                }
-
-                // Copy the record to Buf2
-                memcpy(&Buf2.data[buf2Pos], &Buf1.data[pos], recLen + 6);
-                buf2Pos += recLen + 6;  // Advance Buf2 position
-            }
+    ChunkReader reader;
+    ChunkWriter writer;
+    ReaderInit(&reader, F, &header);
+    WriterInit(&writer, F);
+    // Read-ahead only fetches blocks past the read position and every queued
+    // write lands behind it, so the two never touch the same block
+    ReaderStream(&reader);
+    writer.wb = WriteBehindOpen(F->bf, 0, CHUNK_BLOCKS);
+
+    CompactStats stats = {0};
+    stats.bytesBefore = reader.end;
 
-            pos += recLen + 6;  // Advance to the next record
+    while (reader.pos < reader.end) {
+        char hdr[REC_HEADER];
+        uint32_t recLen;
+        ReaderRead(&reader, hdr, REC_HEADER);
+        memcpy(&recLen, &hdr[1], sizeof(uint32_t));
+
+        if (hdr[0] == '0') {  // If not deleted
+            WriterMarkRecord(&writer);
+            WriterPut(&writer, hdr, REC_HEADER);
+            CopyBytes(&reader, &writer, recLen);
+        } else {
+            ReaderRead(&reader, NULL, recLen);
+            stats.bytesReclaimed += REC_HEADER + recLen;
+            stats.recordsRemoved++;
         }
     }
 
-    // Write any remaining data in Buf2
-    if (buf2Pos > 0) {
-        WriteBlock(F, &Buf2, writeIndex++);
-    }
+    // Write any remaining data in the writer's buffer
+    WriterFlush(&writer);
+    if (reader.ra) ReadAheadClose(reader.ra);
+    if (!WriteBehindClose(writer.wb)) fprintf(stderr, "Compaction: some blocks could not be written\n");
 
     // Update the header
-    header.lastBlock = writeIndex - 1;
-    header.firstFreePos = buf2Pos;
+    stats.bytesAfter = (long)(writer.firstBlock - 1) * B + writer.used;
+    SetStreamEnd(&header, stats.bytesAfter);
+    header.nbRecords -= stats.recordsRemoved;
+    header.nbDeleted = 0;
     WriteBlock(F, &header, 0);
+    BlockFileTruncate(F->bf, header.lastBlock);
+    BlockFileBypassCache(F->bf, false);
+    pthread_rwlock_unlock(&F->lock);
+    BlockFileOpEnd(&op);
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    stats.seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    return stats;
+}
+
+// Visit every live record in stream order
+void ForEachRecord(File *F, void (*visit)(const char *data, uint32_t len, void *ctx), void *ctx) {
+    pthread_rwlock_rdlock(&F->lock);
+    ChunkReader reader;
+    ReaderInit(&reader, F, &F->header);
+    ReaderStream(&reader);
+
+    char *payload = NULL;
+    uint32_t capacity = 0;
+    while (reader.pos < reader.end) {
+        char hdr[REC_HEADER];
+        uint32_t recLen;
+        ReaderRead(&reader, hdr, REC_HEADER);
+        memcpy(&recLen, &hdr[1], sizeof(uint32_t));
+
+        if (hdr[0] != '0') {
+            ReaderRead(&reader, NULL, recLen);
+            continue;
+        }
+        if (recLen > capacity) {
+            capacity = recLen;
+            payload = realloc(payload, capacity);
+        }
+        ReaderRead(&reader, payload, recLen);
+        visit(payload, recLen, ctx);
+    }
+    free(payload);
+    if (reader.ra) ReadAheadClose(reader.ra);
+    pthread_rwlock_unlock(&F->lock);
+}
+
+// Background incremental compaction. The stream is compacted one window at
+// a time, each under a short exclusive lock, so foreground inserts, deletes
+// and reads run between windows. Between windows the stream looks like
+//
+//   [compacted: 0..writePos) [gap: writePos..readPos) [untouched: readPos..end)
+//
+// and the gap is covered by a single deleted filler record, so readers can
+// parse it like any other part of the file. Records inserted meanwhile land
+// after end and are compacted when the pass reaches them.
+typedef struct {
+    int windowBlocks;    // Stream bytes examined per window, in blocks
+    long bytesPerSec;    // I/O budget (bytes read + written); 0 = unlimited
+    // Called under the window lock for every live record that moves
+    void (*moved)(void *ctx, long from, long to);
+    void *ctx;
+} CompactorConfig;
+
+typedef struct {
+    File *F;
+    CompactorConfig cfg;
+    pthread_t thread;
+    volatile bool stop;
+    bool done;
+    long readPos;
+    long writePos;
+    int windows;
+    CompactStats stats;
+} Compactor;
+
+// Compact one window; returns false once the pass has reached the end
+static bool CompactWindow(Compactor *c, long *ioBytes) {
+    File *F = c->F;
+    pthread_rwlock_wrlock(&F->lock);
+    // With a redo log the whole window commits at once, not record by record
+    WalBegin(F->bf);
+    Header *h = &F->header;
+    long end = StreamEnd(h);
+
+    // The filler covering the gap is about to be overwritten
+    if (c->readPos - c->writePos >= REC_HEADER) AddStarts(F, c->writePos, -1);
+
+    long windowBytes = (long)c->cfg.windowBlocks * B;
+    long examined = 0;
+    while (c->readPos < end) {
+        long gap = c->readPos - c->writePos;
+        if (examined >= windowBytes && (gap == 0 || gap >= REC_HEADER)) break;
+
+        char hdr[REC_HEADER];
+        uint32_t recLen;
+        StreamRead(F, c->readPos, hdr, REC_HEADER);
+        memcpy(&recLen, &hdr[1], sizeof(uint32_t));
+        long recBytes = REC_HEADER + recLen;
+
+        AddStarts(F, c->readPos, -1);
+        if (hdr[0] == '0') {
+            AddStarts(F, c->writePos, +1);
+            if (gap > 0) {
+                StreamMove(F, c->writePos, c->readPos, recBytes);
+                *ioBytes += recBytes;
+                if (c->cfg.moved) c->cfg.moved(c->cfg.ctx, c->readPos, c->writePos);
+            }
+            c->writePos += recBytes;
+        } else {
+            c->stats.bytesReclaimed += recBytes;
+            c->stats.recordsRemoved++;
+            h->nbRecords--;
+            h->nbDeleted--;
+        }
+        c->readPos += recBytes;
+        examined += recBytes;
+    }
+    *ioBytes += examined;
+
+    bool more = c->readPos < end;
+    if (!more) {
+        // Pass complete: cut the file back to the compacted prefix
+        c->stats.bytesAfter = c->writePos;
+        SetStreamEnd(h, c->writePos);
+    } else if (c->readPos > c->writePos) {
+        long gap = c->readPos - c->writePos;
+        uint32_t fillLen = (uint32_t)(gap - REC_HEADER);
+        char filler[REC_HEADER];
+        filler[0] = '1';
+        memcpy(&filler[1], &fillLen, sizeof(uint32_t));
+        StreamWrite(F, c->writePos, filler, REC_HEADER);
+        AddStarts(F, c->writePos, +1);
+    }
+    WalCommit(F->bf);
+    if (!more) BlockFileTruncate(F->bf, h->lastBlock);
+    c->windows++;
+    pthread_rwlock_unlock(&F->lock);
+    return more;
+}
+
+static void *CompactorThread(void *arg) {
+    Compactor *c = arg;
+    struct timespec t0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    long ioBytes = 0;
+    bool more = true;
+    while (more && !c->stop) {
+        more = CompactWindow(c, &ioBytes);
+
+        // Sleep until the bytes moved so far fit the budget
+        if (c->cfg.bytesPerSec > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double elapsed = (now.tv_sec - t0.tv_sec) + (now.tv_nsec - t0.tv_nsec) / 1e9;
+            double ahead = (double)ioBytes / c->cfg.bytesPerSec - elapsed;
+            if (ahead > 0) {
+                struct timespec nap = {(time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9)};
+                nanosleep(&nap, NULL);
+            }
+        }
+    }
+
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    c->stats.seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    c->done = !more;
+    return NULL;
+}
+
+Compactor *StartCompactor(File *F, CompactorConfig cfg) {
+    Compactor *c = calloc(1, sizeof(Compactor));
+    c->F = F;
+    c->cfg = cfg;
+    pthread_rwlock_rdlock(&F->lock);
+    c->stats.bytesBefore = StreamEnd(&F->header);
+    pthread_rwlock_unlock(&F->lock);
+    pthread_create(&c->thread, NULL, CompactorThread, c);
+    return c;
+}
+
+// Wait for the pass to finish (or stop it early) and return its statistics
+CompactStats FinishCompactor(Compactor *c, bool stopEarly) {
+    if (stopEarly) c->stop = true;
+    pthread_join(c->thread, NULL);
+    CompactStats stats = c->stats;
+    if (!c->done) stats.bytesAfter = -1;  // Stopped mid-pass: the gap stays behind as a filler record
+    free(c);
+    return stats;
+}
+
+static void Checksum(const char *data, uint32_t len, void *ctx) {
+    unsigned long *sum = ctx;
+    for (uint32_t i = 0; i < len; i++) *sum = *sum * 31 + (unsigned char)data[i];
+}
+
+// Foreground tail-latency benchmark. Every payload starts with its record id
+// and offsetById is the application's index, kept current by the compactor.
+#define MAX_IDS 200000
+
+typedef struct {
+    File *F;
+    long *offsetById;
+    int *nIds;
+    volatile bool *running;
+    BenchOp op;  // This thread's own samples
+    long maxOps;
+    int errors;
+    bool inserter;
+} Foreground;
+
+static void TrackMove(void *ctx, long from, long to) {
+    File *F = ((Foreground *)ctx)->F;
+    long *offsetById = ((Foreground *)ctx)->offsetById;
+    (void)from;
+    uint32_t id;
+    StreamRead(F, to + REC_HEADER, &id, sizeof(uint32_t));
+    offsetById[id] = to;
+}
+
+static long MakeRecord(char *payload, uint32_t id) {
+    uint32_t len = sizeof(uint32_t) + rand() % 200;
+    memcpy(payload, &id, sizeof(uint32_t));
+    for (uint32_t j = sizeof(uint32_t); j < len; j++) payload[j] = 'a' + (id + j) % 26;
+    return len;
+}
+
+static void *ForegroundThread(void *arg) {
+    Foreground *fg = arg;
+    char payload[300];
+    unsigned seed = (unsigned)(size_t)fg;
+    while (*fg->running && fg->op.n < fg->maxOps) {
+        double t0 = BenchNow();
+        if (fg->inserter) {
+            uint32_t id = (uint32_t)__atomic_load_n(fg->nIds, __ATOMIC_RELAXED);
+            if (id >= MAX_IDS) break;
+            long len = MakeRecord(payload, id);
+            // Index under the insert's lock, so the compactor cannot move the
+            // record before it is indexed
+            pthread_rwlock_wrlock(&fg->F->lock);
+            fg->offsetById[id] = AppendRecord(fg->F, payload, (uint32_t)len);
+            pthread_rwlock_unlock(&fg->F->lock);
+            __atomic_store_n(fg->nIds, id + 1, __ATOMIC_RELEASE);
+        } else {
+            int n = __atomic_load_n(fg->nIds, __ATOMIC_ACQUIRE);
+            uint32_t id = (uint32_t)(rand_r(&seed) % n), got;
+            pthread_rwlock_rdlock(&fg->F->lock);
+            long offset = fg->offsetById[id];
+            if (offset >= 0 && ReadRecord(fg->F, offset, payload, sizeof(payload)) >= 0) {
+                memcpy(&got, payload, sizeof(uint32_t));
+                if (got != id) fg->errors++;
+            }
+            pthread_rwlock_unlock(&fg->F->lock);
+        }
+        BenchSample(&fg->op, BenchNow() - t0);
+    }
+    return NULL;
+}
+
+// Run one inserter and two readers for a while, with or without the compactor
+static void RunForeground(bool compact, long bytesPerSec) {
+    File *F = NewFile("foreground.dat");
+    long *offsetById = malloc(MAX_IDS * sizeof(long));
+    char payload[300];
+    int nIds = 0;
+
+    srand(31);
+    for (; nIds < 60000; nIds++) {
+        offsetById[nIds] = InsertRecord(F, payload, (uint32_t)MakeRecord(payload, (uint32_t)nIds));
+    }
+    for (int i = 0; i < nIds; i++) {
+        if (i % 3 != 0) {
+            DeleteRecord(F, offsetById[i]);
+            offsetById[i] = -1;
+        }
+    }
+
+    volatile bool running = true;
+    Foreground fg[3];
+    pthread_t threads[3];
+    for (int t = 0; t < 3; t++) {
+        fg[t] = (Foreground){F, offsetById, &nIds, &running, {0}, 2000000, 0, t == 0};
+        BenchBegin(&fg[t].op, t == 0 ? "insert" : "read", fg[t].maxOps);
+        pthread_create(&threads[t], NULL, ForegroundThread, &fg[t]);
+    }
+
+    CompactStats stats = {0};
+    if (compact) {
+        CompactorConfig cfg = {64, bytesPerSec, TrackMove, &fg[0]};
+        stats = FinishCompactor(StartCompactor(F, cfg), false);
+    } else {
+        struct timespec nap = {0, 300000000};
+        nanosleep(&nap, NULL);
+    }
+    running = false;
+    for (int t = 0; t < 3; t++) pthread_join(threads[t], NULL);
+
+    if (compact) {
+        // Inserts keep appending during the pass, so the two sizes are taken
+        // at different times: at the end the stream is all live records
+        printf("Background compaction: reclaimed %ld bytes (%d records) in %.3f s\n", stats.bytesReclaimed,
+               stats.recordsRemoved, stats.seconds);
+        printf("  stream %ld bytes when the pass started, %ld live bytes when it finished (%ld inserted meanwhile)\n",
+               stats.bytesBefore, stats.bytesAfter, stats.bytesAfter - stats.bytesBefore + stats.bytesReclaimed);
+    } else {
+        printf("No compaction:\n");
+    }
+    // The threads share the block I/O, so only latency is shown; both
+    // readers' samples go in one report
+    BenchReport(&fg[0].op, false);
+    for (long i = 0; i < fg[2].op.n; i++) BenchSample(&fg[1].op, fg[2].op.us[i] / 1e6);
+    BenchReport(&fg[1].op, false);
+    free(fg[2].op.us);
+    if (fg[1].errors + fg[2].errors) printf("  %d reads found the wrong record!\n", fg[1].errors + fg[2].errors);
+
+    free(offsetById);
+    FreeFile(F);
+}
+
+// Insert, read and delete records of 1..300 bytes picked by cfg.dist, then
+// compact. A record of L bytes covers about (L + REC_HEADER) / B blocks.
+int RunBench(const BenchConfig *cfg) {
+    File *F = NewFile("bench_compact.dat");
+    if (!F) return 1;
+    long n = cfg->records;
+    long *offsets = malloc(n * sizeof(long));
+    char payload[300];
+    printf("ex13 variable-length records: %ld records, %s keys, %d-byte blocks\n", n, KeyDistName(cfg->dist), B);
+
+    uint64_t rng = cfg->seed;
+    BenchOp op;
+    BenchBegin(&op, "insert", n);
+    for (long i = 0; i < n; i++) {
+        uint32_t len = 1 + (uint32_t)(BenchRandom(&rng) % 300);
+        for (uint32_t j = 0; j < len; j++) payload[j] = 'a' + (i + j) % 26;
+        double t0 = BenchNow();
+        offsets[i] = InsertRecord(F, payload, len);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+
+    KeyGen keys;
+    InitKeyGen(&keys, cfg->dist, n, cfg->seed + 1);
+    BenchBegin(&op, "read", n);
+    for (long i = 0; i < n; i++) {
+        long id = NextKey(&keys);
+        double t0 = BenchNow();
+        ReadRecordAt(F, offsets[id], payload, sizeof(payload));
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+
+    InitKeyGen(&keys, cfg->dist, n, cfg->seed + 2);
+    BenchBegin(&op, "delete", n / 2);
+    for (long i = 0; i < n / 2; i++) {
+        long id = NextKey(&keys);
+        double t0 = BenchNow();
+        DeleteRecord(F, offsets[id]);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+
+    BenchBegin(&op, "compact", 1);
+    CompactStats stats = CompactFile(F);
+    BenchSample(&op, stats.seconds);
+    BenchReport(&op, true);
+    printf("  %d deleted records, %ld -> %ld bytes\n", stats.recordsRemoved, stats.bytesBefore, stats.bytesAfter);
+
+    free(offsets);
+    FreeFile(F);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    if (ParseBenchArgs(argc, argv, 100000, &cfg)) return RunBench(&cfg);
+
+    File *F = NewFile("compact.dat");
+    if (!F) return 1;
+    long *offsets = malloc(20000 * sizeof(long));
+    char payload[300];
+
+    // Records of 1..300 bytes, most of them spanning several blocks
+    srand(13);
+    for (int i = 0; i < 20000; i++) {
+        uint32_t len = 1 + rand() % 300;
+        for (uint32_t j = 0; j < len; j++) payload[j] = 'a' + (i + j) % 26;
+        offsets[i] = InsertRecord(F, payload, len);
+    }
+
+    // Delete-heavy workload: two records out of three go
+    for (int i = 0; i < 20000; i++) {
+        if (i % 3 != 0) DeleteRecord(F, offsets[i]);
+    }
+
+    unsigned long before = 0, after = 0;
+    ForEachRecord(F, Checksum, &before);
+    printf("Before: %d blocks, %d records, %d deleted\n",
+           F->header.lastBlock, F->header.nbRecords, F->header.nbDeleted);
+
+    CompactStats stats = CompactFile(F);
+    ForEachRecord(F, Checksum, &after);
+
+    printf("After:  %d blocks, %d records, %d deleted\n",
+           F->header.lastBlock, F->header.nbRecords, F->header.nbDeleted);
+    printf("Reclaimed %ld of %ld bytes (%d records) in %.3f ms, %.1f MB/s, live data %s\n",
+           stats.bytesReclaimed, stats.bytesBefore, stats.recordsRemoved, stats.seconds * 1e3,
+           stats.bytesBefore / stats.seconds / 1e6, before == after ? "intact" : "CORRUPTED");
+
+    free(offsets);
+    FreeFile(F);
+
+    // Foreground tail latency with and without a rate-limited background compactor
+    printf("\n");
+    RunForeground(false, 0);
+    RunForeground(true, 20 * 1000 * 1000);
+    return 0;
 }
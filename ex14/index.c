@@ -1,8 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../lib/blockfile.h"
+#include "../lib/bench.h"
+#include "../lib/aio.h"
 
+#ifndef B
 #define B 10  // Max number of records per block
+#endif
+#define AIO_CHUNK 64  // Blocks per asynchronous read when splitting
+#define SPLIT_RUN 8   // Blocks a splitting thread fills per fragment before writing them in one go
 
 // Define a structure for a record
 typedef struct {
@@ -18,84 +30,641 @@ typedef struct {
 
 // Define a file structure containing blocks
 typedef struct {
-    int lastBlock;  // Last block index
-    TBlock blocks[];  // Flexible array of blocks
+    BlockFile *bf;
 } File;
 
-// Define a function for reading a block (just a placeholder for demonstration)
-void ReadBlock(File *F, TBlock *buf, int blockIndex) {
-    if (blockIndex <= F->lastBlock) {
-        *buf = F->blocks[blockIndex];
+// Create an empty file at path (replacing any previous one)
+File *NewFile(const char *path) {
+    BlockFile *bf = BlockFileCreate(path, sizeof(TBlock), FIXED_LAYOUT(TBlock, nb, data));
+    if (!bf) {
+        perror(path);
+        exit(1);
     }
+    File *F = malloc(sizeof(File));
+    F->bf = bf;
+    return F;
+}
+
+void CloseFile(File *F) {
+    BlockFileClose(F->bf);
+    free(F);
+}
+
+// Last block index (-1 when empty)
+static inline int LastBlock(File *F) {
+    return (int)F->bf->header.nBlocks - 1;
 }
 
-// Define a function for writing a block (just a placeholder for demonstration)
+// Reading past the last block leaves buf untouched
+void ReadBlock(File *F, TBlock *buf, int blockIndex) {
+    BlockFileRead(F->bf, blockIndex, buf);
+}
+
+// Writing past the last block extends the file
 void WriteBlock(File *F, TBlock *buf, int blockIndex) {
-    if (blockIndex <= F->lastBlock) {
-        F->blocks[blockIndex] = *buf;
+    BlockFileWrite(F->bf, blockIndex, buf);
+}
+
+// Index of the fragment a key belongs to: the number of cut points <= key.
+// Branchless binary search over the sorted cuts; the ternary compiles to a
+// conditional move, so routing costs log2(nCuts) steps with no mispredicts.
+static inline int RouteKey(const int *cuts, int nCuts, int key) {
+    if (nCuts == 0) return 0;
+    const int *base = cuts;
+    int n = nCuts;
+    while (n > 1) {
+        int half = n / 2;
+        base = (base[half] <= key) ? base + half : base;
+        n -= half;
     }
+    return (int)(base - cuts) + (*base <= key);
 }
 
-// Fragment the file into 3 separate files (F1, F2, F3) based on key ranges
-void FragmentFile(File *F, File *F1, File *F2, File *F3, int C1, int C2) {
-    // Buffers for F1, F2, F3
-    TBlock buf1, buf2, buf3;
-    int idx1 = 0, idx2 = 0, idx3 = 0;  // Indices for each buffer
+// How records are assigned to fragments
+typedef enum {
+    PARTITION_RANGE,  // By sorted cut points: fragments hold key ranges
+    PARTITION_HASH    // By key hash: fragments stay even however keys are skewed
+} PartitionMode;
+
+typedef struct {
+    PartitionMode mode;
+    const int *cuts;  // nParts - 1 sorted cut points (range mode only)
+    int nParts;
+} Partitioner;
+
+// Murmur3 finalizer: spreads nearby keys over the whole 32-bit range
+static inline uint32_t HashKey(int key) {
+    uint32_t h = (uint32_t)key;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+// Hash mode maps the hash onto [0, nParts) with a multiply instead of a
+// modulo. Equal keys always share a fragment, so only distinct keys spread.
+static inline int RoutePartition(const Partitioner *p, int key) {
+    if (p->mode == PARTITION_HASH) return (int)(((uint64_t)HashKey(key) * p->nParts) >> 32);
+    return RouteKey(p->cuts, p->nParts - 1, key);
+}
+
+// Growable record list: one per (thread, fragment)
+typedef struct {
+    T_rec *recs;
+    int n;
+    int cap;
+} RecBuffer;
+
+static void RecBufferPush(RecBuffer *rb, T_rec rec) {
+    if (rb->n == rb->cap) {
+        rb->cap = rb->cap ? 2 * rb->cap : B;
+        rb->recs = realloc(rb->recs, rb->cap * sizeof(T_rec));
+    }
+    rb->recs[rb->n++] = rec;
+}
+
+typedef struct {
+    File *F;
+    File **out;
+    const Partitioner *partitioner;
+    int firstBlock;
+    int lastBlock;
+    int *nextBlock;  // Shared: next free block of each fragment
+    TBlock *runs;    // SPLIT_RUN blocks per fragment, owned by this thread
+    int *filled;     // Records in each fragment's run
+} SplitTask;
+
+// Record k of a run
+static inline T_rec *RunSlot(TBlock *run, int k) {
+    return &run[k / B].data[k % B];
+}
+
+// Route a range of blocks into the thread's run of blocks for each
+// fragment. A run that fills is written straight away, at block numbers
+// reserved from the fragment's counter, so memory stays SPLIT_RUN blocks
+// per fragment whatever the input size.
+static void *SplitRange(void *arg) {
+    SplitTask *t = arg;
+    // Scopes live on the worker threads: that is where the I/O happens
+    IoOp op = BlockFileOpBegin(t->F->bf, "split");
+    TBlock chunk[AIO_CHUNK];
+    ReadAhead *ra = ReadAheadOpen(t->F->bf, t->firstBlock, t->lastBlock - t->firstBlock + 1, 0, AIO_CHUNK);
+    int n;
+    while ((n = ReadAheadNext(ra, chunk, NULL)) > 0) {
+        for (int i = 0; i < n; i++) {
+            TBlock *buf = &chunk[i];
+            for (int j = 0; j < buf->nb; j++) {
+                int p = RoutePartition(t->partitioner, buf->data[j].key);
+                TBlock *run = &t->runs[p * SPLIT_RUN];
+                int k = t->filled[p]++;
+                *RunSlot(run, k) = buf->data[j];
+                run[k / B].nb = k % B + 1;
+                if (t->filled[p] < SPLIT_RUN * B) continue;
+                int first = __atomic_fetch_add(&t->nextBlock[p], SPLIT_RUN, __ATOMIC_RELAXED);
+                BlockFileWriteRange(t->out[p]->bf, first, SPLIT_RUN, run);
+                t->filled[p] = 0;
+            }
+        }
+    }
+    ReadAheadClose(ra);
+    BlockFileOpEnd(&op);
+    return NULL;
+}
+
+typedef struct {
+    File **out;
+    SplitTask *tasks;
+    int nTasks;
+    int nParts;
+    int *nextBlock;
+    int nextPart;  // Shared work counter
+} PackJob;
+
+// Pack the records the threads were left holding for each fragment, in
+// thread order, into full blocks at the end of the fragment
+static void *PackTails(void *arg) {
+    PackJob *job = arg;
+    int p;
+    while ((p = __atomic_fetch_add(&job->nextPart, 1, __ATOMIC_RELAXED)) < job->nParts) {
+        IoOp op = BlockFileOpBegin(job->out[p]->bf, "pack");
+        TBlock buf;
+        buf.nb = 0;
+        for (int t = 0; t < job->nTasks; t++) {
+            TBlock *run = &job->tasks[t].runs[p * SPLIT_RUN];
+            for (int k = 0; k < job->tasks[t].filled[p]; k++) {
+                buf.data[buf.nb++] = *RunSlot(run, k);
+                if (buf.nb < B) continue;
+                WriteBlock(job->out[p], &buf, job->nextBlock[p]++);
+                buf.nb = 0;
+            }
+        }
+        if (buf.nb > 0) WriteBlock(job->out[p], &buf, job->nextBlock[p]++);
+        BlockFileOpEnd(&op);
+    }
+    return NULL;
+}
+
+// Fragment F into p->nParts files. The input blocks are split into
+// nThreads ranges routed in parallel; each thread holds a few blocks per
+// fragment and writes them out as they fill. Within a run of blocks,
+// records keep their input order; runs of different ranges interleave (one
+// thread keeps the input order throughout). Every block but a fragment's
+// last is full.
+void FragmentFileWith(File *F, File **out, const Partitioner *p, int nThreads) {
+    int nParts = p->nParts;
+    if (nParts < 1) return;
+    int nBlocks = LastBlock(F) + 1;
+    if (nThreads > nBlocks) nThreads = nBlocks > 0 ? nBlocks : 1;
+    // One pass over the input, one over each fragment: no point caching them
+    BlockFileBypassCache(F->bf, true);
+    for (int i = 0; i < nParts; i++) BlockFileBypassCache(out[i]->bf, true);
+
+    SplitTask *tasks = malloc(nThreads * sizeof(SplitTask));
+    pthread_t *threads = malloc(nThreads * sizeof(pthread_t));
+    int *nextBlock = calloc(nParts, sizeof(int));
+    for (int t = 0; t < nThreads; t++) {
+        tasks[t] = (SplitTask){F, out, p,
+                               (int)((long)nBlocks * t / nThreads),
+                               (int)((long)nBlocks * (t + 1) / nThreads) - 1,
+                               nextBlock, malloc((size_t)nParts * SPLIT_RUN * sizeof(TBlock)),
+                               calloc(nParts, sizeof(int))};
+        pthread_create(&threads[t], NULL, SplitRange, &tasks[t]);
+    }
+    for (int t = 0; t < nThreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    PackJob job = {out, tasks, nThreads, nParts, nextBlock, 0};
+    for (int t = 0; t < nThreads; t++) {
+        pthread_create(&threads[t], NULL, PackTails, &job);
+    }
+    for (int t = 0; t < nThreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    BlockFileBypassCache(F->bf, false);
+    for (int i = 0; i < nParts; i++) BlockFileBypassCache(out[i]->bf, false);
+
+    for (int t = 0; t < nThreads; t++) {
+        free(tasks[t].runs);
+        free(tasks[t].filled);
+    }
+    free(nextBlock);
+    free(tasks);
+    free(threads);
+}
+
+// Range split: out[i] receives the keys in [cuts[i - 1], cuts[i])
+void FragmentFileN(File *F, File **out, const int *cuts, int nCuts, int nThreads) {
+    Partitioner p = {PARTITION_RANGE, cuts, nCuts + 1};
+    FragmentFileWith(F, out, &p, nThreads);
+}
+
+// Hash split into nParts evenly sized shards
+void FragmentFileHash(File *F, File **out, int nParts, int nThreads) {
+    Partitioner p = {PARTITION_HASH, NULL, nParts};
+    FragmentFileWith(F, out, &p, nThreads);
+}
+
+// Parallel scan-gather: run pred over every record of every shard on a pool
+// of nThreads workers pulling shards off a shared counter. Matches are
+// gathered per shard and returned concatenated in shard order in *results
+// (to be freed by the caller); the return value is the number of matches.
+typedef struct {
+    File **shards;
+    int nShards;
+    bool (*pred)(const T_rec *rec, void *ctx);
+    void *ctx;
+    RecBuffer *matches;  // One per shard
+    int nextShard;
+} ScanJob;
+
+static void *ScanWorker(void *arg) {
+    ScanJob *job = arg;
+    int s;
+    while ((s = __atomic_fetch_add(&job->nextShard, 1, __ATOMIC_RELAXED)) < job->nShards) {
+        File *shard = job->shards[s];
+        IoOp op = BlockFileOpBegin(shard->bf, "scan");
+        for (int i = 0; i <= LastBlock(shard); i++) {
+            TBlock buf;
+            buf.nb = 0;
+            ReadBlock(shard, &buf, i);
+            for (int j = 0; j < buf.nb; j++) {
+                if (job->pred(&buf.data[j], job->ctx)) RecBufferPush(&job->matches[s], buf.data[j]);
+            }
+        }
+        BlockFileOpEnd(&op);
+    }
+    return NULL;
+}
+
+int ScanFragments(File **shards, int nShards, bool (*pred)(const T_rec *rec, void *ctx), void *ctx,
+                  int nThreads, T_rec **results) {
+    ScanJob job = {shards, nShards, pred, ctx, calloc(nShards, sizeof(RecBuffer)), 0};
+    pthread_t *threads = malloc(nThreads * sizeof(pthread_t));
+    for (int s = 0; s < nShards; s++) BlockFileBypassCache(shards[s]->bf, true);
+    for (int t = 0; t < nThreads; t++) {
+        pthread_create(&threads[t], NULL, ScanWorker, &job);
+    }
+    for (int t = 0; t < nThreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    for (int s = 0; s < nShards; s++) BlockFileBypassCache(shards[s]->bf, false);
+
+    int total = 0;
+    for (int s = 0; s < nShards; s++) total += job.matches[s].n;
+    *results = malloc((total > 0 ? total : 1) * sizeof(T_rec));
+    int n = 0;
+    for (int s = 0; s < nShards; s++) {
+        memcpy(*results + n, job.matches[s].recs, job.matches[s].n * sizeof(T_rec));
+        n += job.matches[s].n;
+        free(job.matches[s].recs);
+    }
+    free(job.matches);
+    free(threads);
+    return total;
+}
+
+// Automatic cut points. A reservoir sample of the input keys (Algorithm R)
+// is sorted and its quantiles become the cut points for nParts fragments of
+// roughly equal size. With maxImbalance > 0, an exact counting pass checks
+// the largest fragment against the mean and the sample is doubled until it
+// fits (or maxRounds is reached: heavily duplicated keys cannot be split).
+typedef struct {
+    int nParts;
+    int sampleSize;
+    double maxImbalance;  // e.g. 0.1: largest fragment at most 10% above the mean
+    int maxRounds;
+    uint64_t seed;
+} AutoCutConfig;
+
+static inline uint64_t NextRandom(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
 
-    // Initialize buffers
-    buf1.nb = buf2.nb = buf3.nb = 0;
+static int CompareInts(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
 
-    // Iterate through all records in the original file
-    for (int i = 0; i <= F->lastBlock; i++) {
+// Returns how many keys were sampled (fewer than sampleSize for small files)
+static int SampleKeys(File *F, int *sample, int sampleSize, uint64_t *rng) {
+    long seen = 0;
+    int kept = 0;
+    for (int i = 0; i <= LastBlock(F); i++) {
         TBlock buf;
+        buf.nb = 0;
         ReadBlock(F, &buf, i);
-        for (int j = 0; j < buf.nb; j++) {
-            T_rec record = buf.data[j];
-
-            // Determine which file to put the record in based on key ranges
-            if (record.key < C1) {
-                // Insert into F1
-                if (buf1.nb < B) {
-                    buf1.data[buf1.nb++] = record;
-                } else {
-                    // Write to F1 and reset buffer
-                    WriteBlock(F1, &buf1, idx1++);
-                    buf1.data[0] = record;
-                    buf1.nb = 1;
-                }
-            } else if (record.key >= C1 && record.key < C2) {
-                // Insert into F2
-                if (buf2.nb < B) {
-                    buf2.data[buf2.nb++] = record;
-                } else {
-                    // Write to F2 and reset buffer
-                    WriteBlock(F2, &buf2, idx2++);
-                    buf2.data[0] = record;
-                    buf2.nb = 1;
-                }
+        for (int j = 0; j < buf.nb; j++, seen++) {
+            if (kept < sampleSize) {
+                sample[kept++] = buf.data[j].key;
             } else {
-                // Insert into F3
-                if (buf3.nb < B) {
-                    buf3.data[buf3.nb++] = record;
-                } else {
-                    // Write to F3 and reset buffer
-                    WriteBlock(F3, &buf3, idx3++);
-                    buf3.data[0] = record;
-                    buf3.nb = 1;
-                }
+                long slot = (long)(NextRandom(rng) % (uint64_t)(seen + 1));
+                if (slot < sampleSize) sample[slot] = buf.data[j].key;
+            }
+        }
+    }
+    return kept;
+}
+
+// Quantiles of the sorted sample, nudged up so the cuts stay strictly
+// increasing. Cuts that would pass INT_MAX are nudged down from it instead.
+static void CutsFromSample(int *sample, int nSample, int nParts, int *cuts) {
+    qsort(sample, nSample, sizeof(int), CompareInts);
+    for (int i = 1; i < nParts; i++) {
+        int cut = nSample > 0 ? sample[(long)i * nSample / nParts] : i;
+        if (i > 1 && cut <= cuts[i - 2]) cut = cuts[i - 2] < INT_MAX ? cuts[i - 2] + 1 : INT_MAX;
+        cuts[i - 1] = cut;
+    }
+    for (int i = nParts - 3; i >= 0; i--) {
+        if (cuts[i] >= cuts[i + 1]) cuts[i] = cuts[i + 1] - 1;
+    }
+}
+
+// Largest fragment relative to the mean (0 means perfectly even)
+static double MeasureImbalance(File *F, const int *cuts, int nParts) {
+    long *counts = calloc(nParts, sizeof(long));
+    long total = 0;
+    for (int i = 0; i <= LastBlock(F); i++) {
+        TBlock buf;
+        buf.nb = 0;
+        ReadBlock(F, &buf, i);
+        for (int j = 0; j < buf.nb; j++) {
+            counts[RouteKey(cuts, nParts - 1, buf.data[j].key)]++;
+            total++;
+        }
+    }
+    long largest = 0;
+    for (int p = 0; p < nParts; p++) {
+        if (counts[p] > largest) largest = counts[p];
+    }
+    free(counts);
+    return total > 0 ? (double)largest * nParts / total - 1.0 : 0.0;
+}
+
+// Pick cut points (cfg.nParts - 1 of them, written to cuts) and fragment F.
+// Returns the imbalance of the fragments produced, or -1 if it was not measured.
+double FragmentFileAuto(File *F, File **out, AutoCutConfig cfg, int nThreads, int *cuts) {
+    uint64_t rng = cfg.seed ? cfg.seed : 0x9e3779b97f4a7c15ull;
+    int sampleSize = cfg.sampleSize;
+    double imbalance = -1;
+
+    for (int round = 0;; round++) {
+        int *sample = malloc(sampleSize * sizeof(int));
+        int nSample = SampleKeys(F, sample, sampleSize, &rng);
+        CutsFromSample(sample, nSample, cfg.nParts, cuts);
+        free(sample);
+
+        if (cfg.maxImbalance <= 0) break;
+        imbalance = MeasureImbalance(F, cuts, cfg.nParts);
+        // Stop once balanced, out of rounds, or already sampling every record
+        if (imbalance <= cfg.maxImbalance || round + 1 >= cfg.maxRounds || nSample < sampleSize) break;
+        sampleSize *= 2;
+    }
+
+    FragmentFileN(F, out, cuts, cfg.nParts - 1, nThreads);
+    return imbalance;
+}
+
+// Fragment the file into 3 separate files (F1, F2, F3) based on key ranges
+void FragmentFile(File *F, File *F1, File *F2, File *F3, int C1, int C2) {
+    File *out[3] = {F1, F2, F3};
+    int cuts[2] = {C1, C2};
+    FragmentFileN(F, out, cuts, 2, 1);
+}
+
+static int CountRecords(File *F) {
+    int n = 0;
+    for (int i = 0; i <= LastBlock(F); i++) {
+        TBlock buf;
+        buf.nb = 0;
+        ReadBlock(F, &buf, i);
+        n += buf.nb;
+    }
+    return n;
+}
+
+// Check every record of every fragment sits between its two cut points
+static bool CheckFragments(File **out, const int *cuts, int nCuts, int expected) {
+    int total = 0;
+    for (int p = 0; p <= nCuts; p++) {
+        for (int i = 0; i <= LastBlock(out[p]); i++) {
+            TBlock buf;
+            buf.nb = 0;
+            ReadBlock(out[p], &buf, i);
+            for (int j = 0; j < buf.nb; j++) {
+                int key = buf.data[j].key;
+                if ((p > 0 && key < cuts[p - 1]) || (p < nCuts && key >= cuts[p])) return false;
             }
         }
+        total += CountRecords(out[p]);
+    }
+    return total == expected;
+}
+
+// Smallest and largest fragment, in records
+static void FragmentSpread(File **out, int nParts, int *smallest, int *largest) {
+    *smallest = *largest = CountRecords(out[0]);
+    for (int p = 1; p < nParts; p++) {
+        int n = CountRecords(out[p]);
+        if (n < *smallest) *smallest = n;
+        if (n > *largest) *largest = n;
+    }
+}
+
+// Scratch fragment files <prefix>_<p>.dat, removed again by DropFragments
+static void NewFragments(File **out, int nParts, const char *prefix) {
+    char path[64];
+    for (int p = 0; p < nParts; p++) {
+        snprintf(path, sizeof(path), "%s_%d.dat", prefix, p);
+        out[p] = NewFile(path);
+    }
+}
+
+static void DropFragments(File **out, int nParts, const char *prefix) {
+    char path[64];
+    for (int p = 0; p < nParts; p++) {
+        CloseFile(out[p]);
+        snprintf(path, sizeof(path), "%s_%d.dat", prefix, p);
+        unlink(path);
+    }
+}
+
+static bool KeyDivisibleBy7(const T_rec *rec, void *ctx) {
+    (void)ctx;
+    return rec->key % 7 == 0;
+}
+
+// Uniform keys in [0, maxKey), or skewed ones: 90% of them below maxKey / 1000
+static void FillFile(File *F, int nRecords, int maxKey, bool skewed) {
+    TBlock buf;
+    buf.nb = 0;
+    int idx = 0;
+    for (int i = 0; i < nRecords; i++) {
+        int range = (skewed && rand() % 10 != 0) ? maxKey / 1000 : maxKey;
+        buf.data[buf.nb].key = rand() % range;
+        snprintf(buf.data[buf.nb].data, sizeof(buf.data[0].data), "Record %d", i);
+        if (++buf.nb == B) {
+            WriteBlock(F, &buf, idx++);
+            buf.nb = 0;
+        }
     }
+    if (buf.nb > 0) WriteBlock(F, &buf, idx++);
+}
 
-    // Write any remaining records in buffers to the corresponding files
-    if (buf1.nb > 0) {
-        WriteBlock(F1, &buf1, idx1++);
+// Whole-file passes over cfg.records records with cfg.dist keys: each split
+// reads every input block once and writes about as many fragment blocks,
+// the scan reads every fragment block once.
+int RunBench(const BenchConfig *cfg) {
+    int nParts = 16;
+    File *F = NewFile("bench_input.dat");
+    KeyGen keys;
+    InitKeyGen(&keys, cfg->dist, 1 << 30, cfg->seed);
+    TBlock buf;
+    buf.nb = 0;
+    int idx = 0;
+    for (long i = 0; i < cfg->records; i++) {
+        buf.data[buf.nb].key = (int)NextKey(&keys);
+        snprintf(buf.data[buf.nb].data, sizeof(buf.data[0].data), "Record %d", (int)i);
+        if (++buf.nb == B) {
+            WriteBlock(F, &buf, idx++);
+            buf.nb = 0;
+        }
     }
-    if (buf2.nb > 0) {
-        WriteBlock(F2, &buf2, idx2++);
+    if (buf.nb > 0) WriteBlock(F, &buf, idx++);
+    printf("ex14 fragmentation: %ld records, %s keys, %d records per block, %d blocks, %d fragments\n",
+           cfg->records, KeyDistName(cfg->dist), B, idx, nParts);
+
+    int cuts[15];
+    for (int i = 0; i < nParts - 1; i++) cuts[i] = (int)((long)(i + 1) * (1 << 30) / nParts);
+    File *out[16];
+    BenchOp op;
+    const char *names[3] = {"range split", "hash split", "sampled split"};
+    for (int mode = 0; mode < 3; mode++) {
+        BenchBegin(&op, names[mode], 5);
+        for (int run = 0; run < 5; run++) {
+            NewFragments(out, nParts, "bench_shard");
+            double t0 = BenchNow();
+            if (mode == 0) {
+                FragmentFileN(F, out, cuts, nParts - 1, 1);
+            } else if (mode == 1) {
+                FragmentFileHash(F, out, nParts, 1);
+            } else {
+                int autoCuts[15];
+                AutoCutConfig autoCfg = {nParts, 16 * nParts, 0.25, 6, cfg->seed};
+                FragmentFileAuto(F, out, autoCfg, 1, autoCuts);
+            }
+            BenchSample(&op, BenchNow() - t0);
+            if (run < 4 || mode < 2) DropFragments(out, nParts, "bench_shard");
+        }
+        BenchReport(&op, true);
     }
-    if (buf3.nb > 0) {
-        WriteBlock(F3, &buf3, idx3++);
+
+    BenchBegin(&op, "scan", 5);
+    for (int run = 0; run < 5; run++) {
+        T_rec *results;
+        double t0 = BenchNow();
+        ScanFragments(out, nParts, KeyDivisibleBy7, NULL, 1, &results);
+        BenchSample(&op, BenchNow() - t0);
+        free(results);
     }
+    BenchReport(&op, true);
+    DropFragments(out, nParts, "bench_shard");
+    CloseFile(F);
+    remove("bench_input.dat");
+    return 0;
 }
 
+int main(int argc, char **argv) {
+    BenchConfig bench;
+    if (ParseBenchArgs(argc, argv, 1000000, &bench)) return RunBench(&bench);
+
+    int nRecords = 1000000;
+    File *F = NewFile("input.dat");
+    srand(14);
+    FillFile(F, nRecords, 1 << 30, false);
+
+    // The classic three-way split
+    File *F1 = NewFile("F1.dat"), *F2 = NewFile("F2.dat"), *F3 = NewFile("F3.dat");
+    int C1 = 1 << 28, C2 = 1 << 29;
+    FragmentFile(F, F1, F2, F3, C1, C2);
+    printf("3-way split: F1 %d, F2 %d, F3 %d records\n", CountRecords(F1), CountRecords(F2), CountRecords(F3));
+    CloseFile(F1);
+    CloseFile(F2);
+    CloseFile(F3);
+
+    // Shard into 256 pieces with a growing number of threads
+    int nParts = 256;
+    int cuts[255];
+    for (int i = 0; i < nParts - 1; i++) cuts[i] = (int)((long)(i + 1) * (1 << 30) / nParts);
+    File *out[256];
+    for (int nThreads = 1; nThreads <= 8; nThreads *= 2) {
+        NewFragments(out, nParts, "shard");
+
+        double t0 = BenchNow();
+        FragmentFileN(F, out, cuts, nParts - 1, nThreads);
+        double ms = (BenchNow() - t0) * 1e3;
+
+        printf("%d-way split, %d threads: %.1f ms (%.1f M records/s), fragments %s\n",
+               nParts, nThreads, ms, nRecords / ms / 1e3,
+               CheckFragments(out, cuts, nParts - 1, nRecords) ? "correct" : "WRONG");
+        DropFragments(out, nParts, "shard");
+    }
+    CloseFile(F);
+
+    // Skewed keys: range shards with even cut points are badly unbalanced,
+    // hash shards are not
+    F = NewFile("input.dat");
+    FillFile(F, nRecords, 1 << 30, true);
+    int smallest, largest;
+    NewFragments(out, nParts, "shard");
+    FragmentFileN(F, out, cuts, nParts - 1, 4);
+    FragmentSpread(out, nParts, &smallest, &largest);
+    printf("\nSkewed keys, range shards: smallest %d, largest %d records\n", smallest, largest);
+    DropFragments(out, nParts, "shard");
+
+    NewFragments(out, nParts, "shard");
+    FragmentFileHash(F, out, nParts, 4);
+    FragmentSpread(out, nParts, &smallest, &largest);
+    printf("Skewed keys, hash shards:  smallest %d, largest %d records\n", smallest, largest);
+
+    // Sampled cut points keep range shards (and their key order) balanced too
+    File *sampled[256];
+    int autoCuts[255];
+    NewFragments(sampled, nParts, "sampled");
+    AutoCutConfig cfg = {nParts, 16 * nParts, 0.25, 6, 0};
+    double imbalance = FragmentFileAuto(F, sampled, cfg, 4, autoCuts);
+    FragmentSpread(sampled, nParts, &smallest, &largest);
+    printf("Skewed keys, sampled cuts: smallest %d, largest %d records (%.0f%% above mean), fragments %s\n",
+           smallest, largest, imbalance * 100,
+           CheckFragments(sampled, autoCuts, nParts - 1, nRecords) ? "correct" : "WRONG");
+    DropFragments(sampled, nParts, "sampled");
+
+    // Full scan over all shards at once
+    int expected = 0;
+    for (int i = 0; i <= LastBlock(F); i++) {
+        TBlock buf;
+        buf.nb = 0;
+        ReadBlock(F, &buf, i);
+        for (int j = 0; j < buf.nb; j++) expected += buf.data[j].key % 7 == 0;
+    }
+    for (int nThreads = 1; nThreads <= 8; nThreads *= 2) {
+        T_rec *results;
+        double t0 = BenchNow();
+        int found = ScanFragments(out, nParts, KeyDivisibleBy7, NULL, nThreads, &results);
+        double ms = (BenchNow() - t0) * 1e3;
+        printf("Scan-gather, %d threads: %d matches (%s) in %.1f ms\n",
+               nThreads, found, found == expected ? "correct" : "WRONG", ms);
+        free(results);
+    }
+    DropFragments(out, nParts, "shard");
+
+    CloseFile(F);
+    return 0;
+}
@@ -0,0 +1,562 @@
+//**Structure Definitions**
+
+// The ex9 records kept in a B+-tree instead of a primary zone with overflow
+// chains: lookups cost one node per level however many records are inserted,
+// and the file never needs a Reorganize.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../lib/blockfile.h"
+#include "../lib/bench.h"
+#include "../lib/bufpool.h"
+
+#ifndef NODE_SIZE
+#define NODE_SIZE 4096
+#endif
+#ifndef RECORD_SIZE
+#define RECORD_SIZE 256
+#endif
+#ifndef POOL_FRAMES
+#define POOL_FRAMES 64  // Nodes cached in memory
+#endif
+#define MAX_KEY_LENGTH 10
+
+// Record structure (as in ex9)
+typedef struct {
+    char key[MAX_KEY_LENGTH];  // Key for the record
+    char logical_deletion;     // '0' for active, '1' for deleted
+    char data[RECORD_SIZE - MAX_KEY_LENGTH - 1]; // Record data
+} Record;
+
+#define NODE_HEADER (3 * sizeof(int))
+#define LEAF_CAPACITY ((NODE_SIZE - NODE_HEADER) / sizeof(Record))
+#define INNER_CAPACITY ((NODE_SIZE - NODE_HEADER - sizeof(int)) / (MAX_KEY_LENGTH + sizeof(int)))
+
+// Node structure. Leaves hold the records in key order; an inner node with
+// count keys has count + 1 children, child i holding the keys in
+// [keys[i - 1], keys[i]).
+typedef struct {
+    int is_leaf;
+    int count;      // Records (leaf) or keys (inner node)
+    int next_leaf;  // Right sibling of a leaf (-1 for the last one)
+    union {
+        Record records[LEAF_CAPACITY];
+        struct {
+            int children[INNER_CAPACITY + 1];
+            char keys[INNER_CAPACITY][MAX_KEY_LENGTH];
+        };
+    };
+} Node;
+
+_Static_assert(LEAF_CAPACITY >= 3, "NODE_SIZE must hold at least three records");
+_Static_assert(sizeof(Node) <= NODE_SIZE, "a node must fit in NODE_SIZE");
+
+// File header
+typedef struct {
+    int root;           // Block of the root node (-1 when empty)
+    int height;         // Levels, leaves included
+    int node_count;     // Blocks in use; new nodes go at the end
+    int first_leaf;     // Where full scans start
+    int total_records;  // Total number of records in the file
+} TreeHeader;
+
+// Tree structure
+typedef struct {
+    BlockFile *file;   // Block file; the TreeHeader is kept in its user area
+    BufferPool *pool;  // Every node access goes through it
+    TreeHeader header;
+} Tree;
+
+void SaveHeader(BlockFile *file, const TreeHeader *header) {
+    memcpy(file->header.user, header, sizeof(TreeHeader));
+    file->header.nRecords = header->total_records;
+    BlockFileWriteHeader(file);
+}
+
+// Keys are MAX_KEY_LENGTH characters with no terminator
+static int CompareKeys(const char *a, const char *b) {
+    return strncmp(a, b, MAX_KEY_LENGTH);
+}
+
+static Node *PinNode(Tree *tree, int blockNumber) {
+    return PoolPin(tree->pool, blockNumber, false);
+}
+
+static void UnpinNode(Tree *tree, Node *node, int dirty) {
+    PoolUnpin(tree->pool, node, dirty);
+}
+
+// A zeroed node at the end of the file, pinned and already marked dirty
+static Node *NewNode(Tree *tree, int is_leaf, int *blockNumber) {
+    *blockNumber = tree->header.node_count++;
+    Node *node = PoolPin(tree->pool, *blockNumber, true);
+    if (!node) return NULL;
+    node->is_leaf = is_leaf;
+    node->next_leaf = -1;
+    return node;
+}
+
+// First slot whose key is >= key
+static int LeafSearch(const Node *leaf, const char *key) {
+    int left = 0, right = leaf->count;
+    while (left < right) {
+        int mid = (left + right) / 2;
+        if (CompareKeys(leaf->records[mid].key, key) < 0) left = mid + 1;
+        else right = mid;
+    }
+    return left;
+}
+
+// Child to descend into: the number of keys <= key
+static int ChildIndex(const Node *node, const char *key) {
+    int left = 0, right = node->count;
+    while (left < right) {
+        int mid = (left + right) / 2;
+        if (CompareKeys(node->keys[mid], key) <= 0) left = mid + 1;
+        else right = mid;
+    }
+    return left;
+}
+
+// Leaf that holds key, or would
+static int FindLeaf(Tree *tree, const char *key) {
+    int blockNumber = tree->header.root;
+    for (int level = 1; level < tree->header.height; level++) {
+        Node *node = PinNode(tree, blockNumber);
+        if (!node) return -1;
+        int child = node->children[ChildIndex(node, key)];
+        UnpinNode(tree, node, 0);
+        blockNumber = child;
+    }
+    return blockNumber;
+}
+
+
+//** Locate a Record**
+
+// Same contract as ex9: 1 and the record's leaf and slot when found, else 0
+// with the leaf it would go in and record_idx = -1
+int Locate(Tree *tree, const char *key, int *block_idx, int *record_idx) {
+    IoOp op = BlockFileOpBegin(tree->file, "locate");
+    *block_idx = tree->header.root < 0 ? 0 : FindLeaf(tree, key);
+    *record_idx = -1;
+    Node *leaf = tree->header.root < 0 ? NULL : PinNode(tree, *block_idx);
+    if (leaf) {
+        int i = LeafSearch(leaf, key);
+        if (i < leaf->count && CompareKeys(leaf->records[i].key, key) == 0) *record_idx = i;
+        UnpinNode(tree, leaf, 0);
+    }
+    BlockFileOpEnd(&op);
+    return *record_idx >= 0;
+}
+
+// **Interval Query**
+
+// Visit every record with key_a <= key <= key_b in key order, following the
+// leaf links; returns how many there were
+long ScanRange(Tree *tree, const char *key_a, const char *key_b,
+               void (*visit)(int block, int position, const Record *rec, void *ctx), void *ctx) {
+    long n = 0;
+    if (tree->header.root < 0) return 0;
+    IoOp op = BlockFileOpBegin(tree->file, "list");
+    int blockNumber = FindLeaf(tree, key_a);
+    int done = 0;
+    while (blockNumber != -1 && !done) {
+        Node *leaf = PinNode(tree, blockNumber);
+        if (!leaf) break;
+        for (int j = LeafSearch(leaf, key_a); j < leaf->count; j++) {
+            if (CompareKeys(leaf->records[j].key, key_b) > 0) {
+                done = 1;
+                break;
+            }
+            if (visit) visit(blockNumber, j, &leaf->records[j], ctx);
+            n++;
+        }
+        int next = leaf->next_leaf;
+        UnpinNode(tree, leaf, 0);
+        blockNumber = next;
+    }
+    BlockFileOpEnd(&op);
+    return n;
+}
+
+static void PrintRecord(int block, int position, const Record *rec, void *ctx) {
+    (void)ctx;
+    printf("Record in Block %d, Position %d: Key = %.*s, Data = %s\n",
+           block, position, MAX_KEY_LENGTH, rec->key, rec->data);
+}
+
+void List(Tree *tree, const char *key_a, const char *key_b) {
+    ScanRange(tree, key_a, key_b, PrintRecord, NULL);
+}
+
+// **Insertion**
+
+// Insert into the subtree at blockNumber. When the node had to split,
+// returns 1 with the new right sibling in *right and its smallest key in
+// separator. *status is 1 if the record went in, 0 for a duplicate key.
+static int InsertInto(Tree *tree, int blockNumber, const Record *rec, char *separator, int *right, int *status) {
+    Node *node = PinNode(tree, blockNumber);
+    if (!node) {
+        *status = 0;
+        return 0;
+    }
+
+    if (node->is_leaf) {
+        int pos = LeafSearch(node, rec->key);
+        if (pos < node->count && CompareKeys(node->records[pos].key, rec->key) == 0) {
+            // A logically deleted record gives its slot back; a live one stays
+            *status = node->records[pos].logical_deletion == '1';
+            if (*status) node->records[pos] = *rec;
+            UnpinNode(tree, node, *status);
+            return 0;
+        }
+        *status = 1;
+        if (node->count < (int)LEAF_CAPACITY) {
+            memmove(&node->records[pos + 1], &node->records[pos], (node->count - pos) * sizeof(Record));
+            node->records[pos] = *rec;
+            node->count++;
+            UnpinNode(tree, node, 1);
+            return 0;
+        }
+
+        // Split the full leaf: the upper half moves to a new right sibling
+        Record all[LEAF_CAPACITY + 1];
+        memcpy(all, node->records, pos * sizeof(Record));
+        all[pos] = *rec;
+        memcpy(&all[pos + 1], &node->records[pos], (node->count - pos) * sizeof(Record));
+        int total = node->count + 1, half = total / 2;
+
+        Node *sibling = NewNode(tree, 1, right);
+        if (!sibling) {
+            UnpinNode(tree, node, 0);
+            *status = 0;
+            return 0;
+        }
+        memcpy(node->records, all, half * sizeof(Record));
+        node->count = half;
+        memcpy(sibling->records, &all[half], (total - half) * sizeof(Record));
+        sibling->count = total - half;
+        sibling->next_leaf = node->next_leaf;
+        node->next_leaf = *right;
+        memcpy(separator, sibling->records[0].key, MAX_KEY_LENGTH);
+        UnpinNode(tree, sibling, 1);
+        UnpinNode(tree, node, 1);
+        return 1;
+    }
+
+    int i = ChildIndex(node, rec->key);
+    char child_separator[MAX_KEY_LENGTH];
+    int child_right;
+    if (!InsertInto(tree, node->children[i], rec, child_separator, &child_right, status)) {
+        UnpinNode(tree, node, 0);
+        return 0;
+    }
+
+    // The child split: its new sibling goes right after it
+    if (node->count < (int)INNER_CAPACITY) {
+        memmove(node->keys[i + 1], node->keys[i], (node->count - i) * MAX_KEY_LENGTH);
+        memmove(&node->children[i + 2], &node->children[i + 1], (node->count - i) * sizeof(int));
+        memcpy(node->keys[i], child_separator, MAX_KEY_LENGTH);
+        node->children[i + 1] = child_right;
+        node->count++;
+        UnpinNode(tree, node, 1);
+        return 0;
+    }
+
+    // Split the full inner node around its middle key, which moves up
+    char keys[INNER_CAPACITY + 1][MAX_KEY_LENGTH];
+    int children[INNER_CAPACITY + 2];
+    memcpy(keys, node->keys, i * MAX_KEY_LENGTH);
+    memcpy(keys[i], child_separator, MAX_KEY_LENGTH);
+    memcpy(keys[i + 1], node->keys[i], (node->count - i) * MAX_KEY_LENGTH);
+    memcpy(children, node->children, (i + 1) * sizeof(int));
+    children[i + 1] = child_right;
+    memcpy(&children[i + 2], &node->children[i + 1], (node->count - i) * sizeof(int));
+    int total = node->count + 1, mid = total / 2;
+
+    Node *sibling = NewNode(tree, 0, right);
+    if (!sibling) {
+        UnpinNode(tree, node, 0);
+        *status = 0;
+        return 0;
+    }
+    memcpy(node->keys, keys, mid * MAX_KEY_LENGTH);
+    memcpy(node->children, children, (mid + 1) * sizeof(int));
+    node->count = mid;
+    memcpy(separator, keys[mid], MAX_KEY_LENGTH);
+    memcpy(sibling->keys, keys[mid + 1], (total - mid - 1) * MAX_KEY_LENGTH);
+    memcpy(sibling->children, &children[mid + 1], (total - mid) * sizeof(int));
+    sibling->count = total - mid - 1;
+    UnpinNode(tree, sibling, 1);
+    UnpinNode(tree, node, 1);
+    return 1;
+}
+
+// Returns 1 if the record was inserted, 0 if its key is already present
+int Insert(Tree *tree, const Record *rec) {
+    IoOp op = BlockFileOpBegin(tree->file, "insert");
+    int status = 0;
+    if (tree->header.root < 0) {
+        Node *leaf = NewNode(tree, 1, &tree->header.root);
+        if (!leaf) {
+            BlockFileOpEnd(&op);
+            return 0;
+        }
+        leaf->records[0] = *rec;
+        leaf->count = 1;
+        UnpinNode(tree, leaf, 1);
+        tree->header.first_leaf = tree->header.root;
+        tree->header.height = 1;
+        status = 1;
+    } else {
+        char separator[MAX_KEY_LENGTH];
+        int right;
+        if (InsertInto(tree, tree->header.root, rec, separator, &right, &status)) {
+            // The root split: grow the tree by one level
+            int root;
+            Node *node = NewNode(tree, 0, &root);
+            if (!node) {
+                BlockFileOpEnd(&op);
+                return status;  // The split halves are written but unreachable from the root
+            }
+            node->count = 1;
+            memcpy(node->keys[0], separator, MAX_KEY_LENGTH);
+            node->children[0] = tree->header.root;
+            node->children[1] = right;
+            UnpinNode(tree, node, 1);
+            tree->header.root = root;
+            tree->header.height++;
+        }
+    }
+    tree->header.total_records += status;
+    BlockFileOpEnd(&op);
+    return status;
+}
+
+// **Bulk Loading**
+
+// Build a tree from records sorted by key (no duplicates), bottom-up: the
+// leaves are written left to right fill * LEAF_CAPACITY records each, then
+// every level above them in turn. Leaves come first in the file, so a full
+// scan reads it front to back.
+void BulkLoad(const char *name, const Record *records, long n, float fill) {
+    BlockFile *file = BlockFileCreate(name, sizeof(Node), FIXED_LAYOUT(Node, count, records));
+    TreeHeader header = {-1, 0, 0, 0, 0};
+    if (!file) {
+        perror(name);
+        return;
+    }
+
+    int per_leaf = (int)(fill * LEAF_CAPACITY), per_inner = (int)(fill * (INNER_CAPACITY + 1));
+    if (per_leaf < 1) per_leaf = 1;
+    if (per_inner < 2) per_inner = 2;
+
+    // Spread the records evenly so the last leaf is not left nearly empty
+    long nodes = (n + per_leaf - 1) / per_leaf;
+    int *level = malloc((nodes > 0 ? nodes : 1) * sizeof(int));
+    char (*first_keys)[MAX_KEY_LENGTH] = malloc((nodes > 0 ? nodes : 1) * MAX_KEY_LENGTH);
+    Node node;
+    for (long k = 0; k < nodes; k++) {
+        long from = n * k / nodes, to = n * (k + 1) / nodes;
+        memset(&node, 0, sizeof(Node));
+        node.is_leaf = 1;
+        node.count = (int)(to - from);
+        node.next_leaf = k + 1 < nodes ? header.node_count + 1 : -1;
+        memcpy(node.records, &records[from], node.count * sizeof(Record));
+        level[k] = header.node_count;
+        memcpy(first_keys[k], records[from].key, MAX_KEY_LENGTH);
+        BlockFileWrite(file, header.node_count++, &node);
+    }
+    if (nodes > 0) header.height = 1;
+
+    // Each pass turns one level into its parents, in place
+    while (nodes > 1) {
+        long parents = (nodes + per_inner - 1) / per_inner;
+        for (long k = 0; k < parents; k++) {
+            long from = nodes * k / parents, to = nodes * (k + 1) / parents;
+            memset(&node, 0, sizeof(Node));
+            node.next_leaf = -1;
+            node.count = (int)(to - from - 1);
+            for (long c = from; c < to; c++) {
+                node.children[c - from] = level[c];
+                if (c > from) memcpy(node.keys[c - from - 1], first_keys[c], MAX_KEY_LENGTH);
+            }
+            level[k] = header.node_count;
+            memmove(first_keys[k], first_keys[from], MAX_KEY_LENGTH);
+            BlockFileWrite(file, header.node_count++, &node);
+        }
+        nodes = parents;
+        header.height++;
+    }
+
+    header.root = n > 0 ? level[0] : -1;
+    header.total_records = (int)n;
+    free(level);
+    free(first_keys);
+    SaveHeader(file, &header);
+    BlockFileClose(file);
+}
+
+// Open a file written by BulkLoad (or CreateTree)
+bool OpenTree(Tree *tree, const char *name) {
+    tree->file = BlockFileOpen(name);
+    if (!tree->file) return false;
+    memcpy(&tree->header, tree->file->header.user, sizeof(TreeHeader));
+    tree->pool = BufferPoolOpen(tree->file, POOL_FRAMES);
+    return true;
+}
+
+void CloseTree(Tree *tree) {
+    if (!BufferPoolClose(tree->pool)) fprintf(stderr, "Failed to write back some nodes.\n");
+    SaveHeader(tree->file, &tree->header);
+    BlockFileClose(tree->file);
+}
+
+static void MakeRecord(Record *rec, long key) {
+    char text[MAX_KEY_LENGTH + 1];
+    memset(rec, 0, sizeof(Record));
+    snprintf(text, sizeof(text), "%010ld", key);
+    memcpy(rec->key, text, MAX_KEY_LENGTH);
+    rec->logical_deletion = '0';
+    snprintf(rec->data, sizeof(rec->data), "Record %ld", key);
+}
+
+static int CompareLongs(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static void PrintPool(Tree *tree) {
+    PoolStats stats = PoolGetStats(tree->pool);
+    printf("  tree: height %d, %d nodes; pool: %d frames, %.1f%% hits\n", tree->header.height,
+           tree->header.node_count, POOL_FRAMES,
+           100.0 * stats.hits / (stats.hits + stats.misses > 0 ? stats.hits + stats.misses : 1));
+}
+
+static long LocateAll(Tree *tree, const long *keys, long unique, const BenchConfig *cfg, const char *name) {
+    BenchOp op;
+    KeyGen gen;
+    long hits = 0;
+    InitKeyGen(&gen, cfg->dist, unique, cfg->seed + 1);
+    BenchBegin(&op, name, cfg->records);
+    for (long i = 0; i < cfg->records; i++) {
+        char key[MAX_KEY_LENGTH + 1];
+        snprintf(key, sizeof(key), "%010ld", keys[NextKey(&gen)]);
+        int block_idx, record_idx;
+        double t0 = BenchNow();
+        hits += Locate(tree, key, &block_idx, &record_idx);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+    return hits;
+}
+
+// Same keys and lookups as the ex9 bench. Lookups cost one node per level
+// minus what the pool holds (the upper levels), before and after doubling
+// the file with random inserts.
+int RunBench(const BenchConfig *cfg) {
+    long n = cfg->records;
+    long *keys = malloc(n * sizeof(long));
+    KeyGen gen;
+    InitKeyGen(&gen, KEYS_UNIFORM, 10 * n, cfg->seed);
+    for (long i = 0; i < n; i++) keys[i] = NextKey(&gen);
+    qsort(keys, n, sizeof(long), CompareLongs);
+    long unique = 0;
+    for (long i = 0; i < n; i++) {
+        if (unique == 0 || keys[i] != keys[unique - 1]) keys[unique++] = keys[i];
+    }
+
+    Record *records = malloc(unique * sizeof(Record));
+    for (long i = 0; i < unique; i++) MakeRecord(&records[i], keys[i]);
+    BenchOp op;
+    BenchBegin(&op, "bulk load", 1);
+    double t0 = BenchNow();
+    BulkLoad("bench_tree.dat", records, unique, 0.75f);
+    BenchSample(&op, BenchNow() - t0);
+    free(records);
+
+    Tree tree;
+    if (!OpenTree(&tree, "bench_tree.dat")) {
+        perror("bench_tree.dat");
+        return 1;
+    }
+    printf("ex15 B+-tree: %ld records, %s lookups, %d records per leaf, %d keys per inner node\n", unique,
+           KeyDistName(cfg->dist), (int)LEAF_CAPACITY, (int)INNER_CAPACITY);
+    BenchReport(&op, true);
+
+    long hits = LocateAll(&tree, keys, unique, cfg, "locate");
+    printf("  %ld of %ld lookups hit\n", hits, n);
+    PrintPool(&tree);
+
+    // As many random inserts over the same key range; keys already present
+    // are rejected
+    long inserted = 0;
+    Record rec;
+    BenchBegin(&op, "insert", n);
+    for (long i = 0; i < n; i++) {
+        MakeRecord(&rec, NextKey(&gen));
+        t0 = BenchNow();
+        inserted += Insert(&tree, &rec);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+    printf("  %ld of %ld keys were new\n", inserted, n);
+
+    hits = LocateAll(&tree, keys, unique, cfg, "locate after");
+    printf("  %ld of %ld lookups hit\n", hits, n);
+    PrintPool(&tree);
+
+    // Range scans over about 1% of the original keys each
+    long span = unique / 100 > 0 ? unique / 100 : 1, found = 0;
+    BenchBegin(&op, "list", 100);
+    for (int i = 0; i < 100; i++) {
+        long from = (long)(BenchRandom(&gen.state) % (uint64_t)unique);
+        long to = from + span < unique ? from + span : unique - 1;
+        char key_a[MAX_KEY_LENGTH + 1], key_b[MAX_KEY_LENGTH + 1];
+        snprintf(key_a, sizeof(key_a), "%010ld", keys[from]);
+        snprintf(key_b, sizeof(key_b), "%010ld", keys[to]);
+        t0 = BenchNow();
+        found += ScanRange(&tree, key_a, key_b, NULL, NULL);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+    printf("  %ld records per scan\n", found / 100);
+
+    CloseTree(&tree);
+    free(keys);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    if (ParseBenchArgs(argc, argv, 100000, &cfg)) return RunBench(&cfg);
+
+    Record records[12];
+    for (int i = 0; i < 12; i++) MakeRecord(&records[i], 10 * (i + 1));
+    BulkLoad("tree.dat", records, 12, 0.34f);
+
+    Tree tree;
+    if (!OpenTree(&tree, "tree.dat")) {
+        perror("tree.dat");
+        return 1;
+    }
+    int block_idx, record_idx;
+    int found = Locate(&tree, "0000000070", &block_idx, &record_idx);
+    printf("Key 0000000070: %s (block %d)\n", found ? "found" : "not found", block_idx);
+    List(&tree, "0000000030", "0000000050");
+
+    // Enough inserts to split leaves and grow the tree
+    Record rec;
+    int inserted = 0;
+    for (long key = 1; key < 130; key += 4) {
+        MakeRecord(&rec, key);
+        inserted += Insert(&tree, &rec);
+    }
+    printf("After %d inserts: %d records, height %d, %d nodes\n", inserted, tree.header.total_records,
+           tree.header.height, tree.header.node_count);
+    List(&tree, "0000000030", "0000000050");
+    CloseTree(&tree);
+    return 0;
+}
@@ -2,10 +2,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include "../lib/blockfile.h"
+#include "../lib/bench.h"
+#include "../lib/wal.h"
+#include "../lib/payload.h"
+#include "../lib/keycmp.h"
+#include "../lib/merge.h"
+#include "../lib/snapshot.h"
+#include "../lib/latch.h"
+
+#ifndef BLOCK_SIZE
 #define BLOCK_SIZE 3
+#endif
 #define FILE_NAME "data_file.dat"
-#define INITIAL_CAPACITY 1
+#define INITIAL_CAPACITY 1  // Insert scratch: records beyond the header's count
 
 typedef struct {
     int key;
@@ -13,182 +26,738 @@ typedef struct {
     bool erased;
 } Record;
 
+// How hard each insert/delete works to survive a crash
+typedef enum {
+    DURABILITY_NONE,    // Writes reach the page cache: visible to other processes, not crash-safe
+    DURABILITY_PER_OP,  // fdatasync at the end of every operation
+    DURABILITY_GROUP    // fdatasync once groupOps operations or groupMs ms have piled up
+} DurabilityMode;
+
 typedef struct {
-    int RecordCount;
-    Record record[BLOCK_SIZE];
-} Block;
+    DurabilityMode mode;
+    int groupOps;
+    int groupMs;
+} DurabilityConfig;
+
+DurabilityConfig durability = {DURABILITY_NONE, 0, 0};
+bool verbose = true;  // Report every insert/delete (off in bench mode)
+
+// The group of operations not synced yet, all on one file. A flusher
+// thread syncs it once it is groupMs old, so the bound holds when no
+// further operation comes along; the operation that fills it syncs it
+// straight away.
+pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t syncCond;  // A group started, or the flusher should stop
+BlockFile *pendingFile;
+int pendingOps = 0;
+double *pendingAt;  // When each pending operation committed
+int pendingCap;
+struct timespec groupStart;
+long nSyncs;
+BenchOp *commitLatency;  // When set, gets each operation's wait for its sync
+pthread_t flusher;
+bool flusherRunning, stopFlusher;
+
+static double MsSince(const struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
 
-void insertRecord(FILE *file, int key, const char *data) {
-    Block block;
-    int blockNumber = 0;
-    int totalRecords = 0;
-    int capacity = INITIAL_CAPACITY;
-    Record *allRecords = malloc(capacity * sizeof(Record));
+void SyncFile(BlockFile *file) {
+    BlockFileWriteHeader(file);
+    BlockFileSync(file);
+    __atomic_fetch_add(&nSyncs, 1, __ATOMIC_RELAXED);  // Writers on other files too
+}
 
-    if (!allRecords) {
-        printf("Memory allocation failed!\n");
-        return;
-    }
+// Sync the pending group. Called with syncLock held.
+static void SyncGroup(void) {
+    if (pendingOps == 0) return;
+    // Every operation wrote the header as it committed
+    BlockFileSync(pendingFile);
+    nSyncs++;
+    double now = BenchNow();
+    for (int i = 0; commitLatency && i < pendingOps; i++) BenchSample(commitLatency, now - pendingAt[i]);
+    pendingOps = 0;
+    pendingFile = NULL;
+}
 
-    while (ReadBlock(file, blockNumber, &block)) {
-        for (int i = 0; i < block.RecordCount; i++) {
-            if (totalRecords >= capacity) {
-                capacity *= 2;
-                allRecords = realloc(allRecords, capacity * sizeof(Record));
-                if (!allRecords) {
-                    printf("Memory reallocation failed!\n");
-                    return;
-                }
-            }
-            allRecords[totalRecords++] = block.record[i];
+static void *FlushLoop(void *arg) {
+    pthread_mutex_lock(&syncLock);
+    while (!stopFlusher) {
+        if (pendingOps > 0 && MsSince(&groupStart) >= durability.groupMs) {
+            SyncGroup();
+        } else if (pendingOps > 0) {
+            struct timespec deadline = groupStart;
+            long long ns = deadline.tv_nsec + (long long)durability.groupMs * 1000000;
+            deadline.tv_sec += ns / 1000000000;
+            deadline.tv_nsec = ns % 1000000000;
+            pthread_cond_timedwait(&syncCond, &syncLock, &deadline);
+        } else {
+            pthread_cond_wait(&syncCond, &syncLock);
         }
-        blockNumber++;
     }
+    pthread_mutex_unlock(&syncLock);
+    return NULL;
+}
 
-    Record newRecord;
-    newRecord.key = key;
-    strcpy(newRecord.data, data);
-    if (totalRecords >= capacity) {
-        capacity *= 2;
-        allRecords = realloc(allRecords, capacity * sizeof(Record));
-        if (!allRecords) {
-            printf("Memory reallocation failed!\n");
-            return;
+// Called once per operation, after all of its blocks have been written and
+// before its latches are released, so the writers of a file come one at a
+// time; syncLock keeps them and the flusher apart.
+// In group mode the operations since the last sync can be lost in a crash,
+// for groupMs at most.
+void CommitOp(BlockFile *file) {
+    switch (durability.mode) {
+    case DURABILITY_NONE:
+        break;
+    case DURABILITY_PER_OP:
+        SyncFile(file);
+        break;
+    case DURABILITY_GROUP:
+        BlockFileWriteHeader(file);
+        pthread_mutex_lock(&syncLock);
+        if (!flusherRunning) {
+            // Group deadlines are measured on the monotonic clock
+            pthread_condattr_t attr;
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&syncCond, &attr);
+            pthread_condattr_destroy(&attr);
+            stopFlusher = false;
+            flusherRunning = pthread_create(&flusher, NULL, FlushLoop, NULL) == 0;
         }
+        if (pendingFile != file) SyncGroup();
+        if (pendingOps == pendingCap) {
+            pendingCap = pendingCap ? 2 * pendingCap : 64;
+            pendingAt = realloc(pendingAt, pendingCap * sizeof(double));
+        }
+        if (pendingOps == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &groupStart);
+            pthread_cond_signal(&syncCond);
+        }
+        pendingFile = file;
+        pendingAt[pendingOps++] = BenchNow();
+        if (pendingOps >= durability.groupOps) SyncGroup();
+        pthread_mutex_unlock(&syncLock);
+        break;
     }
-    allRecords[totalRecords++] = newRecord;
+}
 
-    for (int i = 0; i < totalRecords - 1; i++) {
-        for (int j = i + 1; j < totalRecords; j++) {
-            if (allRecords[i].key > allRecords[j].key) {
-                Record temp = allRecords[i];
-                allRecords[i] = allRecords[j];
-                allRecords[j] = temp;
-            }
-        }
+// Sync whatever is pending on file, stop the flusher and close the file
+void CloseFile(BlockFile *file) {
+    pthread_mutex_lock(&syncLock);
+    if (pendingFile == file) SyncGroup();
+    bool running = flusherRunning;
+    stopFlusher = true;
+    flusherRunning = false;
+    if (running) pthread_cond_signal(&syncCond);
+    pthread_mutex_unlock(&syncLock);
+    if (running) {
+        pthread_join(flusher, NULL);
+        pthread_cond_destroy(&syncCond);
     }
+    BlockFileClose(file);
+}
 
-    blockNumber = 0;
-    int recordIndex = 0;
+// The demo geometry, plus page-sized blocks for the bench
+#define TOF_PREFIX Tof
+#define TOF_RECORD Record
+#define TOF_CAPACITY BLOCK_SIZE
+#include "tof_template.h"
+
+#define TOF_PREFIX Page4k
+#define TOF_RECORD Record
+#define TOF_BLOCK_BYTES 4096
+#include "tof_template.h"
+
+#define TOF_PREFIX Page64k
+#define TOF_RECORD Record
+#define TOF_BLOCK_BYTES 65536
+#include "tof_template.h"
+
+// Split layout: the sorted TOF holds only keys, flags and payload ids (12
+// bytes a record instead of 108), the data sits in a payload file. Searches
+// and range filters read the dense key file; payloads are fetched by id for
+// the records a caller actually wants.
+typedef struct {
+    int key;
+    bool erased;
+    uint32_t id;  // Payload id
+} KeyEntry;
 
-    while (recordIndex < totalRecords) {
-        ReadBlock(file, blockNumber, &block);
+#define TOF_PREFIX Keys
+#define TOF_RECORD KeyEntry
+#define TOF_BLOCK_BYTES 4096
+#define TOF_KEYS_ONLY
+#include "tof_template.h"
 
-        int i = 0;
-        while (i < BLOCK_SIZE && recordIndex < totalRecords) {
-            block.record[i] = allRecords[recordIndex];
-            recordIndex++;
-            i++;
-        }
-        block.RecordCount = i;
+typedef struct {
+    BlockFile *keys;
+    PayloadFile *payloads;  // "<path>.payload"
+} SplitFile;
+
+#define PAYLOAD_BYTES sizeof(((Record *)0)->data)
+
+bool SplitCreate(SplitFile *file, const char *path) {
+    char payloadPath[256];
+    snprintf(payloadPath, sizeof(payloadPath), "%s.payload", path);
+    file->keys = KeysCreate(path);
+    file->payloads = PayloadCreate(payloadPath, PAYLOAD_BYTES, 4096);
+    if (file->keys && file->payloads) return true;
+    BlockFileClose(file->keys);
+    PayloadClose(file->payloads);
+    return false;
+}
 
-        WriteBlock(file, blockNumber, &block);
-        blockNumber++;
+void SplitClose(SplitFile *file) {
+    BlockFileClose(file->keys);
+    PayloadClose(file->payloads);
+}
+
+// The payload goes first (and is synced first when durability asks), so a
+// key never names a payload that is not there
+void SplitInsertRecord(SplitFile *file, int key, const char *data) {
+    char payload[PAYLOAD_BYTES] = {0};
+    snprintf(payload, sizeof(payload), "%s", data);
+    int64_t id = PayloadAppend(file->payloads, payload);
+    if (id < 0) {
+        printf("Payload write failed!\n");
+        return;
     }
+    if (durability.mode != DURABILITY_NONE) BlockFileSync(file->payloads->bf);
+    KeyEntry entry = {key, false, (uint32_t)id};
+    KeysInsertEntry(file->keys, &entry);
 
-    free(allRecords);
+    if (verbose) printf("Record inserted and sorted successfully: Key = %d, Data = %s\n", key, data);
+}
+
+// The payload stays where it is: ids are not reused
+void SplitDeleteRecord(SplitFile *file, int key) {
+    KeysDeleteRecord(file->keys, key);
+}
 
-    printf("Record inserted and sorted successfully: Key = %d, Data = %s\n", key, data);
+// Fills out (key, flag and data) when the key is there
+int SplitSearch(SplitFile *file, int key, Record *out) {
+    KeyEntry entry;
+    if (!KeysSearch(file->keys, key, &entry)) return 0;
+    out->key = entry.key;
+    out->erased = entry.erased;
+    return PayloadRead(file->payloads, entry.id, out->data);
 }
 
-int ReadBlock(FILE *file, int blockNumber, Block *block) {
-    fseek(file, blockNumber * sizeof(Block), SEEK_SET);
-    size_t bytesRead = fread(block, sizeof(Block), 1, file);
-    return bytesRead == 1;
+static double BytesReadPerOp(IoStats since, long ops) {
+    return (double)IoStatsDiff(BlockFileTotals(), since).bytesRead / (ops > 0 ? ops : 1);
 }
 
-void delete_logic(FILE *file, int key) {
-    Block block, nextBlock;
-    int BlockNumber = 0;
-    bool found = false;
+// The same records in 4 KiB blocks, whole and split: key searches (which
+// fetch the data of what they find) and range filters over about 10% of
+// the key space, which only need the keys
+static int RunSplitBench(const BenchConfig *cfg) {
+    BlockFile *whole = Page4kCreate("bench_tof_whole.dat");
+    SplitFile split;
+    if (!whole || !SplitCreate(&split, "bench_tof_split.dat")) {
+        perror("bench_tof_split.dat");
+        return 1;
+    }
+    long n = cfg->records, range = 10 * n;
+    printf("ex3 split layout: %ld records, %s keys, %d whole records or %d keys per 4096-byte block\n", n,
+           KeyDistName(cfg->dist), (int)Page4kCapacity, (int)KeysCapacity);
+
+    KeyGen keys;
+    char data[PAYLOAD_BYTES];
+    InitKeyGen(&keys, cfg->dist, range, cfg->seed);
+    for (long i = 0; i < n; i++) {
+        int key = (int)NextKey(&keys);
+        snprintf(data, sizeof(data), "Record %d", key);
+        Page4kInsertRecord(whole, key, data);
+        SplitInsertRecord(&split, key, data);
+    }
+    printf("  files: %lld blocks whole, %lld key + %lld payload blocks split\n", (long long)whole->header.nBlocks,
+           (long long)split.keys->header.nBlocks, (long long)split.payloads->bf->header.nBlocks);
+
+    BenchOp op;
+    Record rec;
+    IoStats io;
+    double wholeBytes, splitBytes;
+    long hits = 0;
+    const char *names[2] = {"search (whole)", "search (split)"};
+    for (int layout = 0; layout < 2; layout++) {
+        InitKeyGen(&keys, cfg->dist, range, cfg->seed);  // Keys that are present
+        io = BlockFileTotals();
+        BenchBegin(&op, names[layout], n);
+        for (long i = 0; i < n; i++) {
+            int key = (int)NextKey(&keys);
+            double t0 = BenchNow();
+            hits += layout == 0 ? Page4kSearch(whole, key, &rec) : SplitSearch(&split, key, &rec);
+            BenchSample(&op, BenchNow() - t0);
+        }
+        if (layout == 0) wholeBytes = BytesReadPerOp(io, n);
+        else splitBytes = BytesReadPerOp(io, n);
+        BenchReport(&op, true);
+    }
+    printf("  %ld of %ld searches hit; %.0f vs %.0f bytes read per search (%.1f%%)\n", hits, 2 * n, wholeBytes,
+           splitBytes, 100.0 * splitBytes / wholeBytes);
+
+    long matches = 0, width = range / 10;
+    names[0] = "range (whole)";
+    names[1] = "range (split)";
+    for (int layout = 0; layout < 2; layout++) {
+        uint64_t rng = cfg->seed;
+        io = BlockFileTotals();
+        BenchBegin(&op, names[layout], n);
+        for (long i = 0; i < n; i++) {
+            int lo = (int)(BenchRandom(&rng) % range);
+            double t0 = BenchNow();
+            matches += layout == 0 ? Page4kScanRange(whole, lo, lo + width, NULL, NULL)
+                                   : KeysScanRange(split.keys, lo, lo + width, NULL, NULL);
+            BenchSample(&op, BenchNow() - t0);
+        }
+        if (layout == 0) wholeBytes = BytesReadPerOp(io, n);
+        else splitBytes = BytesReadPerOp(io, n);
+        BenchReport(&op, true);
+    }
+    printf("  %.1f matches per range; %.0f vs %.0f bytes read per range (%.1f%%)\n", matches / (2.0 * n), wholeBytes,
+           splitBytes, 100.0 * splitBytes / wholeBytes);
+
+    BlockFileClose(whole);
+    SplitClose(&split);
+    return 0;
+}
 
-    while (ReadBlock(file, BlockNumber, &block)) {
-        for (int i = 0; i < block.RecordCount; i++) {
-            if (block.record[i].key == key && !block.record[i].erased) {
-                block.record[i].erased = true;
+static int CompareInts(const void *a, const void *b) {
+    int x = *(const int *)a, y = *(const int *)b;
+    return (x > y) - (x < y);
+}
 
-                for (int j = i; j < block.RecordCount - 1; j++) {
-                    block.record[j] = block.record[j + 1];
-                }
-                block.RecordCount--;
-                WriteBlock(file, BlockNumber, &block);
-                found = true;
-                break;
-            }
+// A sorted 4 KiB-block file of n keys drawn from gen, packed full
+static BlockFile *BuildSorted(const char *path, KeyGen *gen, long n, const char *tag) {
+    BlockFile *file = Page4kCreate(path);
+    if (!file) return NULL;
+    int *keys = malloc(n * sizeof(int));
+    for (long i = 0; i < n; i++) keys[i] = (int)NextKey(gen);
+    qsort(keys, n, sizeof(int), CompareInts);
+    Page4kBlock block = {0};
+    int blockNumber = 0;
+    for (long i = 0; i < n; i++) {
+        Record *rec = &block.record[block.RecordCount++];
+        rec->key = keys[i];
+        rec->erased = false;
+        snprintf(rec->data, sizeof(rec->data), "%s %d", tag, keys[i]);
+        if (block.RecordCount == Page4kCapacity || i == n - 1) {
+            Page4kWriteBlock(file, blockNumber++, &block);
+            block.RecordCount = 0;
         }
-        if (found) break;
-        BlockNumber++;
     }
+    file->header.nRecords = n;
+    BlockFileWriteHeader(file);
+    free(keys);
+    return file;
+}
+
+static void JoinRecords(void *row, const void *a, const void *b, void *ctx) {
+    const Record *x = a, *y = b;
+    Record *out = row;
+    out->key = x->key;
+    out->erased = false;
+    snprintf(out->data, sizeof(out->data), "%.49s|%.49s", x->data, y->data);
+}
 
-    if (!found) {
-        printf("Record with key = %d was not found or already erased.\n", key);
+static void CountMatch(const Record *rec, void *ctx) {
+    (*(long *)ctx)++;
+}
+
+// Two sorted files of n keys over [0, 2n): the intersection by one Search
+// in b per record of a (what a nested-loop lookup does), then the merged
+// set operations and join, one pass over each input
+static int RunMergeBench(const BenchConfig *cfg) {
+    long n = 20 * cfg->records;
+    KeyGen gen;
+    InitKeyGen(&gen, cfg->dist, 2 * n, cfg->seed);
+    BlockFile *a = BuildSorted("bench_merge_a.dat", &gen, n, "A");
+    InitKeyGen(&gen, cfg->dist, 2 * n, cfg->seed + 1);
+    BlockFile *b = BuildSorted("bench_merge_b.dat", &gen, n, "B");
+    if (!a || !b) {
+        perror("bench_merge");
+        return 1;
+    }
+    printf("ex3 merge: two files of %ld %s keys over [0, %ld), %lld and %lld blocks\n", n, KeyDistName(cfg->dist),
+           2 * n, (long long)a->header.nBlocks, (long long)b->header.nBlocks);
+
+    BenchOp op;
+    long nested = 0;
+    BenchBegin(&op, "intersect (lookups)", 1);
+    double t0 = BenchNow();
+    Page4kBlock block;
+    for (int i = 0; Page4kReadBlock(a, i, &block); i++) {
+        for (int j = 0; j < block.RecordCount; j++) {
+            if (!block.record[j].erased && Page4kSearch(b, block.record[j].key, NULL)) nested++;
+        }
+    }
+    BenchSample(&op, BenchNow() - t0);
+    BenchReport(&op, true);
+    printf("  %ld records of a have a key in b\n", nested);
+
+    const char *names[3] = {"union", "intersect", "difference"};
+    long counts[3];
+    for (int setOp = MERGE_UNION; setOp <= MERGE_DIFFERENCE; setOp++) {
+        BlockFile *out = Page4kCreate("bench_merge_out.dat");
+        BenchBegin(&op, names[setOp], 1);
+        t0 = BenchNow();
+        counts[setOp] = Page4kMergeFiles(setOp, a, b, out);
+        BenchSample(&op, BenchNow() - t0);
+        BenchReport(&op, true);
+        long check = 0;
+        Page4kScanRange(out, INT_MIN, INT_MAX, CountMatch, &check);
+        printf("  %ld records in %lld blocks%s\n", counts[setOp], (long long)out->header.nBlocks,
+               check == counts[setOp] ? "" : "; FILE DOES NOT MATCH");
+        BlockFileClose(out);
+    }
+    if (counts[MERGE_INTERSECT] != nested || counts[MERGE_INTERSECT] + counts[MERGE_DIFFERENCE] != n) {
+        printf("  SET SIZES DO NOT ADD UP\n");
     }
 
-    int currentBlock = 0;
-    while (ReadBlock(file, currentBlock, &block)) {
-        if (block.RecordCount < BLOCK_SIZE) {
-            int nextBlockNumber = currentBlock + 1;
-            while (ReadBlock(file, nextBlockNumber, &nextBlock)) {
-                while (nextBlock.RecordCount > 0 && block.RecordCount < BLOCK_SIZE) {
-                    block.record[block.RecordCount] = nextBlock.record[0];
-                    block.RecordCount++;
+    BlockFile *out = Page4kCreate("bench_merge_out.dat");
+    BenchBegin(&op, "join", 1);
+    t0 = BenchNow();
+    long rows = Page4kJoinFiles(a, b, out, JoinRecords, NULL);
+    BenchSample(&op, BenchNow() - t0);
+    BenchReport(&op, true);
+    printf("  %ld rows in %lld blocks\n", rows, (long long)out->header.nBlocks);
+
+    BlockFileClose(out);
+    BlockFileClose(a);
+    BlockFileClose(b);
+    return 0;
+}
 
-                    for (int k = 0; k < nextBlock.RecordCount - 1; k++) {
-                        nextBlock.record[k] = nextBlock.record[k + 1];
-                    }
-                    nextBlock.RecordCount--;
+// A reader scanning the whole file over and over while the writer inserts.
+// Keys are distinct, so a scan that does not see them strictly ascending
+// caught an insert halfway through shifting records.
+typedef struct {
+    BlockFile *file;
+    bool done;
+    long scans, torn;
+    long seen;
+    int lastKey;
+    bool ordered;
+    IoStats io;  // The scans' own block I/O
+} ScanTask;
+
+static void CheckOrder(const Record *rec, void *ctx) {
+    ScanTask *t = ctx;
+    if (t->seen++ > 0 && rec->key <= t->lastKey) t->ordered = false;
+    t->lastKey = rec->key;
+}
 
-                    WriteBlock(file, nextBlockNumber, &nextBlock);
-                }
-                if (block.RecordCount == BLOCK_SIZE) break;
+static void *ScanLoop(void *arg) {
+    ScanTask *t = arg;
+    IoOp op = BlockFileOpBegin(t->file, "scan");
+    while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+        t->seen = 0;
+        t->ordered = true;
+        TofScanRange(t->file, INT_MIN, INT_MAX, CheckOrder, t);
+        t->scans++;
+        if (!t->ordered) t->torn++;
+    }
+    t->io = BlockFileOpEnd(&op);
+    return NULL;
+}
 
-                nextBlockNumber++;
-            }
-            WriteBlock(file, currentBlock, &block);
+// cfg->records inserts of distinct keys into the demo geometry with a
+// scanner running, reading the file in place and then through snapshots
+static int RunSnapshotBench(const BenchConfig *cfg) {
+    long n = cfg->records;
+    int *keys = malloc(n * sizeof(int));
+    uint64_t state = cfg->seed | 1;
+    for (long i = 0; i < n; i++) keys[i] = (int)i;
+    for (long i = n - 1; i > 0; i--) {
+        long j = (long)(BenchRandom(&state) % (uint64_t)(i + 1));
+        int tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+    printf("ex3 concurrent scans: %ld inserts, one scanner thread\n", n);
+
+    for (int snapshots = 0; snapshots <= 1; snapshots++) {
+        BlockFile *file = TofCreate("bench_tof_scan.dat");
+        if (!file || (snapshots && !SnapshotsEnable(file))) {
+            perror("bench_tof_scan.dat");
+            free(keys);
+            return 1;
+        }
+        ScanTask task = {file};
+        pthread_t reader;
+        pthread_create(&reader, NULL, ScanLoop, &task);
+        BenchOp op;
+        BenchBegin(&op, snapshots ? "insert (snapshot scans)" : "insert (scans in place)", n);
+        char data[sizeof(((Record *)0)->data)];
+        for (long i = 0; i < n; i++) {
+            snprintf(data, sizeof(data), "Record %d", keys[i]);
+            double t0 = BenchNow();
+            TofInsertRecord(file, keys[i], data);
+            BenchSample(&op, BenchNow() - t0);
         }
-        currentBlock++;
+        __atomic_store_n(&task.done, true, __ATOMIC_RELEASE);
+        pthread_join(reader, NULL);
+        // The inserts' figures leave the scanner's reads out; they get their own line
+        IoStatsAdd(&op.ioStart, task.io);
+        BenchReport(&op, true);
+        printf("  %ld scans, %ld saw a torn file\n", task.scans, task.torn);
+        long scans = task.scans > 0 ? task.scans : 1;
+        printf("  scanner I/O: %.2f reads/scan %.2f seeks/scan %.3f ms in I/O per scan\n",
+               (double)task.io.blocksRead / scans, (double)task.io.seeks / scans, task.io.ioNanos / 1e6 / scans);
+        if (snapshots) {
+            SnapshotStats ss = SnapshotGetStats(file);
+            printf("  %lld blocks preserved (at most %lld at once), %lld read back, %lld opens waited\n",
+                   (long long)ss.preserved, (long long)ss.peakImages, (long long)ss.overlaid, (long long)ss.waits);
+        }
+        BlockFileClose(file);
     }
+    free(keys);
+    return 0;
 }
 
-void WriteBlock(FILE *file, int blockNumber, const Block *block) {
-    fseek(file, blockNumber * sizeof(Block), SEEK_SET);
-    fwrite(block, sizeof(Block), 1, file);
-    fflush(file);
+// One writer's share of the durability bench
+typedef struct {
+    BlockFile *file;
+    KeyGen keys;
+    long count;
+    bool paced;
+    BenchOp *op;
+    pthread_mutex_t *sampleLock;  // The writers share op
+} WriterTask;
+
+static void *WriteLoop(void *arg) {
+    WriterTask *t = arg;
+    struct timespec pause = {0, 200000};
+    char data[sizeof(((Record *)0)->data)];
+    for (long i = 0; i < t->count; i++) {
+        int key = (int)NextKey(&t->keys);
+        snprintf(data, sizeof(data), "Record %d", key);
+        double t0 = BenchNow();
+        Page4kInsertRecord(t->file, key, data);
+        double dt = BenchNow() - t0;
+        pthread_mutex_lock(t->sampleLock);
+        BenchSample(t->op, dt);
+        pthread_mutex_unlock(t->sampleLock);
+        if (t->paced) nanosleep(&pause, NULL);
+    }
+    return NULL;
 }
 
-void display_File(FILE *file) {
-    fseek(file, 0, SEEK_SET);
-    Block block;
-    int blockNumber = 0;
+// cfg->records inserts into a 4 KiB-block file in each durability mode. In
+// group mode, also how long each insert stayed unsynced after it returned;
+// the paced run inserts slowly enough that groups close on time, not size,
+// and the last run splits the inserts between two writers sharing groups.
+static int RunDurabilityBench(const BenchConfig *cfg) {
+    DurabilityConfig modes[4] = {{DURABILITY_PER_OP, 0, 0}, {DURABILITY_GROUP, 32, 2}, {DURABILITY_GROUP, 32, 2},
+                                 {DURABILITY_GROUP, 32, 2}};
+    const char *names[4] = {"insert (per-op)", "insert (group)", "insert (paced)", "insert (2 writers)"};
+    long n = cfg->records;
+    printf("ex3 durability: %ld inserts per mode, %s keys, 4096-byte blocks, groups of 32 ops / 2 ms\n", n,
+           KeyDistName(cfg->dist));
+    for (int m = 0; m < 4; m++) {
+        BlockFile *file = Page4kCreate("bench_tof_sync.dat");
+        if (!file) {
+            perror("bench_tof_sync.dat");
+            return 1;
+        }
+        durability = modes[m];
+        nSyncs = 0;
+        BenchOp op, commit;
+        BenchBegin(&commit, "  until synced", n);
+        commitLatency = durability.mode == DURABILITY_GROUP ? &commit : NULL;
+        pthread_mutex_t sampleLock = PTHREAD_MUTEX_INITIALIZER;
+        int nWriters = m == 3 ? 2 : 1;
+        WriterTask tasks[2];
+        pthread_t threads[2];
+        BenchBegin(&op, names[m], n);
+        for (int w = 0; w < nWriters; w++) {
+            tasks[w] = (WriterTask){file, {0}, n / nWriters + (w < n % nWriters), m == 2, &op, &sampleLock};
+            InitKeyGen(&tasks[w].keys, cfg->dist, 10 * n, cfg->seed + w);
+        }
+        if (nWriters == 1) {
+            WriteLoop(&tasks[0]);
+        } else {
+            for (int w = 0; w < nWriters; w++) pthread_create(&threads[w], NULL, WriteLoop, &tasks[w]);
+            for (int w = 0; w < nWriters; w++) pthread_join(threads[w], NULL);
+        }
+        BenchReport(&op, true);
+        CloseFile(file);
+        printf("  %ld syncs\n", nSyncs);
+        // Each insert joins exactly one group, however the writers interleave
+        if (commitLatency && commit.n != n) printf("  SYNCED %ld OF %ld INSERTS\n", commit.n, n);
+        if (commitLatency) BenchReport(&commit, false);
+        else free(commit.us);
+        commitLatency = NULL;
+    }
+    durability = (DurabilityConfig){DURABILITY_NONE, 0, 0};
+    return 0;
+}
 
-    while (ReadBlock(file, blockNumber, &block)) {
-        printf("Block %d:\n", blockNumber);
-        for (int i = 0; i < block.RecordCount; i++) {
-            printf("  Record %d -> Key: %d, Data: %s\n", i, block.record[i].key, block.record[i].data);
+// Reader threads searching a 4 KiB-block file for keys it holds while one
+// writer inserts more. Nothing is deleted, so every search must succeed.
+typedef struct {
+    BlockFile *file;
+    const int *keys;
+    long nKeys, lookups;
+    uint64_t seed;
+    long missed;
+} SearchTask;
+
+typedef struct {
+    BlockFile *file;
+    KeyGen gen;
+    bool done;
+    long inserts;
+} InsertTask;
+
+static void CollectKey(const Record *rec, void *ctx) {
+    SearchTask *t = ctx;
+    ((int *)t->keys)[t->nKeys++] = rec->key;
+}
+
+static void *SearchLoop(void *arg) {
+    SearchTask *t = arg;
+    uint64_t state = t->seed;
+    for (long i = 0; i < t->lookups; i++) {
+        if (!Page4kSearch(t->file, t->keys[BenchRandom(&state) % (uint64_t)t->nKeys], NULL)) t->missed++;
+    }
+    return NULL;
+}
+
+static void *InsertLoop(void *arg) {
+    InsertTask *t = arg;
+    struct timespec pause = {0, 1000000};
+    while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+        Page4kInsertRecord(t->file, (int)NextKey(&t->gen), "inserted");
+        t->inserts++;
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+// The same number of searches split over 1 to 8 reader threads, with an
+// insert about every millisecond: throughput should grow with the readers
+// up to the number of cores
+static int RunConcurrentBench(const BenchConfig *cfg) {
+    long n = 20 * cfg->records;
+    long lookups = 200 * cfg->records;
+    KeyGen gen;
+    InitKeyGen(&gen, cfg->dist, 4 * n, cfg->seed);
+    BlockFile *file = BuildSorted("bench_tof_read.dat", &gen, n, "R");
+    if (!file) {
+        perror("bench_tof_read.dat");
+        return 1;
+    }
+    SearchTask base = {file, malloc(n * sizeof(int))};
+    Page4kScanRange(file, INT_MIN, INT_MAX, CollectKey, &base);
+    printf("ex3 concurrent reads: %ld searches of %ld %s keys, one writer inserting\n", lookups, base.nKeys,
+           KeyDistName(cfg->dist));
+
+    for (int nThreads = 1; nThreads <= 8; nThreads *= 2) {
+        InsertTask writer = {file};
+        InitKeyGen(&writer.gen, cfg->dist, 4 * n, cfg->seed + nThreads);
+        int64_t retries = LatchRetries(BlockLatches(file));
+        SearchTask tasks[8];
+        pthread_t threads[8], writerThread;
+        pthread_create(&writerThread, NULL, InsertLoop, &writer);
+        double t0 = BenchNow();
+        for (int i = 0; i < nThreads; i++) {
+            tasks[i] = base;
+            tasks[i].lookups = lookups / nThreads;
+            tasks[i].seed = cfg->seed * 31 + i + 1;
+            pthread_create(&threads[i], NULL, SearchLoop, &tasks[i]);
+        }
+        long missed = 0;
+        for (int i = 0; i < nThreads; i++) {
+            pthread_join(threads[i], NULL);
+            missed += tasks[i].missed;
         }
-        blockNumber++;
+        double elapsed = BenchNow() - t0;
+        __atomic_store_n(&writer.done, true, __ATOMIC_RELEASE);
+        pthread_join(writerThread, NULL);
+        printf("  %d reader%s: %.0f searches/s, %ld inserts, %lld retried reads%s\n", nThreads,
+               nThreads == 1 ? " " : "s", lookups / nThreads * nThreads / elapsed, writer.inserts,
+               (long long)(LatchRetries(BlockLatches(file)) - retries), missed ? "; SEARCHES MISSED KEYS" : "");
     }
+    free((int *)base.keys);
+    BlockFileClose(file);
+    return 0;
 }
 
-int main() {
-    FILE *file = fopen(FILE_NAME, "rb+");
+// Deletes from the end leave empty blocks there; an insert past every key
+// must still go right after the last record, or the file is no longer packed
+// and later deletes never close the hole
+static int RunPackingCheck(void) {
+    BlockFile *file = TofCreate("bench_tof_packed.dat");
+    if (!file) {
+        perror("bench_tof_packed.dat");
+        return 1;
+    }
+    char data[sizeof(((Record *)0)->data)];
+    for (int key = 1; key <= 3 * BLOCK_SIZE; key++) {
+        snprintf(data, sizeof(data), "Record %d", key);
+        TofInsertRecord(file, key, data);
+    }
+    for (int key = 3 * BLOCK_SIZE; key > 2 * BLOCK_SIZE - 2; key--) TofDeleteRecord(file, key);
+    TofInsertRecord(file, 100, "Record 100");
+
+    // Every block but the last holding records is full
+    TofBlock block;
+    int partial = -1, holes = 0;
+    for (int b = 0; TofReadBlock(file, b, &block); b++) {
+        if (block.RecordCount == 0) continue;
+        if (partial >= 0) holes++;
+        if (block.RecordCount < BLOCK_SIZE) partial = b;
+    }
+    printf("ex3 packing: insert past the end after deletes from it: %s\n", holes ? "PARTIAL BLOCK LEFT BEHIND" : "packed");
+    CloseFile(file);
+    return 0;
+}
+
+// Same workload at each block size, one file per geometry, the packing
+// check, then the durability modes, the split layout against whole records,
+// the merge operations, concurrent scans and concurrent searches
+int RunBench(const BenchConfig *cfg) {
+    verbose = false;
+    if (TofRunBench(cfg, "bench_tof.dat") != 0) return 1;
+    if (RunPackingCheck() != 0) return 1;
+    if (Page4kRunBench(cfg, "bench_tof_4k.dat") != 0) return 1;
+    if (Page64kRunBench(cfg, "bench_tof_64k.dat") != 0) return 1;
+    if (RunDurabilityBench(cfg) != 0) return 1;
+    if (RunSplitBench(cfg) != 0) return 1;
+    if (RunMergeBench(cfg) != 0) return 1;
+    if (RunSnapshotBench(cfg) != 0) return 1;
+    return RunConcurrentBench(cfg);
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    if (ParseBenchArgs(argc, argv, 500, &cfg)) return RunBench(&cfg);
+
+    bool created;
+    BlockFile *file = TofOpenOrCreate(FILE_NAME, &created);
     if (!file) {
-        file = fopen(FILE_NAME, "wb+");
-        printf("Created a new file named: %s\n", FILE_NAME);
+        perror(FILE_NAME);
+        return 1;
     }
+    if (created) printf("Created a new file named: %s\n", FILE_NAME);
 
     char name[100];
     for (int i = 5; i < 12; i++) {
         snprintf(name, sizeof(name), "Record %d", i);
-        insertRecord(file, i, name);
+        TofInsertRecord(file, i, name);
     }
-    insertRecord(file, 2, "Record 2");
+    TofInsertRecord(file, 2, "Record 2");
 
     printf("\nFile contents after insertion:\n");
-    display_File(file);
-    delete_logic(file , 7);
-    display_File(file);
-    fclose(file);
+    TofDisplayFile(file);
+    TofDeleteRecord(file , 7);
+    TofDisplayFile(file);
+    printf("\nBlock I/O per operation:\n");
+    BlockFilePrintOps(file, stdout);
+    CloseFile(file);
     return 0;
 }
 
@@ -0,0 +1,504 @@
+// Sorted TOF over fixed-size records, instantiated once per geometry:
+//
+//   #define TOF_PREFIX Tof        // Names: TofBlock, TofInsertRecord, ...
+//   #define TOF_RECORD Record     // Needs int key, bool erased and char data[]
+//   #define TOF_CAPACITY 3        // Records per block
+//   #include "tof_template.h"
+//
+// Define TOF_BLOCK_BYTES (e.g. 4096) instead of TOF_CAPACITY to get as many
+// records as fit in a block of exactly that size. TOF_KEYS_ONLY drops the
+// data field: the file then only holds keys and flags (plus whatever else
+// the record carries, a payload id say), and only InsertEntry, DeleteRecord,
+// Search, ScanRange, MergeFiles and JoinFiles are generated. The including
+// file provides `verbose`, INITIAL_CAPACITY and CommitOp(BlockFile *) and
+// includes lib/wal.h, lib/keycmp.h, lib/merge.h, lib/snapshot.h and
+// lib/latch.h. Every inclusion #undefs its parameters, so the same file can
+// be included again for another geometry.
+
+#if !defined(TOF_PREFIX) || !defined(TOF_RECORD)
+#error "tof_template.h needs TOF_PREFIX and TOF_RECORD"
+#endif
+
+#define TOF_CAT2(a, b) a##b
+#define TOF_CAT(a, b) TOF_CAT2(a, b)
+#define TOF_FN(name) TOF_CAT(TOF_PREFIX, name)
+
+#ifdef TOF_BLOCK_BYTES
+#define TOF_CAP ((TOF_BLOCK_BYTES - sizeof(int)) / sizeof(TOF_RECORD))
+#else
+#define TOF_CAP (TOF_CAPACITY)
+#endif
+
+typedef struct {
+    int RecordCount;
+    TOF_RECORD record[TOF_CAP];
+#ifdef TOF_BLOCK_BYTES
+    char pad[TOF_BLOCK_BYTES - sizeof(int) - TOF_CAP * sizeof(TOF_RECORD)];  // Block is exactly TOF_BLOCK_BYTES
+#endif
+} TOF_FN(Block);
+
+_Static_assert(TOF_CAP >= 1, "a block must hold at least one record");
+_Static_assert(sizeof(((TOF_RECORD *)0)->key) == sizeof(int), "records are sorted on an int key");
+#ifndef TOF_KEYS_ONLY
+_Static_assert(sizeof(((TOF_RECORD *)0)->data) > 1, "data must be a char array");
+#endif
+_Static_assert(offsetof(TOF_FN(Block), record) % _Alignof(TOF_RECORD) == 0, "slots must be aligned");
+#ifdef TOF_BLOCK_BYTES
+_Static_assert(sizeof(TOF_FN(Block)) == TOF_BLOCK_BYTES, "block does not fill TOF_BLOCK_BYTES exactly");
+#endif
+
+enum { TOF_FN(Capacity) = TOF_CAP };
+
+LayoutDesc TOF_FN(Layout)(void) {
+    return FIXED_LAYOUT(TOF_FN(Block), RecordCount, record);
+}
+
+BlockFile *TOF_FN(OpenOrCreate)(const char *path, bool *created) {
+    return BlockFileOpenOrCreate(path, sizeof(TOF_FN(Block)), TOF_FN(Layout)(), created);
+}
+
+BlockFile *TOF_FN(Create)(const char *path) {
+    return BlockFileCreate(path, sizeof(TOF_FN(Block)), TOF_FN(Layout)());
+}
+
+int TOF_FN(ReadBlock)(BlockFile *file, int blockNumber, TOF_FN(Block) *block) {
+    return BlockFileRead(file, blockNumber, block);
+}
+
+void TOF_FN(WriteBlock)(BlockFile *file, int blockNumber, const TOF_FN(Block) *block) {
+    BlockFileWrite(file, blockNumber, block);
+}
+
+// Any number of threads can search, scan and display while others insert
+// and delete. A writer latches the blocks it rewrites, from the one its key
+// belongs in to the end of the file (lib/latch.h), so writers take turns
+// and the blocks before theirs stay readable. Readers read with pread into
+// their own buffers and check the latches afterwards: a search a writer
+// got into runs again. Scans are consistent block by block, or as a whole
+// on a file with snapshots.
+
+// A block for a reader: as of snap when there is one, else noted in reads
+// to be checked at the end, or (reads NULL) read again until no writer got
+// in between
+static bool TOF_FN(ReadAt)(BlockFile *file, Snapshot *snap, LatchReads *reads, int blockNumber, TOF_FN(Block) *block) {
+    if (snap) return SnapshotRead(file, snap, blockNumber, block);
+    LatchTable *latches = BlockLatches(file);
+    if (reads) {
+        LatchReadNote(latches, reads, blockNumber);
+        bool ok = TOF_FN(ReadBlock)(file, blockNumber, block);
+        // A block read mid-write fails the check later; until then its
+        // count only has to stay in bounds
+        if (block->RecordCount < 0 || block->RecordCount > (int)TOF_CAP) block->RecordCount = 0;
+        return ok;
+    }
+    for (;;) {
+        uint64_t version = LatchReadBegin(latches, blockNumber);
+        bool ok = TOF_FN(ReadBlock)(file, blockNumber, block);
+        if (LatchReadValid(latches, blockNumber, version)) return ok;
+    }
+}
+
+// Records are packed from block 0 on, so the blocks' key ranges are in
+// order: binary search on them, about log2(nblk) reads. Returns the first
+// block that can hold key, left in *block (-1 when key is past the last).
+// Reads the file as of snap (NULL: as it stands) through ReadAt.
+static int TOF_FN(FindBlock)(BlockFile *file, Snapshot *snap, LatchReads *reads, int key, TOF_FN(Block) *block) {
+    int64_t nBlocks = snap ? SnapshotHeader(file, snap)->nBlocks : __atomic_load_n(&file->header.nBlocks, __ATOMIC_RELAXED);
+    int left = 0, right = (int)nBlocks - 1, found = -1, loaded = -1;
+    while (left <= right) {
+        int mid = (left + right) / 2;
+        loaded = TOF_FN(ReadAt)(file, snap, reads, mid, block) ? mid : -1;
+        if (loaded < 0 || block->RecordCount == 0) {
+            right = mid - 1;
+        } else if (block->record[block->RecordCount - 1].key < key) {
+            left = mid + 1;
+        } else {
+            found = mid;
+            // No earlier block can end with key when this one starts below it
+            if (block->record[0].key < key) break;
+            right = mid - 1;
+        }
+    }
+    if (found >= 0 && found != loaded) TOF_FN(ReadAt)(file, snap, reads, found, block);
+    return found;
+}
+
+// The last block holding records. Deletes leave the blocks after it empty,
+// so a key past every block goes there, not in the file's last block.
+static int TOF_FN(TailBlock)(BlockFile *file, int64_t nBlocks) {
+    int64_t nRecords = __atomic_load_n(&file->header.nRecords, __ATOMIC_RELAXED);
+    int64_t tail = nRecords > 0 ? (nRecords - 1) / (int64_t)TOF_CAP : 0;
+    if (tail >= nBlocks) tail = nBlocks - 1;
+    return tail > 0 ? (int)tail : 0;
+}
+
+// Latch what an insert or delete of key rewrites: from the block key
+// belongs in (the last one holding records when it is past them all) to the
+// end of the file, plus the block an insert may append. Every such range holds the
+// last block, so writers take turns. The start is found before the latch
+// is held and checked again once it is, unless the latch holds the whole
+// file. Returns it; *last gets the end.
+static int TOF_FN(LatchFrom)(BlockFile *file, int key, int64_t *last) {
+    LatchTable *latches = BlockLatches(file);
+    TOF_FN(Block) block;
+    for (;;) {
+        int64_t nBlocks = __atomic_load_n(&file->header.nBlocks, __ATOMIC_RELAXED);
+        int first = TOF_FN(FindBlock)(file, NULL, NULL, key, &block);
+        if (first < 0) first = TOF_FN(TailBlock)(file, nBlocks);
+        LatchWrite(latches, first, nBlocks);
+        int again = first == 0 ? 0 : TOF_FN(FindBlock)(file, NULL, NULL, key, &block);
+        if (again < 0) again = TOF_FN(TailBlock)(file, nBlocks);
+        if (again >= first && file->header.nBlocks == nBlocks) {
+            *last = nBlocks;
+            return first;
+        }
+        LatchRelease(latches, first, nBlocks);
+    }
+}
+
+// Insert a record as given, keeping the file sorted. Only the blocks from
+// the one the key belongs in on are read and rewritten: the ones before are
+// full and stay as they are. The record array comes from the file's scratch
+// arena, sized from the header's record count, so a steady stream of
+// inserts does not touch malloc.
+void TOF_FN(InsertEntry)(BlockFile *file, const TOF_RECORD *entry) {
+    TOF_FN(Block) block;
+    IoOp op = BlockFileOpBegin(file, "insert");
+    int64_t last;
+    int first = TOF_FN(LatchFrom)(file, entry->key, &last);
+    int blockNumber = first;
+    int totalRecords = 0;
+    int capacity = (int)(file->header.nRecords - (int64_t)first * TOF_CAP) + INITIAL_CAPACITY;
+    if (capacity < INITIAL_CAPACITY) capacity = INITIAL_CAPACITY;
+    ArenaMark mark = ArenaSave(&file->scratch);
+    TOF_RECORD *allRecords = ArenaAlloc(&file->scratch, capacity * sizeof(TOF_RECORD));
+
+    if (!allRecords) {
+        printf("Memory allocation failed!\n");
+        LatchRelease(BlockLatches(file), first, last);
+        BlockFileOpEnd(&op);
+        return;
+    }
+
+    while (TOF_FN(ReadBlock)(file, blockNumber, &block)) {
+        for (int i = 0; i < block.RecordCount; i++) {
+            if (totalRecords >= capacity) {
+                allRecords = ArenaGrow(&file->scratch, allRecords, capacity * sizeof(TOF_RECORD), 2 * capacity * sizeof(TOF_RECORD));
+                capacity *= 2;
+                if (!allRecords) {
+                    printf("Memory reallocation failed!\n");
+                    ArenaRestore(&file->scratch, mark);
+                    LatchRelease(BlockLatches(file), first, last);
+                    BlockFileOpEnd(&op);
+                    return;
+                }
+            }
+            allRecords[totalRecords++] = block.record[i];
+        }
+        blockNumber++;
+    }
+
+    TOF_RECORD newRecord = *entry;
+    if (totalRecords >= capacity) {
+        allRecords = ArenaGrow(&file->scratch, allRecords, capacity * sizeof(TOF_RECORD), 2 * capacity * sizeof(TOF_RECORD));
+        capacity *= 2;
+        if (!allRecords) {
+            printf("Memory reallocation failed!\n");
+            ArenaRestore(&file->scratch, mark);
+            LatchRelease(BlockLatches(file), first, last);
+            BlockFileOpEnd(&op);
+            return;
+        }
+    }
+    // The records read are sorted: shift the larger ones up by one
+    int pos = totalRecords++;
+    while (pos > 0 && allRecords[pos - 1].key > newRecord.key) {
+        allRecords[pos] = allRecords[pos - 1];
+        pos--;
+    }
+    allRecords[pos] = newRecord;
+
+    // The rewrite touches every block after the new record: all or nothing
+    WalBegin(file);
+    blockNumber = first;
+    int recordIndex = 0;
+
+    while (recordIndex < totalRecords) {
+        TOF_FN(ReadBlock)(file, blockNumber, &block);
+
+        int i = 0;
+        while (i < TOF_CAP && recordIndex < totalRecords) {
+            block.record[i] = allRecords[recordIndex];
+            recordIndex++;
+            i++;
+        }
+        block.RecordCount = i;
+
+        TOF_FN(WriteBlock)(file, blockNumber, &block);
+        blockNumber++;
+    }
+
+    ArenaRestore(&file->scratch, mark);
+    file->header.nRecords++;
+    WalCommit(file);
+    BlockFileOpEnd(&op);
+    // Commit before letting go of the latch so writers reach CommitOp one at
+    // a time and a header write can't interleave with another writer's
+    CommitOp(file);
+    LatchRelease(BlockLatches(file), first, last);
+}
+
+#ifndef TOF_KEYS_ONLY
+void TOF_FN(InsertRecord)(BlockFile *file, int key, const char *data) {
+    TOF_RECORD newRecord = {0};
+    newRecord.key = key;
+    snprintf(newRecord.data, sizeof(newRecord.data), "%s", data);
+    TOF_FN(InsertEntry)(file, &newRecord);
+
+    if (verbose) printf("Record inserted and sorted successfully: Key = %d, Data = %s\n", key, data);
+}
+#endif
+
+// Remove the record and pull the ones after it down, from the block the
+// key belongs in on; the blocks before it are full already
+void TOF_FN(DeleteRecord)(BlockFile *file, int key) {
+    TOF_FN(Block) block, nextBlock;
+    bool found = false;
+    IoOp op = BlockFileOpBegin(file, "delete");
+    int64_t last;
+    int first = TOF_FN(LatchFrom)(file, key, &last);
+    int BlockNumber = first;
+    WalBegin(file);
+
+    while (TOF_FN(ReadBlock)(file, BlockNumber, &block)) {
+        for (int i = 0; i < block.RecordCount; i++) {
+            if (block.record[i].key == key && !block.record[i].erased) {
+                block.record[i].erased = true;
+
+                for (int j = i; j < block.RecordCount - 1; j++) {
+                    block.record[j] = block.record[j + 1];
+                }
+                block.RecordCount--;
+                TOF_FN(WriteBlock)(file, BlockNumber, &block);
+                file->header.nRecords--;
+                found = true;
+                break;
+            }
+        }
+        if (found) break;
+        BlockNumber++;
+    }
+
+    if (!found && verbose) {
+        printf("Record with key = %d was not found or already erased.\n", key);
+    }
+
+    // The file is packed, so the first empty block ends the records: the
+    // ones after it are left empty by earlier deletes and need no visit
+    int currentBlock = first;
+    while (TOF_FN(ReadBlock)(file, currentBlock, &block) && block.RecordCount > 0) {
+        if (block.RecordCount < TOF_CAP) {
+            int nextBlockNumber = currentBlock + 1;
+            while (TOF_FN(ReadBlock)(file, nextBlockNumber, &nextBlock) && nextBlock.RecordCount > 0) {
+                while (nextBlock.RecordCount > 0 && block.RecordCount < TOF_CAP) {
+                    block.record[block.RecordCount] = nextBlock.record[0];
+                    block.RecordCount++;
+
+                    for (int k = 0; k < nextBlock.RecordCount - 1; k++) {
+                        nextBlock.record[k] = nextBlock.record[k + 1];
+                    }
+                    nextBlock.RecordCount--;
+
+                    TOF_FN(WriteBlock)(file, nextBlockNumber, &nextBlock);
+                }
+                if (block.RecordCount == TOF_CAP) break;
+
+                nextBlockNumber++;
+            }
+            TOF_FN(WriteBlock)(file, currentBlock, &block);
+        }
+        currentBlock++;
+    }
+    WalCommit(file);
+    BlockFileOpEnd(&op);
+    // Commit before letting go of the latch so writers reach CommitOp one at
+    // a time and a header write can't interleave with another writer's
+    CommitOp(file);
+    LatchRelease(BlockLatches(file), first, last);
+}
+
+// First slot in the block with a key >= key (RecordCount if none): a
+// branchless binary search, log2(TOF_CAP) steps instead of a scan
+static inline int TOF_FN(LowerBound)(const TOF_FN(Block) *block, int key) {
+    return IntLowerBound(&block->record[0].key, block->RecordCount, sizeof(TOF_RECORD), key);
+}
+
+// Copies the record with this key into *out (if not NULL); returns whether
+// there is one
+int TOF_FN(Search)(BlockFile *file, int key, TOF_RECORD *out) {
+    TOF_FN(Block) block;
+    IoOp op = BlockFileOpBegin(file, "search");
+    LatchReads reads;
+    TOF_RECORD match;
+    int found;
+    do {
+        LatchReadsReset(&reads);
+        found = 0;
+        if (TOF_FN(FindBlock)(file, NULL, &reads, key, &block) >= 0) {
+            for (int i = TOF_FN(LowerBound)(&block, key); i < block.RecordCount && block.record[i].key == key && !found; i++) {
+                if (!block.record[i].erased) {
+                    match = block.record[i];
+                    found = 1;
+                }
+            }
+        }
+    } while (!LatchReadsValid(BlockLatches(file), &reads));
+    if (found && out) *out = match;
+    BlockFileOpEnd(&op);
+    return found;
+}
+
+// Calls visit (if not NULL) on every record with lo <= key <= hi, in key
+// order; returns how many there are. On a file with snapshots the scan
+// pins one, so an insert shifting records meanwhile is not seen half done.
+long TOF_FN(ScanRange)(BlockFile *file, int lo, int hi, void (*visit)(const TOF_RECORD *, void *), void *ctx) {
+    TOF_FN(Block) block;
+    IoOp op = BlockFileOpBegin(file, "range");
+    Snapshot *snap = SnapshotOpen(file);
+    long matches = 0;
+    int blockNumber = TOF_FN(FindBlock)(file, snap, NULL, lo, &block);
+    bool more = blockNumber >= 0;
+    int i = more ? TOF_FN(LowerBound)(&block, lo) : 0;
+    while (more) {
+        for (; i < block.RecordCount; i++) {
+            if (block.record[i].key > hi) {
+                more = false;
+                break;
+            }
+            if (block.record[i].key >= lo && !block.record[i].erased) {
+                if (visit) visit(&block.record[i], ctx);
+                matches++;
+            }
+        }
+        if (more) more = TOF_FN(ReadAt)(file, snap, NULL, ++blockNumber, &block);
+        i = 0;
+    }
+    SnapshotClose(snap);
+    BlockFileOpEnd(&op);
+    return matches;
+}
+
+static bool TOF_FN(Live)(const void *record) {
+    return !((const TOF_RECORD *)record)->erased;
+}
+
+static int TOF_FN(CompareRecords)(const void *a, const void *b) {
+    int x = ((const TOF_RECORD *)a)->key, y = ((const TOF_RECORD *)b)->key;
+    return (x > y) - (x < y);
+}
+
+// Write op(a, b) to out, an empty file of this geometry, with one merge
+// pass over each input (lib/merge.h). Returns the records written, or -1.
+long TOF_FN(MergeFiles)(MergeOp setOp, BlockFile *a, BlockFile *b, BlockFile *out) {
+    MergeInput inA = {a, a->header.nBlocks, TOF_FN(Live)}, inB = {b, b->header.nBlocks, TOF_FN(Live)};
+    MergeOutput o = {out};
+    IoOp op = BlockFileOpBegin(out, "merge");
+    int64_t n = MergeSets(setOp, &inA, &inB, TOF_FN(CompareRecords), &o);
+    if (n >= 0) {
+        out->header.nRecords = n;
+        BlockFileWriteHeader(out);
+    }
+    BlockFileOpEnd(&op);
+    CommitOp(out);
+    return n;
+}
+
+// Equi-join of a and b into out, all of this geometry: combine fills one
+// output record per pair of records with the same key
+long TOF_FN(JoinFiles)(BlockFile *a, BlockFile *b, BlockFile *out,
+                       void (*combine)(void *row, const void *a, const void *b, void *ctx), void *ctx) {
+    MergeInput inA = {a, a->header.nBlocks, TOF_FN(Live)}, inB = {b, b->header.nBlocks, TOF_FN(Live)};
+    MergeOutput o = {out, .join = combine, .ctx = ctx};
+    IoOp op = BlockFileOpBegin(out, "join");
+    int64_t n = MergeJoin(&inA, &inB, TOF_FN(CompareRecords), &o);
+    if (n >= 0) {
+        out->header.nRecords = n;
+        BlockFileWriteHeader(out);
+    }
+    BlockFileOpEnd(&op);
+    CommitOp(out);
+    return n;
+}
+
+#ifndef TOF_KEYS_ONLY
+void TOF_FN(DisplayFile)(BlockFile *file) {
+    TOF_FN(Block) block;
+    int blockNumber = 0;
+    Snapshot *snap = SnapshotOpen(file);
+
+    while (TOF_FN(ReadAt)(file, snap, NULL, blockNumber, &block)) {
+        printf("Block %d:\n", blockNumber);
+        for (int i = 0; i < block.RecordCount; i++) {
+            printf("  Record %d -> Key: %d, Data: %s\n", i, block.record[i].key, block.record[i].data);
+        }
+        blockNumber++;
+    }
+    SnapshotClose(snap);
+}
+
+// Inserts and deletes with keys from cfg.dist. Both rewrite only the blocks
+// from the key's block to the last one holding records, half the file on
+// average with uniform keys. An insert finds its block by binary search,
+// then reads those blocks twice and writes them once: about nblk reads and
+// nblk/2 writes. A delete pulls one record into each of them from the next,
+// about two reads and two writes a block: nblk of each.
+int TOF_FN(RunBench)(const BenchConfig *cfg, const char *path) {
+    BlockFile *file = TOF_FN(Create)(path);
+    if (!file) {
+        perror(path);
+        return 1;
+    }
+    printf("ex3 sorted TOF: %ld records, %s keys, %d records per block (%zu-byte blocks)\n", cfg->records,
+           KeyDistName(cfg->dist), (int)TOF_CAP, sizeof(TOF_FN(Block)));
+
+    KeyGen keys;
+    BenchOp op;
+    char data[sizeof(((TOF_RECORD *)0)->data)];
+    InitKeyGen(&keys, cfg->dist, 10 * cfg->records, cfg->seed);
+    BenchBegin(&op, "insert", cfg->records);
+    for (long i = 0; i < cfg->records; i++) {
+        int key = (int)NextKey(&keys);
+        snprintf(data, sizeof(data), "Record %d", key);
+        double t0 = BenchNow();
+        TOF_FN(InsertRecord)(file, key, data);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+    printf("  file: %lld blocks; scratch arena: %lld chunk mallocs\n", (long long)file->header.nBlocks,
+           (long long)file->scratch.mallocs);
+
+    // Replaying the same seed deletes keys that are present
+    InitKeyGen(&keys, cfg->dist, 10 * cfg->records, cfg->seed);
+    BenchBegin(&op, "delete", cfg->records / 2);
+    for (long i = 0; i < cfg->records / 2; i++) {
+        int key = (int)NextKey(&keys);
+        double t0 = BenchNow();
+        TOF_FN(DeleteRecord)(file, key);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+
+    BlockFileClose(file);
+    return 0;
+}
+#endif
+
+#undef TOF_CAT2
+#undef TOF_CAT
+#undef TOF_FN
+#undef TOF_CAP
+#undef TOF_PREFIX
+#undef TOF_RECORD
+#undef TOF_CAPACITY
+#undef TOF_BLOCK_BYTES
+#undef TOF_KEYS_ONLY
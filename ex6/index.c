@@ -1,10 +1,20 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../lib/blockfile.h"
+#include "../lib/bench.h"
+#include "../lib/aio.h"
+#include "../lib/wal.h"
+#include "../lib/snapshot.h"
 
+#ifndef B
 #define B 4 // Block size 
+#endif
 
 typedef struct {
-    FILE *file;       
+    BlockFile *file;       
     int lastBlockNum; 
 } TOFFile;
 
@@ -12,13 +22,24 @@ typedef struct {
     int data[B]; 
 } Buffer;
 
+// Blocks have no record count: empty slots hold -1
+#define BUFFER_LAYOUT FixedLayout(sizeof(int), B, BF_NO_COUNT, 0)
+
+void ReadBlock(TOFFile *F, int blockNumber, Buffer *Buf) {
+    BlockFileRead(F->file, blockNumber, Buf);
+}
+
+void WriteBlock(TOFFile *F, int blockNumber, const Buffer *Buf) {
+    BlockFileWrite(F->file, blockNumber, Buf);
+}
+
 void Delete(TOFFile *F, int i, int j) {
     Buffer Buf, LastBuf;
     int lastBlock = F->lastBlockNum;
     int lastRecordIndex;
+    IoOp op = BlockFileOpBegin(F->file, "delete");
 
-    fseek(F->file, lastBlock * sizeof(Buffer), SEEK_SET);
-    fread(&LastBuf, sizeof(Buffer), 1, F->file);
+    ReadBlock(F, lastBlock, &LastBuf);
     lastRecordIndex = B - 1;
     while (lastRecordIndex >= 0 && LastBuf.data[lastRecordIndex] == -1) { // Assume -1 indicates empty
         lastRecordIndex--;
@@ -26,28 +47,34 @@ void Delete(TOFFile *F, int i, int j) {
 
     if (lastRecordIndex < 0) {
         fprintf(stderr, "File is empty, nothing to delete.\n");
+        BlockFileOpEnd(&op);
         return;
     }
 
-    fseek(F->file, i * sizeof(Buffer), SEEK_SET);
-    fread(&Buf, sizeof(Buffer), 1, F->file);
-
-    Buf.data[j] = LastBuf.data[lastRecordIndex];
-
-    fseek(F->file, i * sizeof(Buffer), SEEK_SET);
-    fwrite(&Buf, sizeof(Buffer), 1, F->file);
+    // Both blocks and the record count change together or not at all
+    WalBegin(F->file);
+    if (i == lastBlock) {
+        // Best case: the hole and the last record share a block
+        LastBuf.data[j] = LastBuf.data[lastRecordIndex];
+    } else {
+        ReadBlock(F, i, &Buf);
+        Buf.data[j] = LastBuf.data[lastRecordIndex];
+        WriteBlock(F, i, &Buf);
+    }
 
     LastBuf.data[lastRecordIndex] = -1; // Mark as empty
-    fseek(F->file, lastBlock * sizeof(Buffer), SEEK_SET);
-    fwrite(&LastBuf, sizeof(Buffer), 1, F->file);
+    WriteBlock(F, lastBlock, &LastBuf);
 
     if (lastRecordIndex == 0) {
         F->lastBlockNum--;
     }
+    F->file->header.nRecords--;
+    WalCommit(F->file);
+    BlockFileOpEnd(&op);
 }
 
 void initializeFile(const char *filename, int numBlocks) {
-    FILE *file = fopen(filename, "wb");
+    BlockFile *file = BlockFileCreate(filename, sizeof(Buffer), BUFFER_LAYOUT);
     Buffer Buf;
 
     int value = 1;
@@ -55,19 +82,20 @@ void initializeFile(const char *filename, int numBlocks) {
         for (int i = 0; i < B; i++) {
             Buf.data[i] = value++;
         }
-        fwrite(&Buf, sizeof(Buffer), 1, file);
+        BlockFileWrite(file, block, &Buf);
     }
+    file->header.nRecords = (int64_t)numBlocks * B;
 
-    fclose(file);
+    BlockFileClose(file);
 }
 
 void printFile(const char *filename, int numBlocks) {
-    FILE *file = fopen(filename, "rb");
+    BlockFile *file = BlockFileOpen(filename);
     Buffer Buf;
 
     printf("Contents of the file:\n");
     for (int block = 0; block < numBlocks; block++) {
-        fread(&Buf, sizeof(Buffer), 1, file);
+        BlockFileRead(file, block, &Buf);
         printf("Block %d: ", block);
         for (int i = 0; i < B; i++) {
             printf("%d ", Buf.data[i]);
@@ -75,17 +103,208 @@ void printFile(const char *filename, int numBlocks) {
         printf("\n");
     }
 
-    fclose(file);
+    BlockFileClose(file);
+}
+
+// Count the records of an open file, marking each value in seen (values
+// 1..maxValue, as initializeFile numbers them). With snapshots enabled the
+// scan pins one, so it never meets a record twice: once in its hole and once
+// in the last block it is moving out of. Returns whether what it saw agrees
+// with the record count in the header.
+static bool ScanRecords(TOFFile *F, unsigned char *seen, long maxValue) {
+    Snapshot *snap = SnapshotOpen(F->file);
+    long count = 0;
+    bool consistent = true;
+    Buffer Buf;
+    memset(seen, 0, maxValue + 1);
+    for (int block = 0; SnapshotRead(F->file, snap, block, &Buf); block++) {
+        for (int i = 0; i < B; i++) {
+            int v = Buf.data[i];
+            if (v == -1) continue;
+            count++;
+            if (v < 1 || v > maxValue || seen[v]++) consistent = false;
+        }
+    }
+    consistent = consistent && count == SnapshotHeader(F->file, snap)->nRecords;
+    SnapshotClose(snap);
+    return consistent;
+}
+
+typedef struct {
+    TOFFile *F;
+    long maxValue;
+    bool done;
+    long scans, torn;
+    pthread_t thread;
+    IoStats io;  // The scans' own block I/O
+} ScanTask;
+
+static void *ScanLoop(void *arg) {
+    ScanTask *t = arg;
+    unsigned char *seen = malloc(t->maxValue + 1);
+    IoOp op = BlockFileOpBegin(t->F->file, "scan");
+    while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+        if (!ScanRecords(t->F, seen, t->maxValue)) t->torn++;
+        t->scans++;
+    }
+    t->io = BlockFileOpEnd(&op);
+    free(seen);
+    return NULL;
+}
+
+// Stop the scanner and leave its I/O out of op's figures
+static void StopScanner(ScanTask *t, BenchOp *op) {
+    __atomic_store_n(&t->done, true, __ATOMIC_RELEASE);
+    pthread_join(t->thread, NULL);
+    // The scanner's reads get their own line
+    IoStatsAdd(&op->ioStart, t->io);
+}
+
+// Fresh file of numBlocks full blocks, open for deletes
+static TOFFile OpenFresh(const char *filename, int numBlocks, bool wal) {
+    initializeFile(filename, numBlocks);
+    TOFFile F = {BlockFileOpen(filename), numBlocks - 1};
+    if (wal) WalAttach(F.file);
+    return F;
+}
+
+// count deletes at positions drawn from cfg.dist, made durable one by one
+// when sync is set. A scanner running alongside is stopped before the
+// report, which leaves its reads out. Returns the records left.
+static long RunDeletes(const BenchConfig *cfg, TOFFile *F, const char *name, long count, bool sync,
+                       ScanTask *scanner) {
+    long live = (long)(F->lastBlockNum + 1) * B;
+    KeyGen keys;
+    BenchOp op;
+    InitKeyGen(&keys, cfg->dist, live, cfg->seed);
+    BenchBegin(&op, name, count);
+    for (long n = 0; n < count; n++, live--) {
+        long pos = NextKey(&keys) % live;
+        double t0 = BenchNow();
+        Delete(F, (int)(pos / B), (int)(pos % B));
+        if (sync) BlockFileSync(F->file);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    if (scanner) StopScanner(scanner, &op);
+    BenchReport(&op, true);
+    return live;
+}
+
+// Deletes with a thread scanning the file over and over, in place and then
+// through snapshots; reports the scans that saw a torn file
+static void RunScannedDeletes(const BenchConfig *cfg, int numBlocks, long count, bool snapshots) {
+    TOFFile F = OpenFresh("bench_matrix.tof", numBlocks, false);
+    if (snapshots) SnapshotsEnable(F.file);
+    ScanTask task = {&F, (long)numBlocks * B};
+    pthread_create(&task.thread, NULL, ScanLoop, &task);
+    RunDeletes(cfg, &F, snapshots ? "delete (snapshot scans)" : "delete (scans in place)", count, false, &task);
+    printf("  %ld scans, %ld saw a torn file\n", task.scans, task.torn);
+    long scans = task.scans > 0 ? task.scans : 1;
+    printf("  scanner I/O: %.2f reads/scan %.2f seeks/scan %.3f ms in I/O per scan\n",
+           (double)task.io.blocksRead / scans, (double)task.io.seeks / scans, task.io.ioNanos / 1e6 / scans);
+    if (snapshots) {
+        SnapshotStats ss = SnapshotGetStats(F.file);
+        printf("  %lld blocks preserved (at most %lld at once), %lld read back\n", (long long)ss.preserved,
+               (long long)ss.peakImages, (long long)ss.overlaid);
+    }
+    BlockFileClose(F.file);
+}
+
+// Rewrite logged blocks behind the log and cut the file short, then crash:
+// replaying the log must bring back neither the logged images nor the blocks
+// cut off. Needs 5 blocks.
+static void RunBypassCrash(const char *filename, int numBlocks) {
+    enum { N = 4 };
+    if (numBlocks <= N) return;
+    TOFFile F = OpenFresh(filename, numBlocks, true);
+    Buffer Buf, behind[N];
+    for (int b = 0; b < N; b++) {
+        for (int i = 0; i < B; i++) Buf.data[i] = 100 + b;
+        WriteBlock(&F, b, &Buf);
+        for (int i = 0; i < B; i++) behind[b].data[i] = 900 + b;
+    }
+    BlockFileSync(F.file);
+    WriteBehind *wb = WriteBehindOpen(F.file, 0, N);
+    WriteBehindPut(wb, 0, N, behind);
+    WriteBehindClose(wb);
+
+    for (int i = 0; i < B; i++) Buf.data[i] = 700;
+    WriteBlock(&F, numBlocks - 1, &Buf);
+    BlockFileSync(F.file);
+    BlockFileTruncate(F.file, numBlocks - 1);
+    BlockFileWriteHeader(F.file);
+    BlockFileSync(F.file);
+    WalCrash(F.file);
+
+    F.file = BlockFileOpen(filename);
+    int kept = 0;
+    for (int b = 0; b < N; b++) kept += BlockFileRead(F.file, b, &Buf) && Buf.data[0] == 900 + b;
+    long long nBlocks = (long long)F.file->header.nBlocks;
+    printf("recovery after write-behind and truncate: %d of %d blocks as written behind, %lld of %d blocks %s\n",
+           kept, N, nBlocks, numBlocks - 1, kept == N && nBlocks == numBlocks - 1 ? "(as written)" : "(MISMATCH)");
+    BlockFileClose(F.file);
 }
 
-int main() {
+// Deletes at positions drawn from cfg.dist over the live records. The cost
+// analysis below predicts 1 read + 1 write at best and 2 + 2 at worst.
+// The durable runs are capped, since each delete waits for an fdatasync:
+// in place that is the data file, through the redo log only the log.
+int RunBench(const BenchConfig *cfg) {
+    const char *filename = "bench_matrix.tof";
+    int numBlocks = (int)((cfg->records + B - 1) / B);
+    long half = (long)numBlocks * B / 2, synced = half < 2000 ? half : 2000;
+    printf("ex6 TOF delete: %d records, %s positions, %d records per block\n", numBlocks * B,
+           KeyDistName(cfg->dist), B);
+
+    TOFFile F = OpenFresh(filename, numBlocks, false);
+    RunDeletes(cfg, &F, "delete", half, false, NULL);
+    BlockFileClose(F.file);
+
+    F = OpenFresh(filename, numBlocks, false);
+    RunDeletes(cfg, &F, "delete (sync)", synced, true, NULL);
+    BlockFileClose(F.file);
+
+    F = OpenFresh(filename, numBlocks, true);
+    RunDeletes(cfg, &F, "delete (wal)", synced, true, NULL);
+    WalStats ws = WalGetStats(F.file);
+    printf("  wal: %lld commits, %lld records, %.1f bytes/commit, %lld syncs\n", (long long)ws.commits,
+           (long long)ws.records, ws.commits ? (double)ws.logBytes / ws.commits : 0.0, (long long)ws.syncs);
+    BlockFileClose(F.file);
+
+    // Crash after committing without a checkpoint; reopening replays the log
+    F = OpenFresh(filename, numBlocks, true);
+    long live = RunDeletes(cfg, &F, "delete (wal, no sync)", half, false, NULL);
+    WalCrash(F.file);
+    struct stat st;
+    char logPath[64];
+    snprintf(logPath, sizeof(logPath), "%s.wal", filename);
+    long long logSize = stat(logPath, &st) == 0 ? (long long)st.st_size : 0;
+    double t0 = BenchNow();
+    F.file = BlockFileOpen(filename);
+    double ms = (BenchNow() - t0) * 1e3;
+    ws = WalGetStats(F.file);
+    printf("recovery: %lld transactions from a %.1f MiB log in %.1f ms, %lld records %s\n",
+           (long long)ws.recovered, logSize / 1048576.0, ms, (long long)F.file->header.nRecords,
+           F.file->header.nRecords == live ? "(as committed)" : "(MISMATCH)");
+    BlockFileClose(F.file);
+    RunBypassCrash(filename, numBlocks);
+
+    RunScannedDeletes(cfg, numBlocks, half, false);
+    RunScannedDeletes(cfg, numBlocks, half, true);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    if (ParseBenchArgs(argc, argv, 100000, &cfg)) return RunBench(&cfg);
+
     const char *filename = "matrix.tof";
     int numBlocks = 3;
 
     initializeFile(filename, numBlocks);
 
     TOFFile tofFile;
-    tofFile.file = fopen(filename, "r+b");
+    tofFile.file = BlockFileOpen(filename);
     tofFile.lastBlockNum = numBlocks - 1;
 
     printf("Before deletion:\n");
@@ -96,8 +315,9 @@ int main() {
 
     printf("After deletion:\n");
     printFile(filename, numBlocks);
+    BlockFilePrintOps(tofFile.file, stdout);
 
-    fclose(tofFile.file);
+    BlockFileClose(tofFile.file);
     return 0;
 }
 
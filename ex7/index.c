@@ -1,10 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include "../lib/blockfile.h"
+#include "../lib/bench.h"
 
+#ifndef B
 #define B 4 
+#endif
 // File structure 
 typedef struct {
-    FILE *file;    
+    BlockFile *file;    
     int numBlocks; 
 } TOFFile;
 
@@ -12,17 +16,27 @@ typedef struct {
     int data[B];
 } Buffer;
 
+// Blocks have no record count: padding slots hold -1
+#define BUFFER_LAYOUT FixedLayout(sizeof(int), B, BF_NO_COUNT, 0)
+
+void ReadBlock(TOFFile *F, int blockNumber, Buffer *Buf) {
+    BlockFileRead(F->file, blockNumber, Buf);
+}
+
+void WriteBlock(TOFFile *F, int blockNumber, const Buffer *Buf) {
+    BlockFileWrite(F->file, blockNumber, Buf);
+}
+
 void Reorganize(TOFFile *F, int VP) {
     Buffer Buf1, Buf2;
     int leftBlock = 0, rightBlock = F->numBlocks - 1;
     int leftIndex, rightIndex;
+    IoOp op = BlockFileOpBegin(F->file, "reorganize");
+    BlockFileBypassCache(F->file, true);
 
     while (leftBlock <= rightBlock) {
-        fseek(F->file, leftBlock * sizeof(Buffer), SEEK_SET);
-        fread(&Buf1, sizeof(Buffer), 1, F->file);
-
-        fseek(F->file, rightBlock * sizeof(Buffer), SEEK_SET);
-        fread(&Buf2, sizeof(Buffer), 1, F->file);
+        ReadBlock(F, leftBlock, &Buf1);
+        ReadBlock(F, rightBlock, &Buf2);
 
         leftIndex = 0;
         rightIndex = B - 1;
@@ -47,11 +61,8 @@ void Reorganize(TOFFile *F, int VP) {
             }
         }
 
-        fseek(F->file, leftBlock * sizeof(Buffer), SEEK_SET);
-        fwrite(&Buf1, sizeof(Buffer), 1, F->file);
-
-        fseek(F->file, rightBlock * sizeof(Buffer), SEEK_SET);
-        fwrite(&Buf2, sizeof(Buffer), 1, F->file);
+        WriteBlock(F, leftBlock, &Buf1);
+        WriteBlock(F, rightBlock, &Buf2);
 
         if (leftIndex == B) {
             leftBlock++;
@@ -60,17 +71,19 @@ void Reorganize(TOFFile *F, int VP) {
             rightBlock--;
         }
     }
+    BlockFileBypassCache(F->file, false);
+    BlockFileOpEnd(&op);
 }
 
 void InitializeFile(const char *filename, int *values, int numValues) {
-    FILE *file = fopen(filename, "wb");
+    BlockFile *file = BlockFileCreate(filename, sizeof(Buffer), BUFFER_LAYOUT);
     if (!file) {
         perror("Failed to create file");
         exit(1);
     }
 
     Buffer Buf;
-    int i, j = 0;
+    int i, j = 0, block = 0;
 
     while (j < numValues) {
         for (i = 0; i < B; i++) {
@@ -80,14 +93,15 @@ void InitializeFile(const char *filename, int *values, int numValues) {
                 Buf.data[i] = -1; 
             }
         }
-        fwrite(&Buf, sizeof(Buffer), 1, file);
+        BlockFileWrite(file, block++, &Buf);
     }
+    file->header.nRecords = numValues;
 
-    fclose(file);
+    BlockFileClose(file);
 }
 
 void PrintFile(const char *filename, int numBlocks) {
-    FILE *file = fopen(filename, "rb");
+    BlockFile *file = BlockFileOpen(filename);
     if (!file) {
         perror("Failed to open file");
         exit(1);
@@ -95,7 +109,7 @@ void PrintFile(const char *filename, int numBlocks) {
 
     Buffer Buf;
     for (int i = 0; i < numBlocks; i++) {
-        fread(&Buf, sizeof(Buffer), 1, file);
+        BlockFileRead(file, i, &Buf);
         printf("Block %d: ", i);
         for (int j = 0; j < B; j++) {
             printf("%d ", Buf.data[j]);
@@ -103,10 +117,49 @@ void PrintFile(const char *filename, int numBlocks) {
         printf("\n");
     }
 
-    fclose(file);
+    BlockFileClose(file);
 }
 
-int main() {
+// Partition freshly loaded files around their middle key. Each Reorganize
+// reads every block at least once and rewrites the ones it swapped into.
+int RunBench(const BenchConfig *cfg) {
+    const char *filename = "bench_testfile.bin";
+    int numValues = (int)cfg->records;
+    int numBlocks = (numValues + B - 1) / B;
+    int *values = malloc(numValues * sizeof(int));
+    printf("ex7 TOF partition: %d records, %s keys, %d records per block\n", numValues,
+           KeyDistName(cfg->dist), B);
+
+    KeyGen keys;
+    BenchOp op;
+    InitKeyGen(&keys, cfg->dist, numValues, cfg->seed);
+    BenchBegin(&op, "reorganize", 10);
+    for (int run = 0; run < 10; run++) {
+        // Loading the file does not count towards the per-op I/O
+        IoStats setup = BlockFileTotals();
+        for (int i = 0; i < numValues; i++) values[i] = (int)NextKey(&keys);
+        InitializeFile(filename, values, numValues);
+        BenchExcludeIo(&op, setup);
+
+        TOFFile F;
+        F.file = BlockFileOpen(filename);
+        F.numBlocks = numBlocks;
+        double t0 = BenchNow();
+        Reorganize(&F, numValues / 2);
+        BenchSample(&op, BenchNow() - t0);
+        BlockFileClose(F.file);
+    }
+    BenchReport(&op, true);
+    printf("  file: %d blocks\n", numBlocks);
+
+    free(values);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    if (ParseBenchArgs(argc, argv, 100000, &cfg)) return RunBench(&cfg);
+
     const char *filename = "testfile.bin";
     int values[] = {3, 8, 1, 9, 5, 6, 10, 4, 7, 2, 11, 12};
     int numValues = sizeof(values) / sizeof(values[0]);
@@ -119,7 +172,7 @@ int main() {
     PrintFile(filename, numBlocks);
 
     TOFFile F;
-    F.file = fopen(filename, "rb+");
+    F.file = BlockFileOpen(filename);
     if (!F.file) {
         perror("Failed to open file");
         exit(1);
@@ -128,7 +181,7 @@ int main() {
 
     Reorganize(&F, VP);
 
-    fclose(F.file);
+    BlockFileClose(F.file);
 
     printf("\nAfter reorganization:\n");
     PrintFile(filename, numBlocks);
@@ -2,11 +2,25 @@
 #include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
-
+#include <pthread.h>
+#include "../lib/blockfile.h"
+#include "../lib/bench.h"
+#include "../lib/aio.h"
+#include "../lib/bloom.h"
+#include "../lib/wal.h"
+#include "../lib/keycmp.h"
+
+#ifndef BLOCK_SIZE
 #define BLOCK_SIZE 256
+#endif
 #define MAX_KEY_LENGTH 10
 #define DELIMITER "|"
 #define MAX_RECORDS (BLOCK_SIZE / sizeof(Record))
+#define MAX_KEYS_PER_BLOCK (BLOCK_SIZE / (MAX_KEY_LENGTH + 2))  // Records with empty other fields
+#ifndef BLOOM_FP_RATE
+#define BLOOM_FP_RATE 0.01
+#endif
+#define BATCH_KEYS 4096  // Keys per LookupBatch call in the bench
 
 typedef struct {
     char key[MAX_KEY_LENGTH + 1];  // Include space for null terminator
@@ -28,40 +42,41 @@ typedef struct {
 } Header;
 
 typedef struct {
-    FILE *file;
+    BlockFile *file;
     Header header;
+    BloomSet *bloom;  // One key filter per block, or NULL when searches read every block
 } File;
 
 void Record_to_String(Record rec, char *recordStr) {
     snprintf(recordStr, BLOCK_SIZE, "%s%c%s", rec.key, rec.logical_deletion, rec.other_fields);
 }
 
-void readBlock(FILE *file, int blockNumber, Block *block) {
-    fseek(file, sizeof(Header) + blockNumber * sizeof(Block), SEEK_SET);
-    fread(block, sizeof(Block), 1, file);
+void readBlock(BlockFile *file, int blockNumber, Block *block) {
+    BlockFileRead(file, blockNumber, block);
 }
 
-void writeBlock(FILE *file, int blockNumber, Block *block) {
-    fseek(file, sizeof(Header) + blockNumber * sizeof(Block), SEEK_SET);
-    fwrite(block, sizeof(Block), 1, file);
+void writeBlock(BlockFile *file, int blockNumber, Block *block) {
+    BlockFileWrite(file, blockNumber, block);
 }
 
-void setHeader(FILE *file, Header *header) {
-    fseek(file, 0, SEEK_SET);
-    fwrite(header, sizeof(Header), 1, file);
+// The TOVS header lives in the user area of the block-file header
+void setHeader(BlockFile *file, Header *header) {
+    memcpy(file->header.user, header, sizeof(Header));
+    file->header.nRecords = header->Number_of_Records;
+    BlockFileWriteHeader(file);
 }
 
-Header getHeader(FILE *file) {
-    Header header = {0, 0};
-    fseek(file, 0, SEEK_SET);
-    fread(&header, sizeof(Header), 1, file);
+Header getHeader(BlockFile *file) {
+    Header header;
+    memcpy(&header, file->header.user, sizeof(Header));
     return header;
 }
 
+// "rb+" opens an existing file and creates it when missing; "wb+" always starts empty
 File *Open(const char *filename, const char *mode) {
-    FILE *file = fopen(filename, mode);
-    if (!file && mode[0] == 'r') {
-        file = fopen(filename, "wb+");
+    BlockFile *file = mode[0] == 'r' ? BlockFileOpen(filename) : NULL;
+    if (!file) {
+        file = BlockFileCreate(filename, sizeof(Block), VARIABLE_LAYOUT(Block, record_count, data));
         if (file) {
             Header header = {0, 0};
             setHeader(file, &header);
@@ -76,27 +91,40 @@ File *Open(const char *filename, const char *mode) {
     File *FIle = (File *)malloc(sizeof(File));
     if (!FIle) {
         fprintf(stderr, "Memory allocation failed for File structure.\n");
-        fclose(file);
+        BlockFileClose(file);
         return NULL;
     }
 
     FIle->file = file;
     FIle->header = getHeader(file);
+    FIle->bloom = NULL;
     printf("File is open\n");
     return FIle;
 }
 
+// Identifies the file contents a saved filter set describes
+static uint64_t bloomStamp(const File *file) {
+    return (uint64_t)file->header.Number_of_Blocks << 32 | (uint32_t)file->header.Number_of_Records;
+}
+
 void Close(File *file) {
     if (!file) return;
+    if (file->bloom) {
+        file->bloom->stamp = bloomStamp(file);
+        if (!BloomSave(file->bloom, file->file->path)) fprintf(stderr, "Could not save the Bloom filters.\n");
+        BloomFree(file->bloom);
+    }
     setHeader(file->file, &file->header);
-    fclose(file->file);
+    BlockFileClose(file->file);
     free(file);
 }
 
+// The block comes from the file's scratch arena: the caller restores its
+// mark when done with it
 Block *AllocBlock(File *file) {
     if (!file) return NULL;
 
-    Block *block = (Block *)malloc(sizeof(Block));
+    Block *block = ArenaAlloc(&file->file->scratch, sizeof(Block));
     if (!block) {
         fprintf(stderr, "Memory allocation failed.\n");
         return NULL;
@@ -126,6 +154,9 @@ void insertRecord_TOVS(File *file, Record rec) {
 
     Block block;
     bool inserted = false;
+    IoOp op = BlockFileOpBegin(file->file, "insert");
+    // The record, a new block and the header counts land as one transaction
+    WalBegin(file->file);
 
     for (int blockNumber = 0; blockNumber < file->header.Number_of_Blocks; blockNumber++) {
         readBlock(file->file, blockNumber, &block);
@@ -136,23 +167,28 @@ void insertRecord_TOVS(File *file, Record rec) {
             block.free_pos += recordLen + strlen(DELIMITER);
             block.record_count++;
             writeBlock(file->file, blockNumber, &block);
+            if (file->bloom) BloomAdd(file->bloom, blockNumber, rec.key, strlen(rec.key));
             inserted = true;
             break;
         }
     }
 
     if (!inserted) {
+        ArenaMark mark = ArenaSave(&file->file->scratch);
         Block *newBlock = AllocBlock(file);
         strcat(newBlock->data, recordStr);
         strcat(newBlock->data, DELIMITER);
         newBlock->free_pos += recordLen + strlen(DELIMITER);
         newBlock->record_count++;
         writeBlock(file->file, file->header.Number_of_Blocks - 1, newBlock);
-        free(newBlock);
+        if (file->bloom) BloomAdd(file->bloom, file->header.Number_of_Blocks - 1, rec.key, strlen(rec.key));
+        ArenaRestore(&file->file->scratch, mark);
     }
 
     file->header.Number_of_Records++;
     setHeader(file->file, &file->header);
+    WalCommit(file->file);
+    BlockFileOpEnd(&op);
 }
 
 void initialLoad_TOVS(File *file, int min, int max) {
@@ -186,6 +222,29 @@ void parseBlock(Block *block, Record *records, int *recordCount) {
     }
 }
 
+// Zero-padded keys of a block's records, in block order, without copying
+// the rest of each record out the way parseBlock does
+typedef char KeySlot[16];
+
+static int blockKeys(const Block *block, KeySlot *keys) {
+    const char *p = block->data, *end = block->data + block->free_pos;
+    int n = 0;
+    while (p < end) {
+        if (*p == DELIMITER[0]) {
+            p++;
+            continue;
+        }
+        const char *next = memchr(p, DELIMITER[0], end - p);
+        if (!next) next = end;
+        size_t len = next - p < MAX_KEY_LENGTH ? (size_t)(next - p) : MAX_KEY_LENGTH;
+        memset(keys[n], 0, sizeof(KeySlot));
+        memcpy(keys[n], p, strnlen(p, len));
+        n++;
+        p = next;
+    }
+    return n;
+}
+
 // Corrected Binary Search
 int binarySearch(Record *records, int recordCount, const char *key) {
     int left = 0;
@@ -209,26 +268,271 @@ int binarySearch(Record *records, int recordCount, const char *key) {
     return -1; // Key not found
 }
 
-void searchRecordByKey(File *file, const char *key) {
-    for (int blockNumber = 0; blockNumber < file->header.Number_of_Blocks; blockNumber++) {
+// Index of the record within its block, or -1; *blockNumber is where it was found.
+// Inserts fill the first block with room, so a block's keys are not sorted:
+// every key slot is compared against the key, one SSE2 compare each.
+int findRecord(File *file, const char *key, int *blockNumber) {
+    IoOp op = BlockFileOpBegin(file->file, "search");
+    KeyProbe probe = KeyProbeFrom(key, sizeof(KeySlot));
+    for (*blockNumber = 0; *blockNumber < file->header.Number_of_Blocks; (*blockNumber)++) {
+        if (file->bloom && !BloomMayContain(file->bloom, *blockNumber, key, strlen(key))) continue;
         Block block;
-        readBlock(file->file, blockNumber, &block);
-
-        Record records[MAX_RECORDS];
-        int recordCount = 0;
-        parseBlock(&block, records, &recordCount);
+        readBlock(file->file, *blockNumber, &block);
 
-        int index = binarySearch(records, recordCount, key);
+        KeySlot keys[MAX_KEYS_PER_BLOCK];
+        int index = KeyProbeFind(&probe, keys, blockKeys(&block, keys), sizeof(KeySlot));
         if (index != -1) {
-            printf("Record with key %s found in block %d at index %d.\n", key, blockNumber, index);
-            return;
+            BlockFileOpEnd(&op);
+            return index;
         }
     }
+    BlockFileOpEnd(&op);
+    return -1;
+}
+
+// Turn on per-block Bloom filters: load the sidecar saved by Close, or
+// rebuild it with one pass over the file when it is missing or stale.
+void enableBloomFilters(File *file, double fpRate) {
+    if (file->bloom) return;
+    file->bloom = BloomLoad(file->file->path, bloomStamp(file));
+    if (file->bloom) return;
 
-    printf("Record with key %s not found.\n", key);
+    file->bloom = BloomCreate(file->header.Number_of_Blocks, MAX_KEYS_PER_BLOCK, fpRate);
+    IoOp op = BlockFileOpBegin(file->file, "bloom rebuild");
+    Block block;
+    ReadAhead *ra = ReadAheadOpen(file->file, 0, file->header.Number_of_Blocks, 0, 1);
+    int64_t blockNumber;
+    while (ReadAheadNext(ra, &block, &blockNumber) > 0) {
+        KeySlot keys[MAX_KEYS_PER_BLOCK];
+        int keyCount = blockKeys(&block, keys);
+        for (int i = 0; i < keyCount; i++) {
+            BloomAdd(file->bloom, (uint32_t)blockNumber, keys[i], strlen(keys[i]));
+        }
+    }
+    ReadAheadClose(ra);
+    BlockFileOpEnd(&op);
+}
+
+typedef struct {
+    int blockNumber;
+    int index;  // Within the block, -1 when the key is not in the file
+} LookupResult;
+
+// A batch key, normalised and kept sorted so a block's keys are matched
+// against the whole batch by binary search
+typedef struct {
+    NormKey key;
+    int pos;  // Index in the caller's keys
+} BatchKey;
+
+static int compareBatchKeys(const void *a, const void *b) {
+    return NormKeyCompare(((const BatchKey *)a)->key, ((const BatchKey *)b)->key);
+}
+
+typedef struct {
+    File *file;
+    const BatchKey *keys;
+    int nKeys;
+    int first, end;         // Blocks [first, end)
+    LookupResult *results;  // By position in the caller's keys
+    long found;
+} LookupTask;
+
+// One pass over the task's blocks in file order. Each record key resolves
+// every batch key equal to it that has no match yet, so results keep the
+// first block and index, as findRecord would; stops once all have one.
+static void *lookupRange(void *arg) {
+    LookupTask *t = arg;
+    IoOp op = BlockFileOpBegin(t->file->file, "lookup batch");
+    for (int i = 0; i < t->nKeys; i++) t->results[t->keys[i].pos] = (LookupResult){-1, -1};
+    ReadAhead *ra = ReadAheadOpen(t->file->file, t->first, t->end - t->first, 0, 1);
+    Block block;
+    int64_t blockNumber;
+    while (t->found < t->nKeys && ReadAheadNext(ra, &block, &blockNumber) > 0) {
+        KeySlot keys[MAX_KEYS_PER_BLOCK];
+        int keyCount = blockKeys(&block, keys);
+        for (int j = 0; j < keyCount; j++) {
+            NormKey key = NormKeyFrom(keys[j], sizeof(KeySlot));
+            int lo = 0, hi = t->nKeys;
+            while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (NormKeyCompare(t->keys[mid].key, key) < 0) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            for (; lo < t->nKeys && NormKeyCompare(t->keys[lo].key, key) == 0; lo++) {
+                LookupResult *r = &t->results[t->keys[lo].pos];
+                if (r->index == -1) {
+                    *r = (LookupResult){(int)blockNumber, j};
+                    t->found++;
+                }
+            }
+        }
+    }
+    ReadAheadClose(ra);
+    BlockFileOpEnd(&op);
+    return NULL;
 }
 
-int main() {
+// Look up n keys with one ordered pass over the blocks instead of a scan
+// per key: results[i] is what findRecord gives for keys[i]. The blocks are
+// split into nThreads ranges read in parallel, and the earliest range with
+// a match wins. The pass reads blocks whatever the Bloom filters say, so
+// for a handful of keys findRecord is cheaper. Returns how many were found.
+long LookupBatch(File *file, const char *const *keys, int n, LookupResult *results, int nThreads) {
+    Arena *scratch = &file->file->scratch;
+    ArenaMark mark = ArenaSave(scratch);
+    BatchKey *sorted = ArenaAlloc(scratch, (n > 0 ? n : 1) * sizeof(BatchKey));
+    for (int i = 0; i < n; i++) {
+        sorted[i] = (BatchKey){NormKeyFrom(keys[i], sizeof(KeySlot)), i};
+    }
+    qsort(sorted, n, sizeof(BatchKey), compareBatchKeys);
+
+    int nBlocks = file->header.Number_of_Blocks;
+    if (nThreads > nBlocks) nThreads = nBlocks;
+    if (nThreads < 1) nThreads = 1;
+    LookupTask *tasks = ArenaAlloc(scratch, nThreads * sizeof(LookupTask));
+    pthread_t *threads = ArenaAlloc(scratch, nThreads * sizeof(pthread_t));
+    for (int t = 0; t < nThreads; t++) {
+        tasks[t] = (LookupTask){file, sorted, n,
+                                (int)((long)nBlocks * t / nThreads),
+                                (int)((long)nBlocks * (t + 1) / nThreads),
+                                nThreads == 1 ? results : ArenaAlloc(scratch, (n > 0 ? n : 1) * sizeof(LookupResult)), 0};
+    }
+    if (nThreads == 1) {
+        lookupRange(&tasks[0]);
+    } else {
+        for (int t = 0; t < nThreads; t++) {
+            pthread_create(&threads[t], NULL, lookupRange, &tasks[t]);
+        }
+        for (int t = 0; t < nThreads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    long found = 0;
+    for (int i = 0; i < n; i++) {
+        if (nThreads > 1) {
+            results[i] = (LookupResult){-1, -1};
+            for (int t = 0; t < nThreads && results[i].index == -1; t++) results[i] = tasks[t].results[i];
+        }
+        found += results[i].index != -1;
+    }
+    ArenaRestore(scratch, mark);
+    return found;
+}
+
+void searchRecordByKey(File *file, const char *key) {
+    int blockNumber;
+    int index = findRecord(file, key, &blockNumber);
+    if (index != -1) {
+        printf("Record with key %s found in block %d at index %d.\n", key, blockNumber, index);
+    } else {
+        printf("Record with key %s not found.\n", key);
+    }
+}
+
+// Search for keys drawn from dist over [offset, offset + records): offset 0
+// hits, offset records misses every time
+static void benchSearch(File *file, const BenchConfig *cfg, const char *name, long offset) {
+    KeyGen keys;
+    BenchOp op;
+    char key[MAX_KEY_LENGTH + 1];
+    long found = 0;
+    InitKeyGen(&keys, cfg->dist, cfg->records, cfg->seed + 1);
+    BenchBegin(&op, name, cfg->records);
+    for (long i = 0; i < cfg->records; i++) {
+        snprintf(key, sizeof(key), "%010ld", offset + NextKey(&keys));
+        int blockNumber;
+        double t0 = BenchNow();
+        found += findRecord(file, key, &blockNumber) != -1;
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+    printf("  %ld of %ld searches hit\n", found, cfg->records);
+}
+
+// The benchSearch hit keys again, BATCH_KEYS per LookupBatch call
+static void benchBatch(File *file, const BenchConfig *cfg, const char *name, int nThreads) {
+    KeyGen gen;
+    BenchOp op;
+    long found = 0;
+    char (*text)[MAX_KEY_LENGTH + 1] = malloc(BATCH_KEYS * sizeof(*text));
+    const char **keys = malloc(BATCH_KEYS * sizeof(char *));
+    LookupResult *results = malloc(BATCH_KEYS * sizeof(LookupResult));
+    InitKeyGen(&gen, cfg->dist, cfg->records, cfg->seed + 1);
+    BenchBegin(&op, name, cfg->records / BATCH_KEYS + 1);
+    for (long done = 0; done < cfg->records;) {
+        int n = cfg->records - done < BATCH_KEYS ? (int)(cfg->records - done) : BATCH_KEYS;
+        for (int i = 0; i < n; i++) {
+            snprintf(text[i], sizeof(text[i]), "%010ld", NextKey(&gen));
+            keys[i] = text[i];
+        }
+        double t0 = BenchNow();
+        found += LookupBatch(file, keys, n, results, nThreads);
+        BenchSample(&op, BenchNow() - t0);
+        done += n;
+    }
+    BenchReport(&op, true);
+    printf("  %ld of %ld keys hit, %d keys per batch, %d threads\n", found, cfg->records, BATCH_KEYS, nThreads);
+    free(text);
+    free(keys);
+    free(results);
+}
+
+// Inserts keep scanning for the first block with room and searches scan
+// blocks in order, so both cost up to nblk reads. With the Bloom filters a
+// search only reads the blocks whose filter says maybe: about one block for
+// a hit plus BLOOM_FP_RATE of the others. A lookup batch reads each block
+// at most once for all of its keys.
+int RunBench(const BenchConfig *cfg) {
+    File *file = Open("bench_tovs.dat", "wb+");
+    if (!file) return 1;
+    printf("ex8 TOVS: %ld records, %s keys, %d-byte blocks\n", cfg->records, KeyDistName(cfg->dist), BLOCK_SIZE);
+
+    KeyGen keys;
+    BenchOp op;
+    Record rec;
+    InitKeyGen(&keys, cfg->dist, cfg->records, cfg->seed);
+    BenchBegin(&op, "insert", cfg->records);
+    for (long i = 0; i < cfg->records; i++) {
+        long key = NextKey(&keys);
+        snprintf(rec.key, sizeof(rec.key), "%010ld", key);
+        snprintf(rec.other_fields, sizeof(rec.other_fields), "Record number %ld", key);
+        rec.logical_deletion = '0';
+        double t0 = BenchNow();
+        insertRecord_TOVS(file, rec);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    BenchReport(&op, true);
+    printf("  file: %d blocks\n", file->header.Number_of_Blocks);
+
+    benchSearch(file, cfg, "search", 0);
+    benchSearch(file, cfg, "search miss", cfg->records);
+    benchBatch(file, cfg, "lookup batch", 1);
+    benchBatch(file, cfg, "lookup batch (4t)", 4);
+
+    BenchBegin(&op, "bloom rebuild", 1);
+    double t0 = BenchNow();
+    enableBloomFilters(file, BLOOM_FP_RATE);
+    BenchSample(&op, BenchNow() - t0);
+    BenchReport(&op, true);
+    benchSearch(file, cfg, "search (bloom)", 0);
+    benchSearch(file, cfg, "miss (bloom)", cfg->records);
+    printf("  filters: %u bits, %u hashes per block; %.1f%% of block checks skipped the read\n",
+           file->bloom->words * 64, file->bloom->nHashes,
+           100.0 * file->bloom->negatives / (file->bloom->checks > 0 ? file->bloom->checks : 1));
+
+    Close(file);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    if (ParseBenchArgs(argc, argv, 5000, &cfg)) return RunBench(&cfg);
+
     File *file = Open("tovs_file.dat", "rb+");
     if (!file) {
         fprintf(stderr, "Failed to open or create the TOVS file.\n");
@@ -3,26 +3,63 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include "../lib/blockfile.h"
+#include "../lib/bench.h"
+#include "../lib/aio.h"
+#include "../lib/bloom.h"
+#include "../lib/payload.h"
+#include "../lib/keycmp.h"
+#include "../lib/merge.h"
+#include "../lib/wal.h"
+#include "../lib/snapshot.h"
 
+#ifndef BLOCK_SIZE
 #define BLOCK_SIZE 256
-#define MAX_RECORDS (BLOCK_SIZE / sizeof(Record))
+#endif
+#ifndef RECORD_SIZE
+#define RECORD_SIZE 256
+#endif
+#define MAX_RECORDS (BLOCK_SIZE / sizeof(Slot))
 #define MAX_KEY_LENGTH 10
+#define AIO_CHUNK 16  // Blocks per asynchronous read/write in List and Reorganize
 #define INFINITE_KEY "ZZZZZZZZZZ" // Used for the fictitious last record
+#ifndef BLOOM_FP_RATE
+#define BLOOM_FP_RATE 0.01
+#endif
+#define BATCH_KEYS 16384  // Keys per LookupBatch call in the bench
 
 // Record structure
 typedef struct {
     char key[MAX_KEY_LENGTH];  // Key for the record
     char logical_deletion;     // '0' for active, '1' for deleted
-    char data[BLOCK_SIZE - MAX_KEY_LENGTH - 1]; // Record data
+    char data[RECORD_SIZE - MAX_KEY_LENGTH - 1]; // Record data
 } Record;
 
+// What a block holds per record. With -DSPLIT_PAYLOAD the data moves to a
+// payload file ("<path>.payload") and blocks keep the key, the flag and the
+// payload id: 16 bytes instead of RECORD_SIZE, so searches and range
+// filters read a few percent of the bytes and fetch data only when needed.
+#ifdef SPLIT_PAYLOAD
+typedef struct {
+    char key[MAX_KEY_LENGTH];
+    char logical_deletion;
+    uint32_t payload_id;
+} Slot;
+#else
+typedef Record Slot;
+#endif
+
 // Block structure
 typedef struct {
-    Record records[MAX_RECORDS];  // Records in the block
+    Slot records[MAX_RECORDS];    // Records in the block
     int record_count;             // Number of valid records in the block
     int overflow_link;            // Points to the first block in the overflow zone (or -1 if none)
 } Block;
 
+// In-block search compares 16 bytes from each slot's key on
+_Static_assert(sizeof(Block) - offsetof(Block, records[MAX_RECORDS - 1]) >= 16, "slot keys need 16 readable bytes");
+
 // File header
 typedef struct {
     int primary_blocks;           // Number of blocks in the primary zone
@@ -32,112 +69,549 @@ typedef struct {
 
 // File structure
 typedef struct {
-    FILE *file;                   // File pointer
+    BlockFile *file;              // Block file; the FileHeader is kept in its user area
     FileHeader header;            // File metadata
+    BloomSet *bloom;              // Keys of each primary block's overflow chain, or NULL
+    PayloadFile *payloads;        // Record data with -DSPLIT_PAYLOAD, else NULL
 } File;
 
+// Primary blocks come first, overflow block k is block primary_blocks + k
+void ReadBlock(File *file, int blockNumber, Block *block) {
+    BlockFileRead(file->file, blockNumber, block);
+}
+
+void WriteBlock(File *file, int blockNumber, const Block *block) {
+    BlockFileWrite(file->file, blockNumber, block);
+}
+
+void SaveHeader(BlockFile *file, const FileHeader *header) {
+    memcpy(file->header.user, header, sizeof(FileHeader));
+    file->header.nRecords = header->total_records;
+    BlockFileWriteHeader(file);
+}
+
+// Keys are MAX_KEY_LENGTH characters with no terminator, compared as two
+// big-endian words (same order as strncmp)
+static int CompareKeys(const char *a, const char *b) {
+    return NormKeyCompare(NormKeyFrom(a, MAX_KEY_LENGTH), NormKeyFrom(b, MAX_KEY_LENGTH));
+}
+
+// The bytes of a key that count, for hashing: callers' keys may end early
+// at a NUL, stored ones are zero padded
+static size_t KeyLength(const char *key) {
+    return strnlen(key, MAX_KEY_LENGTH);
+}
+
+static int CompareRecords(const void *a, const void *b) {
+    return CompareKeys(((const Slot *)a)->key, ((const Slot *)b)->key);
+}
+
+// The payload file that goes with a data file; NULL without -DSPLIT_PAYLOAD
+static PayloadFile *OpenPayloads(const char *name, bool create) {
+#ifdef SPLIT_PAYLOAD
+    char path[256];
+    snprintf(path, sizeof(path), "%s.payload", name);
+    return create ? PayloadCreate(path, sizeof(((Record *)0)->data), 4096) : PayloadOpen(path);
+#else
+    (void)name;
+    (void)create;
+    return NULL;
+#endif
+}
+
+// Fill a block slot from a record, storing its data in the payload file
+// when there is one
+static bool StoreRecord(PayloadFile *payloads, const Record *rec, Slot *slot) {
+#ifdef SPLIT_PAYLOAD
+    int64_t id = PayloadAppend(payloads, rec->data);
+    memcpy(slot->key, rec->key, MAX_KEY_LENGTH);
+    slot->logical_deletion = rec->logical_deletion;
+    slot->payload_id = (uint32_t)id;
+    return id >= 0;
+#else
+    (void)payloads;
+    *slot = *rec;
+    return true;
+#endif
+}
+
+// A slot's data (sizeof(Record.data) bytes)
+static bool LoadData(PayloadFile *payloads, const Slot *slot, char *data) {
+#ifdef SPLIT_PAYLOAD
+    return PayloadRead(payloads, slot->payload_id, data);
+#else
+    (void)payloads;
+    memcpy(data, slot->data, sizeof(slot->data));
+    return true;
+#endif
+}
+
+// Identifies the file contents a saved set of chain filters describes
+// The top bit tells these filters (keys hashed up to their NUL) from
+// sidecars that hashed all MAX_KEY_LENGTH bytes, which get rebuilt
+static uint64_t ChainStamp(const FileHeader *header) {
+    return (uint64_t)header->primary_blocks << 40 ^ (uint64_t)header->overflow_blocks << 20 ^
+           (uint32_t)header->total_records ^ 1ull << 63;
+}
+
+// Copy a primary block's records and its overflow chain's into *records
+// (grown as needed), in key order; returns how many there are
+static int GatherChain(File *file, const Block *primary, Slot **records, int *capacity) {
+    Block overflow;
+    const Block *from = primary;
+    int count = 0;
+    for (;;) {
+        if (count + from->record_count > *capacity) {
+            *capacity = 2 * (count + from->record_count);
+            *records = realloc(*records, *capacity * sizeof(Slot));
+        }
+        memcpy(*records + count, from->records, from->record_count * sizeof(Slot));
+        count += from->record_count;
+        int chain = from->overflow_link;
+        if (chain == -1) break;
+        ReadBlock(file, file->header.primary_blocks + chain, &overflow);
+        from = &overflow;
+    }
+    if (primary->overflow_link != -1) qsort(*records, count, sizeof(Slot), CompareRecords);
+    return count;
+}
+
 
 //** Locate a Record**
 
-int Locate(File *file, const char *key, int *block_idx, int *record_idx) {
+// Binary search in the primary zone, then the overflow chain of the block
+// the key falls in (the last one starting at or before it). Found records
+// report their file block: primary_blocks + k for overflow block k.
+// *chain_owner gets that primary block (-1 for an empty file).
+static int Search(File *file, const char *key, int *block_idx, int *record_idx, int *chain_owner) {
     Block block;
     int left = 0, right = file->header.primary_blocks - 1;
+    int owner = -1, chain = -1;
+    KeyProbe probe = KeyProbeFrom(key, MAX_KEY_LENGTH);
 
     // Perform binary search in the primary zone
     while (left <= right) {
         int mid = (left + right) / 2;
 
         // Read the middle block
-        fseek(file->file, sizeof(FileHeader) + mid * sizeof(Block), SEEK_SET);
-        fread(&block, sizeof(Block), 1,  file->file);
+        ReadBlock(file, mid, &block);
 
         // Check key range
-        if (strcmp(key, block.records[0].key) >= 0 && strcmp(key, block.records[block.record_count - 1].key) <= 0) {
+        if (CompareKeys(key, block.records[0].key) >= 0 && CompareKeys(key, block.records[block.record_count - 1].key) <= 0) {
             // Locate the record within the block
-            for (int i = 0; i < block.record_count; i++) {
-                if (strcmp(block.records[i].key, key) == 0) {
-                    *block_idx = mid;
-                    *record_idx = i;
-                    return 1; // Record found
-                }
+            int i = KeyProbeFind(&probe, block.records, block.record_count, sizeof(Slot));
+            if (i >= 0) {
+                *block_idx = mid;
+                *record_idx = i;
+                *chain_owner = mid;
+                return 1; // Record found
             }
+            owner = mid;
+            chain = block.overflow_link;
             break;
-        } else if (strcmp(key, block.records[0].key) < 0) {
+        } else if (CompareKeys(key, block.records[0].key) < 0) {
             right = mid - 1;
         } else {
+            owner = mid;  // Past this block's last key: its chain may hold it
+            chain = block.overflow_link;
             left = mid + 1;
         }
     }
 
+    // Keys below the first block's overflow into its chain
+    if (owner == -1 && file->header.primary_blocks > 0) {
+        owner = 0;
+        chain = -2;  // Not read yet
+    }
+    *chain_owner = owner;
+
+    // The chain filter rules most misses out without reading the chain
+    if (owner >= 0 && (!file->bloom || BloomMayContain(file->bloom, owner, key, KeyLength(key)))) {
+        if (chain == -2) {
+            ReadBlock(file, owner, &block);
+            chain = block.overflow_link;
+        }
+        while (chain != -1) {
+            ReadBlock(file, file->header.primary_blocks + chain, &block);
+            int i = KeyProbeFind(&probe, block.records, block.record_count, sizeof(Slot));
+            if (i >= 0) {
+                *block_idx = file->header.primary_blocks + chain;
+                *record_idx = i;
+                return 1;
+            }
+            chain = block.overflow_link;
+        }
+    }
+
     // Record not found
     *block_idx = left;  // Where the record should be
     *record_idx = -1;
     return 0;
 }
 
-// **Algorithm (b): Interval Query**
+int Locate(File *file, const char *key, int *block_idx, int *record_idx) {
+    int owner;
+    IoOp op = BlockFileOpBegin(file->file, "locate");
+    int found = Search(file, key, block_idx, record_idx, &owner);
+    BlockFileOpEnd(&op);
+    return found;
+}
 
-void List(File *file, const char *key_a, const char *key_b) {
+typedef struct {
+    int block_idx;   // As Locate reports it; -1 when the key is missing
+    int record_idx;
+} LookupResult;
+
+// A batch key, sorted so that the keys a primary block and its chain own
+// are consecutive
+typedef struct {
+    const char *key;
+    int pos;          // Index in the caller's keys
+    bool in_chain;    // Its owner's chain has to be read for it
+} BatchKey;
+
+static int CompareBatchKeys(const void *a, const void *b) {
+    return CompareKeys(((const BatchKey *)a)->key, ((const BatchKey *)b)->key);
+}
+
+typedef struct {
+    File *file;
+    BatchKey *keys;           // This task's slice
+    int n_keys;
+    int first, end;           // Primary blocks [first, end)
+    LookupResult *results;    // By position in the caller's keys
+} LookupTask;
+
+// Follow owner's chain once for all of keys[start, end) still unresolved
+// (and not ruled out by the chain filter)
+static void LookupChain(LookupTask *t, int owner, int chain, int start, int end) {
+    File *file = t->file;
+    int wanted = 0;
+    for (int i = start; i < end; i++) {
+        BatchKey *k = &t->keys[i];
+        k->in_chain = t->results[k->pos].record_idx < 0 &&
+                      (!file->bloom || BloomMayContain(file->bloom, owner, k->key, KeyLength(k->key)));
+        wanted += k->in_chain;
+    }
     Block block;
+    while (wanted > 0 && chain != -1) {
+        ReadBlock(file, file->header.primary_blocks + chain, &block);
+        for (int i = start; i < end; i++) {
+            BatchKey *k = &t->keys[i];
+            if (!k->in_chain) continue;
+            KeyProbe probe = KeyProbeFrom(k->key, MAX_KEY_LENGTH);
+            int j = KeyProbeFind(&probe, block.records, block.record_count, sizeof(Slot));
+            if (j >= 0) {
+                t->results[k->pos] = (LookupResult){file->header.primary_blocks + chain, j};
+                k->in_chain = false;
+                wanted--;
+            }
+        }
+        chain = block.overflow_link;
+    }
+}
+
+// One pass over the task's primary blocks, read ahead in file order. A
+// block owns the keys from its first key up to the next block's first key
+// (block 0 also those below it): keys within its range are probed in the
+// block, and the ones not there, with the keys past its last one, share
+// one walk of its chain once the next block shows where they end.
+static void *LookupRange(void *arg) {
+    LookupTask *t = arg;
+    File *file = t->file;
+    IoOp op = BlockFileOpBegin(file->file, "lookup batch");
+    Block chunk[AIO_CHUNK];
+    ReadAhead *ra = ReadAheadOpen(file->file, t->first, t->end - t->first, 0, AIO_CHUNK);
+    int64_t first;
+    int n, k = 0;
+    int owner = -1, chain = -1, owned = 0;  // Pending chain walk: keys [owned, k)
+    while (k < t->n_keys && (n = ReadAheadNext(ra, chunk, &first)) > 0) for (int b = 0; b < n; b++) {
+        const Block *block = &chunk[b];
+        if (block->record_count == 0) continue;
+        while (k < t->n_keys && CompareKeys(t->keys[k].key, block->records[0].key) < 0) k++;
+        if (owner >= 0) {
+            LookupChain(t, owner, chain, owned, k);
+            owned = k;
+        }
+        for (; k < t->n_keys && CompareKeys(t->keys[k].key, block->records[block->record_count - 1].key) <= 0; k++) {
+            KeyProbe probe = KeyProbeFrom(t->keys[k].key, MAX_KEY_LENGTH);
+            int j = KeyProbeFind(&probe, block->records, block->record_count, sizeof(Slot));
+            if (j >= 0) t->results[t->keys[k].pos] = (LookupResult){(int)first + b, j};
+        }
+        owner = (int)first + b;
+        chain = block->overflow_link;
+    }
+    if (owner >= 0) LookupChain(t, owner, chain, owned, t->n_keys);
+    ReadAheadClose(ra);
+    BlockFileOpEnd(&op);
+    return NULL;
+}
+
+// Look up n keys at once: results[i] says where keys[i] is, as Locate
+// would. The keys are sorted and every primary block they need is read
+// once, in file order, with each chain walked once for all the keys it
+// may hold. The primary zone is split into nThreads ranges searched in
+// parallel, each with the keys from its first block's first key on. A batch
+// too small to cover the primary zone (n log2 blocks < blocks) is located
+// key by key in sorted order instead. Returns how many keys were found.
+long LookupBatch(File *file, const char *const *keys, int n, LookupResult *results, int nThreads) {
+    if (nThreads < 1) nThreads = 1;
+    BatchKey *sorted = malloc((n > 0 ? n : 1) * sizeof(BatchKey));
+    for (int i = 0; i < n; i++) {
+        sorted[i] = (BatchKey){keys[i], i, false};
+        results[i] = (LookupResult){-1, -1};
+    }
+    qsort(sorted, n, sizeof(BatchKey), CompareBatchKeys);
+
+    int blocks = file->header.primary_blocks, levels = 0;
+    while ((1 << levels) <= blocks) levels++;
+    if ((long)n * levels < blocks) {
+        IoOp op = BlockFileOpBegin(file->file, "lookup batch");
+        for (int i = 0; i < n; i++) {
+            int block_idx, record_idx, owner;
+            LookupResult *r = &results[sorted[i].pos];
+            if (Search(file, sorted[i].key, &block_idx, &record_idx, &owner)) *r = (LookupResult){block_idx, record_idx};
+        }
+        BlockFileOpEnd(&op);
+        nThreads = 0;
+    }
+    if (nThreads > blocks) nThreads = blocks;
+
+    LookupTask *tasks = malloc((nThreads > 0 ? nThreads : 1) * sizeof(LookupTask));
+    pthread_t *threads = malloc((nThreads > 0 ? nThreads : 1) * sizeof(pthread_t));
+    int key_start = 0;
+    for (int t = 0; t < nThreads; t++) {
+        int first = (int)((long)blocks * t / nThreads), end = (int)((long)blocks * (t + 1) / nThreads);
+        // Keys from the next range's first key on are left to it
+        int key_end = n;
+        if (t + 1 < nThreads) {
+            Block block;
+            ReadBlock(file, end, &block);
+            key_end = key_start;
+            while (key_end < n && CompareKeys(sorted[key_end].key, block.records[0].key) < 0) key_end++;
+        }
+        tasks[t] = (LookupTask){file, sorted + key_start, key_end - key_start, first, end, results};
+        key_start = key_end;
+    }
+    if (nThreads == 1) {
+        LookupRange(&tasks[0]);
+    } else {
+        for (int t = 0; t < nThreads; t++) {
+            pthread_create(&threads[t], NULL, LookupRange, &tasks[t]);
+        }
+        for (int t = 0; t < nThreads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+
+    long found = 0;
+    for (int i = 0; i < n; i++) found += results[i].record_idx >= 0;
+    free(threads);
+    free(tasks);
+    free(sorted);
+    return found;
+}
+
+// **Insertion**
+
+// A record goes into the primary block its key falls in while that block
+// has room (kept sorted), else into the block's overflow chain: the first
+// chain block with room, or a new one linked at its head. Returns 0 if the
+// key is already present. A new chain block and the link to it land
+// together, along with the counts in the header's user area, for the log
+// and for snapshot readers.
+int InsertRecord(File *file, const Record *rec) {
+    int block_idx, record_idx, owner;
+    IoOp op = BlockFileOpBegin(file->file, "insert");
+    Slot slot;
+    if (Search(file, rec->key, &block_idx, &record_idx, &owner) || !StoreRecord(file->payloads, rec, &slot)) {
+        BlockFileOpEnd(&op);
+        return 0;
+    }
+
+    WalBegin(file->file);
+    Block block = {0};
+    if (owner == -1) {
+        // Empty file: start the primary zone
+        owner = file->header.primary_blocks++;
+        block.overflow_link = -1;
+    } else {
+        ReadBlock(file, owner, &block);
+    }
 
-    // Iterate through the primary zone
-    for (int i = 0; i < file->header.primary_blocks; i++) {
-        fseek(file->file, sizeof(FileHeader) + i * sizeof(Block), SEEK_SET);
-        fread(&block, sizeof(Block), 1,  file->file);
+    if (block.record_count < (int)MAX_RECORDS) {
+        int pos = block.record_count;
+        while (pos > 0 && CompareKeys(block.records[pos - 1].key, rec->key) > 0) {
+            block.records[pos] = block.records[pos - 1];
+            pos--;
+        }
+        block.records[pos] = slot;
+        block.record_count++;
+        WriteBlock(file, owner, &block);
+    } else {
+        Block overflow;
+        int chain = block.overflow_link;
+        while (chain != -1) {
+            ReadBlock(file, file->header.primary_blocks + chain, &overflow);
+            if (overflow.record_count < (int)MAX_RECORDS) break;
+            chain = overflow.overflow_link;
+        }
+        if (chain == -1) {
+            // Every chain block is full: link a new one in front
+            chain = file->header.overflow_blocks++;
+            overflow = (Block){0};
+            overflow.overflow_link = block.overflow_link;
+            block.overflow_link = chain;
+            WriteBlock(file, owner, &block);
+        }
+        overflow.records[overflow.record_count++] = slot;
+        WriteBlock(file, file->header.primary_blocks + chain, &overflow);
+        if (file->bloom) BloomAdd(file->bloom, owner, rec->key, KeyLength(rec->key));
+    }
+    file->header.total_records++;
+    memcpy(file->file->header.user, &file->header, sizeof(FileHeader));
+    file->file->header.nRecords = file->header.total_records;
+    WalCommit(file->file);
+    BlockFileOpEnd(&op);
+    return 1;
+}
+
+// **Algorithm (b): Interval Query**
+
+// Print a record of the interval; data comes from the payload file when
+// the blocks only hold keys
+static void PrintRecord(File *file, const char *zone, int block_idx, int pos, const Slot *slot) {
+    char data[sizeof(((Record *)0)->data)] = "";
+    LoadData(file->payloads, slot, data);
+    printf("Record in %s %d, Position %d: Key = %.*s, Data = %.*s\n", zone, block_idx, pos, MAX_KEY_LENGTH, slot->key,
+           (int)sizeof(data), data);
+}
+
+// Every record with key_a <= key <= key_b, printed when print is set;
+// returns how many there are. Only the keys are needed to filter. On a file
+// with snapshots the scan reads one, so inserts meanwhile are not seen.
+static long ScanRange(File *file, const char *key_a, const char *key_b, bool print) {
+    Block block, overflow;
+    long matches = 0;
+    Snapshot *snap = SnapshotOpen(file->file);
+    FileHeader header;
+    if (snap) memcpy(&header, SnapshotHeader(file->file, snap)->user, sizeof(FileHeader));
+    else header = file->header;
+    BlockFileBypassCache(file->file, true);
+
+    // Iterate through the primary zone, read ahead; overflow chains are
+    // followed block by block
+    Block chunk[AIO_CHUNK];
+    ReadAhead *ra = ReadAheadOpen(file->file, 0, header.primary_blocks, 0, AIO_CHUNK);
+    int64_t first;
+    int n;
+    while ((n = ReadAheadNext(ra, chunk, &first)) > 0) for (int k = 0; k < n; k++) {
+        int i = (int)first + k;
+        block = chunk[k];
+        // The read-ahead sees blocks as they stand: put back the snapshot's
+        SnapshotOverlay(file->file, snap, i, 1, &block);
 
         // Display records within the range
         for (int j = 0; j < block.record_count; j++) {
-            if (strcmp(block.records[j].key, key_a) >= 0 && strcmp(block.records[j].key, key_b) <= 0) {
-                printf("Record in Block %d, Position %d: Key = %s, Data = %s\n",
-                       i, j, block.records[j].key, block.records[j].data);
+            if (CompareKeys(block.records[j].key, key_a) >= 0 && CompareKeys(block.records[j].key, key_b) <= 0) {
+                if (print) PrintRecord(file, "Block", i, j, &block.records[j]);
+                matches++;
             }
         }
 
         // Check the overflow zone for this block
         int overflow_block_idx = block.overflow_link;
         while (overflow_block_idx != -1) {
-            fseek(file->file, sizeof(FileHeader) + (file->header.primary_blocks + overflow_block_idx) * sizeof(Block), SEEK_SET);
-            fread(&block, sizeof(Block), 1,  file->file);
+            SnapshotRead(file->file, snap, header.primary_blocks + overflow_block_idx, &overflow);
 
-            for (int j = 0; j < block.record_count; j++) {
-                if (strcmp(block.records[j].key, key_a) >= 0 && strcmp(block.records[j].key, key_b) <= 0) {
-                    printf("Record in Overflow Block %d, Position %d: Key = %s, Data = %s\n",
-                           overflow_block_idx, j, block.records[j].key, block.records[j].data);
+            for (int j = 0; j < overflow.record_count; j++) {
+                if (CompareKeys(overflow.records[j].key, key_a) >= 0 && CompareKeys(overflow.records[j].key, key_b) <= 0) {
+                    if (print) PrintRecord(file, "Overflow Block", overflow_block_idx, j, &overflow.records[j]);
+                    matches++;
                 }
             }
-            overflow_block_idx = block.overflow_link;
+            overflow_block_idx = overflow.overflow_link;
         }
     }
+    ReadAheadClose(ra);
+    BlockFileBypassCache(file->file, false);
+    SnapshotClose(snap);
+    return matches;
+}
+
+void List(File *file, const char *key_a, const char *key_b) {
+    IoOp op = BlockFileOpBegin(file->file, "list");
+    ScanRange(file, key_a, key_b, true);
+    BlockFileOpEnd(&op);
 }
 
 // **Algorithm (c): Reorganize the File**
 
+// Reorganize output, staged AIO_CHUNK blocks at a time for the write-behind
+typedef struct {
+    WriteBehind *wb;
+    Block blocks[AIO_CHUNK];
+    int first;  // Block number of blocks[0]
+    int n;
+} OutputChunk;
+
+static void FlushOutput(OutputChunk *out) {
+    if (out->n > 0) WriteBehindPut(out->wb, out->first, out->n, out->blocks);
+    out->first += out->n;
+    out->n = 0;
+}
+
+static void PutOutput(OutputChunk *out, const Block *block) {
+    out->blocks[out->n++] = *block;
+    if (out->n == AIO_CHUNK) FlushOutput(out);
+}
+
 void Reorganize(File *file, const char *new_name, float rate) {
-    FILE *new_file = fopen(new_name, "wb+");
+    BlockFile *new_file = BlockFileCreate(new_name, sizeof(Block), FIXED_LAYOUT(Block, record_count, records));
     if (!new_file) {
         fprintf(stderr, "Failed to create new file.\n");
         return;
     }
+    // Live payloads are copied in key order; deleted ones stay behind
+    PayloadFile *new_payloads = OpenPayloads(new_name, true);
 
     FileHeader new_header = {0, 0, 0};
-    fwrite(&new_header, sizeof(FileHeader), 1, new_file);
+    IoOp op = BlockFileOpBegin(file->file, "reorganize");
+    // A full copy: keep it out of the page cache on both sides
+    BlockFileBypassCache(file->file, true);
+    BlockFileBypassCache(new_file, true);
 
-    Block block, new_block = {0};
+    Block new_block = {0};
+    Slot *records = NULL;  // One primary block and its chain, merged
+    int capacity = 0;
     int fill_limit = (int)(rate * MAX_RECORDS);
+    if (fill_limit < 1) fill_limit = 1;
 
-    for (int i = 0; i < file->header.primary_blocks + file->header.overflow_blocks; i++) {
-        fseek(file->file, sizeof(FileHeader) + i * sizeof(Block), SEEK_SET);
-        fread(&block, sizeof(Block), 1,  file->file);
+    // Both files are streamed: primary reads run ahead of the copy, writes
+    // behind it. Overflow chains are read as each primary block comes up.
+    Block chunk[AIO_CHUNK];
+    OutputChunk out = {.wb = WriteBehindOpen(new_file, 0, AIO_CHUNK)};
+    ReadAhead *ra = ReadAheadOpen(file->file, 0, file->header.primary_blocks, 0, AIO_CHUNK);
+    int n;
+    while ((n = ReadAheadNext(ra, chunk, NULL)) > 0) for (int k = 0; k < n; k++) {
+        int count = GatherChain(file, &chunk[k], &records, &capacity);
 
         // Copy logically non-deleted records to the new file
-        for (int j = 0; j < block.record_count; j++) {
-            if (block.records[j].logical_deletion == '0') {
-                new_block.records[new_block.record_count++] = block.records[j];
+        for (int j = 0; j < count; j++) {
+            if (records[j].logical_deletion == '0') {
+                Slot *slot = &new_block.records[new_block.record_count++];
+                *slot = records[j];
+#ifdef SPLIT_PAYLOAD
+                char data[sizeof(((Record *)0)->data)] = "";
+                PayloadRead(file->payloads, slot->payload_id, data);
+                slot->payload_id = (uint32_t)PayloadAppend(new_payloads, data);
+#endif
                 new_header.total_records++;
 
                 // Write the block when full
                 if (new_block.record_count == fill_limit) {
-                    fwrite(&new_block, sizeof(Block), 1, new_file);
+                    new_block.overflow_link = -1;
+                    PutOutput(&out, &new_block);
                     new_block = (Block){0};
                     new_header.primary_blocks++;
                 }
@@ -147,14 +621,477 @@ void Reorganize(File *file, const char *new_name, float rate) {
 
     // Write the last partially filled block
     if (new_block.record_count > 0) {
-        fwrite(&new_block, sizeof(Block), 1, new_file);
+        new_block.overflow_link = -1;
+        PutOutput(&out, &new_block);
         new_header.primary_blocks++;
     }
+    ReadAheadClose(ra);
+    free(records);
+    FlushOutput(&out);
+    if (!WriteBehindClose(out.wb)) fprintf(stderr, "Failed to write %s.\n", new_name);
 
     // Update the header of the new file
-    fseek(new_file, 0, SEEK_SET);
-    fwrite(&new_header, sizeof(FileHeader), 1, new_file);
+    SaveHeader(new_file, &new_header);
+
+    // The new file has no overflow chains yet: its filters start empty
+    if (file->bloom) {
+        BloomSet *filters = BloomCreate(new_header.primary_blocks, MAX_RECORDS, file->bloom->fpRate);
+        filters->stamp = ChainStamp(&new_header);
+        if (!BloomSave(filters, new_name)) fprintf(stderr, "Failed to write the filters of %s.\n", new_name);
+        BloomFree(filters);
+    }
+    BlockFileBypassCache(file->file, false);
+    BlockFileOpEnd(&op);
 
-    fclose(new_file);
+    BlockFileClose(new_file);
+    PayloadClose(new_payloads);
     printf("Reorganization complete. New file: %s\n", new_name);
 }
+
+// Open a file written by Reorganize or BuildFile
+bool OpenIndexed(File *file, const char *name) {
+    file->file = BlockFileOpen(name);
+    if (!file->file) return false;
+    memcpy(&file->header, file->file->header.user, sizeof(FileHeader));
+    file->bloom = NULL;
+    file->payloads = OpenPayloads(name, false);
+#ifdef SPLIT_PAYLOAD
+    if (!file->payloads) {
+        BlockFileClose(file->file);
+        return false;
+    }
+#endif
+    return true;
+}
+
+// Check a Bloom filter per overflow chain before walking it. The filters
+// come from the sidecar when it matches the file, else from one pass over
+// the chains, sized for the longest so they keep fp_rate until chains grow
+// past it (Reorganize starts them afresh).
+void EnableChainFilters(File *file, double fp_rate) {
+    if (file->bloom) return;
+    file->bloom = BloomLoad(file->file->path, ChainStamp(&file->header));
+    if (file->bloom) return;
+
+    IoOp op = BlockFileOpBegin(file->file, "bloom rebuild");
+    typedef struct {
+        int owner;
+        char key[MAX_KEY_LENGTH];
+    } ChainKey;
+    ChainKey *keys = NULL;
+    long n_keys = 0, keys_capacity = 0;
+    int longest = MAX_RECORDS;
+
+    Block chunk[AIO_CHUNK];
+    ReadAhead *ra = ReadAheadOpen(file->file, 0, file->header.primary_blocks, 0, AIO_CHUNK);
+    int64_t first;
+    int n;
+    while ((n = ReadAheadNext(ra, chunk, &first)) > 0) for (int k = 0; k < n; k++) {
+        Block overflow;
+        int count = 0;
+        for (int chain = chunk[k].overflow_link; chain != -1; chain = overflow.overflow_link) {
+            ReadBlock(file, file->header.primary_blocks + chain, &overflow);
+            for (int j = 0; j < overflow.record_count; j++) {
+                if (n_keys == keys_capacity) {
+                    keys_capacity = keys_capacity ? 2 * keys_capacity : 1024;
+                    keys = realloc(keys, keys_capacity * sizeof(ChainKey));
+                }
+                keys[n_keys].owner = (int)first + k;
+                memcpy(keys[n_keys++].key, overflow.records[j].key, MAX_KEY_LENGTH);
+            }
+            count += overflow.record_count;
+        }
+        if (count > longest) longest = count;
+    }
+    ReadAheadClose(ra);
+
+    file->bloom = BloomCreate(file->header.primary_blocks, longest, fp_rate);
+    for (long i = 0; i < n_keys; i++) BloomAdd(file->bloom, keys[i].owner, keys[i].key, KeyLength(keys[i].key));
+    free(keys);
+    BlockFileOpEnd(&op);
+}
+
+void CloseIndexed(File *file) {
+    if (file->bloom) {
+        file->bloom->stamp = ChainStamp(&file->header);
+        if (!BloomSave(file->bloom, file->file->path)) fprintf(stderr, "Failed to write the chain filters.\n");
+        BloomFree(file->bloom);
+    }
+    SaveHeader(file->file, &file->header);
+    BlockFileClose(file->file);
+    PayloadClose(file->payloads);
+}
+
+// **Set operations and join**
+
+// The inputs, and the payload file of the output
+typedef struct {
+    File *in[2];
+    PayloadFile *out;
+} MergeContext;
+
+static bool LiveSlot(const void *slot) {
+    return ((const Slot *)slot)->logical_deletion == '0';
+}
+
+static void CopySlot(void *dst, const void *src, int side, void *ctx) {
+    MergeContext *m = ctx;
+    Record rec;
+    memcpy(rec.key, ((const Slot *)src)->key, MAX_KEY_LENGTH);
+    rec.logical_deletion = '0';
+    LoadData(m->in[side]->payloads, src, rec.data);
+    StoreRecord(m->out, &rec, dst);
+}
+
+// A joined record keeps the key and the start of both records' data
+static void JoinSlots(void *dst, const void *a, const void *b, void *ctx) {
+    MergeContext *m = ctx;
+    Record rec;
+    char data_a[sizeof(rec.data)], data_b[sizeof(rec.data)];
+    memcpy(rec.key, ((const Slot *)a)->key, MAX_KEY_LENGTH);
+    rec.logical_deletion = '0';
+    LoadData(m->in[0]->payloads, a, data_a);
+    LoadData(m->in[1]->payloads, b, data_b);
+    int half = (int)sizeof(rec.data) / 2 - 1;
+    snprintf(rec.data, sizeof(rec.data), "%.*s|%.*s", half, data_a, half, data_b);
+    StoreRecord(m->out, &rec, dst);
+}
+
+// Only the primary zones are merged, so both files must be free of overflow
+// chains (as Reorganize and BuildFile leave them). The result is a new file
+// with no chains either, blocks filled at rate like Reorganize.
+static long MergeInto(File *a, File *b, const char *out_name, float rate, MergeOp set_op, bool join) {
+    if (a->header.overflow_blocks > 0 || b->header.overflow_blocks > 0) {
+        fprintf(stderr, "Merging needs files without overflow chains: reorganize them first.\n");
+        return -1;
+    }
+    BlockFile *out = BlockFileCreate(out_name, sizeof(Block), FIXED_LAYOUT(Block, record_count, records));
+    if (!out) {
+        fprintf(stderr, "Failed to create %s.\n", out_name);
+        return -1;
+    }
+    MergeContext m = {{a, b}, OpenPayloads(out_name, true)};
+    Block empty = {.overflow_link = -1};
+    int fill_limit = (int)(rate * MAX_RECORDS);
+    MergeOutput o = {out, fill_limit > 0 ? fill_limit : 1, &empty, CopySlot, JoinSlots, &m};
+    MergeInput in_a = {a->file, a->header.primary_blocks, LiveSlot};
+    MergeInput in_b = {b->file, b->header.primary_blocks, LiveSlot};
+
+    IoOp op = BlockFileOpBegin(a->file, join ? "join" : "merge");
+    int64_t n = join ? MergeJoin(&in_a, &in_b, CompareRecords, &o) : MergeSets(set_op, &in_a, &in_b, CompareRecords, &o);
+    BlockFileOpEnd(&op);
+    if (n < 0) fprintf(stderr, "Failed to write %s.\n", out_name);
+
+    FileHeader header = {(int)o.blocks, 0, n > 0 ? (int)n : 0};
+    SaveHeader(out, &header);
+    BlockFileClose(out);
+    PayloadClose(m.out);
+    return n;
+}
+
+// Union, intersection or difference of two files by key, into a new file;
+// returns the records written (-1 on failure)
+long MergeIndexed(MergeOp op, File *a, File *b, const char *out_name, float rate) {
+    return MergeInto(a, b, out_name, rate, op, false);
+}
+
+// One record per pair of records with equal keys
+long JoinIndexed(File *a, File *b, const char *out_name, float rate) {
+    return MergeInto(a, b, out_name, rate, MERGE_INTERSECT, true);
+}
+
+// Load sorted keys into the primary zone, fill_limit records per block
+void BuildFile(const char *name, const long *keys, long n, int fill_limit) {
+    BlockFile *file = BlockFileCreate(name, sizeof(Block), FIXED_LAYOUT(Block, record_count, records));
+    PayloadFile *payloads = OpenPayloads(name, true);
+    FileHeader header = {0, 0, 0};
+    Block block = {0};
+    Record rec = {0};
+    for (long i = 0; i < n; i++) {
+        char key[MAX_KEY_LENGTH + 1];
+        snprintf(key, sizeof(key), "%010ld", keys[i]);
+        memcpy(rec.key, key, MAX_KEY_LENGTH);
+        rec.logical_deletion = '0';
+        snprintf(rec.data, sizeof(rec.data), "Record %ld", keys[i]);
+        StoreRecord(payloads, &rec, &block.records[block.record_count++]);
+        header.total_records++;
+        if (block.record_count == fill_limit || i == n - 1) {
+            block.overflow_link = -1;
+            BlockFileWrite(file, header.primary_blocks++, &block);
+            block = (Block){0};
+        }
+    }
+    SaveHeader(file, &header);
+    BlockFileClose(file);
+    PayloadClose(payloads);
+}
+
+static int CompareLongs(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// Lookups of stored keys picked by rank (keys != NULL), or of keys in
+// [0, range) that are not in the sorted `present` array
+static void BenchLocate(File *file, const long *keys, long range, const long *present, long n_present,
+                        const BenchConfig *cfg, const char *name) {
+    BenchOp op;
+    KeyGen gen;
+    long hits = 0;
+    IoStats io = BlockFileTotals();
+    InitKeyGen(&gen, cfg->dist, range, cfg->seed + 1);
+    BenchBegin(&op, name, cfg->records);
+    for (long i = 0; i < cfg->records; i++) {
+        long value = NextKey(&gen);
+        if (keys) {
+            value = keys[value];
+        } else {
+            while (bsearch(&value, present, n_present, sizeof(long), CompareLongs)) value = (value + 1) % range;
+        }
+        char key[MAX_KEY_LENGTH + 1];
+        snprintf(key, sizeof(key), "%010ld", value);
+        int block_idx, record_idx;
+        double t0 = BenchNow();
+        hits += Locate(file, key, &block_idx, &record_idx);
+        BenchSample(&op, BenchNow() - t0);
+    }
+    io = IoStatsDiff(BlockFileTotals(), io);
+    BenchReport(&op, true);
+    printf("  %ld of %ld lookups hit, %.0f bytes read each\n", hits, cfg->records,
+           (double)io.bytesRead / cfg->records);
+}
+
+// The "locate" keys again, BATCH_KEYS per LookupBatch call. The first
+// batch is checked against Locate.
+static void BenchBatch(File *file, const long *keys, long range, const BenchConfig *cfg, const char *name,
+                       int n_threads) {
+    BenchOp op;
+    KeyGen gen;
+    long hits = 0;
+    bool same = true;
+    char (*text)[MAX_KEY_LENGTH + 1] = malloc(BATCH_KEYS * sizeof(*text));
+    const char **batch = malloc(BATCH_KEYS * sizeof(char *));
+    LookupResult *results = malloc(BATCH_KEYS * sizeof(LookupResult));
+    IoStats io = BlockFileTotals();
+    InitKeyGen(&gen, cfg->dist, range, cfg->seed + 1);
+    BenchBegin(&op, name, cfg->records / BATCH_KEYS + 1);
+    for (long done = 0; done < cfg->records;) {
+        int n = cfg->records - done < BATCH_KEYS ? (int)(cfg->records - done) : BATCH_KEYS;
+        for (int i = 0; i < n; i++) {
+            snprintf(text[i], sizeof(text[i]), "%010ld", keys[NextKey(&gen)]);
+            batch[i] = text[i];
+        }
+        double t0 = BenchNow();
+        hits += LookupBatch(file, batch, n, results, n_threads);
+        BenchSample(&op, BenchNow() - t0);
+        // Check the first batch against Locate, leaving its reads out
+        if (done == 0) {
+            IoStats check = BlockFileTotals();
+            for (int i = 0; i < n; i++) {
+                int block_idx, record_idx;
+                int found = Locate(file, batch[i], &block_idx, &record_idx);
+                same &= found ? results[i].block_idx == block_idx && results[i].record_idx == record_idx
+                              : results[i].record_idx < 0;
+            }
+            BenchExcludeIo(&op, check);
+            IoStatsAdd(&io, IoStatsDiff(BlockFileTotals(), check));
+        }
+        done += n;
+    }
+    io = IoStatsDiff(BlockFileTotals(), io);
+    BenchReport(&op, true);
+    printf("  %ld of %ld lookups hit, %.0f bytes read each, %d threads%s\n", hits, cfg->records,
+           (double)io.bytesRead / cfg->records, n_threads, same ? "" : "; DIFFERS FROM LOCATE");
+    free(text);
+    free(batch);
+    free(results);
+}
+
+// Interval filters over 1% of the key space; each one scans every key
+static void BenchRange(File *file, long range, const BenchConfig *cfg) {
+    BenchOp op;
+    uint64_t rng = cfg->seed;
+    long scans = 20, matches = 0;
+    IoStats io = BlockFileTotals();
+    BenchBegin(&op, "range", scans);
+    for (long i = 0; i < scans; i++) {
+        long lo = (long)(BenchRandom(&rng) % range);
+        char key_a[MAX_KEY_LENGTH + 1], key_b[MAX_KEY_LENGTH + 1];
+        snprintf(key_a, sizeof(key_a), "%010ld", lo);
+        snprintf(key_b, sizeof(key_b), "%010ld", lo + range / 100);
+        IoOp scan = BlockFileOpBegin(file->file, "range");
+        double t0 = BenchNow();
+        matches += ScanRange(file, key_a, key_b, false);
+        BenchSample(&op, BenchNow() - t0);
+        BlockFileOpEnd(&scan);
+    }
+    io = IoStatsDiff(BlockFileTotals(), io);
+    BenchReport(&op, true);
+    printf("  %.1f matches per range, %.0f KiB read each\n", (double)matches / scans, io.bytesRead / 1024.0 / scans);
+}
+
+// Set operations between the file a_name (without overflow chains) and one
+// of n other keys over [0, range): the intersection by one Locate in b per
+// record of a, as nested-loop lookups do it, then merged
+static void BenchMerge(const char *a_name, long n, long range, const BenchConfig *cfg) {
+    long *keys = malloc(n * sizeof(long));
+    KeyGen gen;
+    InitKeyGen(&gen, KEYS_UNIFORM, range, cfg->seed + 2);
+    for (long i = 0; i < n; i++) keys[i] = NextKey(&gen);
+    qsort(keys, n, sizeof(long), CompareLongs);
+    long unique = 0;
+    for (long i = 0; i < n; i++) {
+        if (unique == 0 || keys[i] != keys[unique - 1]) keys[unique++] = keys[i];
+    }
+    BuildFile("bench_indexed_b.dat", keys, unique, MAX_RECORDS);
+    free(keys);
+
+    File a, b;
+    if (!OpenIndexed(&a, a_name) || !OpenIndexed(&b, "bench_indexed_b.dat")) {
+        perror("bench_indexed_b.dat");
+        return;
+    }
+    printf("  merge: %d records in %d blocks with %d records in %d blocks\n", a.header.total_records,
+           a.header.primary_blocks, b.header.total_records, b.header.primary_blocks);
+
+    BenchOp op;
+    long nested = 0;
+    BenchBegin(&op, "intersect (locate)", 1);
+    double t0 = BenchNow();
+    Block block;
+    for (int i = 0; i < a.header.primary_blocks; i++) {
+        ReadBlock(&a, i, &block);
+        for (int j = 0; j < block.record_count; j++) {
+            int block_idx, record_idx;
+            if (LiveSlot(&block.records[j])) nested += Locate(&b, block.records[j].key, &block_idx, &record_idx);
+        }
+    }
+    BenchSample(&op, BenchNow() - t0);
+    BenchReport(&op, true);
+    printf("  %ld records of a have a key in b\n", nested);
+
+    const char *names[3] = {"union", "intersect", "difference"};
+    long counts[3];
+    for (int set_op = MERGE_UNION; set_op <= MERGE_DIFFERENCE; set_op++) {
+        BenchBegin(&op, names[set_op], 1);
+        t0 = BenchNow();
+        counts[set_op] = MergeIndexed(set_op, &a, &b, "bench_merged.dat", 1.0f);
+        BenchSample(&op, BenchNow() - t0);
+        BenchReport(&op, true);
+        printf("  %ld records\n", counts[set_op]);
+    }
+    if (counts[MERGE_INTERSECT] != nested || counts[MERGE_INTERSECT] + counts[MERGE_DIFFERENCE] != a.header.total_records ||
+        counts[MERGE_UNION] != a.header.total_records + b.header.total_records - nested) {
+        printf("  SET SIZES DO NOT ADD UP\n");
+    }
+    BenchBegin(&op, "join", 1);
+    t0 = BenchNow();
+    long rows = JoinIndexed(&a, &b, "bench_merged.dat", 1.0f);
+    BenchSample(&op, BenchNow() - t0);
+    BenchReport(&op, true);
+    printf("  %ld rows\n", rows);
+    CloseIndexed(&a);
+    CloseIndexed(&b);
+}
+
+// Locate costs about log2(primary_blocks) reads, plus the overflow chain
+// of the block a key falls in unless its filter rules the key out. A
+// lookup batch reads the primary zone once and each chain once at most;
+// so do merges, for both inputs.
+// Reorganize reads every block once and writes the new file once.
+int RunBench(const BenchConfig *cfg) {
+    long n = cfg->records;
+    long *keys = malloc(n * sizeof(long));
+    KeyGen gen;
+    InitKeyGen(&gen, KEYS_UNIFORM, 10 * n, cfg->seed);
+    for (long i = 0; i < n; i++) keys[i] = NextKey(&gen);
+    qsort(keys, n, sizeof(long), CompareLongs);
+    long unique = 0;
+    for (long i = 0; i < n; i++) {
+        if (unique == 0 || keys[i] != keys[unique - 1]) keys[unique++] = keys[i];
+    }
+    int fill = MAX_RECORDS > 1 ? (int)(0.75 * MAX_RECORDS) : 1;
+    BuildFile("bench_indexed.dat", keys, unique, fill);
+
+    File file;
+    if (!OpenIndexed(&file, "bench_indexed.dat")) {
+        perror("bench_indexed.dat");
+        return 1;
+    }
+    printf("ex9 indexed sequential: %ld records, %s lookups, %d primary blocks of %d %s\n", unique,
+           KeyDistName(cfg->dist), file.header.primary_blocks, (int)MAX_RECORDS,
+           file.payloads ? "keys (data in the payload file)" : "records");
+
+    // Random inserts fill the primary blocks and then grow overflow chains
+    BenchOp op;
+    Record rec = {0};
+    long *present = malloc((unique + n / 2) * sizeof(long));
+    long n_present = unique;
+    memcpy(present, keys, unique * sizeof(long));
+    rec.logical_deletion = '0';
+    BenchBegin(&op, "insert", n / 2);
+    for (long i = 0; i < n / 2; i++) {
+        long key = NextKey(&gen);
+        char text[MAX_KEY_LENGTH + 1];
+        snprintf(text, sizeof(text), "%010ld", key);
+        memcpy(rec.key, text, MAX_KEY_LENGTH);
+        snprintf(rec.data, sizeof(rec.data), "Record %ld", key);
+        double t0 = BenchNow();
+        int inserted = InsertRecord(&file, &rec);
+        BenchSample(&op, BenchNow() - t0);
+        if (inserted) present[n_present++] = key;
+    }
+    BenchReport(&op, true);
+    qsort(present, n_present, sizeof(long), CompareLongs);
+    printf("  %ld records, %d overflow blocks\n", n_present, file.header.overflow_blocks);
+
+    BenchLocate(&file, keys, unique, NULL, 0, cfg, "locate");
+    BenchLocate(&file, NULL, 10 * n, present, n_present, cfg, "locate miss");
+    BenchBatch(&file, keys, unique, cfg, "lookup batch", 1);
+    BenchBatch(&file, keys, unique, cfg, "lookup batch (4t)", 4);
+    BenchRange(&file, 10 * n, cfg);
+
+    BenchBegin(&op, "bloom rebuild", 1);
+    double t0 = BenchNow();
+    EnableChainFilters(&file, BLOOM_FP_RATE);
+    BenchSample(&op, BenchNow() - t0);
+    BenchReport(&op, true);
+    BenchLocate(&file, keys, unique, NULL, 0, cfg, "locate (bloom)");
+    BenchLocate(&file, NULL, 10 * n, present, n_present, cfg, "miss (bloom)");
+    printf("  %.1f%% of chain checks skipped the chain\n",
+           100.0 * file.bloom->negatives / (file.bloom->checks > 0 ? file.bloom->checks : 1));
+    free(present);
+
+    BenchBegin(&op, "reorganize", 1);
+    t0 = BenchNow();
+    Reorganize(&file, "bench_indexed_new.dat", 0.9f);
+    BenchSample(&op, BenchNow() - t0);
+    BenchReport(&op, true);
+
+    CloseIndexed(&file);
+    free(keys);
+    BenchMerge("bench_indexed_new.dat", n, 10 * n, cfg);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg;
+    if (ParseBenchArgs(argc, argv, 100000, &cfg)) return RunBench(&cfg);
+
+    long keys[12];
+    for (int i = 0; i < 12; i++) keys[i] = 10 * (i + 1);
+    BuildFile("indexed.dat", keys, 12, 1);
+
+    File file;
+    if (!OpenIndexed(&file, "indexed.dat")) {
+        perror("indexed.dat");
+        return 1;
+    }
+    int block_idx, record_idx;
+    int found = Locate(&file, "0000000070", &block_idx, &record_idx);
+    printf("Key 0000000070: %s (block %d)\n", found ? "found" : "not found", block_idx);
+    List(&file, "0000000030", "0000000050");
+    Reorganize(&file, "indexed_reorganized.dat", 1.0f);
+    CloseIndexed(&file);
+    return 0;
+}
@@ -0,0 +1,513 @@
+#define _GNU_SOURCE
+#include "aio.h"
+#include "snapshot.h"
+#include "wal.h"
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_DEPTH 32
+#define MAX_WORKERS 8
+
+// One transfer of `count` whole blocks through a page-aligned slot, so the
+// same request works for padded blocks and O_DIRECT
+typedef struct Request {
+    char *buf;
+    int64_t first;
+    int64_t count;
+    int fd;
+    int64_t off;
+    size_t len;
+    bool write;
+    bool done;
+    bool failed;
+    struct Request *next;  // Thread pool queues
+} Request;
+
+typedef struct {
+    bool uring;
+
+    // io_uring: the submission and completion rings shared with the kernel
+    int ringFd;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+
+    Request *doneHead;  // Completed, not yet handed out (pool, or io_uring inline fallbacks)
+
+    // Thread pool fallback
+    pthread_t workers[MAX_WORKERS];
+    int nWorkers;
+    pthread_mutex_t lock;
+    pthread_cond_t workReady, doneReady;
+    Request *queueHead, *queueTail;
+    bool stopping;
+} Engine;
+
+static int64_t NowNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int QueueDepth(int depth) {
+    if (depth <= 0) {
+        const char *env = getenv("BLOCKFILE_QUEUE_DEPTH");
+        depth = env ? atoi(env) : DEFAULT_DEPTH;
+    }
+    if (depth < 1) depth = 1;
+    if (depth > 4096) depth = 4096;
+    return depth;
+}
+
+static ssize_t Transfer(Request *r, size_t done) {
+    return r->write ? pwrite(r->fd, r->buf + done, r->len - done, r->off + done)
+                    : pread(r->fd, r->buf + done, r->len - done, r->off + done);
+}
+
+// Settle a transfer whose first attempt returned res (bytes or < 0). Reads
+// only come back short at end of file, so the rest reads as zeros like
+// ReadAll; short writes and errors are continued here with pwrite/pread.
+static void Finish(Request *r, ssize_t res) {
+    size_t done = 0;
+    int errors = 0;
+    for (;;) {
+        if (res < 0) {
+            if (++errors == 3) {
+                r->failed = true;
+                break;
+            }
+        } else {
+            done += res;
+            if (done >= r->len) break;
+            if (!r->write) {
+                memset(r->buf + done, 0, r->len - done);
+                break;
+            }
+            if (res == 0) {
+                r->failed = true;
+                break;
+            }
+        }
+        res = Transfer(r, done);
+    }
+}
+
+static int UringSetup(unsigned entries, struct io_uring_params *p) {
+    memset(p, 0, sizeof(*p));
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int UringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static bool UringInit(Engine *e, int depth) {
+    struct io_uring_params p;
+    int fd = UringSetup(depth, &p);
+    if (fd < 0) return false;
+
+    e->ringFd = fd;
+    e->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    e->cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && e->cqRingSize > e->sqRingSize) e->sqRingSize = e->cqRingSize;
+    e->sqRing = mmap(NULL, e->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    e->cqRing = single ? e->sqRing
+                       : mmap(NULL, e->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                              IORING_OFF_CQ_RING);
+    e->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    e->sqes = mmap(NULL, e->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (e->sqRing == MAP_FAILED || e->cqRing == MAP_FAILED || e->sqes == MAP_FAILED) {
+        if (e->sqRing != MAP_FAILED) munmap(e->sqRing, e->sqRingSize);
+        if (!single && e->cqRing != MAP_FAILED) munmap(e->cqRing, e->cqRingSize);
+        if (e->sqes != MAP_FAILED) munmap(e->sqes, e->sqesSize);
+        close(fd);
+        return false;
+    }
+
+    char *sq = e->sqRing, *cq = e->cqRing;
+    e->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    e->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    e->sqArray = (unsigned *)(sq + p.sq_off.array);
+    e->cqHead = (unsigned *)(cq + p.cq_off.head);
+    e->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    e->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    e->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    e->uring = true;
+    return true;
+}
+
+// Queues never have more than `depth` requests out, so the rings never fill
+static void UringSubmit(Engine *e, Request *r) {
+    unsigned tail = *e->sqTail;
+    unsigned idx = tail & *e->sqMask;
+    struct io_uring_sqe *sqe = &e->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = r->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = r->fd;
+    sqe->addr = (uintptr_t)r->buf;
+    sqe->len = (unsigned)r->len;
+    sqe->off = r->off;
+    sqe->user_data = (uintptr_t)r;
+    e->sqArray[idx] = idx;
+    __atomic_store_n(e->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    int rc;
+    do {
+        rc = UringEnter(e->ringFd, 1, 0, 0);
+    } while (rc < 0 && errno == EINTR);
+    if (rc < 0) {
+        // The kernel did not take it: withdraw the entry and do it inline
+        __atomic_store_n(e->sqTail, tail, __ATOMIC_RELEASE);
+        Finish(r, Transfer(r, 0));
+        r->next = e->doneHead;
+        e->doneHead = r;
+    }
+}
+
+static Request *UringWait(Engine *e) {
+    if (e->doneHead) {
+        Request *r = e->doneHead;
+        e->doneHead = r->next;
+        return r;
+    }
+    for (;;) {
+        unsigned head = *e->cqHead;
+        if (head != __atomic_load_n(e->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &e->cqes[head & *e->cqMask];
+            Request *r = (Request *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+            __atomic_store_n(e->cqHead, head + 1, __ATOMIC_RELEASE);
+            Finish(r, res);
+            return r;
+        }
+        if (UringEnter(e->ringFd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN) return NULL;
+    }
+}
+
+static void *PoolWorker(void *arg) {
+    Engine *e = arg;
+    pthread_mutex_lock(&e->lock);
+    for (;;) {
+        while (e->queueHead == NULL && !e->stopping) pthread_cond_wait(&e->workReady, &e->lock);
+        if (e->queueHead == NULL) break;
+        Request *r = e->queueHead;
+        e->queueHead = r->next;
+        if (e->queueHead == NULL) e->queueTail = NULL;
+        pthread_mutex_unlock(&e->lock);
+
+        Finish(r, Transfer(r, 0));
+
+        pthread_mutex_lock(&e->lock);
+        r->next = e->doneHead;
+        e->doneHead = r;
+        pthread_cond_signal(&e->doneReady);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+static void PoolInit(Engine *e, int depth) {
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->workReady, NULL);
+    pthread_cond_init(&e->doneReady, NULL);
+    e->nWorkers = depth < MAX_WORKERS ? depth : MAX_WORKERS;
+    for (int i = 0; i < e->nWorkers; i++) pthread_create(&e->workers[i], NULL, PoolWorker, e);
+}
+
+static void PoolSubmit(Engine *e, Request *r) {
+    pthread_mutex_lock(&e->lock);
+    r->next = NULL;
+    if (e->queueTail) {
+        e->queueTail->next = r;
+    } else {
+        e->queueHead = r;
+    }
+    e->queueTail = r;
+    pthread_cond_signal(&e->workReady);
+    pthread_mutex_unlock(&e->lock);
+}
+
+static Request *PoolWait(Engine *e) {
+    pthread_mutex_lock(&e->lock);
+    while (e->doneHead == NULL) pthread_cond_wait(&e->doneReady, &e->lock);
+    Request *r = e->doneHead;
+    e->doneHead = r->next;
+    pthread_mutex_unlock(&e->lock);
+    return r;
+}
+
+static bool forceThreads;
+static bool uringWorks;
+static pthread_once_t probeOnce = PTHREAD_ONCE_INIT;
+
+static void ProbeBackend(void) {
+    const char *env = getenv("BLOCKFILE_AIO");
+    forceThreads = env && strcmp(env, "threads") == 0;
+    struct io_uring_params p;
+    int fd = UringSetup(1, &p);
+    uringWorks = fd >= 0;
+    if (fd >= 0) close(fd);
+}
+
+const char *AioBackend(void) {
+    pthread_once(&probeOnce, ProbeBackend);
+    return uringWorks && !forceThreads ? "io_uring" : "threads";
+}
+
+static void EngineInit(Engine *e, int depth) {
+    memset(e, 0, sizeof(*e));
+    pthread_once(&probeOnce, ProbeBackend);
+    if (!forceThreads && UringInit(e, depth)) return;
+    PoolInit(e, depth);
+}
+
+static void EngineSubmit(Engine *e, Request *r) {
+    r->done = false;
+    r->failed = false;
+    if (e->uring) {
+        UringSubmit(e, r);
+    } else {
+        PoolSubmit(e, r);
+    }
+}
+
+// Any one completed request, with *nanos set to the time spent waiting for
+// it. NULL means the wait itself failed (io_uring only): the requests still
+// out may complete at any time, so their buffers must stay allocated.
+static Request *EngineWait(Engine *e, int64_t *nanos) {
+    int64_t t0 = NowNanos();
+    Request *r = e->uring ? UringWait(e) : PoolWait(e);
+    *nanos = NowNanos() - t0;
+    // Only the owning thread sets done, so it can poll it without the pool lock
+    if (r) r->done = true;
+    return r;
+}
+
+static void EngineDestroy(Engine *e) {
+    if (e->uring) {
+        munmap(e->sqes, e->sqesSize);
+        if (e->cqRing != e->sqRing) munmap(e->cqRing, e->cqRingSize);
+        munmap(e->sqRing, e->sqRingSize);
+        close(e->ringFd);
+        return;
+    }
+    pthread_mutex_lock(&e->lock);
+    e->stopping = true;
+    pthread_cond_broadcast(&e->workReady);
+    pthread_mutex_unlock(&e->lock);
+    for (int i = 0; i < e->nWorkers; i++) pthread_join(e->workers[i], NULL);
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->workReady);
+    pthread_cond_destroy(&e->doneReady);
+}
+
+static Request *NewSlots(int n, int chunk, size_t stride) {
+    Request *slots = calloc(n, sizeof(Request));
+    for (int i = 0; i < n; i++) {
+        void *p;
+        if (posix_memalign(&p, BF_PAGE_SIZE, chunk * stride) != 0) p = NULL;
+        slots[i].buf = p;
+    }
+    return slots;
+}
+
+static void FreeSlots(Request *slots, int n) {
+    for (int i = 0; i < n; i++) free(slots[i].buf);
+    free(slots);
+}
+
+static void Prepare(BlockFile *bf, Request *r, int64_t first, int64_t count, bool write) {
+    r->first = first;
+    r->count = count;
+    r->fd = BlockFileBlockFd(bf);
+    r->off = BlockFileBlockOffset(bf, first);
+    r->len = count * bf->header.blockSize;
+    r->write = write;
+}
+
+struct ReadAhead {
+    BlockFile *bf;
+    Engine engine;
+    Request *slots;
+    int nSlots;
+    int chunk;
+    int head;      // Slot of the next chunk to hand out; the rest follow in ring order
+    int inFlight;
+    int64_t next;  // Next block to request
+    int64_t end;
+};
+
+static void Refill(ReadAhead *ra) {
+    while (ra->inFlight < ra->nSlots && ra->next < ra->end) {
+        Request *r = &ra->slots[(ra->head + ra->inFlight) % ra->nSlots];
+        int64_t count = ra->end - ra->next < ra->chunk ? ra->end - ra->next : ra->chunk;
+        Prepare(ra->bf, r, ra->next, count, false);
+        EngineSubmit(&ra->engine, r);
+        ra->next += count;
+        ra->inFlight++;
+    }
+}
+
+ReadAhead *ReadAheadOpen(BlockFile *bf, int64_t first, int64_t count, int depth, int chunk) {
+    // The queue reads the data file directly: committed blocks go there first
+    if (bf->wal) WalSync(bf->wal);
+    ReadAhead *ra = calloc(1, sizeof(ReadAhead));
+    int64_t n = __atomic_load_n(&bf->header.nBlocks, __ATOMIC_RELAXED);
+    if (first < 0) first = 0;
+    if (count < 0 || first + count > n) count = first < n ? n - first : 0;
+    ra->bf = bf;
+    ra->nSlots = QueueDepth(depth);
+    ra->chunk = chunk > 0 ? chunk : 1;
+    ra->next = first;
+    ra->end = first + count;
+    ra->slots = NewSlots(ra->nSlots, ra->chunk, bf->header.blockSize);
+    EngineInit(&ra->engine, ra->nSlots);
+    Refill(ra);
+    return ra;
+}
+
+int ReadAheadNext(ReadAhead *ra, void *buf, int64_t *blockNo) {
+    if (ra->inFlight == 0) return 0;
+    Request *r = &ra->slots[ra->head];
+    while (!r->done) {
+        int64_t nanos;
+        Request *c = EngineWait(&ra->engine, &nanos);
+        if (c == NULL) return -1;
+        BlockFileAccountIo(ra->bf, c->first, c->count, false, nanos);
+    }
+    if (r->failed) return -1;
+
+    size_t bytes = ra->bf->blockBytes, stride = ra->bf->header.blockSize;
+    for (int64_t i = 0; i < r->count; i++) memcpy((char *)buf + i * bytes, r->buf + i * stride, bytes);
+    if (blockNo) *blockNo = r->first;
+    int n = (int)r->count;
+
+    r->done = false;
+    ra->head = (ra->head + 1) % ra->nSlots;
+    ra->inFlight--;
+    Refill(ra);
+    return n;
+}
+
+void ReadAheadClose(ReadAhead *ra) {
+    if (ra == NULL) return;
+    // Let the reads still out land before their buffers go away
+    while (ra->inFlight > 0) {
+        Request *r = &ra->slots[ra->head];
+        int64_t nanos;
+        while (!r->done) {
+            Request *c = EngineWait(&ra->engine, &nanos);
+            if (c == NULL) {
+                // The kernel may still read into them: leave the ring and the
+                // buffers allocated
+                free(ra);
+                return;
+            }
+            BlockFileAccountIo(ra->bf, c->first, c->count, false, nanos);
+        }
+        ra->head = (ra->head + 1) % ra->nSlots;
+        ra->inFlight--;
+    }
+    EngineDestroy(&ra->engine);
+    FreeSlots(ra->slots, ra->nSlots);
+    free(ra);
+}
+
+struct WriteBehind {
+    BlockFile *bf;
+    Engine engine;
+    Request *slots;
+    Request **free;  // Stack of idle slots
+    int nFree;
+    int nSlots;
+    int chunk;
+    bool failed;
+    bool lost;  // A wait failed with writes still out
+};
+
+// Wait for one write and put its slot back
+static bool Reap(WriteBehind *wb) {
+    int64_t nanos;
+    Request *r = EngineWait(&wb->engine, &nanos);
+    if (r == NULL) {
+        wb->failed = wb->lost = true;
+        return false;
+    }
+    if (r->failed) wb->failed = true;
+    BlockFileAccountIo(wb->bf, r->first, r->count, true, nanos);
+    wb->free[wb->nFree++] = r;
+    return true;
+}
+
+WriteBehind *WriteBehindOpen(BlockFile *bf, int depth, int chunk) {
+    // The writes bypass the log: empty it, or replaying it after a crash
+    // would put older images back over them
+    WalCheckpoint(bf);
+    // Everything queued until Close is one update for snapshot readers
+    SnapshotBegin(bf);
+    WriteBehind *wb = calloc(1, sizeof(WriteBehind));
+    wb->bf = bf;
+    wb->nSlots = QueueDepth(depth);
+    wb->chunk = chunk > 0 ? chunk : 1;
+    wb->slots = NewSlots(wb->nSlots, wb->chunk, bf->header.blockSize);
+    wb->free = malloc(wb->nSlots * sizeof(Request *));
+    for (int i = 0; i < wb->nSlots; i++) wb->free[wb->nFree++] = &wb->slots[i];
+    EngineInit(&wb->engine, wb->nSlots);
+    return wb;
+}
+
+bool WriteBehindPut(WriteBehind *wb, int64_t first, int64_t count, const void *buf) {
+    size_t bytes = wb->bf->blockBytes, stride = wb->bf->header.blockSize;
+    const char *src = buf;
+    while (count > 0) {
+        if (wb->nFree == 0 && !Reap(wb)) return false;
+        Request *r = wb->free[--wb->nFree];
+        int64_t n = count < wb->chunk ? count : wb->chunk;
+        for (int64_t i = 0; i < n; i++) {
+            memcpy(r->buf + i * stride, src + i * bytes, bytes);
+            memset(r->buf + i * stride + bytes, 0, stride - bytes);
+        }
+        SnapshotPreserve(wb->bf, first, n);
+        Prepare(wb->bf, r, first, n, true);
+        EngineSubmit(&wb->engine, r);
+        first += n;
+        count -= n;
+        src += n * bytes;
+    }
+    return !wb->failed;
+}
+
+bool WriteBehindDrain(WriteBehind *wb) {
+    while (wb->nFree < wb->nSlots && Reap(wb)) {
+    }
+    return !wb->failed;
+}
+
+bool WriteBehindClose(WriteBehind *wb) {
+    if (wb == NULL) return true;
+    bool ok = WriteBehindDrain(wb);
+    SnapshotCommit(wb->bf);
+    if (wb->lost) {
+        // As in ReadAheadClose: the kernel may still be writing from them
+        free(wb->free);
+        free(wb);
+        return false;
+    }
+    EngineDestroy(&wb->engine);
+    FreeSlots(wb->slots, wb->nSlots);
+    free(wb->free);
+    free(wb);
+    return ok;
+}
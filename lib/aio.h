@@ -0,0 +1,47 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "blockfile.h"
+
+// Asynchronous whole-block I/O for sequential jobs. A read-ahead keeps up to
+// `depth` chunk reads in flight in front of the consumer; a write-behind
+// queues chunk writes and only waits when `depth` are outstanding.
+//
+// The back end is io_uring (raw syscalls, one ring per queue), or a small
+// pool of pread/pwrite threads where io_uring is unavailable or
+// BLOCKFILE_AIO=threads. A depth <= 0 means $BLOCKFILE_QUEUE_DEPTH, else 32.
+//
+// Each queue belongs to one thread. The I/O is accounted to the block file
+// (and to that thread's operation scopes) as it completes. Queues bypass a
+// redo log (lib/wal): opening a read-ahead first applies what the log has
+// committed, opening a write-behind takes a checkpoint.
+// A write-behind is one update for snapshot readers (lib/snapshot), who see
+// it at Close; a read-ahead reads blocks as they stand, so a snapshot reader
+// puts back what changed with SnapshotOverlay.
+
+typedef struct ReadAhead ReadAhead;
+typedef struct WriteBehind WriteBehind;
+
+// Read blocks [first, first + count) in order, `chunk` blocks per request.
+// count is clipped to the blocks the file has.
+ReadAhead *ReadAheadOpen(BlockFile *bf, int64_t first, int64_t count, int depth, int chunk);
+// Copy the next chunk into buf (chunk block structs); returns how many
+// blocks it holds, 0 at the end or -1 on an I/O error. *blockNo (if not
+// NULL) gets the number of its first block.
+int ReadAheadNext(ReadAhead *ra, void *buf, int64_t *blockNo);
+void ReadAheadClose(ReadAhead *ra);
+
+// Writes are copied on Put, so buf can be reused at once. Blocks queued but
+// not yet written must not be read through the block file: Close (or Drain)
+// first. Both return false if any write failed.
+WriteBehind *WriteBehindOpen(BlockFile *bf, int depth, int chunk);
+bool WriteBehindPut(WriteBehind *wb, int64_t first, int64_t count, const void *buf);
+bool WriteBehindDrain(WriteBehind *wb);
+bool WriteBehindClose(WriteBehind *wb);
+
+// "io_uring" or "threads": what the next queue will use
+const char *AioBackend(void);
+
+#endif
@@ -0,0 +1,90 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct ArenaChunk {
+    ArenaChunk *next;  // Older chunk in use, or next spare
+    size_t size;
+    _Alignas(16) unsigned char data[];
+};
+
+static size_t Round(size_t n) {
+    return (n + 15) & ~(size_t)15;
+}
+
+void *ArenaAlloc(Arena *a, size_t n) {
+    n = Round(n > 0 ? n : 1);
+    if (!a->chunk || a->chunk->size - a->used < n) {
+        // Spares are kept largest first: if the first is too small, none
+        // fits. Those go back to malloc and the new chunk is at least twice
+        // the largest, so an operation that keeps growing costs a logarithmic
+        // number of mallocs and the spares never pile up.
+        ArenaChunk *c = a->spare;
+        if (c && c->size >= n) {
+            a->spare = c->next;
+        } else {
+            size_t size = n > ARENA_CHUNK_BYTES ? n : ARENA_CHUNK_BYTES;
+            if (c && size < 2 * c->size) size = 2 * c->size;
+            if (a->chunk && size < 2 * a->chunk->size) size = 2 * a->chunk->size;
+            while (a->spare) {
+                c = a->spare;
+                a->spare = c->next;
+                free(c);
+            }
+            c = malloc(sizeof(ArenaChunk) + size);
+            if (!c) return NULL;
+            c->size = size;
+            a->mallocs++;
+        }
+        c->next = a->chunk;
+        a->chunk = c;
+        a->used = 0;
+    }
+    void *p = a->chunk->data + a->used;
+    a->used += n;
+    return p;
+}
+
+void *ArenaGrow(Arena *a, void *p, size_t old, size_t n) {
+    if (!p) return ArenaAlloc(a, n);
+    size_t start = a->chunk ? a->used - Round(old > 0 ? old : 1) : 0;
+    if (a->chunk && p == a->chunk->data + start && a->chunk->size - start >= Round(n)) {
+        a->used = start + Round(n > 0 ? n : 1);
+        return p;
+    }
+    void *q = ArenaAlloc(a, n);
+    if (q) memcpy(q, p, old < n ? old : n);
+    return q;
+}
+
+ArenaMark ArenaSave(const Arena *a) {
+    return (ArenaMark){a->chunk, a->used};
+}
+
+// Insert into the spare list, keeping it sorted by size, largest first
+static void AddSpare(Arena *a, ArenaChunk *c) {
+    ArenaChunk **at = &a->spare;
+    while (*at && (*at)->size > c->size) at = &(*at)->next;
+    c->next = *at;
+    *at = c;
+}
+
+void ArenaRestore(Arena *a, ArenaMark mark) {
+    while (a->chunk != mark.chunk) {
+        ArenaChunk *c = a->chunk;
+        a->chunk = c->next;
+        AddSpare(a, c);
+    }
+    a->used = mark.chunk ? mark.used : 0;
+}
+
+void ArenaFree(Arena *a) {
+    ArenaRestore(a, (ArenaMark){NULL, 0});
+    while (a->spare) {
+        ArenaChunk *c = a->spare;
+        a->spare = c->next;
+        free(c);
+    }
+    a->mallocs = 0;
+}
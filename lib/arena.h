@@ -0,0 +1,49 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Scratch memory for the operation in progress on a file: block buffers and
+// record arrays are bump-allocated from chunks the arena keeps, and the
+// operation hands everything back at once by restoring the mark it saved
+// when it started. Chunks go to a spare list rather than back to malloc, so
+// once the arena has grown to an operation's peak, later operations do not
+// allocate at all and long runs do not fragment the heap.
+//
+//   ArenaMark mark = ArenaSave(&bf->scratch);
+//   Block *block = ArenaAlloc(&bf->scratch, sizeof(Block));
+//   ...
+//   ArenaRestore(&bf->scratch, mark);
+//
+// Marks nest, so an operation can call another one on the same file. One
+// thread at a time per arena. A zeroed Arena is empty and ready to use.
+
+#define ARENA_CHUNK_BYTES (64 << 10)  // Smallest chunk; bigger requests get a chunk of their own size
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+    ArenaChunk *chunk;  // Chunk allocations come from, or NULL
+    size_t used;        // Bytes handed out from it
+    ArenaChunk *spare;  // Chunks given back by ArenaRestore, largest first
+    int64_t mallocs;    // Chunks ever allocated
+} Arena;
+
+typedef struct {
+    ArenaChunk *chunk;
+    size_t used;
+} ArenaMark;
+
+// 16-byte aligned; NULL only when malloc fails
+void *ArenaAlloc(Arena *a, size_t n);
+// Resize p, which holds old bytes: in place when p is the latest allocation
+// and its chunk has room, otherwise a copy (the old bytes stay allocated
+// until the mark is restored)
+void *ArenaGrow(Arena *a, void *p, size_t old, size_t n);
+ArenaMark ArenaSave(const Arena *a);
+// Give back everything allocated since the mark
+void ArenaRestore(Arena *a, ArenaMark mark);
+void ArenaFree(Arena *a);
+
+#endif
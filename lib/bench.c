@@ -0,0 +1,131 @@
+#include "bench.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *distNames[] = {"seq", "uniform", "zipf"};
+
+bool ParseBenchArgs(int argc, char **argv, long defaultRecords, BenchConfig *cfg) {
+    if (argc < 2 || strcmp(argv[1], "bench") != 0) return false;
+    cfg->records = argc > 2 ? atol(argv[2]) : defaultRecords;
+    if (cfg->records <= 0) cfg->records = defaultRecords;
+    cfg->dist = KEYS_UNIFORM;
+    for (int d = 0; argc > 3 && d < 3; d++) {
+        if (strcmp(argv[3], distNames[d]) == 0) cfg->dist = (KeyDist)d;
+    }
+    cfg->seed = argc > 4 ? strtoull(argv[4], NULL, 10) : 42;
+    if (cfg->seed == 0) cfg->seed = 42;
+    return true;
+}
+
+const char *KeyDistName(KeyDist dist) {
+    return distNames[dist];
+}
+
+uint64_t BenchRandom(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static double Zeta(long n, double theta) {
+    double sum = 0;
+    for (long i = 1; i <= n; i++) sum += 1.0 / pow((double)i, theta);
+    return sum;
+}
+
+void InitKeyGen(KeyGen *g, KeyDist dist, long n, uint64_t seed) {
+    memset(g, 0, sizeof(KeyGen));
+    g->dist = dist;
+    g->n = n > 0 ? n : 1;
+    g->state = seed ? seed : 42;
+    if (dist == KEYS_ZIPF) {
+        g->theta = 0.99;
+        g->zetaN = Zeta(g->n, g->theta);
+        g->alpha = 1.0 / (1.0 - g->theta);
+        g->eta = (1.0 - pow(2.0 / g->n, 1.0 - g->theta)) / (1.0 - Zeta(2, g->theta) / g->zetaN);
+    }
+}
+
+long NextKey(KeyGen *g) {
+    switch (g->dist) {
+    case KEYS_SEQUENTIAL:
+        return g->next++ % g->n;
+    case KEYS_UNIFORM:
+        return (long)(BenchRandom(&g->state) % (uint64_t)g->n);
+    case KEYS_ZIPF: {
+        double u = (BenchRandom(&g->state) >> 11) * (1.0 / 9007199254740992.0);
+        double uz = u * g->zetaN;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + pow(0.5, g->theta)) return 1;
+        long k = (long)(g->n * pow(g->eta * u - g->eta + 1.0, g->alpha));
+        return k < g->n ? k : g->n - 1;
+    }
+    }
+    return 0;
+}
+
+double BenchNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void BenchBegin(BenchOp *op, const char *name, long capacity) {
+    op->name = name;
+    op->capacity = capacity > 0 ? capacity : 1;
+    op->us = malloc(op->capacity * sizeof(double));
+    op->n = 0;
+    op->seconds = 0;
+    op->ioStart = BlockFileTotals();
+}
+
+void BenchSample(BenchOp *op, double seconds) {
+    if (op->n == op->capacity) {
+        op->capacity *= 2;
+        op->us = realloc(op->us, op->capacity * sizeof(double));
+    }
+    op->us[op->n++] = seconds * 1e6;
+    op->seconds += seconds;
+}
+
+void BenchExcludeIo(BenchOp *op, IoStats since) {
+    IoStatsAdd(&op->ioStart, IoStatsDiff(BlockFileTotals(), since));
+}
+
+static int CompareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array
+static double Percentile(const double *sorted, long n, double p) {
+    long rank = (long)ceil(p / 100.0 * n);
+    if (rank < 1) rank = 1;
+    return sorted[rank - 1];
+}
+
+void BenchReport(BenchOp *op, bool measureIo) {
+    if (op->n == 0) {
+        printf("  %-20s no samples\n", op->name);
+        free(op->us);
+        return;
+    }
+    qsort(op->us, op->n, sizeof(double), CompareDoubles);
+    printf("  %-20s %8ld ops %11.0f ops/s  p50 %8.2f  p99 %8.2f  p99.9 %9.2f  max %9.2f us",
+           op->name, op->n, op->seconds > 0 ? op->n / op->seconds : 0.0, Percentile(op->us, op->n, 50),
+           Percentile(op->us, op->n, 99), Percentile(op->us, op->n, 99.9), op->us[op->n - 1]);
+    if (measureIo) {
+        IoStats io = IoStatsDiff(BlockFileTotals(), op->ioStart);
+        printf("  %8.2f reads/op %8.2f writes/op %8.2f seeks/op %5.1f%% in I/O", (double)io.blocksRead / op->n,
+               (double)io.blocksWritten / op->n, (double)io.seeks / op->n,
+               op->seconds > 0 ? io.ioNanos / 1e7 / op->seconds : 0.0);
+    }
+    printf("\n");
+    free(op->us);
+}
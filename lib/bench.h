@@ -0,0 +1,77 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "blockfile.h"
+
+// Shared benchmark support. Every exercise with a main has a bench mode:
+//
+//   ./exN bench [records] [seq|uniform|zipf] [seed]
+//
+// Block sizes are compile-time constants; override them with
+// make DEFS=-DB=64 (ex6, ex7, ex11-ex14) or DEFS=-DBLOCK_SIZE=512 (ex3, ex8, ex9;
+// ex9 also takes -DRECORD_SIZE, and -DSPLIT_PAYLOAD to keep record data in
+// a payload file). ex15 takes -DNODE_SIZE, -DRECORD_SIZE and -DPOOL_FRAMES.
+// ex8 and ex9 also bench their Bloom filters, sized with -DBLOOM_FP_RATE
+// (0.01).
+//
+// Set BLOCKFILE_STATS=path (or -) to also get every block file's counters
+// and per-operation I/O as JSON lines when it is closed, and
+// BLOCKFILE_IO=page or direct to pad blocks to whole pages (and bypass the
+// page cache in reorganisations, compactions and scans). Those sequential
+// passes go through lib/aio: BLOCKFILE_QUEUE_DEPTH sets how many requests
+// stay in flight (32) and BLOCKFILE_AIO=threads swaps io_uring for a pool.
+// BLOCKFILE_WAL=1 sends every file's writes through a redo log (lib/wal.h).
+
+typedef enum {
+    KEYS_SEQUENTIAL,  // 0, 1, 2, ...
+    KEYS_UNIFORM,     // Uniform over [0, n)
+    KEYS_ZIPF         // Zipf(0.99) over [0, n): small keys are hot
+} KeyDist;
+
+typedef struct {
+    long records;
+    KeyDist dist;
+    uint64_t seed;
+} BenchConfig;
+
+// Returns false when argv does not ask for bench mode
+bool ParseBenchArgs(int argc, char **argv, long defaultRecords, BenchConfig *cfg);
+const char *KeyDistName(KeyDist dist);
+
+typedef struct {
+    KeyDist dist;
+    long n;
+    long next;       // Sequential: next key
+    uint64_t state;  // xorshift64 state
+    double theta, zetaN, alpha, eta;  // Zipf constants (Gray et al.)
+} KeyGen;
+
+void InitKeyGen(KeyGen *g, KeyDist dist, long n, uint64_t seed);
+long NextKey(KeyGen *g);
+uint64_t BenchRandom(uint64_t *state);
+
+// Monotonic clock, in seconds
+double BenchNow(void);
+
+// One measured operation type: per-op latencies plus the block I/O done
+// between BenchBegin and BenchReport (across every block file)
+typedef struct {
+    const char *name;
+    double *us;
+    long n;
+    long capacity;
+    double seconds;  // Sum of the samples
+    IoStats ioStart;
+} BenchOp;
+
+void BenchBegin(BenchOp *op, const char *name, long capacity);
+void BenchSample(BenchOp *op, double seconds);
+// Leave the block I/O done since `since` (setup between samples) out of the report
+void BenchExcludeIo(BenchOp *op, IoStats since);
+// Prints ops/s, latency percentiles and block I/O per op, then frees the samples.
+// Exercises without block files pass measureIo = false.
+void BenchReport(BenchOp *op, bool measureIo);
+
+#endif
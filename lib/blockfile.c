@@ -0,0 +1,603 @@
+#define _GNU_SOURCE
+#include "blockfile.h"
+#include "latch.h"
+#include "snapshot.h"
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+LayoutDesc FixedLayout(uint32_t recordSize, uint32_t capacity, uint32_t countOffset, uint32_t slotsOffset) {
+    LayoutDesc l = {LAYOUT_FIXED, recordSize, capacity, countOffset, slotsOffset};
+    return l;
+}
+
+LayoutDesc VariableLayout(uint32_t dataBytes, uint32_t countOffset, uint32_t dataOffset) {
+    LayoutDesc l = {LAYOUT_VARIABLE, 0, dataBytes, countOffset, dataOffset};
+    return l;
+}
+
+int BlockCount(const LayoutDesc *layout, const void *block) {
+    if (layout->countOffset == BF_NO_COUNT) return (int)layout->capacity;
+    int n;
+    memcpy(&n, (const char *)block + layout->countOffset, sizeof(int));
+    return n;
+}
+
+void SetBlockCount(const LayoutDesc *layout, void *block, int count) {
+    if (layout->countOffset == BF_NO_COUNT) return;
+    memcpy((char *)block + layout->countOffset, &count, sizeof(int));
+}
+
+void *BlockSlot(const LayoutDesc *layout, void *block, int i) {
+    return (char *)block + layout->dataOffset + (size_t)i * layout->recordSize;
+}
+
+// Full-length pread/pwrite. A block partly past end of file was only ever
+// partly written, so the missing tail reads as zeros.
+static bool ReadAll(int fd, void *buf, size_t n, off_t off) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = pread(fd, p, n, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return false;
+        if (r == 0) {
+            memset(p, 0, n);
+            return true;
+        }
+        p += r;
+        n -= r;
+        off += r;
+    }
+    return true;
+}
+
+// O_DIRECT reads only come back short at end of file, and a retry from the
+// unaligned offset would fail, so the rest is zeros straight away
+static bool ReadAllDirect(int fd, void *buf, size_t n, off_t off) {
+    ssize_t r;
+    do {
+        r = pread(fd, buf, n, off);
+    } while (r < 0 && errno == EINTR);
+    if (r < 0) return false;
+    if ((size_t)r < n) memset((char *)buf + r, 0, n - r);
+    return true;
+}
+
+static bool WriteAll(int fd, const void *buf, size_t n, off_t off) {
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= w;
+        off += w;
+    }
+    return true;
+}
+
+static IoStats totals;
+static __thread IoStats threadTotals;
+
+// Adding blockBytes used the padding after the layout: old files still open
+_Static_assert(offsetof(BlockFileHeader, nBlocks) == 40, "on-disk header layout changed");
+
+static IoMode ioMode;
+static pthread_once_t ioModeOnce = PTHREAD_ONCE_INIT;
+
+static void LoadIoMode(void) {
+    const char *mode = getenv("BLOCKFILE_IO");
+    if (mode == NULL) return;
+    if (strcmp(mode, "page") == 0) ioMode = IO_PAGE_ALIGNED;
+    if (strcmp(mode, "direct") == 0) ioMode = IO_DIRECT;
+}
+
+void BlockFileSetIoMode(IoMode mode) {
+    pthread_once(&ioModeOnce, LoadIoMode);
+    ioMode = mode;
+}
+
+IoMode BlockFileIoMode(void) {
+    pthread_once(&ioModeOnce, LoadIoMode);
+    return ioMode;
+}
+
+uint32_t PageAlignedSize(uint32_t n) {
+    uint32_t size = BF_PAGE_SIZE;
+    while (size < n) size *= 2;
+    return size;
+}
+
+// Per-thread page-aligned staging area for padded blocks and O_DIRECT. The
+// key only exists to free it when the thread exits.
+static pthread_key_t bounceKey;
+static pthread_once_t bounceOnce = PTHREAD_ONCE_INIT;
+static __thread char *bounce;
+static __thread size_t bounceSize;
+
+static void MakeBounceKey(void) {
+    pthread_key_create(&bounceKey, free);
+}
+
+static char *Bounce(size_t n) {
+    if (n <= bounceSize) return bounce;
+    void *p;
+    if (posix_memalign(&p, BF_PAGE_SIZE, n) != 0) return NULL;
+    free(bounce);
+    bounce = p;
+    bounceSize = n;
+    pthread_once(&bounceOnce, MakeBounceKey);
+    pthread_setspecific(bounceKey, p);
+    return bounce;
+}
+
+static int64_t NowNanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void AddAtomic(IoStats *s, const IoStats *d) {
+    __atomic_add_fetch(&s->blocksRead, d->blocksRead, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->blocksWritten, d->blocksWritten, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->seeks, d->seeks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->bytesRead, d->bytesRead, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->bytesWritten, d->bytesWritten, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->ioNanos, d->ioNanos, __ATOMIC_RELAXED);
+}
+
+static IoStats LoadAtomic(IoStats *s) {
+    IoStats r;
+    r.blocksRead = __atomic_load_n(&s->blocksRead, __ATOMIC_RELAXED);
+    r.blocksWritten = __atomic_load_n(&s->blocksWritten, __ATOMIC_RELAXED);
+    r.seeks = __atomic_load_n(&s->seeks, __ATOMIC_RELAXED);
+    r.bytesRead = __atomic_load_n(&s->bytesRead, __ATOMIC_RELAXED);
+    r.bytesWritten = __atomic_load_n(&s->bytesWritten, __ATOMIC_RELAXED);
+    r.ioNanos = __atomic_load_n(&s->ioNanos, __ATOMIC_RELAXED);
+    return r;
+}
+
+// Charges one access of `blocks` blocks starting at blockNo to the file, the
+// process and the calling thread. With several threads on one file the seek
+// count is approximate: it sees their accesses interleaved.
+static void CountIo(BlockFile *bf, int64_t blockNo, int64_t blocks, int64_t bytes, bool write, int64_t t0) {
+    IoStats d = {0};
+    if (write) {
+        d.blocksWritten = blocks;
+        d.bytesWritten = bytes;
+    } else {
+        d.blocksRead = blocks;
+        d.bytesRead = bytes;
+    }
+    d.seeks = __atomic_exchange_n(&bf->nextBlock, blockNo + blocks, __ATOMIC_RELAXED) != blockNo;
+    d.ioNanos = NowNanos() - t0;
+    AddAtomic(&bf->stats, &d);
+    AddAtomic(&totals, &d);
+    IoStatsAdd(&threadTotals, d);
+}
+
+IoStats BlockFileTotals(void) {
+    return LoadAtomic(&totals);
+}
+
+IoStats BlockFileThreadTotals(void) {
+    return threadTotals;
+}
+
+IoStats IoStatsDiff(IoStats end, IoStats start) {
+    IoStats d;
+    d.blocksRead = end.blocksRead - start.blocksRead;
+    d.blocksWritten = end.blocksWritten - start.blocksWritten;
+    d.seeks = end.seeks - start.seeks;
+    d.bytesRead = end.bytesRead - start.bytesRead;
+    d.bytesWritten = end.bytesWritten - start.bytesWritten;
+    d.ioNanos = end.ioNanos - start.ioNanos;
+    return d;
+}
+
+void IoStatsAdd(IoStats *into, IoStats delta) {
+    into->blocksRead += delta.blocksRead;
+    into->blocksWritten += delta.blocksWritten;
+    into->seeks += delta.seeks;
+    into->bytesRead += delta.bytesRead;
+    into->bytesWritten += delta.bytesWritten;
+    into->ioNanos += delta.ioNanos;
+}
+
+IoOp BlockFileOpBegin(BlockFile *bf, const char *name) {
+    IoOp op = {bf, name, threadTotals};
+    return op;
+}
+
+IoStats BlockFileOpEnd(IoOp *op) {
+    IoStats d = IoStatsDiff(threadTotals, op->start);
+    BlockFile *bf = op->bf;
+    pthread_mutex_lock(&bf->opLock);
+    int i = 0;
+    while (i < bf->nOps && bf->ops[i].name != op->name && strcmp(bf->ops[i].name, op->name) != 0) i++;
+    if (i == bf->nOps && i < BF_MAX_OPS) {
+        bf->ops[i].name = op->name;
+        bf->nOps++;
+    }
+    if (i < bf->nOps) {
+        bf->ops[i].count++;
+        IoStatsAdd(&bf->ops[i].io, d);
+    }
+    pthread_mutex_unlock(&bf->opLock);
+    return d;
+}
+
+bool BlockFileOpStats(BlockFile *bf, const char *name, OpStats *out) {
+    bool found = false;
+    pthread_mutex_lock(&bf->opLock);
+    for (int i = 0; i < bf->nOps && !found; i++) {
+        if (strcmp(bf->ops[i].name, name) == 0) {
+            *out = bf->ops[i];
+            found = true;
+        }
+    }
+    pthread_mutex_unlock(&bf->opLock);
+    return found;
+}
+
+void BlockFilePrintOps(BlockFile *bf, FILE *out) {
+    pthread_mutex_lock(&bf->opLock);
+    for (int i = 0; i < bf->nOps; i++) {
+        const OpStats *o = &bf->ops[i];
+        double n = (double)o->count;
+        fprintf(out, "  %-12s %6lld ops %8.2f reads/op %8.2f writes/op %8.2f seeks/op\n", o->name,
+                (long long)o->count, o->io.blocksRead / n, o->io.blocksWritten / n, o->io.seeks / n);
+    }
+    pthread_mutex_unlock(&bf->opLock);
+}
+
+static void WriteIoJson(FILE *out, IoStats s) {
+    fprintf(out,
+            "\"blocksRead\":%lld,\"blocksWritten\":%lld,\"seeks\":%lld,\"bytesRead\":%lld,"
+            "\"bytesWritten\":%lld,\"ioNanos\":%lld",
+            (long long)s.blocksRead, (long long)s.blocksWritten, (long long)s.seeks, (long long)s.bytesRead,
+            (long long)s.bytesWritten, (long long)s.ioNanos);
+}
+
+// Names come from the exercises as string literals, the path from the caller
+static void WriteJsonString(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', out);
+        if ((unsigned char)*s >= 0x20) fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+void BlockFileWriteStatsJson(BlockFile *bf, FILE *out) {
+    fprintf(out, "{\"file\":");
+    WriteJsonString(out, bf->path);
+    fprintf(out, ",\"blockSize\":%u,\"blocks\":%lld,\"records\":%lld,", bf->header.blockSize,
+            (long long)bf->header.nBlocks, (long long)bf->header.nRecords);
+    WriteIoJson(out, LoadAtomic(&bf->stats));
+    fprintf(out, ",\"ops\":{");
+    pthread_mutex_lock(&bf->opLock);
+    for (int i = 0; i < bf->nOps; i++) {
+        fprintf(out, "%s", i ? "," : "");
+        WriteJsonString(out, bf->ops[i].name);
+        fprintf(out, ":{\"count\":%lld,", (long long)bf->ops[i].count);
+        WriteIoJson(out, bf->ops[i].io);
+        fputc('}', out);
+    }
+    pthread_mutex_unlock(&bf->opLock);
+    fprintf(out, "}}\n");
+}
+
+static void ExportStats(BlockFile *bf) {
+    const char *dest = getenv("BLOCKFILE_STATS");
+    if (dest == NULL || *dest == '\0') return;
+    if (strcmp(dest, "-") == 0) {
+        BlockFileWriteStatsJson(bf, stderr);
+        return;
+    }
+    FILE *out = fopen(dest, "a");
+    if (out == NULL) return;
+    BlockFileWriteStatsJson(bf, out);
+    fclose(out);
+}
+
+static off_t BlockOffset(const BlockFile *bf, int64_t blockNo) {
+    return (off_t)bf->header.dataOffset + (off_t)blockNo * bf->header.blockSize;
+}
+
+// nBlocks only grows here; writers on different blocks may race to extend it
+static void NoteBlocks(BlockFile *bf, int64_t n) {
+    int64_t cur = __atomic_load_n(&bf->header.nBlocks, __ATOMIC_RELAXED);
+    while (n > cur &&
+           !__atomic_compare_exchange_n(&bf->header.nBlocks, &cur, n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Whole-block transfers. The caller's buffer holds count structs of
+// blockBytes each; on disk every block is blockSize long. Padding, or an
+// unaligned buffer under O_DIRECT, goes through the bounce buffer.
+static bool ReadBlocks(BlockFile *bf, int64_t first, int64_t count, void *buf) {
+    size_t bytes = bf->blockBytes, stride = bf->header.blockSize;
+    bool direct = __atomic_load_n(&bf->bypass, __ATOMIC_RELAXED);
+    int fd = direct ? bf->directFd : bf->fd;
+    if (bytes == stride && (!direct || (uintptr_t)buf % BF_PAGE_SIZE == 0)) {
+        return direct ? ReadAllDirect(fd, buf, count * stride, BlockOffset(bf, first))
+                      : ReadAll(fd, buf, count * stride, BlockOffset(bf, first));
+    }
+    char *b = Bounce(count * stride);
+    if (b == NULL) return false;
+    bool ok = direct ? ReadAllDirect(fd, b, count * stride, BlockOffset(bf, first))
+                     : ReadAll(fd, b, count * stride, BlockOffset(bf, first));
+    for (int64_t i = 0; ok && i < count; i++) memcpy((char *)buf + i * bytes, b + i * stride, bytes);
+    return ok;
+}
+
+static bool WriteBlocks(BlockFile *bf, int64_t first, int64_t count, const void *buf) {
+    size_t bytes = bf->blockBytes, stride = bf->header.blockSize;
+    bool direct = __atomic_load_n(&bf->bypass, __ATOMIC_RELAXED);
+    int fd = direct ? bf->directFd : bf->fd;
+    if (bytes == stride && (!direct || (uintptr_t)buf % BF_PAGE_SIZE == 0)) {
+        return WriteAll(fd, buf, count * stride, BlockOffset(bf, first));
+    }
+    char *b = Bounce(count * stride);
+    if (b == NULL) return false;
+    for (int64_t i = 0; i < count; i++) {
+        memcpy(b + i * stride, (const char *)buf + i * bytes, bytes);
+        memset(b + i * stride + bytes, 0, stride - bytes);
+    }
+    return WriteAll(fd, b, count * stride, BlockOffset(bf, first));
+}
+
+bool BlockFileBypassCache(BlockFile *bf, bool on) {
+    if (!on || BlockFileIoMode() != IO_DIRECT || bf->header.blockSize % BF_PAGE_SIZE != 0) {
+        __atomic_store_n(&bf->bypass, false, __ATOMIC_RELAXED);
+        return false;
+    }
+    if (bf->directFd < 0) {
+        bf->directFd = open(bf->path, O_RDWR | O_DIRECT);
+        if (bf->directFd < 0) return false;  // e.g. tmpfs
+    }
+    __atomic_store_n(&bf->bypass, true, __ATOMIC_RELAXED);
+    return true;
+}
+
+static BlockFile *NewBlockFile(int fd, const char *path) {
+    BlockFile *bf = calloc(1, sizeof(BlockFile));
+    bf->fd = fd;
+    bf->directFd = -1;
+    bf->path = strdup(path);
+    pthread_mutex_init(&bf->opLock, NULL);
+    return bf;
+}
+
+static void FreeBlockFile(BlockFile *bf) {
+    SnapshotDetach(bf);
+    LatchTableFree(bf->latches);
+    if (bf->directFd >= 0) close(bf->directFd);
+    ArenaFree(&bf->scratch);
+    pthread_mutex_destroy(&bf->opLock);
+    free(bf->path);
+    free(bf);
+}
+
+BlockFile *BlockFileCreate(const char *path, uint32_t blockSize, LayoutDesc layout) {
+    if (blockSize == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+
+    BlockFile *bf = NewBlockFile(fd, path);
+    bf->header.magic = BF_MAGIC;
+    bf->header.version = BF_VERSION;
+    bf->header.blockSize = BlockFileIoMode() == IO_BUFFERED ? blockSize : PageAlignedSize(blockSize);
+    bf->header.blockBytes = blockSize;
+    bf->blockBytes = blockSize;
+    // The header gets whole blocks to itself so block 0 stays block-aligned
+    uint32_t hdr = sizeof(BlockFileHeader), stride = bf->header.blockSize;
+    bf->header.dataOffset = (hdr + stride - 1) / stride * stride;
+    bf->header.layout = layout;
+    if (!BlockFileWriteHeader(bf) || !WalOnOpen(bf, true)) {
+        close(fd);
+        FreeBlockFile(bf);
+        return NULL;
+    }
+    return bf;
+}
+
+BlockFile *BlockFileOpen(const char *path) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) return NULL;
+
+    BlockFile *bf = NewBlockFile(fd, path);
+    if (!ReadAll(fd, &bf->header, sizeof(BlockFileHeader), 0) || bf->header.magic != BF_MAGIC ||
+        bf->header.version != BF_VERSION || bf->header.blockSize == 0) {
+        close(fd);
+        FreeBlockFile(bf);
+        errno = EINVAL;
+        return NULL;
+    }
+    // Files from before padding existed leave blockBytes zero
+    bf->blockBytes = bf->header.blockBytes ? bf->header.blockBytes : bf->header.blockSize;
+    if (!WalOnOpen(bf, false)) {
+        close(fd);
+        FreeBlockFile(bf);
+        return NULL;
+    }
+    return bf;
+}
+
+BlockFile *BlockFileOpenOrCreate(const char *path, uint32_t blockSize, LayoutDesc layout, bool *created) {
+    BlockFile *bf = BlockFileOpen(path);
+    if (bf != NULL && bf->blockBytes == blockSize) {
+        if (created) *created = false;
+        return bf;
+    }
+    // Missing, foreign or written with another block size: start over
+    if (bf != NULL) BlockFileClose(bf);
+    if (created) *created = true;
+    return BlockFileCreate(path, blockSize, layout);
+}
+
+void BlockFileClose(BlockFile *bf) {
+    if (bf == NULL) return;
+    if (bf->wal) WalDetach(bf->wal);
+    BlockFileWriteHeader(bf);
+    ExportStats(bf);
+    close(bf->fd);
+    FreeBlockFile(bf);
+}
+
+void BlockFileAbandon(BlockFile *bf) {
+    if (bf == NULL) return;
+    close(bf->fd);
+    FreeBlockFile(bf);
+}
+
+bool BlockFileRead(BlockFile *bf, int64_t blockNo, void *buf) {
+    if (blockNo < 0 || blockNo >= __atomic_load_n(&bf->header.nBlocks, __ATOMIC_RELAXED)) return false;
+    struct Wal *wal = WalActive(bf);
+    if (wal && WalRead(wal, blockNo, 0, buf, bf->blockBytes)) return true;
+    int64_t t0 = NowNanos();
+    bool ok = ReadBlocks(bf, blockNo, 1, buf);
+    CountIo(bf, blockNo, 1, bf->header.blockSize, false, t0);
+    return ok;
+}
+
+// The writes below keep the old image of every block they overwrite for
+// open snapshots, and count as one transaction for them when called alone
+static bool PutBlock(BlockFile *bf, int64_t blockNo, const void *buf) {
+    struct Wal *wal = WalActive(bf);
+    if (wal) return WalWrite(wal, blockNo, 0, buf, bf->blockBytes);
+    int64_t t0 = NowNanos();
+    if (!WriteBlocks(bf, blockNo, 1, buf)) return false;
+    CountIo(bf, blockNo, 1, bf->header.blockSize, true, t0);
+    NoteBlocks(bf, blockNo + 1);
+    return true;
+}
+
+bool BlockFileWrite(BlockFile *bf, int64_t blockNo, const void *buf) {
+    if (blockNo < 0) return false;
+    SnapshotBegin(bf);
+    SnapshotPreserve(bf, blockNo, 1);
+    bool ok = PutBlock(bf, blockNo, buf);
+    SnapshotCommit(bf);
+    return ok;
+}
+
+int64_t BlockFileReadRange(BlockFile *bf, int64_t first, int64_t count, void *buf) {
+    int64_t n = __atomic_load_n(&bf->header.nBlocks, __ATOMIC_RELAXED);
+    if (first < 0 || first >= n || count <= 0) return 0;
+    if (first + count > n) count = n - first;
+    if (WalActive(bf)) {
+        // Block by block, so logged blocks come from the log
+        for (int64_t i = 0; i < count; i++) {
+            if (!BlockFileRead(bf, first + i, (char *)buf + i * bf->blockBytes)) return 0;
+        }
+        return count;
+    }
+    int64_t t0 = NowNanos();
+    bool ok = ReadBlocks(bf, first, count, buf);
+    CountIo(bf, first, count, count * bf->header.blockSize, false, t0);
+    return ok ? count : 0;
+}
+
+static bool PutRange(BlockFile *bf, int64_t first, int64_t count, const void *buf) {
+    if (WalActive(bf)) {
+        bool ok = true;
+        WalBegin(bf);
+        for (int64_t i = 0; i < count; i++) ok = BlockFileWrite(bf, first + i, (const char *)buf + i * bf->blockBytes) && ok;
+        return WalCommit(bf) && ok;
+    }
+    int64_t t0 = NowNanos();
+    if (!WriteBlocks(bf, first, count, buf)) return false;
+    CountIo(bf, first, count, count * bf->header.blockSize, true, t0);
+    NoteBlocks(bf, first + count);
+    return true;
+}
+
+bool BlockFileWriteRange(BlockFile *bf, int64_t first, int64_t count, const void *buf) {
+    if (first < 0 || count <= 0) return count == 0;
+    SnapshotBegin(bf);
+    SnapshotPreserve(bf, first, count);
+    bool ok = PutRange(bf, first, count, buf);
+    SnapshotCommit(bf);
+    return ok;
+}
+
+bool BlockFileReadBytes(BlockFile *bf, int64_t blockNo, uint32_t offset, void *buf, uint32_t n) {
+    if (blockNo < 0 || blockNo >= __atomic_load_n(&bf->header.nBlocks, __ATOMIC_RELAXED)) return false;
+    if (offset + n > bf->blockBytes) return false;
+    struct Wal *wal = WalActive(bf);
+    if (wal && WalRead(wal, blockNo, offset, buf, n)) return true;
+    int64_t t0 = NowNanos();
+    bool ok = ReadAll(bf->fd, buf, n, BlockOffset(bf, blockNo) + offset);
+    CountIo(bf, blockNo, 1, n, false, t0);
+    return ok;
+}
+
+static bool PutBytes(BlockFile *bf, int64_t blockNo, uint32_t offset, const void *buf, uint32_t n) {
+    struct Wal *wal = WalActive(bf);
+    if (wal) return WalWrite(wal, blockNo, offset, buf, n);
+    int64_t t0 = NowNanos();
+    if (!WriteAll(bf->fd, buf, n, BlockOffset(bf, blockNo) + offset)) return false;
+    CountIo(bf, blockNo, 1, n, true, t0);
+    // A partial write into a fresh block still makes the whole block exist
+    NoteBlocks(bf, blockNo + 1);
+    return true;
+}
+
+bool BlockFileWriteBytes(BlockFile *bf, int64_t blockNo, uint32_t offset, const void *buf, uint32_t n) {
+    if (blockNo < 0 || offset + n > bf->blockBytes) return false;
+    SnapshotBegin(bf);
+    SnapshotPreserve(bf, blockNo, 1);
+    bool ok = PutBytes(bf, blockNo, offset, buf, n);
+    SnapshotCommit(bf);
+    return ok;
+}
+
+int BlockFileBlockFd(BlockFile *bf) {
+    return __atomic_load_n(&bf->bypass, __ATOMIC_RELAXED) ? bf->directFd : bf->fd;
+}
+
+int64_t BlockFileBlockOffset(const BlockFile *bf, int64_t blockNo) {
+    return BlockOffset(bf, blockNo);
+}
+
+void BlockFileAccountIo(BlockFile *bf, int64_t first, int64_t count, bool write, int64_t nanos) {
+    CountIo(bf, first, count, count * bf->header.blockSize, write, NowNanos() - nanos);
+    if (write) NoteBlocks(bf, first + count);
+}
+
+bool BlockFileTruncate(BlockFile *bf, int64_t nBlocks) {
+    if (nBlocks < 0) return false;
+    // Empty the log first: replaying it would grow the file back
+    if (WalActive(bf) && !WalCheckpoint(bf)) return false;
+    SnapshotBegin(bf);
+    SnapshotPreserve(bf, nBlocks, INT64_MAX - nBlocks);
+    bool ok = ftruncate(bf->fd, BlockOffset(bf, nBlocks)) == 0;
+    if (ok) __atomic_store_n(&bf->header.nBlocks, nBlocks, __ATOMIC_RELAXED);
+    SnapshotCommit(bf);
+    return ok;
+}
+
+bool BlockFileWriteHeader(BlockFile *bf) {
+    struct Wal *wal = WalActive(bf);
+    // Snapshots opened from here on see the header as written
+    SnapshotBegin(bf);
+    bool ok = wal ? WalWriteHeader(wal) : WriteAll(bf->fd, &bf->header, sizeof(BlockFileHeader), 0);
+    SnapshotCommit(bf);
+    return ok;
+}
+
+bool BlockFileSync(BlockFile *bf) {
+    struct Wal *wal = WalActive(bf);
+    if (wal) return WalSync(wal);
+    return fdatasync(bf->fd) == 0;
+}
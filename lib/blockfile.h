@@ -0,0 +1,204 @@
+#ifndef BLOCKFILE_H
+#define BLOCKFILE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "arena.h"
+
+// Shared block-file layer used by the TOF, TOVS, indexed, queue and
+// maintenance exercises. A file is a versioned header followed by
+// fixed-size blocks; block i lives at dataOffset + i * blockSize.
+
+#define BF_MAGIC 0x464B4C42u  // "BLKF"
+#define BF_VERSION 1
+#define BF_USER_BYTES 128     // Structure-specific metadata kept in the header
+#define BF_NO_COUNT 0xFFFFFFFFu  // countOffset of blocks that mark empty slots in place
+#define BF_MAX_OPS 16         // Named operations tracked per file
+#define BF_PAGE_SIZE 4096     // Alignment unit of the page-aligned and direct modes
+
+typedef enum {
+    LAYOUT_FIXED = 1,    // A record count plus an array of fixed-size slots
+    LAYOUT_VARIABLE = 2  // A byte area holding variable-length records
+} BlockLayout;
+
+// Where things live inside a block, so generic code can walk the blocks of
+// any structure without knowing its C types
+typedef struct {
+    uint32_t layout;       // BlockLayout
+    uint32_t recordSize;   // Fixed: bytes per slot (0 for variable)
+    uint32_t capacity;     // Fixed: slots per block. Variable: bytes in the data area
+    uint32_t countOffset;  // Offset of the int record count
+    uint32_t dataOffset;   // Fixed: offset of slot 0. Variable: offset of the data area
+} LayoutDesc;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t blockSize;   // Bytes per block on disk
+    uint32_t dataOffset;  // Where block 0 starts
+    LayoutDesc layout;
+    uint32_t blockBytes;  // Bytes of each block callers see; the rest is padding (0: no padding)
+    int64_t nBlocks;
+    int64_t nRecords;
+    int64_t nDeleted;
+    char user[BF_USER_BYTES];
+} BlockFileHeader;
+
+// Block I/O done so far; partial-block accesses count as whole blocks
+typedef struct {
+    int64_t blocksRead;
+    int64_t blocksWritten;
+    int64_t seeks;         // Accesses that did not start at the block after the previous one
+    int64_t bytesRead;
+    int64_t bytesWritten;
+    int64_t ioNanos;       // Time spent inside pread/pwrite
+} IoStats;
+
+// I/O of every completed scope with the same name
+typedef struct {
+    const char *name;
+    int64_t count;
+    IoStats io;
+} OpStats;
+
+struct Wal;
+struct SnapshotStore;
+struct LatchTable;
+
+typedef struct {
+    int fd;
+    int directFd;       // O_DIRECT descriptor while bypassing the cache, else -1
+    bool bypass;
+    uint32_t blockBytes;  // What Read/Write move per block: the caller's block struct
+    char *path;
+    BlockFileHeader header;
+    IoStats stats;      // This file only
+    int64_t nextBlock;  // Where a sequential access would start
+    pthread_mutex_t opLock;
+    int nOps;
+    OpStats ops[BF_MAX_OPS];
+    struct Wal *wal;    // Redo log (lib/wal), or NULL
+    struct SnapshotStore *snapshots;  // Old block images for snapshot readers (lib/snapshot), or NULL
+    Arena scratch;      // Buffers for the operation in progress (lib/arena.h)
+    struct LatchTable *latches;  // Block-range latches (lib/latch), created on first use
+} BlockFile;
+
+// An operation in progress on one thread. It is charged the calling thread's
+// block I/O on every file (a copy reads one file and writes another), and
+// nothing from other threads, so concurrent operations stay apart.
+typedef struct {
+    BlockFile *bf;
+    const char *name;
+    IoStats start;
+} IoOp;
+
+// Describe a block struct: FIXED_LAYOUT(Block, RecordCount, record) for
+// typedef struct { int RecordCount; Record record[N]; } Block;
+#define FIXED_LAYOUT(BlockType, countField, slotsField)                                        \
+    FixedLayout(sizeof(((BlockType *)0)->slotsField[0]),                                       \
+                sizeof(((BlockType *)0)->slotsField) / sizeof(((BlockType *)0)->slotsField[0]), \
+                offsetof(BlockType, countField), offsetof(BlockType, slotsField))
+
+#define VARIABLE_LAYOUT(BlockType, countField, dataField)                         \
+    VariableLayout(sizeof(((BlockType *)0)->dataField), offsetof(BlockType, countField), \
+                   offsetof(BlockType, dataField))
+
+LayoutDesc FixedLayout(uint32_t recordSize, uint32_t capacity, uint32_t countOffset, uint32_t slotsOffset);
+LayoutDesc VariableLayout(uint32_t dataBytes, uint32_t countOffset, uint32_t dataOffset);
+
+// Generic access to a block through its layout. Blocks without a count
+// report every slot as used.
+int BlockCount(const LayoutDesc *layout, const void *block);
+void SetBlockCount(const LayoutDesc *layout, void *block, int count);
+void *BlockSlot(const LayoutDesc *layout, void *block, int i);
+
+// How new files lay out their blocks and how large jobs reach the disk.
+// Process-wide; starts from $BLOCKFILE_IO (buffered, page or direct).
+typedef enum {
+    IO_BUFFERED,      // Blocks are exactly as big as the caller's struct
+    IO_PAGE_ALIGNED,  // New files pad blocks to a power-of-two multiple of BF_PAGE_SIZE
+    IO_DIRECT         // Page-aligned, and BlockFileBypassCache turns on O_DIRECT
+} IoMode;
+
+void BlockFileSetIoMode(IoMode mode);
+IoMode BlockFileIoMode(void);
+// Smallest power-of-two multiple of BF_PAGE_SIZE holding n bytes
+uint32_t PageAlignedSize(uint32_t n);
+
+// Large sequential jobs (scans, compactions, reorganisations) wrap
+// themselves in BypassCache(bf, true) / (bf, false) so they do not evict the
+// hot working set. Whole-block I/O then goes through O_DIRECT with aligned
+// bounce buffers. It only happens in IO_DIRECT mode, on page-aligned files,
+// on filesystems that support it; returns whether bypass is now on.
+bool BlockFileBypassCache(BlockFile *bf, bool on);
+
+// Open/close. Create truncates; blockSize is the size of the caller's block
+// struct, padded on disk in the page-aligned modes. Open fails (NULL) on a
+// missing file or a bad magic/version; OpenOrCreate falls back to Create.
+BlockFile *BlockFileCreate(const char *path, uint32_t blockSize, LayoutDesc layout);
+BlockFile *BlockFileOpen(const char *path);
+BlockFile *BlockFileOpenOrCreate(const char *path, uint32_t blockSize, LayoutDesc layout, bool *created);
+void BlockFileClose(BlockFile *bf);
+// Close without writing anything back, as a crash would leave the file.
+// Snapshots (lib/snapshot.h) have to be closed first.
+void BlockFileAbandon(BlockFile *bf);
+
+// Block I/O through pread/pwrite, so concurrent callers never share a file
+// position. Reads past the last block return false; writes past it extend
+// the file.
+bool BlockFileRead(BlockFile *bf, int64_t blockNo, void *buf);
+bool BlockFileWrite(BlockFile *bf, int64_t blockNo, const void *buf);
+int64_t BlockFileReadRange(BlockFile *bf, int64_t first, int64_t count, void *buf);
+bool BlockFileWriteRange(BlockFile *bf, int64_t first, int64_t count, const void *buf);
+
+// Partial-block access for structures that update a few bytes in place.
+// Always buffered, even while bypassing the cache.
+bool BlockFileReadBytes(BlockFile *bf, int64_t blockNo, uint32_t offset, void *buf, uint32_t n);
+bool BlockFileWriteBytes(BlockFile *bf, int64_t blockNo, uint32_t offset, const void *buf, uint32_t n);
+
+// Drop every block from nBlocks on
+bool BlockFileTruncate(BlockFile *bf, int64_t nBlocks);
+
+// Totals over every block file the process has used, and over the calling thread
+IoStats BlockFileTotals(void);
+IoStats BlockFileThreadTotals(void);
+IoStats IoStatsDiff(IoStats end, IoStats start);
+void IoStatsAdd(IoStats *into, IoStats delta);
+
+// Per-operation accounting:
+//   IoOp op = BlockFileOpBegin(file, "insert");
+//   ... ReadBlock/WriteBlock ...
+//   BlockFileOpEnd(&op);
+// End returns the I/O of this operation and adds it to the file's entry for
+// the name (names are compared as strings; past BF_MAX_OPS names are dropped).
+// A scope abandoned on an error path needs no cleanup. I/O done by other
+// threads on the operation's behalf is not charged to it.
+IoOp BlockFileOpBegin(BlockFile *bf, const char *name);
+IoStats BlockFileOpEnd(IoOp *op);
+// A copy of the totals for one name; false if it never ran
+bool BlockFileOpStats(BlockFile *bf, const char *name, OpStats *out);
+// Average block I/O per operation, one line per name
+void BlockFilePrintOps(BlockFile *bf, FILE *out);
+
+// One JSON object with the file's counters and per-operation totals. Close
+// also appends it as a line to $BLOCKFILE_STATS when set ("-" is stderr).
+void BlockFileWriteStatsJson(BlockFile *bf, FILE *out);
+
+// For asynchronous back ends (lib/aio) that move whole blocks themselves:
+// the descriptor to use right now (O_DIRECT while bypassing the cache), where
+// a block starts, and accounting for a transfer they completed in `nanos`.
+// Accounted writes extend nBlocks like BlockFileWrite.
+int BlockFileBlockFd(BlockFile *bf);
+int64_t BlockFileBlockOffset(const BlockFile *bf, int64_t blockNo);
+void BlockFileAccountIo(BlockFile *bf, int64_t first, int64_t count, bool write, int64_t nanos);
+
+// The in-memory header only reaches the file through WriteHeader (and
+// Close); Sync makes everything written so far durable. With a redo log
+// attached, writes go through it (see lib/wal.h).
+bool BlockFileWriteHeader(BlockFile *bf);
+bool BlockFileSync(BlockFile *bf);
+
+#endif
@@ -0,0 +1,132 @@
+#include "bloom.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOOM_MAGIC 0x464D4C42u  // "BLMF"
+#define BLOOM_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nFilters;
+    uint32_t words;
+    uint32_t nHashes;
+    uint32_t pad;
+    double fpRate;
+    uint64_t stamp;
+} SidecarHeader;
+
+BloomSet *BloomCreate(uint32_t nFilters, uint32_t keysPerFilter, double fpRate) {
+    if (keysPerFilter < 1) keysPerFilter = 1;
+    if (fpRate <= 0 || fpRate >= 1) fpRate = 0.01;
+    double bits = -(double)keysPerFilter * log(fpRate) / (M_LN2 * M_LN2);
+    BloomSet *bs = calloc(1, sizeof(BloomSet));
+    bs->words = (uint32_t)ceil(bits / 64);
+    bs->nHashes = (uint32_t)lround(bits / keysPerFilter * M_LN2);
+    if (bs->nHashes < 1) bs->nHashes = 1;
+    bs->fpRate = fpRate;
+    bs->nFilters = nFilters;
+    bs->bits = calloc((size_t)nFilters * bs->words + 1, sizeof(uint64_t));
+    return bs;
+}
+
+void BloomFree(BloomSet *bs) {
+    if (!bs) return;
+    free(bs->bits);
+    free(bs);
+}
+
+// FNV-1a, then a murmur finalizer so keys differing in one digit spread out.
+// The two halves drive double hashing: bit i is h1 + i * h2.
+static uint64_t Hash(const void *key, size_t len) {
+    const unsigned char *p = key;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) h = (h ^ p[i]) * 0x100000001b3ull;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+void BloomAdd(BloomSet *bs, uint32_t filter, const void *key, size_t len) {
+    if (filter >= bs->nFilters) {
+        uint32_t n = filter + 1 > 2 * bs->nFilters ? filter + 1 : 2 * bs->nFilters;
+        bs->bits = realloc(bs->bits, ((size_t)n * bs->words + 1) * sizeof(uint64_t));
+        memset(bs->bits + (size_t)bs->nFilters * bs->words, 0, (size_t)(n - bs->nFilters) * bs->words * sizeof(uint64_t));
+        bs->nFilters = n;
+    }
+    uint64_t *f = bs->bits + (size_t)filter * bs->words, h = Hash(key, len), m = (uint64_t)bs->words * 64;
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (uint32_t i = 0; i < bs->nHashes; i++) {
+        uint64_t bit = ((uint64_t)h1 + (uint64_t)i * h2) % m;
+        f[bit / 64] |= 1ull << (bit % 64);
+    }
+}
+
+bool BloomMayContain(BloomSet *bs, uint32_t filter, const void *key, size_t len) {
+    __atomic_add_fetch(&bs->checks, 1, __ATOMIC_RELAXED);
+    if (filter >= bs->nFilters) {
+        __atomic_add_fetch(&bs->negatives, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    const uint64_t *f = bs->bits + (size_t)filter * bs->words;
+    uint64_t h = Hash(key, len), m = (uint64_t)bs->words * 64;
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 32) | 1;
+    for (uint32_t i = 0; i < bs->nHashes; i++) {
+        uint64_t bit = ((uint64_t)h1 + (uint64_t)i * h2) % m;
+        if (!(f[bit / 64] & (1ull << (bit % 64)))) {
+            __atomic_add_fetch(&bs->negatives, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+    return true;
+}
+
+void BloomClear(BloomSet *bs, uint32_t filter) {
+    if (filter < bs->nFilters) memset(bs->bits + (size_t)filter * bs->words, 0, bs->words * sizeof(uint64_t));
+}
+
+static char *SidecarPath(const char *dataPath) {
+    size_t n = strlen(dataPath);
+    char *path = malloc(n + sizeof(".bloom"));
+    memcpy(path, dataPath, n);
+    memcpy(path + n, ".bloom", sizeof(".bloom"));
+    return path;
+}
+
+bool BloomSave(const BloomSet *bs, const char *dataPath) {
+    char *path = SidecarPath(dataPath);
+    FILE *out = fopen(path, "wb");
+    free(path);
+    if (!out) return false;
+    SidecarHeader h = {BLOOM_MAGIC, BLOOM_VERSION, bs->nFilters, bs->words, bs->nHashes, 0, bs->fpRate, bs->stamp};
+    size_t n = (size_t)bs->nFilters * bs->words;
+    bool ok = fwrite(&h, sizeof(h), 1, out) == 1 && fwrite(bs->bits, sizeof(uint64_t), n, out) == n;
+    return fclose(out) == 0 && ok;
+}
+
+BloomSet *BloomLoad(const char *dataPath, uint64_t stamp) {
+    char *path = SidecarPath(dataPath);
+    FILE *in = fopen(path, "rb");
+    free(path);
+    if (!in) return NULL;
+    SidecarHeader h;
+    BloomSet *bs = NULL;
+    if (fread(&h, sizeof(h), 1, in) == 1 && h.magic == BLOOM_MAGIC && h.version == BLOOM_VERSION &&
+        h.stamp == stamp && h.words > 0 && h.nHashes > 0) {
+        size_t n = (size_t)h.nFilters * h.words;
+        bs = calloc(1, sizeof(BloomSet));
+        *bs = (BloomSet){h.nFilters, h.words, h.nHashes, h.fpRate, h.stamp, calloc(n + 1, sizeof(uint64_t)), 0, 0};
+        if (fread(bs->bits, sizeof(uint64_t), n, in) != n) {
+            BloomFree(bs);
+            bs = NULL;
+        }
+    }
+    fclose(in);
+    return bs;
+}
@@ -0,0 +1,47 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A set of equally sized Bloom filters, one per block or per overflow
+// chain, checked before the block is read: a negative answer is certain,
+// so a lookup for a missing key skips the read. Filters only ever gain
+// keys; structures rebuild them when records go away (reorganisation).
+//
+// They live in a sidecar next to the data file ("<path>.bloom"). The owner
+// picks a stamp that changes whenever the data file does (record and block
+// counts, say); a sidecar whose stamp does not match is stale, and Load
+// refuses it so the caller rebuilds from the data.
+
+typedef struct {
+    uint32_t nFilters;
+    uint32_t words;     // 64-bit words per filter
+    uint32_t nHashes;
+    double fpRate;      // Target false-positive rate at the sized key count
+    uint64_t stamp;
+    uint64_t *bits;     // nFilters * words
+    // MayContain calls, and how many said no; counted atomically, since
+    // batched lookups check filters from several threads
+    int64_t checks;
+    int64_t negatives;
+} BloomSet;
+
+// Filters for keysPerFilter keys each at false-positive rate fpRate:
+// m = -n ln p / (ln 2)^2 bits and k = (m / n) ln 2 hashes
+BloomSet *BloomCreate(uint32_t nFilters, uint32_t keysPerFilter, double fpRate);
+void BloomFree(BloomSet *bs);
+
+// Adding to a filter past the last one grows the set
+void BloomAdd(BloomSet *bs, uint32_t filter, const void *key, size_t len);
+// False only if the key was never added to that filter. Filters the set
+// does not have yet are empty.
+bool BloomMayContain(BloomSet *bs, uint32_t filter, const void *key, size_t len);
+void BloomClear(BloomSet *bs, uint32_t filter);
+
+bool BloomSave(const BloomSet *bs, const char *dataPath);
+// NULL when the sidecar is missing, unreadable or stamped differently
+BloomSet *BloomLoad(const char *dataPath, uint64_t stamp);
+
+#endif
@@ -0,0 +1,139 @@
+#include "bufpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    int64_t blockNo;  // -1 while the frame is free
+    int pins;
+    bool dirty;
+    bool referenced;  // Clock bit: set on every pin, cleared as the hand passes
+    int next;         // Next frame in the same hash bucket (-1 at the end)
+} Frame;
+
+struct BufferPool {
+    BlockFile *bf;
+    int nFrames;
+    size_t frameBytes;
+    char *data;  // nFrames blocks of frameBytes
+    Frame *frames;
+    int *buckets;  // Block number -> first frame, chained through Frame.next
+    int nBuckets;  // Power of two
+    int hand;
+    PoolStats stats;
+};
+
+static int Bucket(const BufferPool *pool, int64_t blockNo) {
+    return (int)(((uint64_t)blockNo * 0x9E3779B97F4A7C15ull) >> 32) & (pool->nBuckets - 1);
+}
+
+static void *FrameData(const BufferPool *pool, int f) {
+    return pool->data + (size_t)f * pool->frameBytes;
+}
+
+BufferPool *BufferPoolOpen(BlockFile *bf, int frames) {
+    BufferPool *pool = calloc(1, sizeof(BufferPool));
+    pool->bf = bf;
+    pool->nFrames = frames > 0 ? frames : 1;
+    pool->frameBytes = bf->blockBytes;
+    pool->data = calloc(pool->nFrames, pool->frameBytes);
+    pool->frames = malloc(pool->nFrames * sizeof(Frame));
+    for (pool->nBuckets = 1; pool->nBuckets < 2 * pool->nFrames; pool->nBuckets *= 2) {}
+    pool->buckets = malloc(pool->nBuckets * sizeof(int));
+    for (int b = 0; b < pool->nBuckets; b++) pool->buckets[b] = -1;
+    for (int f = 0; f < pool->nFrames; f++) pool->frames[f] = (Frame){-1, 0, false, false, -1};
+    return pool;
+}
+
+static bool WriteBack(BufferPool *pool, int f) {
+    Frame *frame = &pool->frames[f];
+    if (!frame->dirty) return true;
+    if (!BlockFileWrite(pool->bf, frame->blockNo, FrameData(pool, f))) return false;
+    frame->dirty = false;
+    pool->stats.writeBacks++;
+    return true;
+}
+
+static void Unlink(BufferPool *pool, int f) {
+    int *link = &pool->buckets[Bucket(pool, pool->frames[f].blockNo)];
+    while (*link != f) link = &pool->frames[*link].next;
+    *link = pool->frames[f].next;
+}
+
+// Clock sweep for an unpinned frame; two full turns clear every reference bit
+static int Victim(BufferPool *pool) {
+    for (int step = 0; step < 2 * pool->nFrames; step++) {
+        int f = pool->hand;
+        Frame *frame = &pool->frames[f];
+        pool->hand = (pool->hand + 1) % pool->nFrames;
+        if (frame->pins > 0) continue;
+        if (frame->referenced) {
+            frame->referenced = false;
+            continue;
+        }
+        if (frame->blockNo >= 0) {
+            if (!WriteBack(pool, f)) return -1;
+            Unlink(pool, f);
+        }
+        return f;
+    }
+    return -1;
+}
+
+void *PoolPin(BufferPool *pool, int64_t blockNo, bool fresh) {
+    for (int f = pool->buckets[Bucket(pool, blockNo)]; f != -1; f = pool->frames[f].next) {
+        if (pool->frames[f].blockNo == blockNo) {
+            pool->frames[f].pins++;
+            pool->frames[f].referenced = true;
+            pool->stats.hits++;
+            if (fresh) memset(FrameData(pool, f), 0, pool->frameBytes);
+            return FrameData(pool, f);
+        }
+    }
+
+    int f = Victim(pool);
+    if (f < 0) {
+        fprintf(stderr, "Buffer pool: all %d frames are pinned\n", pool->nFrames);
+        return NULL;
+    }
+    pool->stats.misses++;
+    void *data = FrameData(pool, f);
+    if (fresh) {
+        memset(data, 0, pool->frameBytes);
+    } else if (!BlockFileRead(pool->bf, blockNo, data)) {
+        pool->frames[f].blockNo = -1;
+        return NULL;
+    }
+    int b = Bucket(pool, blockNo);
+    pool->frames[f] = (Frame){blockNo, 1, fresh, true, pool->buckets[b]};
+    pool->buckets[b] = f;
+    return data;
+}
+
+void PoolUnpin(BufferPool *pool, void *block, bool dirty) {
+    int f = (int)(((char *)block - pool->data) / pool->frameBytes);
+    pool->frames[f].pins--;
+    if (dirty) pool->frames[f].dirty = true;
+}
+
+bool PoolFlush(BufferPool *pool) {
+    bool ok = true;
+    for (int f = 0; f < pool->nFrames; f++) {
+        if (pool->frames[f].blockNo >= 0 && !WriteBack(pool, f)) ok = false;
+    }
+    return ok;
+}
+
+PoolStats PoolGetStats(const BufferPool *pool) {
+    return pool->stats;
+}
+
+bool BufferPoolClose(BufferPool *pool) {
+    bool ok = PoolFlush(pool);
+    free(pool->data);
+    free(pool->frames);
+    free(pool->buckets);
+    free(pool);
+    return ok;
+}
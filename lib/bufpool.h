@@ -0,0 +1,39 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "blockfile.h"
+
+// A fixed set of in-memory frames caching the blocks of one block file, for
+// structures that revisit the same blocks (the upper levels of a tree).
+// Frames are replaced with the clock algorithm; a pinned frame is never
+// replaced, and a dirty one is written back when it is. Not thread-safe.
+//
+//   Node *node = PoolPin(pool, blockNo, false);
+//   ... read or modify *node ...
+//   PoolUnpin(pool, node, modified);
+
+typedef struct BufferPool BufferPool;
+
+typedef struct {
+    int64_t hits;
+    int64_t misses;      // Pins that had to read the block (or take a fresh frame)
+    int64_t writeBacks;  // Dirty frames written on eviction or flush
+} PoolStats;
+
+BufferPool *BufferPoolOpen(BlockFile *bf, int frames);
+// Writes back every dirty frame, then frees the pool (not the file)
+bool BufferPoolClose(BufferPool *pool);
+
+// The block's frame, pinned. `fresh` skips the read for a block about to be
+// overwritten (a new node) and hands back a zeroed frame. NULL when every
+// frame is pinned or the read fails.
+void *PoolPin(BufferPool *pool, int64_t blockNo, bool fresh);
+void PoolUnpin(BufferPool *pool, void *block, bool dirty);
+
+// Write back every dirty frame, keeping them cached
+bool PoolFlush(BufferPool *pool);
+PoolStats PoolGetStats(const BufferPool *pool);
+
+#endif
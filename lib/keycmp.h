@@ -0,0 +1,106 @@
+#ifndef KEYCMP_H
+#define KEYCMP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Key comparison for in-block search, once the block is cached and the CPU
+// is what a lookup costs.
+//
+// Fixed-width string keys (up to 16 bytes) are normalised to two big-endian
+// words, zero padded: comparing those as integers orders keys like memcmp,
+// in two compares instead of a byte loop. Equality against every slot of a
+// block goes through a probe: one 16-byte SSE2 compare per slot, masked to
+// the key width (plain memcmp without SSE2). int keys get a branchless
+// lower bound over their slots.
+
+typedef struct {
+    uint64_t hi, lo;
+} NormKey;
+
+static inline uint64_t KeyLoadBE(const unsigned char *p) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+// The first len (<= 16) bytes of key, stopping early at a NUL like strncmp
+static inline NormKey NormKeyFrom(const char *key, size_t len) {
+    unsigned char buf[16] = {0};
+    memcpy(buf, key, strnlen(key, len > 16 ? 16 : len));
+    return (NormKey){KeyLoadBE(buf), KeyLoadBE(buf + 8)};
+}
+
+static inline int NormKeyCompare(NormKey a, NormKey b) {
+    if (a.hi != b.hi) return a.hi < b.hi ? -1 : 1;
+    return (a.lo > b.lo) - (a.lo < b.lo);
+}
+
+typedef struct {
+    unsigned char bytes[16];  // The key, zero padded
+    size_t len;
+#ifdef __SSE2__
+    __m128i vec;
+    int mask;  // movemask bits that must all match
+#endif
+} KeyProbe;
+
+static inline KeyProbe KeyProbeFrom(const char *key, size_t len) {
+    KeyProbe p;
+    memset(p.bytes, 0, sizeof(p.bytes));
+    p.len = len > 16 ? 16 : len;
+    memcpy(p.bytes, key, strnlen(key, p.len));
+#ifdef __SSE2__
+    p.vec = _mm_loadu_si128((const __m128i *)p.bytes);
+    p.mask = (int)((1u << p.len) - 1);
+#endif
+    return p;
+}
+
+// Whether the len key bytes at slot match. Reads 16 bytes at slot with SSE2,
+// so a slot needs 16 readable bytes from its key on.
+static inline bool KeyProbeMatches(const KeyProbe *p, const void *slot) {
+#ifdef __SSE2__
+    __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)slot), p->vec);
+    return (_mm_movemask_epi8(eq) & p->mask) == p->mask;
+#else
+    return memcmp(slot, p->bytes, p->len) == 0;
+#endif
+}
+
+// First of n slots, stride bytes apart with the key at the start of each,
+// that matches the probe, or -1
+static inline int KeyProbeFind(const KeyProbe *p, const void *slots, int n, size_t stride) {
+    const unsigned char *s = slots;
+    for (int i = 0; i < n; i++, s += stride) {
+        if (KeyProbeMatches(p, s)) return i;
+    }
+    return -1;
+}
+
+// Index of the first of n sorted int keys, stride bytes apart, that is >= key
+// (n when none is). The ternary compiles to a conditional move.
+static inline int IntLowerBound(const void *keys, int n, size_t stride, int key) {
+    if (n == 0) return 0;
+    const unsigned char *base = keys;
+    while (n > 1) {
+        int half = n / 2;
+        int k;
+        memcpy(&k, base + (size_t)half * stride, sizeof(k));
+        base = k < key ? base + (size_t)half * stride : base;
+        n -= half;
+    }
+    int k;
+    memcpy(&k, base, sizeof(k));
+    return (int)((base - (const unsigned char *)keys) / stride) + (k < key);
+}
+
+#endif
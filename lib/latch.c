@@ -0,0 +1,118 @@
+#include "latch.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+// One cache line each, so readers of one stripe do not share a line with
+// a writer of the next
+typedef struct {
+    _Alignas(64) uint64_t version;  // Odd while a writer holds the stripe
+    pthread_mutex_t lock;           // Serialises writers
+} Stripe;
+
+struct LatchTable {
+    Stripe stripes[LATCH_STRIPES];
+    int64_t retries;
+};
+
+static __thread const LatchTable *holding;  // Table this thread has latched
+
+static int StripeOf(int64_t blockNo) {
+    return (int)((blockNo / LATCH_SEGMENT) % LATCH_STRIPES);
+}
+
+LatchTable *BlockLatches(BlockFile *bf) {
+    LatchTable *t = __atomic_load_n(&bf->latches, __ATOMIC_ACQUIRE);
+    if (t) return t;
+    LatchTable *fresh = aligned_alloc(64, sizeof(LatchTable));
+    memset(fresh, 0, sizeof(LatchTable));
+    for (int i = 0; i < LATCH_STRIPES; i++) pthread_mutex_init(&fresh->stripes[i].lock, NULL);
+    if (__atomic_compare_exchange_n(&bf->latches, &t, fresh, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return fresh;
+    LatchTableFree(fresh);
+    return t;
+}
+
+void LatchTableFree(LatchTable *t) {
+    if (t == NULL) return;
+    for (int i = 0; i < LATCH_STRIPES; i++) pthread_mutex_destroy(&t->stripes[i].lock);
+    free(t);
+}
+
+// The stripes blocks [first, last] map to
+static void StripesOf(int64_t first, int64_t last, bool *in) {
+    memset(in, 0, LATCH_STRIPES * sizeof(bool));
+    int64_t from = first / LATCH_SEGMENT, to = last / LATCH_SEGMENT;
+    if (to - from + 1 >= LATCH_STRIPES) to = from + LATCH_STRIPES - 1;
+    for (int64_t s = from; s <= to; s++) in[s % LATCH_STRIPES] = true;
+}
+
+void LatchWrite(LatchTable *t, int64_t first, int64_t last) {
+    bool in[LATCH_STRIPES];
+    StripesOf(first, last, in);
+    for (int i = 0; i < LATCH_STRIPES; i++) {
+        if (!in[i]) continue;
+        pthread_mutex_lock(&t->stripes[i].lock);
+        __atomic_fetch_add(&t->stripes[i].version, 1, __ATOMIC_SEQ_CST);
+    }
+    holding = t;
+}
+
+void LatchRelease(LatchTable *t, int64_t first, int64_t last) {
+    bool in[LATCH_STRIPES];
+    StripesOf(first, last, in);
+    for (int i = LATCH_STRIPES - 1; i >= 0; i--) {
+        if (!in[i]) continue;
+        __atomic_fetch_add(&t->stripes[i].version, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&t->stripes[i].lock);
+    }
+    holding = NULL;
+}
+
+uint64_t LatchReadBegin(LatchTable *t, int64_t blockNo) {
+    if (holding == t) return 0;
+    uint64_t v;
+    while ((v = __atomic_load_n(&t->stripes[StripeOf(blockNo)].version, __ATOMIC_ACQUIRE)) & 1) sched_yield();
+    return v;
+}
+
+bool LatchReadValid(LatchTable *t, int64_t blockNo, uint64_t version) {
+    if (holding == t) return true;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&t->stripes[StripeOf(blockNo)].version, __ATOMIC_RELAXED) == version) return true;
+    __atomic_add_fetch(&t->retries, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+void LatchReadsReset(LatchReads *r) {
+    r->n = 0;
+}
+
+void LatchReadNote(LatchTable *t, LatchReads *r, int64_t blockNo) {
+    if (holding == t) return;
+    int s = StripeOf(blockNo);
+    for (int i = 0; i < r->n; i++) {
+        if (r->stripe[i] == s) return;
+    }
+    uint64_t v = LatchReadBegin(t, blockNo);
+    if (r->n == LATCH_READ_SET) return;
+    r->stripe[r->n] = (uint16_t)s;
+    r->version[r->n++] = v;
+}
+
+bool LatchReadsValid(LatchTable *t, const LatchReads *r) {
+    if (holding == t) return true;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    for (int i = 0; i < r->n; i++) {
+        if (__atomic_load_n(&t->stripes[r->stripe[i]].version, __ATOMIC_RELAXED) != r->version[i]) {
+            __atomic_add_fetch(&t->retries, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+    return true;
+}
+
+int64_t LatchRetries(const LatchTable *t) {
+    return __atomic_load_n(&t->retries, __ATOMIC_RELAXED);
+}
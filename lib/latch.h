@@ -0,0 +1,56 @@
+#ifndef LATCH_H
+#define LATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "blockfile.h"
+
+// Block-range latches for a file that many threads read while writers
+// update it in place. Blocks map to stripes LATCH_SEGMENT at a time, so a
+// run of neighbouring blocks shares a few stripes, wrapping around
+// LATCH_STRIPES.
+//
+// A writer latches the range of blocks it will rewrite. It locks the
+// stripes' mutexes in stripe order, so writers whose ranges overlap
+// serialise and others do not, and it turns each stripe's version odd
+// until Release.
+//
+// Readers take nothing. They note the versions of the stripes they read
+// and check them afterwards, like a seqlock, and retry when a writer got
+// in between. A read writes no shared memory, so readers on different
+// cores do not slow each other down. A thread holding write latches reads
+// the table's blocks without checks.
+
+#define LATCH_SEGMENT 16    // Blocks per stripe
+#define LATCH_STRIPES 256
+#define LATCH_READ_SET 64   // Stripes one multi-block read checks; past that, reads go unchecked
+
+typedef struct LatchTable LatchTable;
+
+// The stripes and versions one multi-block read has seen
+typedef struct {
+    int n;
+    uint16_t stripe[LATCH_READ_SET];
+    uint64_t version[LATCH_READ_SET];
+} LatchReads;
+
+// bf's table, created on first use
+LatchTable *BlockLatches(BlockFile *bf);
+void LatchTableFree(LatchTable *t);
+
+// Blocks [first, last], exclusively. One range at a time per thread.
+void LatchWrite(LatchTable *t, int64_t first, int64_t last);
+void LatchRelease(LatchTable *t, int64_t first, int64_t last);
+
+// One block: Begin waits out a writer and returns the version to pass to
+// Valid once the block has been read
+uint64_t LatchReadBegin(LatchTable *t, int64_t blockNo);
+bool LatchReadValid(LatchTable *t, int64_t blockNo, uint64_t version);
+// Several blocks: Note each one before reading it, check them all at the end
+void LatchReadsReset(LatchReads *r);
+void LatchReadNote(LatchTable *t, LatchReads *r, int64_t blockNo);
+bool LatchReadsValid(LatchTable *t, const LatchReads *r);
+// Reads that failed validation so far
+int64_t LatchRetries(const LatchTable *t);
+
+#endif
@@ -0,0 +1,215 @@
+#include "merge.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include "aio.h"
+
+// Records of one input, in file order
+typedef struct {
+    const MergeInput *in;
+    const LayoutDesc *layout;
+    ReadAhead *ra;
+    char *chunk;       // MERGE_CHUNK blocks
+    int nBlocks;       // Blocks in chunk
+    int block, slot;   // Position of the next record to look at
+    const void *rec;   // Current record, NULL at the end
+    bool failed;
+} Cursor;
+
+static void CursorNext(Cursor *c) {
+    size_t bytes = c->in->bf->blockBytes;
+    for (;;) {
+        if (c->block < c->nBlocks) {
+            char *block = c->chunk + c->block * bytes;
+            if (c->slot < BlockCount(c->layout, block)) {
+                c->rec = BlockSlot(c->layout, block, c->slot++);
+                if (!c->in->live || c->in->live(c->rec)) return;
+                continue;
+            }
+            c->block++;
+            c->slot = 0;
+            continue;
+        }
+        c->nBlocks = ReadAheadNext(c->ra, c->chunk, NULL);
+        c->block = 0;
+        c->slot = 0;
+        if (c->nBlocks <= 0) {
+            c->failed = c->nBlocks < 0;
+            c->nBlocks = 0;
+            c->rec = NULL;
+            return;
+        }
+    }
+}
+
+static bool CursorOpen(Cursor *c, const MergeInput *in) {
+    *c = (Cursor){in, &in->bf->header.layout};
+    if (c->layout->layout != LAYOUT_FIXED) return false;
+    c->chunk = malloc((size_t)MERGE_CHUNK * in->bf->blockBytes);
+    c->ra = ReadAheadOpen(in->bf, 0, in->blocks, 0, MERGE_CHUNK);
+    CursorNext(c);
+    return true;
+}
+
+static void CursorClose(Cursor *c) {
+    if (c->ra) ReadAheadClose(c->ra);
+    free(c->chunk);
+}
+
+// Output blocks, staged MERGE_CHUNK at a time for the write-behind
+typedef struct {
+    MergeOutput *out;
+    const LayoutDesc *layout;
+    WriteBehind *wb;
+    char *chunk;
+    int nBlocks;   // Staged blocks, the last one being filled
+    int perBlock;
+    int count;     // Records in the block being filled
+    int64_t first; // Block number of chunk's first block
+    int64_t records;
+} Packer;
+
+static char *PackerBlock(Packer *p) {
+    return p->chunk + (size_t)(p->nBlocks - 1) * p->out->bf->blockBytes;
+}
+
+static void PackerFlush(Packer *p) {
+    if (p->nBlocks == 0) return;
+    WriteBehindPut(p->wb, p->first, p->nBlocks, p->chunk);
+    p->first += p->nBlocks;
+    p->nBlocks = 0;
+}
+
+static void PackerStartBlock(Packer *p) {
+    if (p->nBlocks == MERGE_CHUNK) PackerFlush(p);
+    p->nBlocks++;
+    char *block = PackerBlock(p);
+    size_t bytes = p->out->bf->blockBytes;
+    if (p->out->emptyBlock) {
+        memcpy(block, p->out->emptyBlock, bytes);
+    } else {
+        memset(block, 0, bytes);
+    }
+    p->count = 0;
+}
+
+// The next free output slot
+static void *PackerSlot(Packer *p) {
+    if (p->nBlocks == 0 || p->count == p->perBlock) PackerStartBlock(p);
+    void *slot = BlockSlot(p->layout, PackerBlock(p), p->count++);
+    SetBlockCount(p->layout, PackerBlock(p), p->count);
+    p->records++;
+    return slot;
+}
+
+static bool PackerOpen(Packer *p, MergeOutput *out) {
+    *p = (Packer){out, &out->bf->header.layout};
+    if (p->layout->layout != LAYOUT_FIXED) return false;
+    p->perBlock = out->fill > 0 && out->fill < (int)p->layout->capacity ? out->fill : (int)p->layout->capacity;
+    p->chunk = malloc((size_t)MERGE_CHUNK * out->bf->blockBytes);
+    p->wb = WriteBehindOpen(out->bf, 0, MERGE_CHUNK);
+    return true;
+}
+
+static bool PackerClose(Packer *p) {
+    PackerFlush(p);
+    bool ok = WriteBehindClose(p->wb);
+    p->out->blocks = p->first;
+    free(p->chunk);
+    return ok;
+}
+
+static void Emit(Packer *p, const void *record, int side) {
+    void *slot = PackerSlot(p);
+    if (p->out->copy) {
+        p->out->copy(slot, record, side, p->out->ctx);
+    } else {
+        memcpy(slot, record, p->layout->recordSize);
+    }
+}
+
+// Opens everything, or nothing
+static bool Begin(Cursor *ca, Cursor *cb, Packer *p, const MergeInput *a, const MergeInput *b, MergeOutput *out,
+                  bool copies) {
+    uint32_t size = out->bf->header.layout.recordSize;
+    if (copies && !out->copy &&
+        (a->bf->header.layout.recordSize != size || b->bf->header.layout.recordSize != size)) {
+        return false;
+    }
+    if (!CursorOpen(ca, a)) return false;
+    if (!CursorOpen(cb, b)) {
+        CursorClose(ca);
+        return false;
+    }
+    if (!PackerOpen(p, out)) {
+        CursorClose(ca);
+        CursorClose(cb);
+        return false;
+    }
+    return true;
+}
+
+static int64_t End(Cursor *ca, Cursor *cb, Packer *p) {
+    bool ok = PackerClose(p) && !ca->failed && !cb->failed;
+    CursorClose(ca);
+    CursorClose(cb);
+    return ok ? p->records : -1;
+}
+
+int64_t MergeSets(MergeOp op, const MergeInput *a, const MergeInput *b, MergeCompare compare, MergeOutput *out) {
+    Cursor ca, cb;
+    Packer p;
+    if (!Begin(&ca, &cb, &p, a, b, out, true)) return -1;
+    // The last a record, kept so that b's records with its key are dropped
+    // even after a has moved on
+    size_t size = ca.layout->recordSize;
+    char *prev = malloc(size);
+    bool havePrev = false;
+    while (ca.rec) {
+        while (cb.rec && compare(ca.rec, cb.rec) > 0) {
+            if (op == MERGE_UNION && !(havePrev && compare(prev, cb.rec) == 0)) Emit(&p, cb.rec, 1);
+            CursorNext(&cb);
+        }
+        bool inB = cb.rec && compare(ca.rec, cb.rec) == 0;
+        if (op == MERGE_UNION || (op == MERGE_INTERSECT) == inB) Emit(&p, ca.rec, 0);
+        memcpy(prev, ca.rec, size);
+        havePrev = true;
+        CursorNext(&ca);
+    }
+    for (; op == MERGE_UNION && cb.rec; CursorNext(&cb)) {
+        if (!(havePrev && compare(prev, cb.rec) == 0)) Emit(&p, cb.rec, 1);
+    }
+    free(prev);
+    return End(&ca, &cb, &p);
+}
+
+int64_t MergeJoin(const MergeInput *a, const MergeInput *b, MergeCompare compare, MergeOutput *out) {
+    Cursor ca, cb;
+    Packer p;
+    if (!out->join || !Begin(&ca, &cb, &p, a, b, out, false)) return -1;
+    size_t size = cb.layout->recordSize;
+    size_t capacity = 16;
+    char *group = malloc(capacity * size);  // b's records with the current key
+    while (ca.rec && cb.rec) {
+        int c = compare(ca.rec, cb.rec);
+        if (c < 0) {
+            CursorNext(&ca);
+        } else if (c > 0) {
+            CursorNext(&cb);
+        } else {
+            size_t n = 0;
+            for (; cb.rec && compare(ca.rec, cb.rec) == 0; CursorNext(&cb)) {
+                if (n == capacity) {
+                    capacity *= 2;
+                    group = realloc(group, capacity * size);
+                }
+                memcpy(group + n++ * size, cb.rec, size);
+            }
+            for (; ca.rec && compare(ca.rec, group) == 0; CursorNext(&ca)) {
+                for (size_t i = 0; i < n; i++) out->join(PackerSlot(&p), ca.rec, group + i * size, out->ctx);
+            }
+        }
+    }
+    free(group);
+    return End(&ca, &cb, &p);
+}
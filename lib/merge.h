@@ -0,0 +1,54 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "blockfile.h"
+
+// Set operations and an equi-join over two block files whose records are
+// sorted by key in file order (a TOF, an indexed file's primary zone). Both
+// are merged in one pass: each input is read once through a read-ahead,
+// and the result is packed into the blocks of a new fixed-layout file
+// through a write-behind. Records are found through each file's LayoutDesc,
+// so the same code serves any structure.
+//
+// Sets keep a's records and take b's only where a has no record with that
+// key; a's duplicate keys all survive. The join pairs every a record with
+// every b record of the same key, holding b's records for one key in memory.
+
+#define MERGE_CHUNK 16  // Blocks per read-ahead and write-behind request
+
+typedef enum {
+    MERGE_UNION,      // a, plus b's records whose key a does not have
+    MERGE_INTERSECT,  // a's records whose key b has
+    MERGE_DIFFERENCE  // a's records whose key b does not have
+} MergeOp;
+
+typedef struct {
+    BlockFile *bf;
+    int64_t blocks;                     // Blocks [0, blocks) hold the records
+    bool (*live)(const void *record);   // NULL: every counted slot holds one
+} MergeInput;
+
+typedef struct {
+    BlockFile *bf;           // Written from block 0 on; its layout must be fixed
+    int fill;                // Records per block; 0 fills blocks up
+    const void *emptyBlock;  // What every block starts as (NULL: zeros)
+    // Fill an output slot from a record of a (side 0) or b (side 1). NULL
+    // copies the record, which then has to be the output's record size.
+    void (*copy)(void *slot, const void *record, int side, void *ctx);
+    // Join only: fill an output slot from a matching pair
+    void (*join)(void *slot, const void *a, const void *b, void *ctx);
+    void *ctx;
+    int64_t blocks;          // Set to the number of blocks written
+} MergeOutput;
+
+// Orders an a record against a b record by key, like strcmp
+typedef int (*MergeCompare)(const void *a, const void *b);
+
+// Both return the number of records written, or -1 when an I/O failed or
+// a layout does not fit
+int64_t MergeSets(MergeOp op, const MergeInput *a, const MergeInput *b, MergeCompare compare, MergeOutput *out);
+int64_t MergeJoin(const MergeInput *a, const MergeInput *b, MergeCompare compare, MergeOutput *out);
+
+#endif
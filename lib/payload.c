@@ -0,0 +1,67 @@
+#include "payload.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define PAYLOAD_MAGIC 0x44415950u  // "PYAD"
+
+// Kept in the user area of the block-file header
+typedef struct {
+    uint32_t magic;
+    uint32_t payloadBytes;
+    uint32_t perBlock;
+} PayloadHeader;
+
+static PayloadFile *Wrap(BlockFile *bf, const PayloadHeader *h) {
+    PayloadFile *pf = malloc(sizeof(PayloadFile));
+    *pf = (PayloadFile){bf, h->payloadBytes, h->perBlock};
+    return pf;
+}
+
+PayloadFile *PayloadCreate(const char *path, uint32_t payloadBytes, uint32_t blockBytes) {
+    if (payloadBytes == 0) return NULL;
+    PayloadHeader h = {PAYLOAD_MAGIC, payloadBytes, blockBytes / payloadBytes};
+    if (h.perBlock < 1) h.perBlock = 1;
+    BlockFile *bf = BlockFileCreate(path, h.perBlock * payloadBytes, FixedLayout(payloadBytes, h.perBlock, BF_NO_COUNT, 0));
+    if (!bf) return NULL;
+    memcpy(bf->header.user, &h, sizeof(h));
+    BlockFileWriteHeader(bf);
+    return Wrap(bf, &h);
+}
+
+PayloadFile *PayloadOpen(const char *path) {
+    BlockFile *bf = BlockFileOpen(path);
+    if (!bf) return NULL;
+    PayloadHeader h;
+    memcpy(&h, bf->header.user, sizeof(h));
+    if (h.magic != PAYLOAD_MAGIC || h.payloadBytes == 0 || h.perBlock * h.payloadBytes != bf->blockBytes) {
+        BlockFileClose(bf);
+        return NULL;
+    }
+    return Wrap(bf, &h);
+}
+
+void PayloadClose(PayloadFile *pf) {
+    if (!pf) return;
+    BlockFileClose(pf->bf);
+    free(pf);
+}
+
+int64_t PayloadAppend(PayloadFile *pf, const void *payload) {
+    int64_t id = pf->bf->header.nRecords;
+    if (!PayloadWrite(pf, id, payload)) return -1;
+    pf->bf->header.nRecords = id + 1;
+    return id;
+}
+
+bool PayloadRead(PayloadFile *pf, int64_t id, void *payload) {
+    if (id < 0 || id >= pf->bf->header.nRecords) return false;
+    return BlockFileReadBytes(pf->bf, id / pf->perBlock, (uint32_t)(id % pf->perBlock) * pf->payloadBytes, payload,
+                              pf->payloadBytes);
+}
+
+bool PayloadWrite(PayloadFile *pf, int64_t id, const void *payload) {
+    if (id < 0) return false;
+    return BlockFileWriteBytes(pf->bf, id / pf->perBlock, (uint32_t)(id % pf->perBlock) * pf->payloadBytes, payload,
+                               pf->payloadBytes);
+}
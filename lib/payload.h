@@ -0,0 +1,34 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "blockfile.h"
+
+// Fixed-size record payloads kept apart from their keys, for structures
+// whose searches and range filters only look at keys and flags: those then
+// scan a dense key file and fetch payloads by record id, only for the
+// records they return. Id i is slot i % perBlock of block i / perBlock;
+// ids are handed out in order and never reused, so the space of deleted
+// records comes back only when the owner rewrites the file.
+//
+// Reading or writing one payload moves just its bytes (BlockFileReadBytes).
+
+typedef struct {
+    BlockFile *bf;          // nRecords in its header is the next id
+    uint32_t payloadBytes;
+    uint32_t perBlock;
+} PayloadFile;
+
+// Blocks hold as many payloads as fit in blockBytes (at least one)
+PayloadFile *PayloadCreate(const char *path, uint32_t payloadBytes, uint32_t blockBytes);
+// NULL when missing or not a payload file
+PayloadFile *PayloadOpen(const char *path);
+void PayloadClose(PayloadFile *pf);
+
+// Store a payload under the next id; returns it, or -1 if the write failed
+int64_t PayloadAppend(PayloadFile *pf, const void *payload);
+bool PayloadRead(PayloadFile *pf, int64_t id, void *payload);
+bool PayloadWrite(PayloadFile *pf, int64_t id, const void *payload);
+
+#endif
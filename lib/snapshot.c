@@ -0,0 +1,311 @@
+#include "snapshot.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "wal.h"
+
+#define INITIAL_BUCKETS 64
+
+// An old image of a block, kept for snapshots older than `until`
+typedef struct Image {
+    int64_t blockNo;
+    uint64_t until;       // First version that no longer has this image in place
+    int64_t slot;         // Block-sized slot of the store file
+    struct Image *next;   // Same bucket
+    struct Image *newer;  // Preserved after this one (any block): images expire in this order
+} Image;
+
+struct Snapshot {
+    struct SnapshotStore *store;
+    uint64_t version;
+    BlockFileHeader header;
+    Snapshot *prev, *next;
+};
+
+struct SnapshotStore {
+    BlockFile *bf;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;  // The writer's transaction committed
+    int fd;
+    uint64_t version;     // Committed transactions so far
+    int depth;            // Nested Begin calls of the writer
+    pthread_t writer;
+    BlockFileHeader committed;  // bf's header as of the last commit
+    Snapshot *live, *liveTail;  // Open snapshots, oldest first
+    int nLive;
+    // Block-mapping table: block number -> its images
+    Image **buckets;
+    int nBuckets;  // Power of two
+    int64_t nImages;
+    Image *oldest, *newest;
+    int64_t *freeSlots;
+    int64_t nFree, capFree, nSlots;
+    char *buf;  // One block being preserved
+    SnapshotStats stats;
+};
+
+static bool WriteFull(int fd, const void *buf, size_t n, off_t off) {
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w <= 0) return false;
+        p += w;
+        n -= (size_t)w;
+        off += w;
+    }
+    return true;
+}
+
+static bool ReadFull(int fd, void *buf, size_t n, off_t off) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = pread(fd, p, n, off);
+        if (r <= 0) return false;
+        p += r;
+        n -= (size_t)r;
+        off += r;
+    }
+    return true;
+}
+
+// The store hooks act on, or NULL while this thread writes back the redo
+// log: that changes where blocks are, not what they hold
+static struct SnapshotStore *Store(const BlockFile *bf) {
+    if (bf->snapshots == NULL || (bf->wal != NULL && WalActive(bf) == NULL)) return NULL;
+    return bf->snapshots;
+}
+
+static int Bucket(const struct SnapshotStore *store, int64_t blockNo) {
+    return (int)(((uint64_t)blockNo * 0x9E3779B97F4A7C15ull) >> 32) & (store->nBuckets - 1);
+}
+
+// Slot of the image block blockNo had at `version`, or -1 when it is the
+// one in place
+static int64_t Lookup(struct SnapshotStore *store, int64_t blockNo, uint64_t version) {
+    int64_t slot = -1;
+    uint64_t best = UINT64_MAX;
+    pthread_mutex_lock(&store->lock);
+    for (Image *img = store->buckets[Bucket(store, blockNo)]; img; img = img->next) {
+        if (img->blockNo == blockNo && img->until > version && img->until < best) {
+            best = img->until;
+            slot = img->slot;
+        }
+    }
+    pthread_mutex_unlock(&store->lock);
+    return slot;
+}
+
+static void Grow(struct SnapshotStore *store) {
+    int n = store->nBuckets * 2;
+    Image **buckets = calloc(n, sizeof(Image *));
+    store->nBuckets = n;
+    for (int b = 0; b < n / 2; b++) {
+        for (Image *img = store->buckets[b], *next; img; img = next) {
+            next = img->next;
+            int to = Bucket(store, img->blockNo);
+            img->next = buckets[to];
+            buckets[to] = img;
+        }
+    }
+    free(store->buckets);
+    store->buckets = buckets;
+}
+
+// Drop the images no open snapshot can read: all of them when none is open
+static void Expire(struct SnapshotStore *store) {
+    while (store->oldest && (store->live == NULL || store->live->version >= store->oldest->until)) {
+        Image *img = store->oldest;
+        Image **link = &store->buckets[Bucket(store, img->blockNo)];
+        while (*link != img) link = &(*link)->next;
+        *link = img->next;
+        store->oldest = img->newer;
+        if (store->oldest == NULL) store->newest = NULL;
+        if (store->nFree == store->capFree) {
+            store->capFree = store->capFree ? 2 * store->capFree : 64;
+            store->freeSlots = realloc(store->freeSlots, store->capFree * sizeof(int64_t));
+        }
+        store->freeSlots[store->nFree++] = img->slot;
+        store->nImages--;
+        free(img);
+    }
+}
+
+bool SnapshotsEnable(BlockFile *bf) {
+    if (bf->snapshots) return true;
+    size_t n = strlen(bf->path);
+    char *path = malloc(n + sizeof(".snap"));
+    memcpy(path, bf->path, n);
+    memcpy(path + n, ".snap", sizeof(".snap"));
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    // Images only matter to snapshots of this process
+    if (fd >= 0) unlink(path);
+    free(path);
+    if (fd < 0) return false;
+
+    struct SnapshotStore *store = calloc(1, sizeof(struct SnapshotStore));
+    pthread_mutex_init(&store->lock, NULL);
+    pthread_cond_init(&store->idle, NULL);
+    store->bf = bf;
+    store->fd = fd;
+    store->committed = bf->header;
+    store->nBuckets = INITIAL_BUCKETS;
+    store->buckets = calloc(store->nBuckets, sizeof(Image *));
+    store->buf = malloc(bf->blockBytes);
+    bf->snapshots = store;
+    return true;
+}
+
+Snapshot *SnapshotOpen(BlockFile *bf) {
+    struct SnapshotStore *store = bf->snapshots;
+    if (store == NULL) return NULL;
+    pthread_mutex_lock(&store->lock);
+    if (store->depth > 0 && pthread_equal(store->writer, pthread_self())) {
+        pthread_mutex_unlock(&store->lock);
+        return NULL;
+    }
+    if (store->depth > 0) store->stats.waits++;
+    while (store->depth > 0) pthread_cond_wait(&store->idle, &store->lock);
+    Snapshot *s = calloc(1, sizeof(Snapshot));
+    s->store = store;
+    s->version = store->version;
+    s->header = store->committed;
+    s->prev = store->liveTail;
+    if (store->liveTail) store->liveTail->next = s;
+    else store->live = s;
+    store->liveTail = s;
+    store->nLive++;
+    store->stats.opened++;
+    pthread_mutex_unlock(&store->lock);
+    return s;
+}
+
+void SnapshotClose(Snapshot *s) {
+    if (s == NULL) return;
+    struct SnapshotStore *store = s->store;
+    pthread_mutex_lock(&store->lock);
+    if (s->prev) s->prev->next = s->next;
+    else store->live = s->next;
+    if (s->next) s->next->prev = s->prev;
+    else store->liveTail = s->prev;
+    store->nLive--;
+    Expire(store);
+    pthread_mutex_unlock(&store->lock);
+    free(s);
+}
+
+const BlockFileHeader *SnapshotHeader(BlockFile *bf, const Snapshot *s) {
+    return s ? &s->header : &bf->header;
+}
+
+bool SnapshotRead(BlockFile *bf, Snapshot *s, int64_t blockNo, void *buf) {
+    if (s == NULL) return BlockFileRead(bf, blockNo, buf);
+    if (blockNo < 0 || blockNo >= s->header.nBlocks) return false;
+    struct SnapshotStore *store = s->store;
+    int64_t slot = Lookup(store, blockNo, s->version);
+    if (slot < 0) {
+        bool ok = BlockFileRead(bf, blockNo, buf);
+        // The writer enters the old image before it overwrites a block, so
+        // a block that was not replaced by now was read as it stood
+        if ((slot = Lookup(store, blockNo, s->version)) < 0) return ok;
+    }
+    __atomic_add_fetch(&store->stats.overlaid, 1, __ATOMIC_RELAXED);
+    return ReadFull(store->fd, buf, bf->blockBytes, (off_t)slot * bf->blockBytes);
+}
+
+int64_t SnapshotOverlay(BlockFile *bf, Snapshot *s, int64_t first, int64_t count, void *buf) {
+    if (s == NULL) return 0;
+    int64_t replaced = 0;
+    for (int64_t i = 0; i < count; i++) {
+        int64_t slot = Lookup(s->store, first + i, s->version);
+        if (slot >= 0 && ReadFull(s->store->fd, (char *)buf + i * bf->blockBytes, bf->blockBytes, (off_t)slot * bf->blockBytes)) {
+            replaced++;
+        }
+    }
+    __atomic_add_fetch(&s->store->stats.overlaid, replaced, __ATOMIC_RELAXED);
+    return replaced;
+}
+
+SnapshotStats SnapshotGetStats(const BlockFile *bf) {
+    SnapshotStats none = {0};
+    if (bf->snapshots == NULL) return none;
+    pthread_mutex_lock(&bf->snapshots->lock);
+    SnapshotStats stats = bf->snapshots->stats;
+    pthread_mutex_unlock(&bf->snapshots->lock);
+    return stats;
+}
+
+// --- Writer hooks ---
+
+void SnapshotBegin(BlockFile *bf) {
+    struct SnapshotStore *store = Store(bf);
+    if (store == NULL) return;
+    pthread_mutex_lock(&store->lock);
+    if (store->depth++ == 0) store->writer = pthread_self();
+    pthread_mutex_unlock(&store->lock);
+}
+
+void SnapshotCommit(BlockFile *bf) {
+    struct SnapshotStore *store = Store(bf);
+    if (store == NULL) return;
+    pthread_mutex_lock(&store->lock);
+    if (--store->depth == 0) {
+        store->version++;
+        store->committed = bf->header;
+        Expire(store);
+        pthread_cond_broadcast(&store->idle);
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+void SnapshotPreserve(BlockFile *bf, int64_t first, int64_t count) {
+    struct SnapshotStore *store = Store(bf);
+    if (store == NULL) return;
+    pthread_mutex_lock(&store->lock);
+    // Snapshots open only between transactions: with none open now, none
+    // can see what this one overwrites. Blocks past the committed end are
+    // new to every snapshot, or were preserved when truncated away.
+    int64_t end = first + count < store->committed.nBlocks ? first + count : store->committed.nBlocks;
+    uint64_t until = store->version + 1;
+    for (int64_t b = first < 0 ? 0 : first; store->nLive > 0 && b < end; b++) {
+        Image **head = &store->buckets[Bucket(store, b)];
+        Image *img = *head;
+        while (img && !(img->blockNo == b && img->until == until)) img = img->next;
+        if (img || !BlockFileRead(bf, b, store->buf)) continue;
+
+        int64_t slot = store->nFree > 0 ? store->freeSlots[--store->nFree] : store->nSlots++;
+        if (!WriteFull(store->fd, store->buf, bf->blockBytes, (off_t)slot * bf->blockBytes)) continue;
+        if (store->nImages >= store->nBuckets) {
+            Grow(store);
+            head = &store->buckets[Bucket(store, b)];
+        }
+        img = malloc(sizeof(Image));
+        *img = (Image){b, until, slot, *head, NULL};
+        *head = img;
+        if (store->newest) store->newest->newer = img;
+        else store->oldest = img;
+        store->newest = img;
+        store->nImages++;
+        store->stats.preserved++;
+        if (store->nImages > store->stats.peakImages) store->stats.peakImages = store->nImages;
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+void SnapshotDetach(BlockFile *bf) {
+    struct SnapshotStore *store = bf->snapshots;
+    if (store == NULL) return;
+    bf->snapshots = NULL;
+    for (Image *img = store->oldest, *next; img; img = next) {
+        next = img->newer;
+        free(img);
+    }
+    pthread_mutex_destroy(&store->lock);
+    pthread_cond_destroy(&store->idle);
+    close(store->fd);
+    free(store->buckets);
+    free(store->freeSlots);
+    free(store->buf);
+    free(store);
+}
@@ -0,0 +1,64 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "blockfile.h"
+
+// Snapshot readers for block files, so a long scan sees the file as one
+// committed state while a writer keeps changing blocks in place. Updates
+// are copy-on-write for readers: before a block is overwritten (or
+// truncated away) for the first time in a transaction, while snapshots are
+// open, its old image is copied to a version store ("<path>.snap",
+// unlinked once open) and entered in a block-mapping table under the
+// version it stopped being current. A reader maps each block through that
+// table: the oldest image newer than its snapshot if there is one, else
+// the block in place. Home blocks, the redo log, read-ahead and truncation
+// work as before; nothing is copied while no snapshot is open.
+//
+// A transaction is whatever WalBegin/WalCommit bracket (log or not), else a
+// single write. Opening a snapshot waits for the one in progress to
+// commit; the writer opening one inside its own transaction gets NULL and
+// reads the file as it stands. Images go as soon as no open snapshot is
+// old enough to need them. One writer at a time; any number of readers.
+//
+// Every read call takes the snapshot as a parameter and treats NULL as the
+// live file, so a scan can pin one when the file has a store and read the
+// same way either way. With a redo log attached, a block still only in the
+// log is read through it, which waits for the writer's open transaction.
+
+typedef struct Snapshot Snapshot;
+
+typedef struct {
+    int64_t opened;      // Snapshots
+    int64_t waits;       // Opens that waited for a transaction to commit
+    int64_t preserved;   // Block images copied to the store
+    int64_t overlaid;    // Snapshot reads served from the store
+    int64_t peakImages;  // Most images the store held at once
+} SnapshotStats;
+
+// Give bf a version store, from which point snapshots can be opened
+bool SnapshotsEnable(BlockFile *bf);
+// Pin the last committed state. NULL when bf has no store (or the calling
+// thread is inside its own transaction).
+Snapshot *SnapshotOpen(BlockFile *bf);
+void SnapshotClose(Snapshot *s);
+// The header as of the snapshot (counts, nBlocks and the user area)
+const BlockFileHeader *SnapshotHeader(BlockFile *bf, const Snapshot *s);
+// Block blockNo as of the snapshot; false past its last block
+bool SnapshotRead(BlockFile *bf, Snapshot *s, int64_t blockNo, void *buf);
+// For blocks read from the file by other means (lib/aio) after s was
+// opened: put back the images of those that changed since. Returns how
+// many it replaced.
+int64_t SnapshotOverlay(BlockFile *bf, Snapshot *s, int64_t first, int64_t count, void *buf);
+SnapshotStats SnapshotGetStats(const BlockFile *bf);
+
+// Hooks used by lib/blockfile, lib/wal and lib/aio: Begin/Commit nest,
+// Preserve saves images of blocks about to be overwritten. No-ops on a file
+// without a store.
+void SnapshotBegin(BlockFile *bf);
+void SnapshotCommit(BlockFile *bf);
+void SnapshotPreserve(BlockFile *bf, int64_t first, int64_t count);
+void SnapshotDetach(BlockFile *bf);
+
+#endif
@@ -0,0 +1,459 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "snapshot.h"
+
+enum { WAL_IMAGE = 1, WAL_DELTA = 2, WAL_HEADER = 3, WAL_COMMIT = 4 };
+
+// Followed by `length` payload bytes. The CRC covers everything after it,
+// so a record cut short by a crash fails the check.
+typedef struct {
+    uint32_t crc;
+    uint16_t type;
+    uint16_t pad;
+    uint32_t length;
+    uint32_t offset;  // Delta: first changed byte within the block
+    int64_t blockNo;
+} WalRecord;
+
+// A block with changes not yet in the data file
+typedef struct {
+    int64_t blockNo;
+    char *image;        // The whole block as it stands now
+    uint32_t lo, hi;    // Bytes changed since it was last applied
+    uint32_t txLo, txHi;  // Bytes changed by the open transaction (lo == hi: none)
+} Entry;
+
+struct Wal {
+    BlockFile *bf;
+    pthread_mutex_t lock;  // Recursive; held from the outermost Begin to its Commit
+    int fd;
+    int64_t end;       // Log size
+    int64_t unsynced;  // Bytes appended since the last fdatasync
+    int depth;         // Nested Begin calls
+    bool headerInTx;   // The open transaction wrote the header
+    BlockFileHeader logged;  // The header as of the last one logged
+    bool headerDirty;  // A committed header has not been written in place
+    Entry *entries;
+    int nEntries, capEntries;
+    int *touched;  // Entries the open transaction changed
+    int nTouched;
+    int *slots;  // Open-addressing index: block number -> entry (-1 empty)
+    int nSlots;  // Power of two, at least twice nEntries
+    char *buf;   // Commit being assembled
+    size_t bufLen, bufCap;
+    WalStats stats;
+};
+
+static uint32_t crcTable[8][256];
+static __thread bool applying;  // This thread writes the data file itself
+
+static void InitCrc(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crcTable[0][i] = c;
+    }
+    for (int t = 1; t < 8; t++)
+        for (int i = 0; i < 256; i++) crcTable[t][i] = crcTable[t - 1][i] >> 8 ^ crcTable[0][crcTable[t - 1][i] & 0xFF];
+}
+
+// CRC-32, eight bytes per step (slicing-by-8): whole block images go
+// through it on every commit
+static uint32_t Crc32(uint32_t crc, const void *data, size_t n) {
+    const unsigned char *p = data;
+    crc = ~crc;
+    for (; n >= 8; n -= 8, p += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crcTable[7][lo & 0xFF] ^ crcTable[6][lo >> 8 & 0xFF] ^ crcTable[5][lo >> 16 & 0xFF] ^ crcTable[4][lo >> 24] ^
+              crcTable[3][hi & 0xFF] ^ crcTable[2][hi >> 8 & 0xFF] ^ crcTable[1][hi >> 16 & 0xFF] ^ crcTable[0][hi >> 24];
+    }
+    while (n--) crc = crcTable[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t RecordCrc(const WalRecord *r, const void *payload) {
+    uint32_t crc = Crc32(0, (const char *)r + sizeof(r->crc), sizeof(WalRecord) - sizeof(r->crc));
+    return Crc32(crc, payload, r->length);
+}
+
+static char *LogPath(const char *path) {
+    size_t n = strlen(path);
+    char *p = malloc(n + sizeof(".wal"));
+    memcpy(p, path, n);
+    memcpy(p + n, ".wal", sizeof(".wal"));
+    return p;
+}
+
+static bool WriteFull(int fd, const void *buf, size_t n, off_t off) {
+    const char *p = buf;
+    while (n > 0) {
+        ssize_t w = pwrite(fd, p, n, off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= w;
+        off += w;
+    }
+    return true;
+}
+
+static bool ReadFull(int fd, void *buf, size_t n, off_t off) {
+    char *p = buf;
+    while (n > 0) {
+        ssize_t r = pread(fd, p, n, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+        off += r;
+    }
+    return true;
+}
+
+// --- Staged and committed blocks ---
+
+static int Slot(const struct Wal *wal, int64_t blockNo) {
+    return (int)(((uint64_t)blockNo * 0x9E3779B97F4A7C15ull) >> 40) & (wal->nSlots - 1);
+}
+
+static Entry *Find(struct Wal *wal, int64_t blockNo) {
+    if (wal->nEntries == 0) return NULL;
+    for (int s = Slot(wal, blockNo);; s = (s + 1) & (wal->nSlots - 1)) {
+        if (wal->slots[s] < 0) return NULL;
+        if (wal->entries[wal->slots[s]].blockNo == blockNo) return &wal->entries[wal->slots[s]];
+    }
+}
+
+static void Index(struct Wal *wal, int e) {
+    int s = Slot(wal, wal->entries[e].blockNo);
+    while (wal->slots[s] >= 0) s = (s + 1) & (wal->nSlots - 1);
+    wal->slots[s] = e;
+}
+
+static Entry *Add(struct Wal *wal, int64_t blockNo) {
+    if (wal->nEntries == wal->capEntries) {
+        wal->capEntries = wal->capEntries ? 2 * wal->capEntries : 16;
+        wal->entries = realloc(wal->entries, wal->capEntries * sizeof(Entry));
+        wal->touched = realloc(wal->touched, wal->capEntries * sizeof(int));
+    }
+    if (2 * (wal->nEntries + 1) > wal->nSlots) {
+        wal->nSlots = wal->nSlots ? 2 * wal->nSlots : 64;
+        wal->slots = realloc(wal->slots, wal->nSlots * sizeof(int));
+        for (int s = 0; s < wal->nSlots; s++) wal->slots[s] = -1;
+        for (int e = 0; e < wal->nEntries; e++) Index(wal, e);
+    }
+    Entry *entry = &wal->entries[wal->nEntries];
+    *entry = (Entry){blockNo, calloc(1, wal->bf->blockBytes), 0, 0, 0, 0};
+    Index(wal, wal->nEntries++);
+    return entry;
+}
+
+static void Clear(struct Wal *wal) {
+    for (int e = 0; e < wal->nEntries; e++) free(wal->entries[e].image);
+    wal->nEntries = 0;
+    for (int s = 0; s < wal->nSlots; s++) wal->slots[s] = -1;
+}
+
+struct Wal *WalActive(const BlockFile *bf) {
+    return applying ? NULL : bf->wal;
+}
+
+bool WalRead(struct Wal *wal, int64_t blockNo, uint32_t offset, void *buf, uint32_t n) {
+    pthread_mutex_lock(&wal->lock);
+    Entry *entry = Find(wal, blockNo);
+    if (entry != NULL) memcpy(buf, entry->image + offset, n);
+    pthread_mutex_unlock(&wal->lock);
+    return entry != NULL;
+}
+
+bool WalWrite(struct Wal *wal, int64_t blockNo, uint32_t offset, const void *buf, uint32_t n) {
+    BlockFile *bf = wal->bf;
+    // Outside a transaction this is one of its own
+    WalBegin(bf);
+
+    Entry *entry = Find(wal, blockNo);
+    if (entry == NULL) {
+        entry = Add(wal, blockNo);
+        // A partial write needs the rest of the block as it is on disk
+        if (n < bf->blockBytes) {
+            applying = true;
+            BlockFileRead(bf, blockNo, entry->image);
+            applying = false;
+        }
+    }
+    memcpy(entry->image + offset, buf, n);
+    if (entry->lo == entry->hi) {
+        entry->lo = offset;
+        entry->hi = offset + n;
+    } else {
+        if (offset < entry->lo) entry->lo = offset;
+        if (offset + n > entry->hi) entry->hi = offset + n;
+    }
+    if (entry->txLo == entry->txHi) {
+        wal->touched[wal->nTouched++] = (int)(entry - wal->entries);
+        entry->txLo = offset;
+        entry->txHi = offset + n;
+    } else {
+        if (offset < entry->txLo) entry->txLo = offset;
+        if (offset + n > entry->txHi) entry->txHi = offset + n;
+    }
+
+    // Staged blocks count as part of the file straight away
+    int64_t cur = bf->header.nBlocks;
+    if (blockNo + 1 > cur) bf->header.nBlocks = blockNo + 1;
+    return WalCommit(bf);
+}
+
+bool WalWriteHeader(struct Wal *wal) {
+    // Written in place it could get ahead of blocks still only in the log
+    WalBegin(wal->bf);
+    wal->headerInTx = true;
+    return WalCommit(wal->bf);
+}
+
+// --- Log ---
+
+static void Append(struct Wal *wal, uint16_t type, int64_t blockNo, uint32_t offset, const void *payload,
+                   uint32_t length) {
+    size_t need = wal->bufLen + sizeof(WalRecord) + length;
+    if (need > wal->bufCap) {
+        wal->bufCap = need > 2 * wal->bufCap ? need : 2 * wal->bufCap;
+        wal->buf = realloc(wal->buf, wal->bufCap);
+    }
+    WalRecord r = {0, type, 0, length, offset, blockNo};
+    r.crc = RecordCrc(&r, payload);
+    memcpy(wal->buf + wal->bufLen, &r, sizeof(r));
+    if (length > 0) memcpy(wal->buf + wal->bufLen + sizeof(r), payload, length);
+    wal->bufLen = need;
+}
+
+void WalBegin(BlockFile *bf) {
+    SnapshotBegin(bf);
+    if (bf->wal == NULL) return;
+    pthread_mutex_lock(&bf->wal->lock);
+    bf->wal->depth++;
+}
+
+static bool Commit(BlockFile *bf);
+
+bool WalCommit(BlockFile *bf) {
+    struct Wal *wal = bf->wal;
+    bool ok = true;
+    if (wal != NULL) {
+        ok = --wal->depth > 0 || Commit(bf);
+        pthread_mutex_unlock(&wal->lock);
+    }
+    SnapshotCommit(bf);
+    return ok;
+}
+
+static bool Commit(BlockFile *bf) {
+    struct Wal *wal = bf->wal;
+
+    wal->bufLen = 0;
+    for (int t = 0; t < wal->nTouched; t++) {
+        Entry *entry = &wal->entries[wal->touched[t]];
+        if (entry->txLo == 0 && entry->txHi == bf->blockBytes) {
+            Append(wal, WAL_IMAGE, entry->blockNo, 0, entry->image, bf->blockBytes);
+        } else {
+            Append(wal, WAL_DELTA, entry->blockNo, entry->txLo, entry->image + entry->txLo, entry->txHi - entry->txLo);
+        }
+        entry->txLo = entry->txHi = 0;
+        wal->stats.records++;
+    }
+    wal->nTouched = 0;
+    // Record counts and the like change in memory without a header write
+    if (wal->headerInTx || memcmp(&wal->logged, &bf->header, sizeof(BlockFileHeader)) != 0) {
+        Append(wal, WAL_HEADER, -1, 0, &bf->header, sizeof(BlockFileHeader));
+        wal->logged = bf->header;
+        wal->headerInTx = false;
+        wal->headerDirty = true;
+    }
+    if (wal->bufLen == 0) return true;
+    Append(wal, WAL_COMMIT, -1, 0, NULL, 0);
+
+    if (!WriteFull(wal->fd, wal->buf, wal->bufLen, wal->end)) return false;
+    wal->end += wal->bufLen;
+    wal->unsynced += wal->bufLen;
+    wal->stats.logBytes += wal->bufLen;
+    wal->stats.commits++;
+    if (wal->end >= WAL_CHECKPOINT_BYTES) return WalCheckpoint(bf);
+    return true;
+}
+
+// Write every committed change in place. Only safe once the log is durable.
+static bool Apply(struct Wal *wal) {
+    BlockFile *bf = wal->bf;
+    bool ok = true;
+    applying = true;
+    for (int e = 0; e < wal->nEntries; e++) {
+        Entry *entry = &wal->entries[e];
+        if (entry->lo == entry->hi) continue;
+        if (entry->lo == 0 && entry->hi == bf->blockBytes) {
+            ok = BlockFileWrite(bf, entry->blockNo, entry->image) && ok;
+        } else {
+            ok = BlockFileWriteBytes(bf, entry->blockNo, entry->lo, entry->image + entry->lo, entry->hi - entry->lo) && ok;
+        }
+    }
+    if (wal->headerDirty) ok = BlockFileWriteHeader(bf) && ok;
+    applying = false;
+    if (ok) {
+        Clear(wal);
+        wal->headerDirty = false;
+    }
+    return ok;
+}
+
+static bool Sync(struct Wal *wal) {
+    if (wal->depth > 0) return false;  // Mid-transaction: nothing new is committed
+    if (wal->unsynced > 0) {
+        if (fdatasync(wal->fd) != 0) return false;
+        wal->unsynced = 0;
+        wal->stats.syncs++;
+    }
+    return Apply(wal);
+}
+
+bool WalSync(struct Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    bool ok = Sync(wal);
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+bool WalCheckpoint(BlockFile *bf) {
+    struct Wal *wal = bf->wal;
+    if (wal == NULL) return true;
+    pthread_mutex_lock(&wal->lock);
+    bool ok = Sync(wal) && fdatasync(bf->fd) == 0 && ftruncate(wal->fd, 0) == 0 && fdatasync(wal->fd) == 0;
+    if (ok) {
+        wal->end = 0;
+        wal->stats.checkpoints++;
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return ok;
+}
+
+WalStats WalGetStats(const BlockFile *bf) {
+    WalStats none = {0};
+    return bf->wal ? bf->wal->stats : none;
+}
+
+// --- Recovery ---
+
+// Replay every committed transaction in the log; stop at the first record
+// that is incomplete or fails its CRC. Returns how many were replayed.
+static int64_t Replay(BlockFile *bf, int fd, int64_t size) {
+    char *log = malloc(size > 0 ? size : 1);
+    if (!ReadFull(fd, log, size, 0)) size = 0;
+
+    int64_t txStart = 0, pos = 0, replayed = 0, lastBlock = -1;
+    while (pos + (int64_t)sizeof(WalRecord) <= size) {
+        WalRecord r;
+        memcpy(&r, log + pos, sizeof(r));
+        if (pos + (int64_t)sizeof(r) + r.length > size || r.crc != RecordCrc(&r, log + pos + sizeof(r))) break;
+        pos += sizeof(r) + r.length;
+        if (r.type != WAL_COMMIT) continue;
+
+        // A whole transaction is in: redo it (images and deltas are absolute,
+        // so replaying one twice is harmless)
+        for (int64_t p = txStart; p < pos;) {
+            WalRecord t;
+            memcpy(&t, log + p, sizeof(t));
+            const char *payload = log + p + sizeof(t);
+            if (t.type == WAL_IMAGE && t.length == bf->blockBytes) {
+                BlockFileWrite(bf, t.blockNo, payload);
+            } else if (t.type == WAL_DELTA) {
+                BlockFileWriteBytes(bf, t.blockNo, t.offset, payload, t.length);
+            } else if (t.type == WAL_HEADER && t.length == sizeof(BlockFileHeader)) {
+                memcpy(&bf->header, payload, sizeof(BlockFileHeader));
+            }
+            if ((t.type == WAL_IMAGE || t.type == WAL_DELTA) && t.blockNo > lastBlock) lastBlock = t.blockNo;
+            p += sizeof(t) + t.length;
+        }
+        txStart = pos;
+        replayed++;
+    }
+    free(log);
+    if (lastBlock + 1 > bf->header.nBlocks) bf->header.nBlocks = lastBlock + 1;
+    return replayed;
+}
+
+bool WalAttach(BlockFile *bf) {
+    static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+    pthread_once(&crcOnce, InitCrc);
+    if (bf->wal) return true;
+
+    char *path = LogPath(bf->path);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    free(path);
+    if (fd < 0) return false;
+
+    struct Wal *wal = calloc(1, sizeof(struct Wal));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&wal->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    wal->bf = bf;
+    wal->fd = fd;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size > 0) {
+        wal->stats.recovered = Replay(bf, fd, size);
+        // The replayed state is made durable before the log is emptied
+        if (!BlockFileWriteHeader(bf) || fdatasync(bf->fd) != 0 || ftruncate(fd, 0) != 0 || fdatasync(fd) != 0) {
+            pthread_mutex_destroy(&wal->lock);
+            close(fd);
+            free(wal);
+            return false;
+        }
+    }
+    wal->logged = bf->header;
+    bf->wal = wal;
+    return true;
+}
+
+bool WalOnOpen(BlockFile *bf, bool created) {
+    char *log = LogPath(bf->path);
+    if (created) unlink(log);
+    bool leftOver = !created && access(log, F_OK) == 0;
+    free(log);
+    const char *wanted = getenv("BLOCKFILE_WAL");
+    if (leftOver || (wanted != NULL && strcmp(wanted, "1") == 0)) return WalAttach(bf);
+    return true;
+}
+
+static void FreeWal(struct Wal *wal) {
+    Clear(wal);
+    pthread_mutex_destroy(&wal->lock);
+    close(wal->fd);
+    free(wal->entries);
+    free(wal->touched);
+    free(wal->slots);
+    free(wal->buf);
+    free(wal);
+}
+
+bool WalDetach(struct Wal *wal) {
+    BlockFile *bf = wal->bf;
+    wal->depth = 0;
+    bool ok = WalCheckpoint(bf);
+    bf->wal = NULL;
+    FreeWal(wal);
+    return ok;
+}
+
+void WalCrash(BlockFile *bf) {
+    if (bf->wal) FreeWal(bf->wal);
+    bf->wal = NULL;
+    BlockFileAbandon(bf);
+}
@@ -0,0 +1,66 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "blockfile.h"
+
+// Redo log for block files, so multi-block updates survive a crash whole
+// or not at all. With a log attached, every block write between
+// WalBegin(bf) and WalCommit(bf) is staged in memory; the commit appends
+// the changed blocks (full images, or the changed byte range for partial
+// writes) plus the header when it was written or changed in memory, then a
+// commit record, to "<path>.wal" in one write. Reads see staged and
+// committed blocks at once.
+//
+// Committed blocks only go to their place in the data file after the log
+// has been made durable: on BlockFileSync (which syncs the log, not the data
+// file) or at a checkpoint. A checkpoint, taken once the log passes
+// WAL_CHECKPOINT_BYTES and on close, applies everything, syncs the data file
+// and empties the log. Opening a file whose log is not empty replays the
+// committed transactions in it and drops a torn tail, so restart costs one
+// pass over the log however large the file is.
+//
+// Writes (header writes included) outside Begin/Commit are logged as a
+// transaction of their own. BLOCKFILE_WAL=1 attaches a log to every file on
+// Create/Open. One transaction at a time per file. Asynchronous I/O
+// (lib/aio) and BlockFileTruncate do not go through the log: read-aheads
+// apply it first, write-behinds and truncates take a checkpoint, so a replay
+// never puts older images over what they wrote or grows the file back.
+
+#define WAL_CHECKPOINT_BYTES (4 << 20)
+
+typedef struct {
+    int64_t commits;
+    int64_t records;       // Block images and deltas logged
+    int64_t logBytes;      // Appended to the log, commit records included
+    int64_t syncs;         // fdatasync calls on the log
+    int64_t checkpoints;
+    int64_t recovered;     // Transactions replayed when the file was opened
+} WalStats;
+
+// Attach a log to bf (replaying whatever an earlier run left in it)
+bool WalAttach(BlockFile *bf);
+// They nest, and only the outermost Commit appends to the log. Without a
+// log they only mark what snapshot readers (lib/snapshot.h) see as one update.
+void WalBegin(BlockFile *bf);
+bool WalCommit(BlockFile *bf);
+bool WalCheckpoint(BlockFile *bf);
+WalStats WalGetStats(const BlockFile *bf);
+// Drop the file the way a crash would: no checkpoint, nothing applied that
+// was not applied already. For benches and crash tests.
+void WalCrash(BlockFile *bf);
+
+// Hooks used by lib/blockfile
+// Create (created) discards any old log; Open attaches when a log is left
+// over or BLOCKFILE_WAL=1, Create only for BLOCKFILE_WAL=1
+bool WalOnOpen(BlockFile *bf, bool created);
+// bf's log, or NULL while this thread is writing it back to the data file
+struct Wal *WalActive(const BlockFile *bf);
+bool WalRead(struct Wal *wal, int64_t blockNo, uint32_t offset, void *buf, uint32_t n);
+bool WalWrite(struct Wal *wal, int64_t blockNo, uint32_t offset, const void *buf, uint32_t n);
+bool WalWriteHeader(struct Wal *wal);
+bool WalSync(struct Wal *wal);
+bool WalDetach(struct Wal *wal);
+
+#endif